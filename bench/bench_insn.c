@@ -0,0 +1,119 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Executes a fixed number of stack switch round trips without any timing or
+ * output. This program is used by test/run_platform_tests.py to count the
+ * number of instructions per switch under qemu; running it with two different
+ * iteration counts and dividing the difference in executed instructions by the
+ * difference in iterations cancels out process startup and setup costs.
+ *
+ * Usage: bench_insn <switch|context|swapcontext> <iterations>
+ */
+
+#include <foxen/stack.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#define STACK_LEN (64U * 1024U)
+
+/******************************************************************************
+ * Workloads                                                                  *
+ ******************************************************************************/
+
+static void *bench_cback(void *data) { return data; }
+
+static void bench_switch(void *stack_start, void *stack_end, size_t n) {
+	for (size_t i = 0U; i < n; i++) {
+		fx_stack_switch(stack_start, stack_end, stack_end, bench_cback,
+		                stack_start);
+	}
+}
+
+typedef struct {
+	fx_stack_context main;
+	fx_stack_context ctx;
+} bench_context_state;
+
+static void *bench_context_cback(void *data) {
+	bench_context_state *state = (bench_context_state *)data;
+	while (1) {
+		fx_stack_context_swap(&state->ctx, &state->main, NULL);
+	}
+	return NULL;
+}
+
+static void bench_context_swap(void *stack_start, void *stack_end, size_t n) {
+	bench_context_state state;
+	memset(&state, 0, sizeof(state));
+	fx_stack_context_init(&state.ctx, stack_start, stack_end,
+	                      bench_context_cback, &state);
+	for (size_t i = 0U; i < n; i++) {
+		fx_stack_context_swap(&state.main, &state.ctx, NULL);
+	}
+	fx_stack_context_destroy(&state.ctx);
+}
+
+/* Baseline: swapcontext() round trip */
+static ucontext_t bench_ucontext_main, bench_ucontext_ctx;
+
+static void bench_ucontext_cback(void) {
+	while (1) {
+		swapcontext(&bench_ucontext_ctx, &bench_ucontext_main);
+	}
+}
+
+static void bench_ucontext_swap(void *stack_start, size_t n) {
+	getcontext(&bench_ucontext_ctx);
+	bench_ucontext_ctx.uc_stack.ss_sp = stack_start;
+	bench_ucontext_ctx.uc_stack.ss_size = STACK_LEN;
+	bench_ucontext_ctx.uc_link = NULL;
+	makecontext(&bench_ucontext_ctx, bench_ucontext_cback, 0);
+	for (size_t i = 0U; i < n; i++) {
+		swapcontext(&bench_ucontext_main, &bench_ucontext_ctx);
+	}
+}
+
+/******************************************************************************
+ * Main program                                                               *
+ ******************************************************************************/
+
+int main(int argc, const char *argv[]) {
+	if (argc != 3) {
+		return 1;
+	}
+	const size_t n = (size_t)strtoul(argv[2], NULL, 10);
+
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+	int res = 0;
+	if (strcmp(argv[1], "switch") == 0) {
+		bench_switch(stack_start, stack_end, n);
+	} else if (strcmp(argv[1], "context") == 0) {
+		bench_context_swap(stack_start, stack_end, n);
+	} else if (strcmp(argv[1], "swapcontext") == 0) {
+		bench_ucontext_swap(stack_start, n);
+	} else {
+		res = 1;
+	}
+	free(stack_start);
+	return res;
+}
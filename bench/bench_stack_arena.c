@@ -0,0 +1,140 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the stack switch throughput when hopping between many stacks in a
+ * random order. Compares individually mapped stacks against an arena backed
+ * by regular 4 KiB pages and an arena backed by 2 MiB huge pages. With
+ * thousands of stacks, the individually mapped stacks no longer fit into the
+ * TLB, whereas the huge page arena only needs a few dozen TLB entries. Both
+ * arenas use cache colouring; the individually mapped stacks do not.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack_pool.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STACK_LEN (32U * 1024U)
+#define N_MAX_STACKS 65536U
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static void *bench_cback(void *data) {
+	/* Touch a few cache lines of the stack, as a small task would */
+	volatile uint64_t buf[32];
+	for (unsigned int i = 0U; i < 32U; i += 8U) {
+		buf[i] = (uint64_t)(uintptr_t)data;
+	}
+	return (void *)(uintptr_t)buf[8];
+}
+
+static double bench_run(fx_stack_pool *pool, unsigned int n_stacks,
+                        const unsigned int *order, unsigned int n_rounds) {
+	static fx_stack *stacks[N_MAX_STACKS];
+	for (unsigned int i = 0U; i < n_stacks; i++) {
+		stacks[i] = fx_stack_pool_alloc(pool);
+		if (!stacks[i]) {
+			fprintf(stderr, "Error while allocating stack %u\n", i);
+			exit(1);
+		}
+	}
+
+	/* Visit the stacks in a fixed random order; the first round faults in
+	   the pages */
+	double t0 = 0.0;
+	for (unsigned int round = 0U; round <= n_rounds; round++) {
+		if (round == 1U) {
+			t0 = bench_now();
+		}
+		for (unsigned int i = 0U; i < n_stacks; i++) {
+			fx_stack *stack = stacks[order[i]];
+			fx_stack_switch(stack->stack_start, stack->stack_end,
+			                stack->stack_end, bench_cback, stack);
+		}
+	}
+	const double t1 = bench_now();
+
+	for (unsigned int i = 0U; i < n_stacks; i++) {
+		fx_stack_pool_free(pool, stacks[i]);
+	}
+
+	/* Return the number of switches per second */
+	return ((double)n_stacks * n_rounds) / (t1 - t0);
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned int n_rounds = 200U;
+	if (argc > 1) {
+		n_rounds = (unsigned int)atoi(argv[1]);
+	}
+
+	static unsigned int order[N_MAX_STACKS];
+	printf("%8s %16s %16s %16s %10s\n", "stacks", "mmap [Msw/s]",
+	       "4 KiB [Msw/s]", "2 MiB [Msw/s]", "speedup");
+	for (unsigned int n_stacks = 64U; n_stacks <= 8192U; n_stacks *= 4U) {
+		/* Random permutation of the stacks */
+		for (unsigned int i = 0U; i < n_stacks; i++) {
+			order[i] = i;
+		}
+		for (unsigned int i = n_stacks - 1U; i > 0U; i--) {
+			const unsigned int j = (unsigned int)rand() % (i + 1U);
+			const unsigned int tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+
+		fx_stack_pool pool_mmap, pool_small, pool_huge;
+		if (!fx_stack_pool_init(&pool_mmap, STACK_LEN, n_stacks, 0U) ||
+		    !fx_stack_pool_init_arena(
+		        &pool_small, STACK_LEN, 0U, n_stacks,
+		        FX_STACK_POOL_NO_GUARD | FX_STACK_POOL_COLOUR) ||
+		    !fx_stack_pool_init_arena(
+		        &pool_huge, STACK_LEN, 0U, n_stacks,
+		        FX_STACK_POOL_HUGE_PAGES | FX_STACK_POOL_COLOUR)) {
+			fprintf(stderr, "Error while initialising the pools\n");
+			return 1;
+		}
+		if (pool_huge.huge_page_size == 0U) {
+			fprintf(stderr, "Warning: huge pages are not available\n");
+		}
+
+		const unsigned int n = n_rounds * 64U / n_stacks + 1U;
+		const double t_mmap = bench_run(&pool_mmap, n_stacks, order, n);
+		const double t_small = bench_run(&pool_small, n_stacks, order, n);
+		const double t_huge = bench_run(&pool_huge, n_stacks, order, n);
+		printf("%8u %16.2f %16.2f %16.2f %9.2fx\n", n_stacks, t_mmap * 1e-6,
+		       t_small * 1e-6, t_huge * 1e-6, t_huge / t_small);
+
+		fx_stack_pool_destroy(&pool_mmap);
+		fx_stack_pool_destroy(&pool_small);
+		fx_stack_pool_destroy(&pool_huge);
+	}
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the time per element of a fx_stack_gen generator and compares it
+ * against a push-style producer invoking a callback function for each
+ * element.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack_gen.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STACK_LEN (64U * 1024U)
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static void bench_producer(fx_stack_gen *gen, void *data) {
+	const unsigned long n = *(unsigned long *)data;
+	for (unsigned long i = 0U; i < n; i++) {
+		fx_stack_gen_yield(gen, &i);
+	}
+}
+
+typedef void (*bench_push_cback)(unsigned long *value, void *data);
+
+static __attribute__((noinline)) void bench_push_producer(
+    unsigned long n, bench_push_cback cback, void *data) {
+	for (unsigned long i = 0U; i < n; i++) {
+		cback(&i, data);
+	}
+}
+
+static void bench_push_consumer(unsigned long *value, void *data) {
+	*(unsigned long *)data += *value;
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned long n = 10000000UL;
+	if (argc > 1) {
+		n = strtoul(argv[1], NULL, 10);
+	}
+
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	/* Run both variants a few times and report the fastest run to reduce the
+	   influence of other processes */
+	double t_push = 1e9, t_gen = 1e9;
+	for (unsigned int run = 0U; run < 5U; run++) {
+		unsigned long sum_push = 0U, sum_gen = 0U;
+		double t0 = bench_now();
+		bench_push_producer(n, bench_push_consumer, &sum_push);
+		double t1 = bench_now();
+		fx_stack_gen gen;
+		fx_stack_gen_init(&gen, stack_start, stack_end, bench_producer, &n);
+		unsigned long *value;
+		while ((value = (unsigned long *)fx_stack_gen_next(&gen))) {
+			sum_gen += *value;
+		}
+		fx_stack_gen_destroy(&gen);
+		double t2 = bench_now();
+		if (sum_push != sum_gen) {
+			fprintf(stderr, "Unexpected result\n");
+			return 1;
+		}
+		t_push = (t1 - t0 < t_push) ? (t1 - t0) : t_push;
+		t_gen = (t2 - t1 < t_gen) ? (t2 - t1) : t_gen;
+	}
+
+	printf("%-24s %10.2f ns/element\n", "push callback", 1e9 * t_push / n);
+	printf("%-24s %10.2f ns/element\n", "fx_stack_gen", 1e9 * t_gen / n);
+
+	free(stack_start);
+	return 0;
+}
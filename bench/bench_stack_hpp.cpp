@@ -0,0 +1,111 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the time per call of fx_stack_switch() with hand-written C
+ * callbacks and of the typed foxen::stack_switch() wrapper executing a lambda.
+ * The first C callback passes its argument and result as the void pointer
+ * itself; the second one passes them through a structure on the caller's
+ * frame, as is required for anything but a single pointer-sized value.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack.h>
+#include <foxen/stack.hpp>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STACK_LEN (64U * 1024U)
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static void *bench_cback(void *data) {
+	return (void *)((uintptr_t)data + 1U);
+}
+
+typedef struct {
+	uintptr_t arg;
+	uintptr_t result;
+} bench_cback_struct_data;
+
+static void *bench_cback_struct(void *data_) {
+	bench_cback_struct_data *data = (bench_cback_struct_data *)data_;
+	data->result = data->arg + 1U;
+	return NULL;
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned long n = 10000000UL;
+	if (argc > 1) {
+		n = strtoul(argv[1], NULL, 10);
+	}
+
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	/* Run both variants a few times and report the fastest run to reduce the
+	   influence of other processes */
+	double t_c = 1e9, t_struct = 1e9, t_cpp = 1e9;
+	for (unsigned int run = 0U; run < 5U; run++) {
+		uintptr_t x = 0U;
+		double t0 = bench_now();
+		for (unsigned long i = 0U; i < n; i++) {
+			x = (uintptr_t)fx_stack_switch(stack_start, stack_end, stack_end,
+			                               bench_cback, (void *)x);
+		}
+		double t1 = bench_now();
+		for (unsigned long i = 0U; i < n; i++) {
+			bench_cback_struct_data data = {x, 0U};
+			fx_stack_switch(stack_start, stack_end, stack_end,
+			                bench_cback_struct, &data);
+			x = data.result;
+		}
+		double t2 = bench_now();
+		for (unsigned long i = 0U; i < n; i++) {
+			x = foxen::stack_switch(stack_start, stack_end, stack_end,
+			                        [](uintptr_t y) { return y + 1U; }, x);
+		}
+		double t3 = bench_now();
+		if (x != 3U * n) {
+			fprintf(stderr, "Unexpected result\n");
+			return 1;
+		}
+		t_c = (t1 - t0 < t_c) ? (t1 - t0) : t_c;
+		t_struct = (t2 - t1 < t_struct) ? (t2 - t1) : t_struct;
+		t_cpp = (t3 - t2 < t_cpp) ? (t3 - t2) : t_cpp;
+	}
+
+	printf("%-24s %10.2f ns/call\n", "fx_stack_switch", 1e9 * t_c / n);
+	printf("%-24s %10.2f ns/call\n", "fx_stack_switch (struct)",
+	       1e9 * t_struct / n);
+	printf("%-24s %10.2f ns/call\n", "foxen::stack_switch", 1e9 * t_cpp / n);
+
+	free(stack_start);
+	return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the time per call of fx_stack_switch(), which is called through the
+ * shared library, and the header-only fx_stack_switch_inline().
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack.h>
+#include <foxen/stack_inline.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STACK_LEN (64U * 1024U)
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static void *bench_cback(void *data) {
+	return (void *)((uintptr_t)data + 1U);
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned long n = 10000000UL;
+	if (argc > 1) {
+		n = strtoul(argv[1], NULL, 10);
+	}
+
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	/* Run both variants a few times and report the fastest run to reduce the
+	   influence of other processes */
+	double t_lib = 1e9, t_inline = 1e9;
+	for (unsigned int run = 0U; run < 5U; run++) {
+		uintptr_t x = 0U;
+		double t0 = bench_now();
+		for (unsigned long i = 0U; i < n; i++) {
+			x = (uintptr_t)fx_stack_switch(stack_start, stack_end, stack_end,
+			                               bench_cback, (void *)x);
+		}
+		double t1 = bench_now();
+		for (unsigned long i = 0U; i < n; i++) {
+			x = (uintptr_t)fx_stack_switch_inline(
+			    stack_start, stack_end, stack_end, bench_cback, (void *)x);
+		}
+		double t2 = bench_now();
+		if (x != 2U * n) {
+			fprintf(stderr, "Unexpected result\n");
+			return 1;
+		}
+		t_lib = (t1 - t0 < t_lib) ? (t1 - t0) : t_lib;
+		t_inline = (t2 - t1 < t_inline) ? (t2 - t1) : t_inline;
+	}
+
+	printf("%-24s %10.2f ns/call\n", "fx_stack_switch", 1e9 * t_lib / n);
+	printf("%-24s %10.2f ns/call\n", "fx_stack_switch_inline",
+	       1e9 * t_inline / n);
+	printf("%-24s %10.2f ns/call\n", "saving",
+	       1e9 * (t_lib - t_inline) / n);
+
+	free(stack_start);
+	return 0;
+}
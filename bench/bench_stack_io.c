@@ -0,0 +1,222 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Echo server over loopback TCP sockets. Each connection is served by a task
+ * that parks on the fx_stack_io reactor while waiting for data; each client
+ * is a task sending fixed-size messages and waiting for the echo. Reports the
+ * number of round trips per second with an increasing number of workers.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack_io.h>
+#include <foxen/stack_sched.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STACK_LEN (4096U * 16U)
+#define MSG_LEN 64U
+#define N_MAX_WORKERS 64U
+
+typedef struct {
+	fx_stack_io *io;
+	fx_stack_sched *sched;
+	int fd;
+	uint16_t port;
+	unsigned int n_connections;
+	unsigned int n_messages;
+} bench_data;
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static bool bench_transfer(fx_stack_io *io, int fd, char *buf, bool do_write) {
+	for (size_t i = 0U; i < MSG_LEN;) {
+		const ssize_t n = do_write
+		                      ? fx_stack_io_write(io, fd, buf + i, MSG_LEN - i, -1)
+		                      : fx_stack_io_read(io, fd, buf + i, MSG_LEN - i, -1);
+		if (n <= 0) {
+			return false;
+		}
+		i += (size_t)n;
+	}
+	return true;
+}
+
+static void *bench_echo(void *data_) {
+	bench_data *data = (bench_data *)data_;
+	const int fd = data->fd;
+	char buf[MSG_LEN];
+	while (bench_transfer(data->io, fd, buf, false) &&
+	       bench_transfer(data->io, fd, buf, true)) {
+	}
+	close(fd);
+	free(data);
+	return NULL;
+}
+
+static void *bench_server(void *data_) {
+	bench_data *data = (bench_data *)data_;
+	fx_stack_sched_task **tasks = (fx_stack_sched_task **)malloc(
+	    data->n_connections * sizeof(fx_stack_sched_task *));
+	for (unsigned int i = 0U; i < data->n_connections; i++) {
+		bench_data *conn = (bench_data *)malloc(sizeof(bench_data));
+		*conn = *data;
+		conn->fd = fx_stack_io_accept(data->io, data->fd, NULL, NULL, -1);
+		const int one = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		tasks[i] = fx_stack_sched_spawn(data->sched, bench_echo, conn);
+	}
+	for (unsigned int i = 0U; i < data->n_connections; i++) {
+		fx_stack_sched_join(tasks[i]);
+	}
+	free(tasks);
+	return NULL;
+}
+
+static void *bench_client(void *data_) {
+	bench_data *data = (bench_data *)data_;
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	const int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = data->port;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fx_stack_io_connect(data->io, fd, (struct sockaddr *)&addr,
+	                        sizeof(addr), -1) != 0) {
+		fprintf(stderr, "Error while connecting to the server\n");
+		exit(1);
+	}
+
+	char buf[MSG_LEN];
+	memset(buf, 'x', MSG_LEN);
+	for (unsigned int i = 0U; i < data->n_messages; i++) {
+		if (!bench_transfer(data->io, fd, buf, true) ||
+		    !bench_transfer(data->io, fd, buf, false)) {
+			fprintf(stderr, "Error while communicating with the server\n");
+			exit(1);
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static double bench_run(fx_stack_io *io, unsigned int n_workers,
+                        unsigned int n_connections, unsigned int n_messages) {
+	fx_stack_sched sched;
+	if (!fx_stack_sched_init(&sched, n_workers, STACK_LEN,
+	                         2U * n_connections + 1U)) {
+		fprintf(stderr, "Error while initialising the scheduler\n");
+		exit(1);
+	}
+
+	/* Listen on an arbitrary port on the loopback interface */
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrlen = sizeof(addr);
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+	    (listen(fd, (int)n_connections) != 0) ||
+	    (getsockname(fd, (struct sockaddr *)&addr, &addrlen) != 0)) {
+		fprintf(stderr, "Error while creating the server socket\n");
+		exit(1);
+	}
+
+	bench_data data = {io, &sched, fd, addr.sin_port, n_connections,
+	                   n_messages};
+	fx_stack_sched_task **clients = (fx_stack_sched_task **)malloc(
+	    n_connections * sizeof(fx_stack_sched_task *));
+
+	const double t0 = bench_now();
+	fx_stack_sched_task *server =
+	    fx_stack_sched_spawn(&sched, bench_server, &data);
+	for (unsigned int i = 0U; i < n_connections; i++) {
+		clients[i] = fx_stack_sched_spawn(&sched, bench_client, &data);
+	}
+	for (unsigned int i = 0U; i < n_connections; i++) {
+		fx_stack_sched_join(clients[i]);
+	}
+	fx_stack_sched_join(server);
+	const double t1 = bench_now();
+
+	free(clients);
+	close(fd);
+	fx_stack_sched_destroy(&sched);
+
+	/* Return the number of round trips per second */
+	return (double)n_connections * n_messages / (t1 - t0);
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned int n_connections = 64U, n_messages = 1000U;
+	if (argc > 1) {
+		n_connections = (unsigned int)atoi(argv[1]);
+	}
+	if (argc > 2) {
+		n_messages = (unsigned int)atoi(argv[2]);
+	}
+
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1) {
+		n_cpus = 1;
+	}
+
+	fx_stack_io io;
+	if (!fx_stack_io_init(&io)) {
+		fprintf(stderr, "Error while initialising the reactor\n");
+		return 1;
+	}
+
+	printf("%8s %12s %20s %10s\n", "workers", "connections",
+	       "round trips [k/s]", "speedup");
+	double base = 0.0;
+	for (unsigned int n_workers = 1U; (n_workers <= N_MAX_WORKERS) &&
+	                                  (n_workers <= 2U * (unsigned int)n_cpus);
+	     n_workers *= 2U) {
+		const double rate =
+		    bench_run(&io, n_workers, n_connections, n_messages);
+		if (n_workers == 1U) {
+			base = rate;
+		}
+		printf("%8u %12u %20.2f %9.2fx\n", n_workers, n_connections,
+		       rate * 1e-3, rate / base);
+	}
+
+	fx_stack_io_destroy(&io);
+	return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the throughput of alloc/free pairs on a shared fx_stack_pool with
+ * an increasing number of threads, both with and without thread-local caches.
+ * With caches, the throughput should scale linearly with the number of cores.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack_pool.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STACK_LEN (4096U * 4U)
+#define N_HELD 4U
+#define N_MAX_THREADS 64U
+
+typedef struct {
+	fx_stack_pool *pool;
+	bool use_cache;
+	unsigned int n_iterations;
+	pthread_barrier_t *barrier;
+} bench_data;
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static void *bench_thread(void *data_) {
+	bench_data *data = (bench_data *)data_;
+	fx_stack_pool_cache cache;
+	fx_stack *held[N_HELD];
+
+	fx_stack_pool_cache_init(&cache, data->pool);
+	pthread_barrier_wait(data->barrier);
+	for (unsigned int i = 0U; i < data->n_iterations; i++) {
+		/* Allocate and release a few stacks at a time, as a task dispatcher
+		   would */
+		for (unsigned int j = 0U; j < N_HELD; j++) {
+			held[j] = data->use_cache ? fx_stack_pool_cache_alloc(&cache)
+			                          : fx_stack_pool_alloc(data->pool);
+		}
+		for (unsigned int j = 0U; j < N_HELD; j++) {
+			if (data->use_cache) {
+				fx_stack_pool_cache_free(&cache, held[j]);
+			} else {
+				fx_stack_pool_free(data->pool, held[j]);
+			}
+		}
+	}
+	fx_stack_pool_cache_destroy(&cache);
+	return NULL;
+}
+
+static double bench_run(unsigned int n_threads, bool use_cache,
+                        unsigned int n_iterations) {
+	fx_stack_pool pool;
+	if (!fx_stack_pool_init(&pool, STACK_LEN,
+	                        n_threads * (N_HELD + 2U * FX_STACK_POOL_CACHE_BATCH),
+	                        0U)) {
+		fprintf(stderr, "Error while initialising the pool\n");
+		exit(1);
+	}
+
+	pthread_t threads[N_MAX_THREADS];
+	pthread_barrier_t barrier;
+	bench_data data = {&pool, use_cache, n_iterations, &barrier};
+	pthread_barrier_init(&barrier, NULL, n_threads + 1U);
+	for (unsigned int i = 0U; i < n_threads; i++) {
+		pthread_create(&threads[i], NULL, bench_thread, &data);
+	}
+
+	pthread_barrier_wait(&barrier);
+	const double t0 = bench_now();
+	for (unsigned int i = 0U; i < n_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	const double t1 = bench_now();
+
+	pthread_barrier_destroy(&barrier);
+	fx_stack_pool_destroy(&pool);
+
+	/* Return the number of alloc/free pairs per second */
+	return ((double)n_threads * n_iterations * N_HELD) / (t1 - t0);
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned int n_iterations = 250000U;
+	if (argc > 1) {
+		n_iterations = (unsigned int)atoi(argv[1]);
+	}
+
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1) {
+		n_cpus = 1;
+	}
+
+	printf("%8s %18s %18s %10s\n", "threads", "shared [Mops/s]",
+	       "cached [Mops/s]", "speedup");
+	double base_cached = 0.0;
+	for (unsigned int n_threads = 1U;
+	     (n_threads <= N_MAX_THREADS) && (n_threads <= 2U * (unsigned int)n_cpus);
+	     n_threads *= 2U) {
+		const double shared = bench_run(n_threads, false, n_iterations);
+		const double cached = bench_run(n_threads, true, n_iterations);
+		if (n_threads == 1U) {
+			base_cached = cached;
+		}
+		printf("%8u %18.2f %18.2f %9.2fx\n", n_threads, shared * 1e-6,
+		       cached * 1e-6, cached / base_cached);
+	}
+	return 0;
+}
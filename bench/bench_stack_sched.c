@@ -0,0 +1,151 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the throughput of short requests executed as fx_stack_sched tasks
+ * with an increasing number of workers, and compares it against creating one
+ * thread per request. Each request spawns a few sub-tasks and joins them, so
+ * that idle workers have to steal work from busy ones.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack_sched.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STACK_LEN (4096U * 16U)
+#define N_SUBTASKS 4U
+#define N_WORK 2000U
+#define N_MAX_WORKERS 64U
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static void *bench_work(void *data) {
+	/* Some busy work the compiler cannot optimise away */
+	volatile uintptr_t x = (uintptr_t)data;
+	for (unsigned int i = 0U; i < N_WORK; i++) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	}
+	return (void *)x;
+}
+
+static void *bench_request_sched(void *data) {
+	fx_stack_sched *sched = (fx_stack_sched *)data;
+	fx_stack_sched_task *tasks[N_SUBTASKS];
+	for (uintptr_t i = 0U; i < N_SUBTASKS; i++) {
+		tasks[i] = fx_stack_sched_spawn(sched, bench_work, (void *)i);
+	}
+	for (unsigned int i = 0U; i < N_SUBTASKS; i++) {
+		fx_stack_sched_join(tasks[i]);
+	}
+	return NULL;
+}
+
+static void *bench_request_thread(void *data) {
+	(void)data;
+	pthread_t threads[N_SUBTASKS];
+	for (uintptr_t i = 0U; i < N_SUBTASKS; i++) {
+		pthread_create(&threads[i], NULL, bench_work, (void *)i);
+	}
+	for (unsigned int i = 0U; i < N_SUBTASKS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	return NULL;
+}
+
+static double bench_run_sched(unsigned int n_workers, unsigned int n_requests) {
+	fx_stack_sched sched;
+	if (!fx_stack_sched_init(&sched, n_workers, STACK_LEN,
+	                         n_requests * (N_SUBTASKS + 1U))) {
+		fprintf(stderr, "Error while initialising the scheduler\n");
+		exit(1);
+	}
+	fx_stack_sched_task **tasks = (fx_stack_sched_task **)malloc(
+	    n_requests * sizeof(fx_stack_sched_task *));
+
+	const double t0 = bench_now();
+	for (unsigned int i = 0U; i < n_requests; i++) {
+		tasks[i] = fx_stack_sched_spawn(&sched, bench_request_sched, &sched);
+	}
+	for (unsigned int i = 0U; i < n_requests; i++) {
+		fx_stack_sched_join(tasks[i]);
+	}
+	const double t1 = bench_now();
+
+	free(tasks);
+	fx_stack_sched_destroy(&sched);
+
+	/* Return the number of requests per second */
+	return (double)n_requests / (t1 - t0);
+}
+
+static double bench_run_thread(unsigned int n_requests) {
+	pthread_t *threads = (pthread_t *)malloc(n_requests * sizeof(pthread_t));
+
+	const double t0 = bench_now();
+	for (unsigned int i = 0U; i < n_requests; i++) {
+		pthread_create(&threads[i], NULL, bench_request_thread, NULL);
+	}
+	for (unsigned int i = 0U; i < n_requests; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	const double t1 = bench_now();
+
+	free(threads);
+	return (double)n_requests / (t1 - t0);
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned int n_requests = 256U;
+	if (argc > 1) {
+		n_requests = (unsigned int)atoi(argv[1]);
+	}
+
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1) {
+		n_cpus = 1;
+	}
+
+	printf("thread per request: %.2f kreq/s\n",
+	       bench_run_thread(n_requests) * 1e-3);
+	printf("%8s %18s %10s\n", "workers", "sched [kreq/s]", "speedup");
+	double base = 0.0;
+	for (unsigned int n_workers = 1U; (n_workers <= N_MAX_WORKERS) &&
+	                                  (n_workers <= 2U * (unsigned int)n_cpus);
+	     n_workers *= 2U) {
+		const double sched = bench_run_sched(n_workers, n_requests);
+		if (n_workers == 1U) {
+			base = sched;
+		}
+		printf("%8u %18.2f %9.2fx\n", n_workers, sched * 1e-3, sched / base);
+	}
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the memory required per suspended context for contexts running on
+ * dedicated pooled stacks and contexts running on a shared run stack, as well
+ * as the time required for a resume/yield round trip in both modes.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack.h>
+#include <foxen/stack_pool.h>
+#include <foxen/stack_shared.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEDICATED_STACK_LEN (64U * 1024U)
+#define SHARED_STACK_LEN (1024U * 1024U)
+#define DEPTH 8U
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+/**
+ * Returns the resident set size of the process in bytes or zero if it cannot
+ * be determined.
+ */
+static size_t bench_rss(void) {
+	unsigned long size = 0U, resident = 0U;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (!f) {
+		return 0U;
+	}
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+		resident = 0U;
+	}
+	fclose(f);
+	return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/******************************************************************************
+ * Workload                                                                   *
+ ******************************************************************************/
+
+typedef void *(*bench_yield_fun)(void *handle, void *value);
+
+typedef struct {
+	bench_yield_fun yield;
+	void *handle;
+} bench_task;
+
+static uintptr_t bench_recurse(bench_task *task, unsigned int depth) {
+	/* Simulate a typical request handler with a few stack frames and some
+	   local data on each level */
+	volatile uint8_t buf[128];
+	memset((void *)buf, (int)depth, sizeof(buf));
+	if (depth > 0U) {
+		return bench_recurse(task, depth - 1U) + buf[0];
+	}
+
+	/* Suspend until NULL is passed to the context */
+	uintptr_t sum = 0U;
+	while (task->yield(task->handle, (void *)sum)) {
+		sum++;
+	}
+	return sum;
+}
+
+static void *bench_cback(void *data) {
+	return (void *)bench_recurse((bench_task *)data, DEPTH);
+}
+
+/******************************************************************************
+ * Dedicated stacks                                                           *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_context ctx;
+	fx_stack_context caller;
+	bench_task task;
+} bench_dedicated_context;
+
+static void *bench_dedicated_yield(void *handle, void *value) {
+	bench_dedicated_context *c = (bench_dedicated_context *)handle;
+	return fx_stack_context_swap(&c->ctx, &c->caller, value);
+}
+
+static void bench_dedicated(unsigned int n) {
+	fx_stack_pool pool;
+	fx_stack_pool_init(&pool, DEDICATED_STACK_LEN, n, 0U);
+	bench_dedicated_context *cs = (bench_dedicated_context *)calloc(
+	    n, sizeof(bench_dedicated_context));
+
+	/* Start all contexts and let them suspend */
+	const size_t rss0 = bench_rss();
+	for (unsigned int i = 0U; i < n; i++) {
+		fx_stack *stack = fx_stack_pool_alloc(&pool);
+		cs[i].task.yield = bench_dedicated_yield;
+		cs[i].task.handle = &cs[i];
+		fx_stack_context_init(&cs[i].ctx, stack->stack_start, stack->stack_end,
+		                      bench_cback, &cs[i].task);
+		fx_stack_context_swap(&cs[i].caller, &cs[i].ctx, NULL);
+	}
+	const size_t rss1 = bench_rss();
+
+	/* Measure resume/yield round trips */
+	const unsigned int n_rounds = 10U;
+	const double t0 = bench_now();
+	for (unsigned int r = 0U; r < n_rounds; r++) {
+		for (unsigned int i = 0U; i < n; i++) {
+			fx_stack_context_swap(&cs[i].caller, &cs[i].ctx, (void *)1);
+		}
+	}
+	const double t1 = bench_now();
+
+	printf("%-10s %16.0f %16.0f %16.1f\n", "dedicated",
+	       (double)(pool.guard_size + pool.stack_size),
+	       (rss1 > rss0) ? (double)(rss1 - rss0) / n : 0.0,
+	       1e9 * (t1 - t0) / ((double)n * n_rounds));
+
+	for (unsigned int i = 0U; i < n; i++) {
+		fx_stack_context_destroy(&cs[i].ctx);
+	}
+	free(cs);
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Shared stack                                                               *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_shared_context sctx;
+	bench_task task;
+} bench_shared_context;
+
+static void *bench_shared_yield(void *handle, void *value) {
+	bench_shared_context *c = (bench_shared_context *)handle;
+	return fx_stack_shared_yield(&c->sctx, value);
+}
+
+static void bench_shared(unsigned int n) {
+	fx_stack_pool pool;
+	fx_stack_pool_init(&pool, SHARED_STACK_LEN, 1U, 0U);
+	fx_stack *stack = fx_stack_pool_alloc(&pool);
+	fx_stack_shared shared;
+	fx_stack_shared_init(&shared, stack->stack_start, stack->stack_end);
+	bench_shared_context *cs =
+	    (bench_shared_context *)calloc(n, sizeof(bench_shared_context));
+
+	/* Start all contexts and let them suspend */
+	const size_t rss0 = bench_rss();
+	for (unsigned int i = 0U; i < n; i++) {
+		cs[i].task.yield = bench_shared_yield;
+		cs[i].task.handle = &cs[i];
+		fx_stack_shared_context_init(&cs[i].sctx, &shared, bench_cback,
+		                             &cs[i].task);
+		fx_stack_shared_resume(&cs[i].sctx, NULL);
+	}
+	const size_t rss1 = bench_rss();
+	size_t saved = 0U;
+	for (unsigned int i = 0U; i < n; i++) {
+		saved += fx_stack_shared_context_saved_size(&cs[i].sctx);
+	}
+
+	/* Measure resume/yield round trips; every resume evicts the previous
+	   context */
+	const unsigned int n_rounds = 10U;
+	const double t0 = bench_now();
+	for (unsigned int r = 0U; r < n_rounds; r++) {
+		for (unsigned int i = 0U; i < n; i++) {
+			fx_stack_shared_resume(&cs[i].sctx, (void *)1);
+		}
+	}
+	const double t1 = bench_now();
+
+	printf("%-10s %16.0f %16.0f %16.1f\n", "shared", (double)saved / n,
+	       (rss1 > rss0) ? (double)(rss1 - rss0) / n : 0.0,
+	       1e9 * (t1 - t0) / ((double)n * n_rounds));
+
+	for (unsigned int i = 0U; i < n; i++) {
+		fx_stack_shared_context_destroy(&cs[i].sctx);
+	}
+	free(cs);
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Main program                                                               *
+ ******************************************************************************/
+
+int main(int argc, const char *argv[]) {
+	unsigned int n = 10000U;
+	if (argc > 1) {
+		n = (unsigned int)atoi(argv[1]);
+	}
+
+	printf("%u suspended contexts, call depth %u\n", n, DEPTH);
+	printf("%-10s %16s %16s %16s\n", "mode", "reserved [B]", "resident [B]",
+	       "round trip [ns]");
+	bench_dedicated(n);
+	bench_shared(n);
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the fx_stack_sync primitives against their pthread counterparts.
+ * In the mutex benchmark, a number of contenders repeatedly lock a mutex
+ * shared by all of them; in the channel benchmark, pairs of senders and
+ * receivers pass messages through a bounded channel. The pthread variants run
+ * one thread per contender; the fx_stack_sync variants run one task per
+ * contender on a scheduler with an increasing number of workers, and on a
+ * single worker using FX_STACK_SYNC_LOCAL.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack_sched.h>
+#include <foxen/stack_sync.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STACK_LEN (4096U * 16U)
+#define N_CONTENDERS 16U
+#define N_LOCKS 20000U
+#define N_MESSAGES 20000U
+#define CHAN_CAPACITY 64U
+#define N_MAX_WORKERS 64U
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+/**
+ * Runs n instances of cback(data), either as threads (if sched is NULL) or as
+ * tasks, and returns the elapsed time in seconds.
+ */
+static double bench_run(fx_stack_sched *sched, unsigned int n,
+                        void *(*cback)(void *), void **data) {
+	pthread_t threads[2U * N_CONTENDERS];
+	fx_stack_sched_task *tasks[2U * N_CONTENDERS];
+
+	const double t0 = bench_now();
+	for (unsigned int i = 0U; i < n; i++) {
+		if (sched) {
+			tasks[i] = fx_stack_sched_spawn(sched, cback, data[i]);
+		} else {
+			pthread_create(&threads[i], NULL, cback, data[i]);
+		}
+	}
+	for (unsigned int i = 0U; i < n; i++) {
+		if (sched) {
+			fx_stack_sched_join(tasks[i]);
+		} else {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	return bench_now() - t0;
+}
+
+/******************************************************************************
+ * Mutex                                                                      *
+ ******************************************************************************/
+
+static volatile uintptr_t bench_counter = 0U;
+
+static void *bench_mutex_pthread(void *data) {
+	pthread_mutex_t *mutex = (pthread_mutex_t *)data;
+	for (unsigned int i = 0U; i < N_LOCKS; i++) {
+		pthread_mutex_lock(mutex);
+		bench_counter = bench_counter + 1U;
+		pthread_mutex_unlock(mutex);
+	}
+	return NULL;
+}
+
+static void *bench_mutex_fx(void *data) {
+	fx_stack_mutex *mutex = (fx_stack_mutex *)data;
+	for (unsigned int i = 0U; i < N_LOCKS; i++) {
+		fx_stack_mutex_lock(mutex);
+		bench_counter = bench_counter + 1U;
+		fx_stack_mutex_unlock(mutex);
+	}
+	return NULL;
+}
+
+static double bench_mutex(fx_stack_sched *sched, unsigned int flags) {
+	pthread_mutex_t pmutex = PTHREAD_MUTEX_INITIALIZER;
+	fx_stack_mutex mutex;
+	fx_stack_mutex_init(&mutex, flags);
+
+	void *data[N_CONTENDERS];
+	for (unsigned int i = 0U; i < N_CONTENDERS; i++) {
+		data[i] = sched ? (void *)&mutex : (void *)&pmutex;
+	}
+	const double t = bench_run(sched, N_CONTENDERS,
+	                           sched ? bench_mutex_fx : bench_mutex_pthread,
+	                           data);
+
+	fx_stack_mutex_destroy(&mutex);
+	pthread_mutex_destroy(&pmutex);
+
+	/* Return the time per lock/unlock pair in nanoseconds */
+	return 1e9 * t / (N_CONTENDERS * N_LOCKS);
+}
+
+/******************************************************************************
+ * Channel                                                                    *
+ ******************************************************************************/
+
+/**
+ * Bounded queue built from a pthread mutex and two condition variables.
+ */
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	void *buf[CHAN_CAPACITY];
+	size_t head, tail;
+} bench_pthread_chan;
+
+static void *bench_chan_pthread_send(void *data) {
+	bench_pthread_chan *chan = (bench_pthread_chan *)data;
+	for (uintptr_t i = 0U; i < N_MESSAGES; i++) {
+		pthread_mutex_lock(&chan->mutex);
+		while (chan->tail - chan->head == CHAN_CAPACITY) {
+			pthread_cond_wait(&chan->not_full, &chan->mutex);
+		}
+		chan->buf[chan->tail++ % CHAN_CAPACITY] = (void *)i;
+		pthread_cond_signal(&chan->not_empty);
+		pthread_mutex_unlock(&chan->mutex);
+	}
+	return NULL;
+}
+
+static void *bench_chan_pthread_recv(void *data) {
+	bench_pthread_chan *chan = (bench_pthread_chan *)data;
+	for (uintptr_t i = 0U; i < N_MESSAGES; i++) {
+		pthread_mutex_lock(&chan->mutex);
+		while (chan->tail == chan->head) {
+			pthread_cond_wait(&chan->not_empty, &chan->mutex);
+		}
+		chan->head++;
+		pthread_cond_signal(&chan->not_full);
+		pthread_mutex_unlock(&chan->mutex);
+	}
+	return NULL;
+}
+
+static void *bench_chan_fx_send(void *data) {
+	fx_stack_chan *chan = (fx_stack_chan *)data;
+	for (uintptr_t i = 0U; i < N_MESSAGES; i++) {
+		fx_stack_chan_send(chan, (void *)i);
+	}
+	return NULL;
+}
+
+static void *bench_chan_fx_recv(void *data) {
+	fx_stack_chan *chan = (fx_stack_chan *)data;
+	void *value;
+	for (uintptr_t i = 0U; i < N_MESSAGES; i++) {
+		fx_stack_chan_recv(chan, &value);
+	}
+	return NULL;
+}
+
+/**
+ * Role of a thread or task in the channel benchmark.
+ */
+typedef struct {
+	void *chan;
+	bool recv;
+	bool pthread;
+} bench_chan_role;
+
+static void *bench_chan_dispatch(void *data) {
+	bench_chan_role *role = (bench_chan_role *)data;
+	if (role->pthread) {
+		return role->recv ? bench_chan_pthread_recv(role->chan)
+		                  : bench_chan_pthread_send(role->chan);
+	}
+	return role->recv ? bench_chan_fx_recv(role->chan)
+	                  : bench_chan_fx_send(role->chan);
+}
+
+static double bench_chan(fx_stack_sched *sched, unsigned int n_pairs,
+                         unsigned int flags) {
+	bench_pthread_chan pchan;
+	pthread_mutex_init(&pchan.mutex, NULL);
+	pthread_cond_init(&pchan.not_empty, NULL);
+	pthread_cond_init(&pchan.not_full, NULL);
+	pchan.head = 0U;
+	pchan.tail = 0U;
+
+	fx_stack_chan chan;
+	if (!fx_stack_chan_init(&chan, CHAN_CAPACITY, flags)) {
+		fprintf(stderr, "Error while initialising the channel\n");
+		exit(1);
+	}
+
+	bench_chan_role roles[2U * N_CONTENDERS];
+	void *data[2U * N_CONTENDERS];
+	for (unsigned int i = 0U; i < 2U * n_pairs; i++) {
+		roles[i].chan = sched ? (void *)&chan : (void *)&pchan;
+		roles[i].recv = i % 2U;
+		roles[i].pthread = !sched;
+		data[i] = &roles[i];
+	}
+	const double t = bench_run(sched, 2U * n_pairs, bench_chan_dispatch, data);
+
+	fx_stack_chan_destroy(&chan);
+	pthread_cond_destroy(&pchan.not_full);
+	pthread_cond_destroy(&pchan.not_empty);
+	pthread_mutex_destroy(&pchan.mutex);
+
+	/* Return the time per message in nanoseconds */
+	return 1e9 * t / (n_pairs * N_MESSAGES);
+}
+
+/******************************************************************************
+ * Main program                                                               *
+ ******************************************************************************/
+
+static fx_stack_sched *bench_sched_init(fx_stack_sched *sched,
+                                        unsigned int n_workers) {
+	if (!fx_stack_sched_init(sched, n_workers, STACK_LEN,
+	                         2U * N_CONTENDERS)) {
+		fprintf(stderr, "Error while initialising the scheduler\n");
+		exit(1);
+	}
+	return sched;
+}
+
+int main() {
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1) {
+		n_cpus = 1;
+	}
+
+	fx_stack_sched sched;
+	printf("%-24s %12s %12s %12s\n", "", "mutex [ns]", "SPSC [ns]",
+	       "MPMC [ns]");
+	printf("%-24s %12.1f %12.1f %12.1f\n", "pthread", bench_mutex(NULL, 0U),
+	       bench_chan(NULL, 1U, 0U), bench_chan(NULL, N_CONTENDERS, 0U));
+
+	bench_sched_init(&sched, 1U);
+	printf("%-24s %12.1f %12.1f %12.1f\n", "fx_stack_sync, local",
+	       bench_mutex(&sched, FX_STACK_SYNC_LOCAL),
+	       bench_chan(&sched, 1U, FX_STACK_SYNC_LOCAL | FX_STACK_CHAN_SPSC),
+	       bench_chan(&sched, N_CONTENDERS, FX_STACK_SYNC_LOCAL));
+	fx_stack_sched_destroy(&sched);
+
+	for (unsigned int n_workers = 1U; (n_workers <= N_MAX_WORKERS) &&
+	                                  (n_workers <= (unsigned int)n_cpus);
+	     n_workers *= 2U) {
+		char name[32];
+		snprintf(name, sizeof(name), "fx_stack_sync, %u worker%s", n_workers,
+		         (n_workers == 1U) ? "" : "s");
+		bench_sched_init(&sched, n_workers);
+		printf("%-24s %12.1f %12.1f %12.1f\n", name, bench_mutex(&sched, 0U),
+		       bench_chan(&sched, 1U, FX_STACK_CHAN_SPSC),
+		       bench_chan(&sched, N_CONTENDERS, 0U));
+		fx_stack_sched_destroy(&sched);
+	}
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures insertion, cancellation and expiry of a large number of concurrent
+ * timers in a fx_stack_timer_wheel and compares them against a binary min-heap
+ * with position tracking, as typically used for I/O timeouts. Most timers are
+ * cancelled before they expire, as is the case for timeouts of I/O operations
+ * that complete in time.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack_timer.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Timers are spread over ten seconds with a resolution of one microsecond;
+   the expiry phase advances the time in steps of one millisecond */
+#define BENCH_RANGE_NS 10000000000ULL
+#define BENCH_TICK_NS 1000U
+#define BENCH_STEP_NS 1000000U
+
+/* One in BENCH_EXPIRE_RATIO timers expires, the others are cancelled */
+#define BENCH_EXPIRE_RATIO 10U
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static uint64_t bench_rand(uint64_t *state) {
+	*state ^= *state << 13U;
+	*state ^= *state >> 7U;
+	*state ^= *state << 17U;
+	return *state;
+}
+
+typedef struct {
+	double insert, cancel, expire;
+} bench_result;
+
+static void bench_min(bench_result *res, double insert, double cancel,
+                      double expire) {
+	res->insert = (insert < res->insert) ? insert : res->insert;
+	res->cancel = (cancel < res->cancel) ? cancel : res->cancel;
+	res->expire = (expire < res->expire) ? expire : res->expire;
+}
+
+/******************************************************************************
+ * Binary heap                                                                *
+ ******************************************************************************/
+
+typedef struct {
+	uint64_t deadline;
+	size_t heap_idx;
+} bench_heap_timer;
+
+typedef struct {
+	bench_heap_timer **elems;
+	size_t size;
+} bench_heap;
+
+static void bench_heap_set(bench_heap *heap, size_t i, bench_heap_timer *t) {
+	heap->elems[i] = t;
+	t->heap_idx = i;
+}
+
+static void bench_heap_sift_up(bench_heap *heap, size_t i) {
+	bench_heap_timer *t = heap->elems[i];
+	while ((i > 0U) && (t->deadline < heap->elems[(i - 1U) / 2U]->deadline)) {
+		bench_heap_set(heap, i, heap->elems[(i - 1U) / 2U]);
+		i = (i - 1U) / 2U;
+	}
+	bench_heap_set(heap, i, t);
+}
+
+static void bench_heap_sift_down(bench_heap *heap, size_t i) {
+	bench_heap_timer *t = heap->elems[i];
+	while (true) {
+		size_t min = 2U * i + 1U;
+		if (min >= heap->size) {
+			break;
+		}
+		if ((min + 1U < heap->size) &&
+		    (heap->elems[min + 1U]->deadline < heap->elems[min]->deadline)) {
+			min++;
+		}
+		if (t->deadline <= heap->elems[min]->deadline) {
+			break;
+		}
+		bench_heap_set(heap, i, heap->elems[min]);
+		i = min;
+	}
+	bench_heap_set(heap, i, t);
+}
+
+static void bench_heap_push(bench_heap *heap, bench_heap_timer *t) {
+	bench_heap_set(heap, heap->size++, t);
+	bench_heap_sift_up(heap, heap->size - 1U);
+}
+
+static void bench_heap_remove(bench_heap *heap, bench_heap_timer *t) {
+	const size_t i = t->heap_idx;
+	heap->size--;
+	if (i < heap->size) {
+		bench_heap_set(heap, i, heap->elems[heap->size]);
+		bench_heap_sift_up(heap, i);
+		bench_heap_sift_down(heap, heap->elems[i]->heap_idx);
+	}
+}
+
+static size_t bench_heap_run(size_t n, bench_result *res) {
+	bench_heap_timer *timers =
+	    (bench_heap_timer *)malloc(n * sizeof(bench_heap_timer));
+	bench_heap heap = {(bench_heap_timer **)malloc(n * sizeof(void *)), 0U};
+	uint64_t rng = 4813U;
+
+	/* Fault in the memory before the measurement */
+	memset(timers, 0, n * sizeof(bench_heap_timer));
+	memset(heap.elems, 0, n * sizeof(void *));
+
+	const double t0 = bench_now();
+	for (size_t i = 0U; i < n; i++) {
+		/* Round to the tick resolution of the timing wheel */
+		timers[i].deadline =
+		    (bench_rand(&rng) % BENCH_RANGE_NS) / BENCH_TICK_NS * BENCH_TICK_NS;
+		bench_heap_push(&heap, &timers[i]);
+	}
+	const double t1 = bench_now();
+	for (size_t i = 0U; i < n; i++) {
+		if (i % BENCH_EXPIRE_RATIO) {
+			bench_heap_remove(&heap, &timers[i]);
+		}
+	}
+	const double t2 = bench_now();
+	size_t n_expired = 0U;
+	for (uint64_t now = 0U; heap.size > 0U; now += BENCH_STEP_NS) {
+		while ((heap.size > 0U) && (heap.elems[0]->deadline <= now)) {
+			bench_heap_remove(&heap, heap.elems[0]);
+			n_expired++;
+		}
+	}
+	const double t3 = bench_now();
+	bench_min(res, t1 - t0, t2 - t1, t3 - t2);
+
+	free(heap.elems);
+	free(timers);
+	return n_expired;
+}
+
+/******************************************************************************
+ * Timing wheel                                                               *
+ ******************************************************************************/
+
+static void bench_wheel_cback(fx_stack_timer *timer, void *data) {
+	(void)timer;
+	(*(size_t *)data)++;
+}
+
+static size_t bench_wheel_run(size_t n, bench_result *res) {
+	fx_stack_timer *timers =
+	    (fx_stack_timer *)malloc(n * sizeof(fx_stack_timer));
+	fx_stack_timer_wheel *wheel =
+	    (fx_stack_timer_wheel *)malloc(sizeof(fx_stack_timer_wheel));
+	fx_stack_timer_wheel_init(wheel, BENCH_TICK_NS, 0U);
+	uint64_t rng = 4813U;
+	size_t n_expired = 0U;
+
+	/* Fault in the memory before the measurement */
+	memset(timers, 0, n * sizeof(fx_stack_timer));
+
+	const double t0 = bench_now();
+	for (size_t i = 0U; i < n; i++) {
+		fx_stack_timer_add(wheel, &timers[i],
+		                   bench_rand(&rng) % BENCH_RANGE_NS, bench_wheel_cback,
+		                   &n_expired);
+	}
+	const double t1 = bench_now();
+	for (size_t i = 0U; i < n; i++) {
+		if (i % BENCH_EXPIRE_RATIO) {
+			fx_stack_timer_cancel(wheel, &timers[i]);
+		}
+	}
+	const double t2 = bench_now();
+	for (uint64_t now = 0U; wheel->n_timers > 0U; now += BENCH_STEP_NS) {
+		fx_stack_timer_wheel_advance(wheel, now);
+	}
+	const double t3 = bench_now();
+	bench_min(res, t1 - t0, t2 - t1, t3 - t2);
+
+	free(wheel);
+	free(timers);
+	return n_expired;
+}
+
+/******************************************************************************
+ * Main program                                                               *
+ ******************************************************************************/
+
+static void bench_print(const char *name, size_t n, size_t n_expired,
+                        const bench_result *res) {
+	printf("%-16s %10.2f ns/insert %10.2f ns/cancel %10.2f ns/expire\n", name,
+	       1e9 * res->insert / (double)n,
+	       1e9 * res->cancel / (double)(n - n_expired),
+	       1e9 * res->expire / (double)n_expired);
+}
+
+int main(int argc, const char *argv[]) {
+	size_t n = 1000000U;
+	if (argc > 1) {
+		n = strtoul(argv[1], NULL, 10);
+	}
+
+	/* Run both variants a few times and report the fastest run to reduce the
+	   influence of other processes */
+	bench_result res_heap = {1e9, 1e9, 1e9}, res_wheel = {1e9, 1e9, 1e9};
+	size_t n_expired_heap = 0U, n_expired_wheel = 0U;
+	for (unsigned int run = 0U; run < 3U; run++) {
+		n_expired_heap = bench_heap_run(n, &res_heap);
+		n_expired_wheel = bench_wheel_run(n, &res_wheel);
+		if (n_expired_heap != n_expired_wheel) {
+			fprintf(stderr, "Unexpected result\n");
+			return 1;
+		}
+	}
+
+	printf("%zu concurrent timers, %zu expired\n", n, n_expired_wheel);
+	bench_print("binary heap", n, n_expired_heap, &res_heap);
+	bench_print("timing wheel", n, n_expired_wheel, &res_wheel);
+	return 0;
+}
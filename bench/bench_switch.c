@@ -0,0 +1,298 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the latency of a stack switch round trip and compares it to a plain
+ * (indirect) function call and to swapcontext(). Each sample is the mean over
+ * a small batch of round trips; the program reports percentiles over all
+ * samples in nanoseconds and, on x86, in TSC cycles.
+ *
+ * This program is compiled once for each library configuration; the
+ * configuration is passed as BENCH_VARIANT by the build system.
+ */
+
+/* Required for clock_gettime() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack.h>
+#include <foxen/stack_inline.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "default"
+#endif
+
+#define STACK_LEN (64U * 1024U)
+#define BATCH 64U
+
+/******************************************************************************
+ * Timing                                                                     *
+ ******************************************************************************/
+
+static uint64_t bench_nanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Returns the current value of the time-stamp counter or zero if it cannot be
+ * read on this platform.
+ */
+static uint64_t bench_cycles(void) {
+#if defined(__amd64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32U) | lo;
+#else
+	return 0U;
+#endif
+}
+
+typedef struct {
+	double *ns;
+	double *cycles;
+	size_t n;
+} bench_samples;
+
+static int bench_cmp_double(const void *a, const void *b) {
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static double bench_percentile(const double *sorted, size_t n, double p) {
+	size_t i = (size_t)(p * (double)(n - 1U) + 0.5);
+	return sorted[(i < n) ? i : (n - 1U)];
+}
+
+static void bench_print_row(const char *name, const char *unit, double *xs,
+                            size_t n) {
+	double mean = 0.0;
+	for (size_t i = 0U; i < n; i++) {
+		mean += xs[i];
+	}
+	mean /= (double)n;
+	qsort(xs, n, sizeof(double), bench_cmp_double);
+	printf("%-22s %-6s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, unit,
+	       xs[0], bench_percentile(xs, n, 0.5), bench_percentile(xs, n, 0.9),
+	       bench_percentile(xs, n, 0.99), bench_percentile(xs, n, 0.999), mean);
+}
+
+static void bench_print(const char *name, bench_samples *s) {
+	bench_print_row(name, "ns", s->ns, s->n);
+	if (s->cycles[s->n - 1U] > 0.0) {
+		bench_print_row("", "cycles", s->cycles, s->n);
+	}
+}
+
+/******************************************************************************
+ * Workloads                                                                  *
+ ******************************************************************************/
+
+typedef void (*bench_fun)(void *state);
+
+/**
+ * Collects samples of the given workload. Each call of the workload function
+ * performs n_ops operations; the samples are normalised per operation.
+ */
+static void bench_run(bench_fun f, void *state, unsigned int n_ops,
+                      bench_samples *s) {
+	/* Warm up */
+	for (size_t i = 0U; i < 1000U; i++) {
+		f(state);
+	}
+
+	for (size_t i = 0U; i < s->n; i++) {
+		const uint64_t c0 = bench_cycles();
+		const uint64_t t0 = bench_nanos();
+		for (unsigned int j = 0U; j < BATCH; j++) {
+			f(state);
+		}
+		const uint64_t t1 = bench_nanos();
+		const uint64_t c1 = bench_cycles();
+		s->ns[i] = (double)(t1 - t0) / (BATCH * n_ops);
+		s->cycles[i] = (double)(c1 - c0) / (BATCH * n_ops);
+	}
+}
+
+static void *bench_cback(void *data) { return data; }
+
+/* Call the callback through a volatile pointer to prevent inlining */
+static void *(*volatile bench_cback_ptr)(void *) = bench_cback;
+
+typedef struct {
+	void *stack_start;
+	void *stack_end;
+} bench_switch_state;
+
+static void bench_plain_call(void *state) { bench_cback_ptr(state); }
+
+static void bench_switch(void *state_) {
+	bench_switch_state *state = (bench_switch_state *)state_;
+	fx_stack_switch(state->stack_start, state->stack_end, state->stack_end,
+	                bench_cback, state);
+}
+
+static void bench_handle_switch(void *state_) {
+	fx_stack_handle *handle = (fx_stack_handle *)state_;
+	fx_stack_handle_switch(handle, handle->stack_end, bench_cback, handle);
+}
+
+static void bench_switch_inline(void *state_) {
+	bench_switch_state *state = (bench_switch_state *)state_;
+	fx_stack_switch_inline(state->stack_start, state->stack_end,
+	                       state->stack_end, bench_cback, state);
+}
+
+typedef struct {
+	void *stack_start;
+	void *stack_end;
+	fx_stack_batch_item items[BATCH];
+} bench_batch_state;
+
+static void bench_switch_batch(void *state_) {
+	bench_batch_state *state = (bench_batch_state *)state_;
+	fx_stack_switch_batch(state->stack_start, state->stack_end,
+	                      state->stack_end, state->items, BATCH);
+}
+
+typedef struct {
+	fx_stack_context main;
+	fx_stack_context ctx;
+} bench_context_state;
+
+static void *bench_context_cback(void *data) {
+	bench_context_state *state = (bench_context_state *)data;
+	while (1) {
+		fx_stack_context_swap(&state->ctx, &state->main, NULL);
+	}
+	return NULL;
+}
+
+static void bench_context_swap(void *state_) {
+	bench_context_state *state = (bench_context_state *)state_;
+	fx_stack_context_swap(&state->main, &state->ctx, NULL);
+}
+
+typedef struct {
+	ucontext_t main;
+	ucontext_t ctx;
+} bench_ucontext_state;
+
+static bench_ucontext_state *bench_ucontext_current = NULL;
+
+static void bench_ucontext_cback(void) {
+	while (1) {
+		swapcontext(&bench_ucontext_current->ctx,
+		            &bench_ucontext_current->main);
+	}
+}
+
+static void bench_ucontext_swap(void *state_) {
+	bench_ucontext_state *state = (bench_ucontext_state *)state_;
+	swapcontext(&state->main, &state->ctx);
+}
+
+/******************************************************************************
+ * Main program                                                               *
+ ******************************************************************************/
+
+int main(int argc, const char *argv[]) {
+	bench_samples s;
+	s.n = 20000U;
+	if (argc > 1) {
+		s.n = (size_t)strtoul(argv[1], NULL, 10);
+	}
+	if (s.n == 0U) {
+		return 1;
+	}
+	s.ns = (double *)malloc(s.n * sizeof(double));
+	s.cycles = (double *)malloc(s.n * sizeof(double));
+
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+	void *stack2_start = malloc(STACK_LEN);
+	void *stack2_end = (void *)((uintptr_t)stack2_start + STACK_LEN);
+
+	printf("Library configuration: %s\n", BENCH_VARIANT);
+	printf("%u round trips per sample, %zu samples\n", BATCH, s.n);
+	printf("%-22s %-6s %9s %9s %9s %9s %9s %9s\n", "benchmark", "unit", "min",
+	       "p50", "p90", "p99", "p99.9", "mean");
+
+	/* Baseline: plain indirect function call */
+	bench_run(bench_plain_call, NULL, 1U, &s);
+	bench_print("plain call", &s);
+
+	/* fx_stack_switch() and fx_stack_switch_inline() */
+	bench_switch_state switch_state = {stack_start, stack_end};
+	bench_run(bench_switch, &switch_state, 1U, &s);
+	bench_print("fx_stack_switch", &s);
+	fx_stack_handle handle;
+	fx_stack_handle_init(&handle, stack_start, stack_end);
+	bench_run(bench_handle_switch, &handle, 1U, &s);
+	bench_print("fx_stack_handle_switch", &s);
+	fx_stack_handle_destroy(&handle);
+	bench_run(bench_switch_inline, &switch_state, 1U, &s);
+	bench_print("fx_stack_switch_inline", &s);
+
+	/* fx_stack_switch_batch(), per item */
+	bench_batch_state batch_state;
+	batch_state.stack_start = stack_start;
+	batch_state.stack_end = stack_end;
+	for (unsigned int i = 0U; i < BATCH; i++) {
+		batch_state.items[i].cback = bench_cback;
+		batch_state.items[i].data = NULL;
+	}
+	bench_run(bench_switch_batch, &batch_state, BATCH, &s);
+	bench_print("fx_stack_switch_batch", &s);
+
+	/* Context swap round trip (two swaps) */
+	bench_context_state context_state;
+	memset(&context_state, 0, sizeof(context_state));
+	fx_stack_context_init(&context_state.ctx, stack2_start, stack2_end,
+	                      bench_context_cback, &context_state);
+	bench_run(bench_context_swap, &context_state, 1U, &s);
+	bench_print("fx_stack_context_swap", &s);
+
+	/* Baseline: swapcontext() round trip (two swaps) */
+	bench_ucontext_state ucontext_state;
+	getcontext(&ucontext_state.ctx);
+	ucontext_state.ctx.uc_stack.ss_sp = stack_start;
+	ucontext_state.ctx.uc_stack.ss_size = STACK_LEN;
+	ucontext_state.ctx.uc_link = NULL;
+	makecontext(&ucontext_state.ctx, bench_ucontext_cback, 0);
+	bench_ucontext_current = &ucontext_state;
+	bench_run(bench_ucontext_swap, &ucontext_state, 1U, &s);
+	bench_print("swapcontext", &s);
+
+	/* The contexts are never finished; just release the memory */
+	fx_stack_context_destroy(&context_state.ctx);
+	free(stack_start);
+	free(stack2_start);
+	free(s.ns);
+	free(s.cycles);
+	return 0;
+}
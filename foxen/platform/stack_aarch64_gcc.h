@@ -0,0 +1,232 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The platform register x18 is reserved on Apple platforms and must not be
+   touched; on Linux it is an ordinary temporary register. */
+#if defined(__APPLE__)
+#define FX_STACK_AARCH64_CLOBBER_X18
+#else
+#define FX_STACK_AARCH64_CLOBBER_X18 "x18",
+#endif
+
+__attribute__((noinline)) static void *_fx_stack_switch(void *stack_ptr,
+                                                        fx_stack_cback cback,
+                                                        void *data) {
+	/* Pass the arguments in the registers used by the callback call. x0 holds
+	   the argument and return value of the callback. */
+	register void *x0 __asm__("x0") = data;
+	register fx_stack_cback x1 __asm__("x1") = cback;
+	register void *x2 __asm__("x2") = stack_ptr;
+
+	/* Force a frame pointer. This makes x29 the base of the canonical frame
+	   address in the unwind information of this function, and links the
+	   frame record of the callback to the frames on the original stack, so
+	   debuggers and profilers can unwind while sp points at the other
+	   stack. */
+	__asm__ __volatile__("" : : "r"(__builtin_frame_address(0)));
+
+	/* This function is never inlined, so the caller already assumes that the
+	   upper halves of v8-v15 are destroyed. The callback preserves x19-x29
+	   and d8-d15, thus only the remaining caller-saved registers and x19,
+	   which holds the original stack pointer, are clobbered. */
+	__asm__ __volatile__(
+	    /* Store the stack pointer in x19 and load the stack pointer from
+	       stack_ptr. Accessing memory relative to a stack pointer that is not
+	       16-byte aligned faults, so round stack_ptr down. */
+	    "mov x19, sp\n\t"
+	    "and x2, x2, #-16\n\t"
+	    "mov sp, x2\n\t"
+
+	    /* Call the callback function with x0 = data */
+	    "blr x1\n\t"
+
+	    /* Restore the original stack pointer */
+	    "mov sp, x19\n\t"
+	    : "+r"(x0), "+r"(x1), "+r"(x2)
+	    :
+	    : "memory", "cc", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10",
+	      "x11", "x12", "x13", "x14", "x15", "x16", "x17",
+	      FX_STACK_AARCH64_CLOBBER_X18 "x19", "x30", "v0", "v1", "v2", "v3",
+	      "v4", "v5", "v6", "v7", "v16", "v17", "v18", "v19", "v20", "v21",
+	      "v22", "v23", "v24", "v25", "v26", "v27", "v28", "v29", "v30",
+	      "v31");
+
+	return x0;
+}
+
+#ifndef FX_STACK_PLATFORM_NO_CONTEXT
+
+/* Callee-saved floating point registers d8-d15, stored in a 64 byte frame
+   below the integer registers. Omitted in the minimal profile. */
+#ifndef FX_STACK_PROFILE_MINIMAL
+#define FX_STACK_AARCH64_FP_SAVE                         \
+	"stp d8, d9, [sp, #-64]!\n\t"                        \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 64")        \
+	"stp d10, d11, [sp, #16]\n\t"                        \
+	"stp d12, d13, [sp, #32]\n\t"                        \
+	"stp d14, d15, [sp, #48]\n\t"                        \
+	FX_STACK_ASM_CFI(".cfi_offset d8, -160")             \
+	FX_STACK_ASM_CFI(".cfi_offset d9, -152")             \
+	FX_STACK_ASM_CFI(".cfi_offset d10, -144")            \
+	FX_STACK_ASM_CFI(".cfi_offset d11, -136")            \
+	FX_STACK_ASM_CFI(".cfi_offset d12, -128")            \
+	FX_STACK_ASM_CFI(".cfi_offset d13, -120")            \
+	FX_STACK_ASM_CFI(".cfi_offset d14, -112")            \
+	FX_STACK_ASM_CFI(".cfi_offset d15, -104")
+#define FX_STACK_AARCH64_FP_RESTORE                      \
+	"ldp d10, d11, [sp, #16]\n\t"                        \
+	"ldp d12, d13, [sp, #32]\n\t"                        \
+	"ldp d14, d15, [sp, #48]\n\t"                        \
+	"ldp d8, d9, [sp], #64\n\t"                          \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -64")       \
+	FX_STACK_ASM_CFI(".cfi_restore d8")                  \
+	FX_STACK_ASM_CFI(".cfi_restore d9")                  \
+	FX_STACK_ASM_CFI(".cfi_restore d10")                 \
+	FX_STACK_ASM_CFI(".cfi_restore d11")                 \
+	FX_STACK_ASM_CFI(".cfi_restore d12")                 \
+	FX_STACK_ASM_CFI(".cfi_restore d13")                 \
+	FX_STACK_ASM_CFI(".cfi_restore d14")                 \
+	FX_STACK_ASM_CFI(".cfi_restore d15")
+#define FX_STACK_AARCH64_FP_WORDS 8U
+#else
+#define FX_STACK_AARCH64_FP_SAVE
+#define FX_STACK_AARCH64_FP_RESTORE
+#define FX_STACK_AARCH64_FP_WORDS 0U
+#endif
+
+/* The full profile stores FPCR in a 16 byte slot at the bottom of the frame */
+#ifdef FX_STACK_PROFILE_FULL
+#define FX_STACK_AARCH64_FP_CONTROL_SAVE                 \
+	"mrs x9, fpcr\n\t"                                   \
+	"str x9, [sp, #-16]!\n\t"                            \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 16")
+#define FX_STACK_AARCH64_FP_CONTROL_RESTORE              \
+	"ldr x9, [sp], #16\n\t"                              \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -16")       \
+	"msr fpcr, x9\n\t"
+#else
+#define FX_STACK_AARCH64_FP_CONTROL_SAVE
+#define FX_STACK_AARCH64_FP_CONTROL_RESTORE
+#endif
+
+FX_STACK_ASM_DECL void _fx_stack_context_swap_asm(void **save_sp,
+                                                  void *load_sp);
+FX_STACK_ASM_DECL void _fx_stack_context_trampoline(void);
+
+__asm__(
+    FX_STACK_ASM_FUNC_BEGIN(_fx_stack_context_swap_asm)
+    FX_STACK_ASM_CFI(".cfi_startproc")
+    /* Store the callee-saved registers x19-x28, the frame pointer and the
+       return address in a 96 byte frame on the current stack, followed by
+       the floating point registers and control state of the profile */
+    "stp x19, x20, [sp, #-96]!\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 96")
+    "stp x21, x22, [sp, #16]\n\t"
+    "stp x23, x24, [sp, #32]\n\t"
+    "stp x25, x26, [sp, #48]\n\t"
+    "stp x27, x28, [sp, #64]\n\t"
+    "stp x29, x30, [sp, #80]\n\t"
+    FX_STACK_ASM_CFI(".cfi_offset x19, -96")
+    FX_STACK_ASM_CFI(".cfi_offset x20, -88")
+    FX_STACK_ASM_CFI(".cfi_offset x21, -80")
+    FX_STACK_ASM_CFI(".cfi_offset x22, -72")
+    FX_STACK_ASM_CFI(".cfi_offset x23, -64")
+    FX_STACK_ASM_CFI(".cfi_offset x24, -56")
+    FX_STACK_ASM_CFI(".cfi_offset x25, -48")
+    FX_STACK_ASM_CFI(".cfi_offset x26, -40")
+    FX_STACK_ASM_CFI(".cfi_offset x27, -32")
+    FX_STACK_ASM_CFI(".cfi_offset x28, -24")
+    FX_STACK_ASM_CFI(".cfi_offset x29, -16")
+    FX_STACK_ASM_CFI(".cfi_offset x30, -8")
+    FX_STACK_AARCH64_FP_SAVE
+    FX_STACK_AARCH64_FP_CONTROL_SAVE
+
+    /* *save_sp = sp; sp = load_sp. The frame on the other stack has the
+       same layout, so the unwind information stays valid and describes the
+       context that is being resumed. */
+    "mov x2, sp\n\t"
+    "str x2, [x0]\n\t"
+    "mov sp, x1\n\t"
+
+    /* Restore the callee-saved registers of the other context and return to
+       the stored return address */
+    FX_STACK_AARCH64_FP_CONTROL_RESTORE
+    FX_STACK_AARCH64_FP_RESTORE
+    "ldp x21, x22, [sp, #16]\n\t"
+    "ldp x23, x24, [sp, #32]\n\t"
+    "ldp x25, x26, [sp, #48]\n\t"
+    "ldp x27, x28, [sp, #64]\n\t"
+    "ldp x29, x30, [sp, #80]\n\t"
+    "ldp x19, x20, [sp], #96\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -96")
+    FX_STACK_ASM_CFI(".cfi_restore x19")
+    FX_STACK_ASM_CFI(".cfi_restore x20")
+    FX_STACK_ASM_CFI(".cfi_restore x21")
+    FX_STACK_ASM_CFI(".cfi_restore x22")
+    FX_STACK_ASM_CFI(".cfi_restore x23")
+    FX_STACK_ASM_CFI(".cfi_restore x24")
+    FX_STACK_ASM_CFI(".cfi_restore x25")
+    FX_STACK_ASM_CFI(".cfi_restore x26")
+    FX_STACK_ASM_CFI(".cfi_restore x27")
+    FX_STACK_ASM_CFI(".cfi_restore x28")
+    FX_STACK_ASM_CFI(".cfi_restore x29")
+    FX_STACK_ASM_CFI(".cfi_restore x30")
+    "ret\n\t"
+    FX_STACK_ASM_CFI(".cfi_endproc")
+    FX_STACK_ASM_FUNC_END(_fx_stack_context_swap_asm)
+
+    FX_STACK_ASM_FUNC_BEGIN(_fx_stack_context_trampoline)
+    /* Outermost frame of the context; the initial frame record is zero */
+    FX_STACK_ASM_CFI(".cfi_startproc")
+    FX_STACK_ASM_CFI(".cfi_undefined x30")
+    /* Entered via "ret" from _fx_stack_context_swap_asm() with a 16-byte
+       aligned stack. x19 holds the context, x20 the entry function. */
+    "mov x0, x19\n\t"
+    "blr x20\n\t"
+    "brk #0\n\t"
+    FX_STACK_ASM_CFI(".cfi_endproc")
+    FX_STACK_ASM_FUNC_END(_fx_stack_context_trampoline));
+
+static void *_fx_stack_context_prepare(void *stack_end, void *ctx,
+                                       _fx_stack_context_entry_t entry) {
+	/* The stack pointer must always be 16-byte aligned */
+	uintptr_t *sp = (uintptr_t *)((uintptr_t)stack_end & ~((uintptr_t)15));
+	unsigned int i;
+
+	*(--sp) = (uintptr_t)_fx_stack_context_trampoline; /* x30 */
+	*(--sp) = 0;                                       /* x29 */
+	for (i = 0; i < 8; i++) {
+		*(--sp) = 0; /* x21-x28 */
+	}
+	*(--sp) = (uintptr_t)entry; /* x20 */
+	*(--sp) = (uintptr_t)ctx;   /* x19 */
+	for (i = 0; i < FX_STACK_AARCH64_FP_WORDS; i++) {
+		*(--sp) = 0; /* d8-d15 */
+	}
+#ifdef FX_STACK_PROFILE_FULL
+	/* Inherit the floating point control state of the current thread */
+	uint64_t fpcr;
+	__asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+	*(--sp) = 0;
+	*(--sp) = (uintptr_t)fpcr;
+#endif
+
+	return sp;
+}
+
+#endif /* FX_STACK_PLATFORM_NO_CONTEXT */
@@ -16,11 +16,39 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+/* Defined if the code uses the floating point unit */
+#if (defined(__ARM_FP) || defined(__ARM_PCS_VFP)) && !defined(__SOFTFP__)
+#define FX_STACK_ARM_HAS_VFP
+#endif
+
+/* The callback may use all caller-saved VFP registers, see the corresponding
+   comment in stack_x86_64_gcc.h. d16-d31 only exist on VFP units with 32
+   double precision registers, which are guaranteed by NEON. */
+#ifdef FX_STACK_ARM_HAS_VFP
+#define FX_STACK_ARM_CLOBBER_VFP_LO                                     \
+	, "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7"
+#else
+#define FX_STACK_ARM_CLOBBER_VFP_LO
+#endif
+#if defined(FX_STACK_ARM_HAS_VFP) && defined(__ARM_NEON)
+#define FX_STACK_ARM_CLOBBER_VFP_HI                                     \
+	, "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24",    \
+	    "d25", "d26", "d27", "d28", "d29", "d30", "d31"
+#else
+#define FX_STACK_ARM_CLOBBER_VFP_HI
+#endif
+
 __attribute__((noinline)) static void *_fx_stack_switch(void *stack_ptr,
                                                         fx_stack_cback cback,
                                                         void *data) {
 	void *result;
 
+	/* Force a frame pointer. This makes the frame pointer the base of the
+	   canonical frame address in the unwind information of this function, so
+	   debuggers and profilers can unwind while sp points at the other
+	   stack. */
+	__asm__ __volatile__("" : : "r"(__builtin_frame_address(0)));
+
 	__asm__ __volatile__(
 	    /* Store the stack pointer register in r4 and load the stack pointer
 	       from stack_ptr. */
@@ -40,8 +68,165 @@ __attribute__((noinline)) static void *_fx_stack_switch(void *stack_ptr,
 
 	    : "=r"(result)
 	    : "r"(stack_ptr), "r"(data), "r"(cback)
-	    : "memory", "r0", "r1", "r2", "r3", "r4", "lr");
+	    : "memory", "cc", "r0", "r1", "r2", "r3", "r4", "r12",
+	      "lr" FX_STACK_ARM_CLOBBER_VFP_LO FX_STACK_ARM_CLOBBER_VFP_HI);
 
 	return result;
 }
 
+#ifndef FX_STACK_PLATFORM_NO_CONTEXT
+
+/* Callee-saved VFP registers d8-d15 must be preserved if the code uses the
+   floating point unit, unless the minimal profile is selected. */
+#if defined(FX_STACK_ARM_HAS_VFP) && !defined(FX_STACK_PROFILE_MINIMAL)
+#define FX_STACK_ARM_VFP
+#endif
+
+/* Unwind tables in the format of the ARM exception handling ABI, used by the
+   C++ runtime and by debuggers in addition to the DWARF call frame
+   information */
+#if defined(__ARM_EABI__) && !defined(__APPLE__)
+#define FX_STACK_ARM_EHABI(directive) directive "\n\t"
+#else
+#define FX_STACK_ARM_EHABI(directive)
+#endif
+
+#ifdef FX_STACK_ARM_VFP
+#define FX_STACK_ARM_VFP_PUSH                               \
+	"vpush {d8-d15}\n\t"                                    \
+	FX_STACK_ARM_EHABI(".vsave {d8-d15}")                   \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 64")           \
+	FX_STACK_ASM_CFI(".cfi_rel_offset d8, 0")               \
+	FX_STACK_ASM_CFI(".cfi_rel_offset d9, 8")               \
+	FX_STACK_ASM_CFI(".cfi_rel_offset d10, 16")             \
+	FX_STACK_ASM_CFI(".cfi_rel_offset d11, 24")             \
+	FX_STACK_ASM_CFI(".cfi_rel_offset d12, 32")             \
+	FX_STACK_ASM_CFI(".cfi_rel_offset d13, 40")             \
+	FX_STACK_ASM_CFI(".cfi_rel_offset d14, 48")             \
+	FX_STACK_ASM_CFI(".cfi_rel_offset d15, 56")
+#define FX_STACK_ARM_VFP_POP                                \
+	"vpop {d8-d15}\n\t"                                     \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -64")          \
+	FX_STACK_ASM_CFI(".cfi_restore d8")                     \
+	FX_STACK_ASM_CFI(".cfi_restore d9")                     \
+	FX_STACK_ASM_CFI(".cfi_restore d10")                    \
+	FX_STACK_ASM_CFI(".cfi_restore d11")                    \
+	FX_STACK_ASM_CFI(".cfi_restore d12")                    \
+	FX_STACK_ASM_CFI(".cfi_restore d13")                    \
+	FX_STACK_ASM_CFI(".cfi_restore d14")                    \
+	FX_STACK_ASM_CFI(".cfi_restore d15")
+#define FX_STACK_ARM_VFP_WORDS 16U
+#else
+#define FX_STACK_ARM_VFP_PUSH
+#define FX_STACK_ARM_VFP_POP
+#define FX_STACK_ARM_VFP_WORDS 0U
+#endif
+
+/* The full profile stores FPSCR in an additional 8 byte slot below the VFP
+   registers */
+#if defined(FX_STACK_ARM_VFP) && defined(FX_STACK_PROFILE_FULL)
+#define FX_STACK_ARM_FP_CONTROL_SAVE                        \
+	"vmrs r2, fpscr\n\t"                                    \
+	"push {r2, r3}\n\t"                                     \
+	FX_STACK_ARM_EHABI(".pad #8")                           \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")
+#define FX_STACK_ARM_FP_CONTROL_RESTORE                     \
+	"pop {r2, r3}\n\t"                                      \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")           \
+	"vmsr fpscr, r2\n\t"
+#define FX_STACK_ARM_FP_CONTROL
+#else
+#define FX_STACK_ARM_FP_CONTROL_SAVE
+#define FX_STACK_ARM_FP_CONTROL_RESTORE
+#endif
+
+/* Switch back to Thumb mode after the ARM-mode assembly if required */
+#ifdef __thumb__
+#define FX_STACK_ARM_RESTORE_MODE ".thumb\n\t"
+#else
+#define FX_STACK_ARM_RESTORE_MODE
+#endif
+
+FX_STACK_ASM_DECL void _fx_stack_context_swap_asm(void **save_sp,
+                                                  void *load_sp);
+FX_STACK_ASM_DECL void _fx_stack_context_trampoline(void);
+
+__asm__(
+    ".syntax unified\n\t"
+    ".arm\n\t"
+    FX_STACK_ASM_FUNC_BEGIN(_fx_stack_context_swap_asm)
+    FX_STACK_ARM_EHABI(".fnstart")
+    FX_STACK_ASM_CFI(".cfi_startproc")
+    /* Push the callee-saved registers and the return address onto the
+       current stack */
+    "push {r4-r11, lr}\n\t"
+    FX_STACK_ARM_EHABI(".save {r4-r11, lr}")
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 36")
+    FX_STACK_ASM_CFI(".cfi_rel_offset r4, 0")
+    FX_STACK_ASM_CFI(".cfi_rel_offset r5, 4")
+    FX_STACK_ASM_CFI(".cfi_rel_offset r6, 8")
+    FX_STACK_ASM_CFI(".cfi_rel_offset r7, 12")
+    FX_STACK_ASM_CFI(".cfi_rel_offset r8, 16")
+    FX_STACK_ASM_CFI(".cfi_rel_offset r9, 20")
+    FX_STACK_ASM_CFI(".cfi_rel_offset r10, 24")
+    FX_STACK_ASM_CFI(".cfi_rel_offset r11, 28")
+    FX_STACK_ASM_CFI(".cfi_rel_offset lr, 32")
+    FX_STACK_ARM_VFP_PUSH
+    FX_STACK_ARM_FP_CONTROL_SAVE
+
+    /* *save_sp = sp; sp = load_sp. The frame on the other stack has the
+       same layout, so the unwind information stays valid. */
+    "str sp, [r0]\n\t"
+    "mov sp, r1\n\t"
+
+    /* Restore the callee-saved registers of the other context and jump to
+       the stored return address */
+    FX_STACK_ARM_FP_CONTROL_RESTORE
+    FX_STACK_ARM_VFP_POP
+    "pop {r4-r11, pc}\n\t"
+    FX_STACK_ASM_CFI(".cfi_endproc")
+    FX_STACK_ARM_EHABI(".fnend")
+    FX_STACK_ASM_FUNC_END(_fx_stack_context_swap_asm)
+
+    FX_STACK_ASM_FUNC_BEGIN(_fx_stack_context_trampoline)
+    /* Outermost frame of the context */
+    FX_STACK_ARM_EHABI(".fnstart")
+    FX_STACK_ARM_EHABI(".cantunwind")
+    FX_STACK_ASM_CFI(".cfi_startproc")
+    FX_STACK_ASM_CFI(".cfi_undefined lr")
+    /* r4 holds the context, r5 the entry function */
+    "mov r0, r4\n\t"
+    "blx r5\n\t"
+    "bkpt #0\n\t"
+    FX_STACK_ASM_CFI(".cfi_endproc")
+    FX_STACK_ARM_EHABI(".fnend")
+    FX_STACK_ASM_FUNC_END(_fx_stack_context_trampoline)
+    FX_STACK_ARM_RESTORE_MODE);
+
+static void *_fx_stack_context_prepare(void *stack_end, void *ctx,
+                                       _fx_stack_context_entry_t entry) {
+	/* The stack must be 8-byte aligned once the trampoline is entered */
+	uintptr_t *sp = (uintptr_t *)((uintptr_t)stack_end & ~((uintptr_t)7));
+	unsigned int i;
+
+	*(--sp) = (uintptr_t)_fx_stack_context_trampoline; /* lr */
+	for (i = 0; i < 6; i++) {
+		*(--sp) = 0; /* r6-r11 */
+	}
+	*(--sp) = (uintptr_t)entry; /* r5 */
+	*(--sp) = (uintptr_t)ctx;   /* r4 */
+	for (i = 0; i < FX_STACK_ARM_VFP_WORDS; i++) {
+		*(--sp) = 0; /* d8-d15 */
+	}
+#ifdef FX_STACK_ARM_FP_CONTROL
+	/* Inherit the floating point control state of the current thread */
+	uint32_t fpscr;
+	__asm__ __volatile__("vmrs %0, fpscr" : "=r"(fpscr));
+	*(--sp) = 0;
+	*(--sp) = (uintptr_t)fpscr;
+#endif
+
+	return sp;
+}
+
+#endif /* FX_STACK_PLATFORM_NO_CONTEXT */
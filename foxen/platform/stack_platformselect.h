@@ -16,6 +16,110 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+/*
+ * Helper macros used by the platform-specific headers to define functions in
+ * top-level assembly code. These functions are not visible outside of the
+ * library.
+ */
+#if defined(__APPLE__) || defined(__MINGW32__)
+#define FX_STACK_ASM_NAME(name) "_" #name
+#else
+#define FX_STACK_ASM_NAME(name) #name
+#endif
+
+#if defined(__APPLE__)
+#define FX_STACK_ASM_FUNC_BEGIN(name)                             \
+	".text\n\t"                                                   \
+	".globl " FX_STACK_ASM_NAME(name) "\n\t"                      \
+	".private_extern " FX_STACK_ASM_NAME(name) "\n\t"             \
+	".p2align 4\n" FX_STACK_ASM_NAME(name) ":\n\t"
+#define FX_STACK_ASM_FUNC_END(name) "\n\t"
+#elif defined(__MINGW32__)
+#define FX_STACK_ASM_FUNC_BEGIN(name)                             \
+	".text\n\t"                                                   \
+	".globl " FX_STACK_ASM_NAME(name) "\n\t"                      \
+	".p2align 4\n" FX_STACK_ASM_NAME(name) ":\n\t"
+#define FX_STACK_ASM_FUNC_END(name) "\n\t"
+#else
+#define FX_STACK_ASM_FUNC_BEGIN(name)                             \
+	".text\n\t"                                                   \
+	".globl " FX_STACK_ASM_NAME(name) "\n\t"                      \
+	".hidden " FX_STACK_ASM_NAME(name) "\n\t"                     \
+	".type " FX_STACK_ASM_NAME(name) ", %function\n\t"            \
+	".p2align 4\n" FX_STACK_ASM_NAME(name) ":\n\t"
+#define FX_STACK_ASM_FUNC_END(name)                               \
+	".size " FX_STACK_ASM_NAME(name) ", .-" FX_STACK_ASM_NAME(name) "\n\t"
+#endif
+
+/*
+ * Emits a call frame information directive in top-level assembly code if the
+ * compiler emits them for C code as well. The directives allow debuggers,
+ * profilers and the C++ runtime to unwind through the context switching code.
+ */
+#if defined(__GCC_HAVE_DWARF2_CFI_ASM) && !defined(__MINGW32__)
+#define FX_STACK_ASM_CFI(directive) directive "\n\t"
+#else
+#define FX_STACK_ASM_CFI(directive)
+#endif
+
+#ifdef __cplusplus
+#define FX_STACK_ASM_DECL extern "C" __attribute__((visibility("hidden")))
+#else
+#define FX_STACK_ASM_DECL extern __attribute__((visibility("hidden")))
+#endif
+
+/*
+ * Register-save profile. By default the switching code preserves exactly the
+ * registers the calling convention declares callee-saved, including the
+ * floating point registers d8-d15 on ARM and AArch64. Defining one of the
+ * following macros selects a different profile for all platforms:
+ *
+ * FX_STACK_PROFILE_MINIMAL:
+ *     Contexts only preserve the integer callee-saved registers, i.e. d8-d15
+ *     are not saved on ARM and AArch64. Code calling fx_stack_context_swap()
+ *     must not keep floating point values in these registers across the swap
+ *     (e.g. because it is compiled with -mgeneral-regs-only). The registers
+ *     declared clobbered by _fx_stack_switch() are the same in all profiles.
+ *
+ * FX_STACK_PROFILE_FULL:
+ *     Additionally preserves the floating point control state (MXCSR and the
+ *     x87 control word on x86, FPSCR on ARM, FPCR on AArch64) per context, so
+ *     changing the rounding mode in one context does not affect the others.
+ *     New contexts inherit the control state of the thread initialising them.
+ */
+#if defined(FX_STACK_PROFILE_MINIMAL) && defined(FX_STACK_PROFILE_FULL)
+#error "FX_STACK_PROFILE_MINIMAL and FX_STACK_PROFILE_FULL are exclusive"
+#endif
+
+/*
+ * Each of the platform-specific headers must define the following functions:
+ *
+ * _fx_stack_switch(stack_ptr, cback, data):
+ *     Calls cback(data) with the stack pointer set to stack_ptr and returns the
+ *     value returned by cback.
+ *
+ * _fx_stack_context_swap_asm(save_sp, load_sp):
+ *     Pushes all callee-saved registers onto the current stack, writes the
+ *     resulting stack pointer to *save_sp, loads load_sp as new stack pointer
+ *     and pops the callee-saved registers from the new stack.
+ *
+ * _fx_stack_context_prepare(stack_end, ctx, entry):
+ *     Writes an initial register frame to the stack ending at stack_end and
+ *     returns the corresponding stack pointer. Loading this stack pointer with
+ *     _fx_stack_context_swap_asm() calls entry(ctx).
+ *
+ * _fx_stack_switch() must set up a frame pointer, so the canonical frame
+ * address in its unwind information does not depend on the stack pointer.
+ * Debuggers, profilers and the C++ runtime then unwind from the callback into
+ * the frames on the original stack. The context trampoline marks the
+ * outermost frame of a context.
+ *
+ * The context functions are defined in top-level assembly and must only be
+ * emitted once per library. They are omitted if FX_STACK_PLATFORM_NO_CONTEXT
+ * is defined, which allows to include this header from foxen/stack_inline.h.
+ */
+typedef void (*_fx_stack_context_entry_t)(void *ctx);
+
 #if   defined(__MINGW32__)
 #include "stack_x86_gcc.h" /* gcc on X86 */
 #elif defined(_M_IX86)
@@ -30,6 +134,8 @@
 #include "stack_x86_gcc.h" /* gcc on X86 */
 #elif defined(__GNUC__) && defined(__arm__)
 #include "stack_arm_gcc.h" /* gcc on arm */
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include "stack_aarch64_gcc.h" /* gcc on aarch64 */
 #elif defined(__GNUC__) && defined(__PPC64__)
 #error "Platform not supported yet!"
 /*#include "stack_ppc64_gcc.h"*/ /* gcc on ppc64 */
@@ -16,11 +16,29 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+/* The callback may use all SSE registers. Calls to the never-inlined
+   _fx_stack_switch() look like ordinary calls to most callers, but with
+   interprocedural register allocation the compiler only assumes the registers
+   listed in the clobber list below to be destroyed. */
+#ifdef __SSE__
+#define FX_STACK_X86_64_CLOBBER_SSE                                     \
+	, "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",   \
+	    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14",    \
+	    "xmm15"
+#else
+#define FX_STACK_X86_64_CLOBBER_SSE
+#endif
+
 __attribute__((noinline)) static void *_fx_stack_switch(void *stack_ptr,
                                                         fx_stack_cback cback,
                                                         void *data) {
 	void *result;
 
+	/* Force a frame pointer. This makes rbp the base of the canonical frame
+	   address in the unwind information of this function, allowing C++
+	   exceptions to propagate while rsp points at the other stack. */
+	__asm__ __volatile__("" : : "r"(__builtin_frame_address(0)));
+
 	__asm__ __volatile__(
 	    /* Store stack_ptr in ebx */
 	    "mov %1, %%rbx\n\t"
@@ -43,8 +61,134 @@ __attribute__((noinline)) static void *_fx_stack_switch(void *stack_ptr,
 	    : "=r"(result)
 	    : "r"(stack_ptr), "r"(data), "r"(cback)
 	    : "memory", "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10",
-	      "r11");
+	      "r11" FX_STACK_X86_64_CLOBBER_SSE);
 
 	return result;
 }
 
+#ifndef FX_STACK_PLATFORM_NO_CONTEXT
+
+/* The full profile stores MXCSR and the x87 control word in an additional
+   8 byte slot below the callee-saved registers */
+#ifdef FX_STACK_PROFILE_FULL
+#ifdef __SSE__
+#define FX_STACK_X86_64_STMXCSR "stmxcsr (%rsp)\n\t"
+#define FX_STACK_X86_64_LDMXCSR "ldmxcsr (%rsp)\n\t"
+#else
+#define FX_STACK_X86_64_STMXCSR
+#define FX_STACK_X86_64_LDMXCSR
+#endif
+#define FX_STACK_X86_64_FP_CONTROL_SAVE                  \
+	"subq $8, %rsp\n\t"                                 \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")         \
+	FX_STACK_X86_64_STMXCSR                              \
+	"fnstcw 4(%rsp)\n\t"
+#define FX_STACK_X86_64_FP_CONTROL_RESTORE               \
+	FX_STACK_X86_64_LDMXCSR                              \
+	"fldcw 4(%rsp)\n\t"                                 \
+	"addq $8, %rsp\n\t"                                 \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")
+#else
+#define FX_STACK_X86_64_FP_CONTROL_SAVE
+#define FX_STACK_X86_64_FP_CONTROL_RESTORE
+#endif
+
+FX_STACK_ASM_DECL void _fx_stack_context_swap_asm(void **save_sp,
+                                                  void *load_sp);
+FX_STACK_ASM_DECL void _fx_stack_context_trampoline(void);
+
+__asm__(
+    FX_STACK_ASM_FUNC_BEGIN(_fx_stack_context_swap_asm)
+    FX_STACK_ASM_CFI(".cfi_startproc")
+    /* Push the callee-saved registers onto the current stack. The return
+       address has already been pushed by the "call" instruction. */
+    "pushq %rbp\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %rbp, 0")
+    "pushq %rbx\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %rbx, 0")
+    "pushq %r12\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %r12, 0")
+    "pushq %r13\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %r13, 0")
+    "pushq %r14\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %r14, 0")
+    "pushq %r15\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %r15, 0")
+    FX_STACK_X86_64_FP_CONTROL_SAVE
+
+    /* *save_sp = rsp; rsp = load_sp. The frame on the other stack has the
+       same layout, so the unwind information stays valid and describes the
+       context that is being resumed. */
+    "movq %rsp, (%rdi)\n\t"
+    "movq %rsi, %rsp\n\t"
+
+    /* Restore the callee-saved registers of the other context and return to
+       wherever that context called _fx_stack_context_swap_asm(). */
+    FX_STACK_X86_64_FP_CONTROL_RESTORE
+    "popq %r15\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")
+    FX_STACK_ASM_CFI(".cfi_restore %r15")
+    "popq %r14\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")
+    FX_STACK_ASM_CFI(".cfi_restore %r14")
+    "popq %r13\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")
+    FX_STACK_ASM_CFI(".cfi_restore %r13")
+    "popq %r12\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")
+    FX_STACK_ASM_CFI(".cfi_restore %r12")
+    "popq %rbx\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")
+    FX_STACK_ASM_CFI(".cfi_restore %rbx")
+    "popq %rbp\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")
+    FX_STACK_ASM_CFI(".cfi_restore %rbp")
+    "retq\n\t"
+    FX_STACK_ASM_CFI(".cfi_endproc")
+    FX_STACK_ASM_FUNC_END(_fx_stack_context_swap_asm)
+
+    FX_STACK_ASM_FUNC_BEGIN(_fx_stack_context_trampoline)
+    /* There is no caller to unwind into; mark this as the outermost frame.
+       The initial frame pointer is zero, which terminates frame pointer
+       chains as well. */
+    FX_STACK_ASM_CFI(".cfi_startproc")
+    FX_STACK_ASM_CFI(".cfi_undefined %rip")
+    /* Entered via "retq" from _fx_stack_context_swap_asm() with a 16-byte
+       aligned stack. rbx holds the context, r12 the entry function. */
+    "movq %rbx, %rdi\n\t"
+    "callq *%r12\n\t"
+    "ud2\n\t"
+    FX_STACK_ASM_CFI(".cfi_endproc")
+    FX_STACK_ASM_FUNC_END(_fx_stack_context_trampoline));
+
+static void *_fx_stack_context_prepare(void *stack_end, void *ctx,
+                                       _fx_stack_context_entry_t entry) {
+	/* The stack must be 16-byte aligned once the trampoline is entered */
+	uintptr_t *sp = (uintptr_t *)((uintptr_t)stack_end & ~((uintptr_t)15));
+
+	*(--sp) = (uintptr_t)_fx_stack_context_trampoline; /* return address */
+	*(--sp) = 0;                                       /* rbp */
+	*(--sp) = (uintptr_t)ctx;                          /* rbx */
+	*(--sp) = (uintptr_t)entry;                        /* r12 */
+	*(--sp) = 0;                                       /* r13 */
+	*(--sp) = 0;                                       /* r14 */
+	*(--sp) = 0;                                       /* r15 */
+#ifdef FX_STACK_PROFILE_FULL
+	/* Inherit the floating point control state of the current thread */
+	*(--sp) = 0;
+#ifdef __SSE__
+	__asm__ __volatile__("stmxcsr (%0)" : : "r"(sp) : "memory");
+#endif
+	__asm__ __volatile__("fnstcw 4(%0)" : : "r"(sp) : "memory");
+#endif
+
+	return sp;
+}
+
+#endif /* FX_STACK_PLATFORM_NO_CONTEXT */
@@ -16,13 +16,33 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+/* The callback may use all caller-saved registers, see the corresponding
+   comment in stack_x86_64_gcc.h */
+#ifdef __SSE__
+#define FX_STACK_X86_CLOBBER_SSE                                        \
+	, "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7"
+#else
+#define FX_STACK_X86_CLOBBER_SSE
+#endif
+
 __attribute__((noinline)) static void *_fx_stack_switch(void *stack_ptr,
                                                         fx_stack_cback cback,
                                                         void *data) {
 	void *result;
 
+	/* Force a frame pointer. This makes ebp the base of the canonical frame
+	   address in the unwind information of this function, allowing C++
+	   exceptions to propagate while esp points at the other stack. */
+	__asm__ __volatile__("" : : "r"(__builtin_frame_address(0)));
+
+	/* All general purpose registers that are not preserved by the callback
+	   are clobbered, so the inputs may be located in memory. They are read
+	   before the stack pointer is modified. */
 	__asm__ __volatile__(
-	    /* Store stack_ptr in ebx. Will be preserved over the function call. */
+	    /* Load the callback and its argument, store stack_ptr in ebx. ebx is
+	       preserved over the function call. */
+	    "mov %3, %%eax\n\t"
+	    "mov %2, %%ecx\n\t"
 	    "mov %1, %%ebx\n\t"
 
 	    /* Exchange ebx and esp, effectively making stack_ptr the new stack
@@ -30,20 +50,131 @@ __attribute__((noinline)) static void *_fx_stack_switch(void *stack_ptr,
 	    "xchg %%esp, %%ebx\n\t"
 
 	    /* Pass "data" to the function as an argument */
-	    "push %2\n\t"
+	    "push %%ecx\n\t"
 
-	    /* Call the function "cback" */
-	    "call *%3\n\t"
-
-	    /* Backup the return value in "result" */
-	    "mov %%eax, %0\n\t"
+	    /* Call the function "cback"; the result is returned in eax */
+	    "call *%%eax\n\t"
 
 	    /* Restore the original stack pointer */
 	    "mov %%ebx, %%esp\n\t"
-	    : "=r"(result)
-	    : "r"(stack_ptr), "r"(data), "r"(cback)
-	    : "memory", "eax", "ebx");
+	    : "=&a"(result)
+	    : "g"(stack_ptr), "g"(data), "g"(cback)
+	    : "memory", "cc", "ebx", "ecx", "edx" FX_STACK_X86_CLOBBER_SSE);
 
 	return result;
 }
 
+#ifndef FX_STACK_PLATFORM_NO_CONTEXT
+
+/* The full profile stores the x87 control word and, if available, MXCSR in
+   an additional 8 byte slot below the callee-saved registers */
+#ifdef FX_STACK_PROFILE_FULL
+#ifdef __SSE__
+#define FX_STACK_X86_STMXCSR "stmxcsr (%esp)\n\t"
+#define FX_STACK_X86_LDMXCSR "ldmxcsr (%esp)\n\t"
+#else
+#define FX_STACK_X86_STMXCSR
+#define FX_STACK_X86_LDMXCSR
+#endif
+#define FX_STACK_X86_FP_CONTROL_SAVE                     \
+	"subl $8, %esp\n\t"                                 \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 8")         \
+	FX_STACK_X86_STMXCSR                                 \
+	"fnstcw 4(%esp)\n\t"
+#define FX_STACK_X86_FP_CONTROL_RESTORE                  \
+	FX_STACK_X86_LDMXCSR                                 \
+	"fldcw 4(%esp)\n\t"                                 \
+	"addl $8, %esp\n\t"                                 \
+	FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -8")
+#else
+#define FX_STACK_X86_FP_CONTROL_SAVE
+#define FX_STACK_X86_FP_CONTROL_RESTORE
+#endif
+
+FX_STACK_ASM_DECL void _fx_stack_context_swap_asm(void **save_sp,
+                                                  void *load_sp);
+FX_STACK_ASM_DECL void _fx_stack_context_trampoline(void);
+
+__asm__(
+    FX_STACK_ASM_FUNC_BEGIN(_fx_stack_context_swap_asm)
+    FX_STACK_ASM_CFI(".cfi_startproc")
+    /* Fetch the arguments before modifying the stack pointer */
+    "movl 4(%esp), %eax\n\t"
+    "movl 8(%esp), %ecx\n\t"
+
+    /* Push the callee-saved registers onto the current stack */
+    "pushl %ebp\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 4")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %ebp, 0")
+    "pushl %ebx\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 4")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %ebx, 0")
+    "pushl %esi\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 4")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %esi, 0")
+    "pushl %edi\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset 4")
+    FX_STACK_ASM_CFI(".cfi_rel_offset %edi, 0")
+    FX_STACK_X86_FP_CONTROL_SAVE
+
+    /* *save_sp = esp; esp = load_sp. The frame on the other stack has the
+       same layout, so the unwind information stays valid. */
+    "movl %esp, (%eax)\n\t"
+    "movl %ecx, %esp\n\t"
+
+    /* Restore the callee-saved registers of the other context */
+    FX_STACK_X86_FP_CONTROL_RESTORE
+    "popl %edi\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -4")
+    FX_STACK_ASM_CFI(".cfi_restore %edi")
+    "popl %esi\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -4")
+    FX_STACK_ASM_CFI(".cfi_restore %esi")
+    "popl %ebx\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -4")
+    FX_STACK_ASM_CFI(".cfi_restore %ebx")
+    "popl %ebp\n\t"
+    FX_STACK_ASM_CFI(".cfi_adjust_cfa_offset -4")
+    FX_STACK_ASM_CFI(".cfi_restore %ebp")
+    "ret\n\t"
+    FX_STACK_ASM_CFI(".cfi_endproc")
+    FX_STACK_ASM_FUNC_END(_fx_stack_context_swap_asm)
+
+    FX_STACK_ASM_FUNC_BEGIN(_fx_stack_context_trampoline)
+    /* Outermost frame of the context */
+    FX_STACK_ASM_CFI(".cfi_startproc")
+    FX_STACK_ASM_CFI(".cfi_undefined %eip")
+    /* Entered via "ret" from _fx_stack_context_swap_asm() with a 16-byte
+       aligned stack. ebx holds the context, esi the entry function. Keep the
+       stack aligned at the call instruction. */
+    "subl $12, %esp\n\t"
+    "pushl %ebx\n\t"
+    "call *%esi\n\t"
+    "ud2\n\t"
+    FX_STACK_ASM_CFI(".cfi_endproc")
+    FX_STACK_ASM_FUNC_END(_fx_stack_context_trampoline));
+
+static void *_fx_stack_context_prepare(void *stack_end, void *ctx,
+                                       _fx_stack_context_entry_t entry) {
+	/* The stack must be 16-byte aligned once the trampoline is entered */
+	uintptr_t *sp = (uintptr_t *)((uintptr_t)stack_end & ~((uintptr_t)15));
+
+	*(--sp) = (uintptr_t)_fx_stack_context_trampoline; /* return address */
+	*(--sp) = 0;                                       /* ebp */
+	*(--sp) = (uintptr_t)ctx;                          /* ebx */
+	*(--sp) = (uintptr_t)entry;                        /* esi */
+	*(--sp) = 0;                                       /* edi */
+#ifdef FX_STACK_PROFILE_FULL
+	/* Inherit the floating point control state of the current thread */
+	*(--sp) = 0;
+	*(--sp) = 0;
+#ifdef __SSE__
+	__asm__ __volatile__("stmxcsr (%0)" : : "r"(sp) : "memory");
+#endif
+	__asm__ __volatile__("fnstcw 4(%0)" : : "r"(sp) : "memory");
+#endif
+
+	return sp;
+}
+
+#endif /* FX_STACK_PLATFORM_NO_CONTEXT */
@@ -16,8 +16,15 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+/* Required for clock_gettime() when compiled with FX_WITH_TRACING */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifndef FX_NO_CONFIG
 #include "config.h"
@@ -25,6 +32,8 @@
 
 #include <foxen/stack.h>
 
+#include "stack_internal.h"
+
 /* Include the platform-specific _fx_stack_switch function */
 #include "platform/stack_platformselect.h"
 
@@ -79,12 +88,68 @@ static __attribute__((noinline)) void *_fx_stack_exception_stub(void *data_) {
 	return nullptr;
 }
 
+/**
+ * Moves the exception stored in the given exception_ptr to a heap-allocated
+ * std::exception_ptr instance and returns an opaque pointer at this instance.
+ * This allows to store exceptions in data structures declared in the C API.
+ */
+static void *_fx_stack_exception_box(std::exception_ptr &eptr) {
+	return new std::exception_ptr(std::move(eptr));
+}
+
+/**
+ * Re-throws the exception stored in the opaque pointer at *exception and
+ * resets the pointer to NULL.
+ */
+static void _fx_stack_exception_rethrow(void **exception) {
+	std::exception_ptr *box = (std::exception_ptr *)(*exception);
+	std::exception_ptr eptr = std::move(*box);
+	*exception = nullptr;
+	delete box;
+	std::rethrow_exception(eptr);
+}
+
+/**
+ * Releases the exception stored in the opaque pointer at *exception without
+ * throwing it.
+ */
+static void _fx_stack_exception_release(void **exception) {
+	delete (std::exception_ptr *)(*exception);
+	*exception = nullptr;
+}
+
 #endif /* FX_WITH_CPP_EXCEPTIONS */
 
 /*****************************************************************************
  * Common stack switching code                                               *
  *****************************************************************************/
 
+/**
+ * Low- and high-address of the stack the calling thread is currently
+ * executing on or NULL if it is executing on its native stack. Volatile, since
+ * the compiler cannot see that the code executed by the stack switching
+ * assembly reads these variables. Also read by stack_grow.c.
+ */
+FX_STACK_HIDDEN __thread void *volatile _fx_stack_current_start
+    FX_STACK_TLS_IE = NULL;
+FX_STACK_HIDDEN __thread void *volatile _fx_stack_current_end
+    FX_STACK_TLS_IE = NULL;
+
+/**
+ * Fiber-local storage table of the running context, or NULL if the thread has
+ * not switched to a context yet or has returned to a context representing the
+ * thread, in which case _fx_stack_thread_locals is used.
+ */
+static __thread void **_fx_stack_current_locals FX_STACK_TLS_IE = NULL;
+static __thread void *_fx_stack_thread_locals[FX_STACK_LOCAL_SLOTS]
+    FX_STACK_TLS_IE;
+
+/**
+ * Number of fiber-local storage slots handed out by
+ * fx_stack_local_key_create().
+ */
+static unsigned int _fx_stack_n_local_keys = 0U;
+
 /*
  * Define valgrind-related macros
  */
@@ -92,23 +157,108 @@ static __attribute__((noinline)) void *_fx_stack_exception_stub(void *data_) {
 
 #include <valgrind.h>
 
-#define FX_VALGRIND_STACK_REGISTER                                    \
-	/* Inform valgrind that the given memory region is a new stack */ \
-	const int stack_id = VALGRIND_STACK_REGISTER(stack_start, stack_end);
+#define FX_VALGRIND_STACK_REGISTER(cond)                                  \
+	/* Inform valgrind that the given memory region is a new stack */     \
+	const unsigned int stack_id =                                         \
+	    (cond) ? VALGRIND_STACK_REGISTER(stack_start, stack_end) : 0U;
 
-#define FX_VALGRIND_STACK_UNREGISTER                                  \
-	/* Inform valgrind that the given memory region is a new stack */ \
-	VALGRIND_STACK_DEREGISTER(stack_id);
+#define FX_VALGRIND_STACK_UNREGISTER(cond)                                \
+	/* Inform valgrind that the stack is no longer in use */              \
+	if (cond) {                                                           \
+		VALGRIND_STACK_DEREGISTER(stack_id);                              \
+	}
 
 #else /* FX_WITH_VALGRIND */
 
-#define FX_VALGRIND_STACK_REGISTER
-#define FX_VALGRIND_STACK_UNREGISTER
+#define FX_VALGRIND_STACK_REGISTER(cond) (void)(cond);
+#define FX_VALGRIND_STACK_UNREGISTER(cond)
 
 #endif /* FX_WITH_VALGRIND */
 
-void *fx_stack_switch(void *stack_start, void *stack_end, void *stack_ptr,
-                      fx_stack_cback cback, void *data) {
+/*
+ * Define stack watermark-related macros
+ */
+#ifdef FX_WITH_STACK_WATERMARK
+
+/**
+ * Peak stack usage of the last fx_stack_switch() call on this thread.
+ */
+static __thread size_t _fx_stack_last_watermark FX_STACK_TLS_IE = 0U;
+
+#define FX_STACK_WATERMARK_PAINT \
+	/* Paint the unused part of the stack */ \
+	fx_stack_paint(stack_start, stack_ptr);
+
+#define FX_STACK_WATERMARK_MEASURE                       \
+	/* Measure how much of the painted region was used */ \
+	_fx_stack_last_watermark = fx_stack_high_water_mark(stack_start, stack_ptr);
+
+#else /* FX_WITH_STACK_WATERMARK */
+
+#define FX_STACK_WATERMARK_PAINT
+#define FX_STACK_WATERMARK_MEASURE
+
+#endif /* FX_WITH_STACK_WATERMARK */
+
+/*
+ * Define tracing-related macros
+ */
+#ifdef FX_WITH_TRACING
+
+#include <time.h>
+
+/* Static probes are only available if the SystemTap headers are installed */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FX_STACK_PROBE(...) STAP_PROBEV(foxenstack, __VA_ARGS__);
+#endif
+#endif
+#ifndef FX_STACK_PROBE
+#define FX_STACK_PROBE(...)
+#endif
+
+/**
+ * Counters and latency histogram of the calling thread.
+ */
+static __thread fx_stack_trace _fx_stack_trace_tls;
+
+static inline uint64_t _fx_stack_trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#define FX_STACK_TRACE_COUNT(counter, n) _fx_stack_trace_tls.counter += (n);
+
+#define FX_STACK_TRACE_ENTER(probe, arg)                        \
+	/* Fire the entry probe and take the entry timestamp */     \
+	FX_STACK_PROBE(probe, stack_start, stack_ptr, arg)          \
+	const uint64_t trace_t0 = _fx_stack_trace_now();
+
+#define FX_STACK_TRACE_EXIT(probe, arg)                         \
+	/* Record how long the callback held the stack */           \
+	const uint64_t trace_dt = _fx_stack_trace_now() - trace_t0; \
+	fx_stack_trace_record(&_fx_stack_trace_tls, trace_dt);      \
+	FX_STACK_PROBE(probe, stack_start, arg, trace_dt)
+
+#else /* FX_WITH_TRACING */
+
+#define FX_STACK_PROBE(...)
+#define FX_STACK_TRACE_COUNT(counter, n)
+#define FX_STACK_TRACE_ENTER(probe, arg)
+#define FX_STACK_TRACE_EXIT(probe, arg)
+
+#endif /* FX_WITH_TRACING */
+
+/**
+ * Common implementation of fx_stack_switch() and fx_stack_handle_switch(). The
+ * stack is registered with valgrind for the duration of the call if
+ * register_stack is non-zero.
+ */
+static inline void *_fx_stack_switch_impl(void *stack_start, void *stack_end,
+                                          void *stack_ptr, fx_stack_cback cback,
+                                          void *data, int register_stack) {
 	/* Make sure the given stack pointer is sane */
 	assert((stack_start < stack_ptr) && (stack_ptr <= stack_end));
 
@@ -117,10 +267,21 @@ void *fx_stack_switch(void *stack_start, void *stack_end, void *stack_ptr,
 	   stub function */
 	fx_stack_exception_stub_data_t stub_data{cback, data, nullptr};
 
-	FX_VALGRIND_STACK_REGISTER
+	void *prev_start = _fx_stack_current_start;
+	void *prev_end = _fx_stack_current_end;
+	_fx_stack_current_start = stack_start;
+	_fx_stack_current_end = stack_end;
+	FX_STACK_WATERMARK_PAINT
+	FX_VALGRIND_STACK_REGISTER(register_stack)
+	FX_STACK_TRACE_COUNT(n_switches, 1U)
+	FX_STACK_TRACE_ENTER(switch_entry, cback)
 	void *result =
 	    _fx_stack_switch(stack_ptr, _fx_stack_exception_stub, &stub_data);
-	FX_VALGRIND_STACK_UNREGISTER
+	FX_STACK_TRACE_EXIT(switch_return, cback)
+	FX_VALGRIND_STACK_UNREGISTER(register_stack)
+	FX_STACK_WATERMARK_MEASURE
+	_fx_stack_current_start = prev_start;
+	_fx_stack_current_end = prev_end;
 
 	/* Re-throw any C++ exception that was thrown by the code inside the
 	   alternative stack. */
@@ -129,11 +290,430 @@ void *fx_stack_switch(void *stack_start, void *stack_end, void *stack_ptr,
 	}
 #else  /* FX_WITH_CPP_EXCEPTIONS */
 	/* Call the platform-specific assembly function */
-	FX_VALGRIND_STACK_REGISTER
+	void *prev_start = _fx_stack_current_start;
+	void *prev_end = _fx_stack_current_end;
+	_fx_stack_current_start = stack_start;
+	_fx_stack_current_end = stack_end;
+	FX_STACK_WATERMARK_PAINT
+	FX_VALGRIND_STACK_REGISTER(register_stack)
+	FX_STACK_TRACE_COUNT(n_switches, 1U)
+	FX_STACK_TRACE_ENTER(switch_entry, cback)
 	void *result = _fx_stack_switch(stack_ptr, cback, data);
-	FX_VALGRIND_STACK_UNREGISTER
+	FX_STACK_TRACE_EXIT(switch_return, cback)
+	FX_VALGRIND_STACK_UNREGISTER(register_stack)
+	FX_STACK_WATERMARK_MEASURE
+	_fx_stack_current_start = prev_start;
+	_fx_stack_current_end = prev_end;
 #endif /* FX_WITH_CPP_EXCEPTIONS */
 
 	return result;
 }
 
+void *fx_stack_switch(void *stack_start, void *stack_end, void *stack_ptr,
+                      fx_stack_cback cback, void *data) {
+	return _fx_stack_switch_impl(stack_start, stack_end, stack_ptr, cback, data,
+	                             1);
+}
+
+void fx_stack_handle_init(fx_stack_handle *handle, void *stack_start,
+                          void *stack_end) {
+	handle->stack_start = stack_start;
+	handle->stack_end = stack_end;
+
+#ifdef FX_WITH_VALGRIND
+	/* Inform valgrind that the given memory region is a new stack */
+	handle->valgrind_stack_id = VALGRIND_STACK_REGISTER(stack_start, stack_end);
+#else
+	handle->valgrind_stack_id = 0;
+#endif
+}
+
+void fx_stack_handle_destroy(fx_stack_handle *handle) {
+#ifdef FX_WITH_VALGRIND
+	if (handle->stack_start) {
+		VALGRIND_STACK_DEREGISTER(handle->valgrind_stack_id);
+	}
+#endif
+
+	handle->stack_start = NULL;
+	handle->stack_end = NULL;
+}
+
+void *fx_stack_handle_switch(const fx_stack_handle *handle, void *stack_ptr,
+                             fx_stack_cback cback, void *data) {
+	return _fx_stack_switch_impl(handle->stack_start, handle->stack_end,
+	                             stack_ptr, cback, data, 0);
+}
+
+void *fx_stack_current_start(void) {
+	return _fx_stack_current_start;
+}
+
+/*****************************************************************************
+ * Fiber-local storage                                                       *
+ *****************************************************************************/
+
+int fx_stack_local_key_create(void) {
+	unsigned int n = __atomic_load_n(&_fx_stack_n_local_keys, __ATOMIC_RELAXED);
+	do {
+		if (n >= FX_STACK_LOCAL_SLOTS) {
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&_fx_stack_n_local_keys, &n, n + 1U,
+	                                      1, __ATOMIC_RELAXED,
+	                                      __ATOMIC_RELAXED));
+	return (int)n;
+}
+
+void *fx_stack_local_get(int key) {
+	assert((key >= 0) && ((unsigned int)key < FX_STACK_LOCAL_SLOTS));
+	void **locals = _fx_stack_current_locals;
+	return (locals ? locals : _fx_stack_thread_locals)[key];
+}
+
+void fx_stack_local_set(int key, void *value) {
+	assert((key >= 0) && ((unsigned int)key < FX_STACK_LOCAL_SLOTS));
+	void **locals = _fx_stack_current_locals;
+	(locals ? locals : _fx_stack_thread_locals)[key] = value;
+}
+
+/*****************************************************************************
+ * Batched execution                                                         *
+ *****************************************************************************/
+
+/**
+ * Data passed to _fx_stack_batch_run() on the separate stack.
+ */
+typedef struct {
+	fx_stack_batch_item *items;
+	size_t n_items;
+	size_t n_exceptions;
+} _fx_stack_batch_data;
+
+static void *_fx_stack_batch_run(void *data_) {
+	_fx_stack_batch_data *batch = (_fx_stack_batch_data *)data_;
+	for (size_t i = 0U; i < batch->n_items; i++) {
+		fx_stack_batch_item *item = &batch->items[i];
+#ifdef FX_WITH_CPP_EXCEPTIONS
+		fx_stack_exception_stub_data_t stub_data{item->cback, item->data,
+		                                         nullptr};
+		item->result = _fx_stack_exception_stub(&stub_data);
+		item->exception = nullptr;
+		if (stub_data.eptr) {
+			item->exception = _fx_stack_exception_box(stub_data.eptr);
+			batch->n_exceptions++;
+		}
+#else  /* FX_WITH_CPP_EXCEPTIONS */
+		item->result = item->cback(item->data);
+		item->exception = NULL;
+#endif /* FX_WITH_CPP_EXCEPTIONS */
+	}
+	return NULL;
+}
+
+size_t fx_stack_switch_batch(void *stack_start, void *stack_end,
+                             void *stack_ptr, fx_stack_batch_item *items,
+                             size_t n_items) {
+	/* Make sure the given stack pointer is sane */
+	assert((stack_start < stack_ptr) && (stack_ptr <= stack_end));
+
+	/* Execute all items in a single stack switch */
+	_fx_stack_batch_data batch = {items, n_items, 0U};
+	void *prev_start = _fx_stack_current_start;
+	void *prev_end = _fx_stack_current_end;
+	_fx_stack_current_start = stack_start;
+	_fx_stack_current_end = stack_end;
+	FX_STACK_WATERMARK_PAINT
+	FX_VALGRIND_STACK_REGISTER(1)
+	FX_STACK_TRACE_COUNT(n_batches, 1U)
+	FX_STACK_TRACE_COUNT(n_batch_items, n_items)
+	FX_STACK_TRACE_ENTER(batch_entry, n_items)
+	_fx_stack_switch(stack_ptr, _fx_stack_batch_run, &batch);
+	FX_STACK_TRACE_EXIT(batch_return, n_items)
+	FX_VALGRIND_STACK_UNREGISTER(1)
+	FX_STACK_WATERMARK_MEASURE
+	_fx_stack_current_start = prev_start;
+	_fx_stack_current_end = prev_end;
+
+	return batch.n_exceptions;
+}
+
+void fx_stack_batch_item_rethrow(fx_stack_batch_item *item) {
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	if (item->exception) {
+		_fx_stack_exception_rethrow(&item->exception);
+	}
+#else
+	(void)item;
+#endif
+}
+
+void fx_stack_batch_item_release(fx_stack_batch_item *item) {
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	if (item->exception) {
+		_fx_stack_exception_release(&item->exception);
+	}
+#else
+	(void)item;
+#endif
+}
+
+/*****************************************************************************
+ * Stack usage instrumentation                                               *
+ *****************************************************************************/
+
+void fx_stack_paint(void *stack_start, void *stack_end) {
+	/* Only paint fully aligned words */
+	const uintptr_t mask = sizeof(uintptr_t) - 1U;
+	uintptr_t *p = (uintptr_t *)(((uintptr_t)stack_start + mask) & ~mask);
+	uintptr_t *p_end = (uintptr_t *)((uintptr_t)stack_end & ~mask);
+	while (p < p_end) {
+		*(p++) = FX_STACK_PAINT_PATTERN;
+	}
+}
+
+size_t fx_stack_high_water_mark(const void *stack_start,
+                                const void *stack_end) {
+	const uintptr_t mask = sizeof(uintptr_t) - 1U;
+	const uintptr_t *p =
+	    (const uintptr_t *)(((uintptr_t)stack_start + mask) & ~mask);
+	const uintptr_t *p_end = (const uintptr_t *)((uintptr_t)stack_end & ~mask);
+
+	/* Stacks grow downwards; the first overwritten word from the bottom marks
+	   the deepest point reached */
+	while ((p < p_end) && (*p == FX_STACK_PAINT_PATTERN)) {
+		p++;
+	}
+	return (size_t)((const uint8_t *)stack_end - (const uint8_t *)p);
+}
+
+size_t fx_stack_last_high_water_mark(void) {
+#ifdef FX_WITH_STACK_WATERMARK
+	return _fx_stack_last_watermark;
+#else
+	return 0U;
+#endif
+}
+
+void fx_stack_watermark_record(fx_stack_watermark *wm, size_t bytes) {
+	__atomic_fetch_add(&wm->count, 1U, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&wm->sum, bytes, __ATOMIC_RELAXED);
+
+	size_t max = __atomic_load_n(&wm->max, __ATOMIC_RELAXED);
+	while ((bytes > max) &&
+	       !__atomic_compare_exchange_n(&wm->max, &max, bytes, 1,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/*****************************************************************************
+ * Tracing                                                                   *
+ *****************************************************************************/
+
+/**
+ * Returns the index of the histogram bucket containing the given value.
+ */
+static size_t _fx_stack_trace_bucket(uint64_t value) {
+	if (value < FX_STACK_TRACE_SUB_BUCKETS) {
+		return (size_t)value;
+	}
+	const unsigned int e = 63U - (unsigned int)__builtin_clzll(value);
+	const unsigned int shift = e - FX_STACK_TRACE_SUB_BITS;
+	return ((size_t)(shift + 1U) << FX_STACK_TRACE_SUB_BITS) +
+	       (size_t)((value >> shift) - FX_STACK_TRACE_SUB_BUCKETS);
+}
+
+/**
+ * Returns the largest value that falls into the given histogram bucket.
+ */
+static uint64_t _fx_stack_trace_bucket_max(size_t idx) {
+	if (idx < FX_STACK_TRACE_SUB_BUCKETS) {
+		return (uint64_t)idx;
+	}
+	const unsigned int shift =
+	    (unsigned int)(idx >> FX_STACK_TRACE_SUB_BITS) - 1U;
+	const uint64_t m =
+	    (uint64_t)(idx & (FX_STACK_TRACE_SUB_BUCKETS - 1U)) +
+	    FX_STACK_TRACE_SUB_BUCKETS;
+	return ((m + 1U) << shift) - 1U;
+}
+
+int fx_stack_trace_get(fx_stack_trace *trace) {
+#ifdef FX_WITH_TRACING
+	memcpy(trace, &_fx_stack_trace_tls, sizeof(fx_stack_trace));
+	return 1;
+#else
+	memset(trace, 0, sizeof(fx_stack_trace));
+	return 0;
+#endif
+}
+
+void fx_stack_trace_reset(void) {
+#ifdef FX_WITH_TRACING
+	memset(&_fx_stack_trace_tls, 0, sizeof(fx_stack_trace));
+#endif
+}
+
+void fx_stack_trace_record(fx_stack_trace *trace, uint64_t ns) {
+	trace->latency[_fx_stack_trace_bucket(ns)]++;
+}
+
+void fx_stack_trace_merge(fx_stack_trace *dst, const fx_stack_trace *src) {
+	dst->n_switches += src->n_switches;
+	dst->n_batches += src->n_batches;
+	dst->n_batch_items += src->n_batch_items;
+	dst->n_context_swaps += src->n_context_swaps;
+	for (size_t i = 0U; i < FX_STACK_TRACE_BUCKETS; i++) {
+		dst->latency[i] += src->latency[i];
+	}
+}
+
+uint64_t fx_stack_trace_percentile(const fx_stack_trace *trace,
+                                   double percentile) {
+	/* Count the number of recorded samples */
+	uint64_t total = 0U;
+	for (size_t i = 0U; i < FX_STACK_TRACE_BUCKETS; i++) {
+		total += trace->latency[i];
+	}
+	if (total == 0U) {
+		return 0U;
+	}
+
+	/* Compute the rank of the requested sample (rounded up, starting at
+	   one) */
+	uint64_t rank = total;
+	if (percentile < 100.0) {
+		const double x =
+		    ((percentile > 0.0) ? percentile : 0.0) * (double)total / 100.0;
+		rank = (uint64_t)x;
+		rank += ((double)rank < x) ? 1U : 0U;
+		rank = (rank < 1U) ? 1U : rank;
+	}
+
+	/* Find the bucket containing the sample */
+	uint64_t count = 0U;
+	for (size_t i = 0U; i < FX_STACK_TRACE_BUCKETS; i++) {
+		count += trace->latency[i];
+		if (count >= rank) {
+			return _fx_stack_trace_bucket_max(i);
+		}
+	}
+	return _fx_stack_trace_bucket_max(FX_STACK_TRACE_BUCKETS - 1U);
+}
+
+/*****************************************************************************
+ * Context switching                                                         *
+ *****************************************************************************/
+
+static void _fx_stack_context_entry(void *ctx_) {
+	fx_stack_context *ctx = (fx_stack_context *)ctx_;
+	void *result;
+
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	{
+		/* Execute the callback wrapped in the exception stub and store any
+		   exception in the context. The caller re-throws the exception. Note
+		   that this block must be left before the final context switch, as
+		   destructors of objects in this frame are never executed otherwise. */
+		fx_stack_exception_stub_data_t stub_data{ctx->cback, ctx->data,
+		                                         nullptr};
+		result = _fx_stack_exception_stub(&stub_data);
+		if (stub_data.eptr) {
+			ctx->exception = _fx_stack_exception_box(stub_data.eptr);
+		}
+	}
+#else  /* FX_WITH_CPP_EXCEPTIONS */
+	result = ctx->cback(ctx->data);
+#endif /* FX_WITH_CPP_EXCEPTIONS */
+
+	/* Transfer control back to the context that resumed us most recently. Do
+	   not update the "caller" member of the target context; this context is
+	   dead and cannot be returned to. */
+	assert(ctx->caller && !ctx->caller->done);
+	ctx->done = 1;
+	ctx->caller->source = ctx;
+	ctx->caller->transfer = result;
+	_fx_stack_current_start = ctx->caller->stack_start;
+	_fx_stack_current_end = ctx->caller->stack_end;
+	_fx_stack_current_locals = ctx->caller->locals;
+	_fx_stack_context_swap_asm(&ctx->sp, ctx->caller->sp);
+
+	/* A finished context is never resumed */
+	abort();
+}
+
+void fx_stack_context_init(fx_stack_context *ctx, void *stack_start,
+                           void *stack_end, fx_stack_cback cback, void *data) {
+	/* Make sure the given stack region is sane */
+	assert(stack_start < stack_end);
+
+#ifdef FX_WITH_STACK_WATERMARK
+	/* Paint the stack so fx_stack_high_water_mark() can be used on it */
+	fx_stack_paint(stack_start, stack_end);
+#endif
+
+	ctx->sp = _fx_stack_context_prepare(stack_end, ctx, _fx_stack_context_entry);
+	ctx->stack_start = stack_start;
+	ctx->stack_end = stack_end;
+	ctx->cback = cback;
+	ctx->data = data;
+	ctx->caller = NULL;
+	ctx->source = NULL;
+	ctx->transfer = NULL;
+	ctx->exception = NULL;
+	ctx->done = 0;
+	ctx->locals = ctx->local_slots;
+	memset(ctx->local_slots, 0, sizeof(ctx->local_slots));
+
+#ifdef FX_WITH_VALGRIND
+	/* Inform valgrind that the given memory region is a new stack */
+	ctx->valgrind_stack_id = VALGRIND_STACK_REGISTER(stack_start, stack_end);
+#else
+	ctx->valgrind_stack_id = 0;
+#endif
+}
+
+void fx_stack_context_destroy(fx_stack_context *ctx) {
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	/* Discard exceptions that were never re-thrown */
+	if (ctx->exception) {
+		_fx_stack_exception_release(&ctx->exception);
+	}
+#endif
+
+#ifdef FX_WITH_VALGRIND
+	if (ctx->stack_start) {
+		VALGRIND_STACK_DEREGISTER(ctx->valgrind_stack_id);
+	}
+#endif
+
+	ctx->stack_start = NULL;
+	ctx->stack_end = NULL;
+}
+
+void *fx_stack_context_swap(fx_stack_context *from, fx_stack_context *to,
+                            void *value) {
+	/* Finished contexts cannot be resumed */
+	assert(!to->done);
+
+	to->caller = from;
+	to->source = from;
+	to->transfer = value;
+	FX_STACK_TRACE_COUNT(n_context_swaps, 1U)
+	FX_STACK_PROBE(context_swap, from, to, value)
+	_fx_stack_current_start = to->stack_start;
+	_fx_stack_current_end = to->stack_end;
+	from->locals = _fx_stack_current_locals;
+	_fx_stack_current_locals = to->locals;
+	_fx_stack_context_swap_asm(&from->sp, to->sp);
+
+	/* We have been resumed. Re-throw any C++ exception that was thrown by the
+	   context that resumed us. */
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	if (from->source->exception) {
+		_fx_stack_exception_rethrow(&from->source->exception);
+	}
+#endif
+
+	return from->transfer;
+}
@@ -19,6 +19,9 @@
 #ifndef FX_FOXEN_STACK_H
 #define FX_FOXEN_STACK_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,11 +38,12 @@ typedef void *(*fx_stack_cback)(void *data);
 
 /**
  * Executes the function "cback" on a separate stack. Note that `stack_start`
- * and `stack_end` are ignored on most platforms. However, these pointers will
- * be used to inform valgrind that this memory region is indeed a stack (if
- * valgrind support is compiled in by setting the `with_valgrind` flag in meson
- * and/or defining the FX_WITH_VALGRIND pre-processor flag.). Furthermore, there
- * is an assertion in place that makes sure that
+ * and `stack_end` are not required for the actual stack switch. However, these
+ * pointers will be used to inform valgrind that this memory region is indeed a
+ * stack (if valgrind support is compiled in by setting the `with_valgrind` flag
+ * in meson and/or defining the FX_WITH_VALGRIND pre-processor flag.), and
+ * `stack_start` is reported by fx_stack_current_start() while the callback is
+ * running. Furthermore, there is an assertion in place that makes sure that
  * `stack_start < stack_ptr <= stack_end`.
  *
  * @param stack_start is the low-address of the memory region that should be
@@ -57,6 +61,480 @@ typedef void *(*fx_stack_cback)(void *data);
 void *fx_stack_switch(void *stack_start, void *stack_end, void *stack_ptr,
                       fx_stack_cback cback, void *data);
 
+/**
+ * Returns the low-address of the stack the calling thread is currently
+ * executing on, i.e. the `stack_start` passed to the innermost active
+ * fx_stack_switch() call or to fx_stack_context_init() for the currently
+ * running context. Returns NULL if the thread is executing on its native stack.
+ */
+void *fx_stack_current_start(void);
+
+/**
+ * Handle describing a stack that is used for many fx_stack_switch() calls. If
+ * valgrind support is enabled, fx_stack_switch() registers and deregisters the
+ * stack with valgrind on every call; a handle registers the stack once when it
+ * is initialised and deregisters it once it is destroyed.
+ *
+ * All members of this structure should be treated as read-only.
+ */
+typedef struct fx_stack_handle {
+	/**
+	 * Low- and high-address of the memory region used as a stack.
+	 */
+	void *stack_start;
+	void *stack_end;
+
+	/**
+	 * Stack identifier used when valgrind support is enabled.
+	 */
+	unsigned int valgrind_stack_id;
+} fx_stack_handle;
+
+/**
+ * Initialises a stack handle and registers the given memory region as a stack
+ * with valgrind if valgrind support is enabled.
+ *
+ * @param handle is the handle that should be initialised.
+ * @param stack_start is the low-address of the memory region that should be
+ * used as a stack.
+ * @param stack_end is the high-address of the memory region that should be used
+ * as a stack.
+ */
+void fx_stack_handle_init(fx_stack_handle *handle, void *stack_start,
+                          void *stack_end);
+
+/**
+ * Deregisters the stack from valgrind. The stack must not be in use. Does not
+ * free the stack memory.
+ *
+ * @param handle is the handle that should be destroyed.
+ */
+void fx_stack_handle_destroy(fx_stack_handle *handle);
+
+/**
+ * Same as fx_stack_switch(), but executes the callback on the stack described
+ * by the given handle and does not register the stack with valgrind.
+ *
+ * @param handle is the stack handle initialised using fx_stack_handle_init().
+ * @param stack_ptr is a the actual memory address at which the called function
+ * should be executed. Normally you want to set this to handle->stack_end.
+ * @param cback is the callback function that should be executed within the new
+ * stack.
+ * @param data is a user-defined pointer that should be passed to the callback
+ * function.
+ * @return the return value returned by the callback function.
+ */
+void *fx_stack_handle_switch(const fx_stack_handle *handle, void *stack_ptr,
+                             fx_stack_cback cback, void *data);
+
+/**
+ * Callback and data pair executed by fx_stack_switch_batch(), along with the
+ * outcome of its execution.
+ */
+typedef struct fx_stack_batch_item {
+	/**
+	 * Callback function that should be executed and the user-defined data
+	 * passed to it.
+	 */
+	fx_stack_cback cback;
+	void *data;
+
+	/**
+	 * Set to the value returned by the callback function, or to NULL if the
+	 * callback threw a C++ exception.
+	 */
+	void *result;
+
+	/**
+	 * Set to an opaque pointer at the C++ exception thrown by the callback
+	 * function or to NULL. The exception must be passed to either
+	 * fx_stack_batch_item_rethrow() or fx_stack_batch_item_release().
+	 */
+	void *exception;
+} fx_stack_batch_item;
+
+/**
+ * Executes the callbacks of the given items back to back on a separate stack.
+ * In contrast to calling fx_stack_switch() for each item, the stack is only
+ * switched (and registered with valgrind) once per batch. All items are
+ * executed, even if one of them throws a C++ exception; exceptions are stored
+ * in the corresponding item instead of being re-thrown.
+ *
+ * If the library has been compiled with FX_WITH_STACK_WATERMARK,
+ * fx_stack_last_high_water_mark() returns the peak usage of the entire batch.
+ *
+ * @param stack_start is the low-address of the memory region that should be
+ * used as a stack.
+ * @param stack_end is the high-address of the memory region that should be used
+ * as a stack.
+ * @param stack_ptr is a the actual memory address at which the callbacks
+ * should be executed. Normally you want to set this to stack_end.
+ * @param items is an array of callback and data pairs. The result and
+ * exception members are set once the function returns.
+ * @param n_items is the number of items in the array.
+ * @return the number of items whose callback threw a C++ exception.
+ */
+size_t fx_stack_switch_batch(void *stack_start, void *stack_end,
+                             void *stack_ptr, fx_stack_batch_item *items,
+                             size_t n_items);
+
+/**
+ * Re-throws the C++ exception stored in the given batch item and resets the
+ * exception member to NULL. Does nothing if the item does not hold an
+ * exception.
+ *
+ * @param item is the batch item holding the exception.
+ */
+void fx_stack_batch_item_rethrow(fx_stack_batch_item *item);
+
+/**
+ * Releases the C++ exception stored in the given batch item without throwing
+ * it and resets the exception member to NULL. Does nothing if the item does not
+ * hold an exception.
+ *
+ * @param item is the batch item holding the exception.
+ */
+void fx_stack_batch_item_release(fx_stack_batch_item *item);
+
+/**
+ * Number of fiber-local storage slots. Every context has its own table of
+ * slots, and every thread has one for code running outside of any context.
+ */
+#define FX_STACK_LOCAL_SLOTS 8U
+
+/**
+ * Structure describing an execution context with its own stack. In contrast to
+ * fx_stack_switch(), which runs a callback to completion, a context can be
+ * suspended at any point by switching to another context using
+ * fx_stack_context_swap() and later be resumed at exactly that point.
+ *
+ * All members of this structure should be treated as private. A context
+ * representing the calling thread (i.e. a context that is only ever used as
+ * the "from" argument of the first fx_stack_context_swap() call) does not need
+ * to be initialised, but should be zeroed.
+ */
+typedef struct fx_stack_context {
+	/**
+	 * Stack pointer of the suspended context. All callee-saved registers are
+	 * stored on the context stack itself.
+	 */
+	void *sp;
+
+	/**
+	 * Low- and high-address of the memory region used as a stack.
+	 */
+	void *stack_start;
+	void *stack_end;
+
+	/**
+	 * Callback function executed by the context and the user-defined data
+	 * passed to it.
+	 */
+	fx_stack_cback cback;
+	void *data;
+
+	/**
+	 * Context that most recently resumed this context. Control is transferred
+	 * back to this context once the callback function returns.
+	 */
+	struct fx_stack_context *caller;
+
+	/**
+	 * Context that transferred control to this context and the value passed
+	 * along with the transfer.
+	 */
+	struct fx_stack_context *source;
+	void *transfer;
+
+	/**
+	 * Opaque pointer at a C++ exception thrown by the callback function.
+	 */
+	void *exception;
+
+	/**
+	 * Set to a non-zero value once the callback function has returned.
+	 */
+	int done;
+
+	/**
+	 * Stack identifier used when valgrind support is enabled.
+	 */
+	unsigned int valgrind_stack_id;
+
+	/**
+	 * Fiber-local storage table that is active while the context is running.
+	 * Points at local_slots for initialised contexts; for a context
+	 * representing the calling thread, the table that was active when the
+	 * context was suspended.
+	 */
+	void **locals;
+	void *local_slots[FX_STACK_LOCAL_SLOTS];
+} fx_stack_context;
+
+/**
+ * Initialises a context that executes the function "cback" on the given stack
+ * once it is resumed for the first time using fx_stack_context_swap().
+ *
+ * @param ctx is the context that should be initialised.
+ * @param stack_start is the low-address of the memory region that should be
+ * used as a stack.
+ * @param stack_end is the high-address of the memory region that should be used
+ * as a stack.
+ * @param cback is the callback function that should be executed within the
+ * context. Once the callback returns, control is transferred back to the
+ * context that most recently resumed this context; the return value of the
+ * callback is passed as the result of that context's fx_stack_context_swap()
+ * call.
+ * @param data is a user-defined pointer that should be passed to the callback
+ * function.
+ */
+void fx_stack_context_init(fx_stack_context *ctx, void *stack_start,
+                           void *stack_end, fx_stack_cback cback, void *data);
+
+/**
+ * Releases any resources associated with the given context. The context must
+ * either have finished or must never be resumed again. Note that destructors of
+ * C++ objects on the stack of an unfinished context are not executed.
+ *
+ * @param ctx is the context that should be destroyed.
+ */
+void fx_stack_context_destroy(fx_stack_context *ctx);
+
+/**
+ * Suspends the currently running context and resumes the context "to". Only
+ * the callee-saved registers are stored; the function returns once another
+ * context switches back to "from".
+ *
+ * If the callback of the context that switched back to "from" threw a C++
+ * exception (and C++ exception support is enabled), this exception is
+ * re-thrown by this function.
+ *
+ * @param from is the context corresponding to the currently executing code.
+ * The current state is stored in this context.
+ * @param to is the context that should be resumed. Must not have finished.
+ * @param value is a user-defined value that should be passed to the resumed
+ * context. It is returned by the fx_stack_context_swap() call that is being
+ * resumed. The value passed when resuming a context for the first time is
+ * discarded.
+ * @return the value passed to fx_stack_context_swap() by the context that
+ * resumed "from", or the return value of its callback function if that context
+ * finished.
+ */
+void *fx_stack_context_swap(fx_stack_context *from, fx_stack_context *to,
+                            void *value);
+
+/**
+ * Returns a non-zero value if the callback function of the given context has
+ * returned. A finished context must not be resumed.
+ */
+static inline int fx_stack_context_done(const fx_stack_context *ctx) {
+	return ctx->done;
+}
+
+/**
+ * Reserves a fiber-local storage slot. Slots are never released; there are
+ * FX_STACK_LOCAL_SLOTS slots per process, so keys should be created once,
+ * e.g. by the library or subsystem that needs them, and stored in a global
+ * variable. Thread-safe.
+ *
+ * @return the key of the slot or -1 if all slots are in use.
+ */
+int fx_stack_local_key_create(void);
+
+/**
+ * Returns the value stored in the given slot of the running fiber. Each
+ * fx_stack_context has its own table of slots, which starts out as all NULL;
+ * code running outside of any context, including callbacks executed by
+ * fx_stack_switch() and related functions, uses the table of the context (or
+ * thread) that called fx_stack_switch(). The lookup consists of a thread-local
+ * load and an array access and does not depend on the number of contexts.
+ *
+ * In contrast to thread-local variables, the value follows the context when
+ * it is resumed on a different thread, e.g. by fx_stack_sched. This function
+ * is not inlined, so its result is never cached across a context switch.
+ *
+ * @param key is a key returned by fx_stack_local_key_create().
+ * @return the value stored in the slot.
+ */
+void *fx_stack_local_get(int key);
+
+/**
+ * Stores a value in the given slot of the running fiber.
+ *
+ * @param key is a key returned by fx_stack_local_key_create().
+ * @param value is the value that should be stored.
+ */
+void fx_stack_local_set(int key, void *value);
+
+/**
+ * Word written to every stack slot by fx_stack_paint(). Slots still holding
+ * this pattern are assumed to have never been used.
+ */
+#define FX_STACK_PAINT_PATTERN ((uintptr_t)0xA5A5A5A5A5A5A5A5ULL)
+
+/**
+ * Running aggregate of stack high-water marks, e.g. per stack pool or per call
+ * site. The members may be read at any time; they are updated atomically by
+ * fx_stack_watermark_record(). Zero-initialise (or use
+ * FX_STACK_WATERMARK_INIT) before use.
+ */
+typedef struct fx_stack_watermark {
+	/**
+	 * Number of recorded high-water marks.
+	 */
+	size_t count;
+
+	/**
+	 * Largest recorded high-water mark in bytes.
+	 */
+	size_t max;
+
+	/**
+	 * Sum of all recorded high-water marks in bytes.
+	 */
+	size_t sum;
+} fx_stack_watermark;
+
+#define FX_STACK_WATERMARK_INIT \
+	{ 0U, 0U, 0U }
+
+/**
+ * Fills the given memory region with FX_STACK_PAINT_PATTERN. The region must
+ * not contain any live stack frames.
+ *
+ * If the library is compiled with the `with_stack_watermark` meson option
+ * (i.e. the FX_WITH_STACK_WATERMARK pre-processor flag), fx_stack_switch(),
+ * fx_stack_context_init() and stacks handed out by a fx_stack_pool are
+ * painted automatically. Note that this touches every page of the stack.
+ *
+ * @param stack_start is the low-address of the region that should be painted.
+ * @param stack_end is the high-address of the region that should be painted.
+ */
+void fx_stack_paint(void *stack_start, void *stack_end);
+
+/**
+ * Returns the number of bytes below stack_end that have been written to since
+ * the region was painted using fx_stack_paint(). The region is scanned upwards
+ * from stack_start for the first word that does not match the pattern.
+ *
+ * @param stack_start is the low-address of the painted region.
+ * @param stack_end is the high-address of the painted region.
+ * @return the peak number of bytes used.
+ */
+size_t fx_stack_high_water_mark(const void *stack_start,
+                                const void *stack_end);
+
+/**
+ * Returns the peak number of bytes used on the stack by the last
+ * fx_stack_switch() call on the calling thread. Always returns zero if the
+ * library has not been compiled with FX_WITH_STACK_WATERMARK.
+ */
+size_t fx_stack_last_high_water_mark(void);
+
+/**
+ * Adds a high-water mark to the given aggregate. Thread-safe.
+ *
+ * @param wm is the aggregate that should be updated.
+ * @param bytes is the high-water mark that should be recorded.
+ */
+void fx_stack_watermark_record(fx_stack_watermark *wm, size_t bytes);
+
+/**
+ * Number of bits of sub-bucket resolution in the latency histogram of a
+ * fx_stack_trace. Values below 2^FX_STACK_TRACE_SUB_BITS are recorded exactly,
+ * larger values with a relative error of at most 2^-FX_STACK_TRACE_SUB_BITS.
+ */
+#define FX_STACK_TRACE_SUB_BITS 3U
+#define FX_STACK_TRACE_SUB_BUCKETS (1U << FX_STACK_TRACE_SUB_BITS)
+
+/**
+ * Number of buckets required to cover the entire 64-bit value range.
+ */
+#define FX_STACK_TRACE_BUCKETS \
+	((65U - FX_STACK_TRACE_SUB_BITS) << FX_STACK_TRACE_SUB_BITS)
+
+/**
+ * Per-thread switch counters and latency histogram. Obtained from
+ * fx_stack_trace_get(); may also be zero-initialised and filled using
+ * fx_stack_trace_record() and fx_stack_trace_merge().
+ */
+typedef struct fx_stack_trace {
+	/**
+	 * Number of fx_stack_switch() and fx_stack_handle_switch() calls.
+	 */
+	uint64_t n_switches;
+
+	/**
+	 * Number of fx_stack_switch_batch() calls and the total number of items
+	 * executed by these calls.
+	 */
+	uint64_t n_batches;
+	uint64_t n_batch_items;
+
+	/**
+	 * Number of fx_stack_context_swap() calls.
+	 */
+	uint64_t n_context_swaps;
+
+	/**
+	 * Log-linear histogram over the time in nanoseconds spent on the other
+	 * stack in each switch or batch, i.e. the time the callback held the
+	 * stack. Use fx_stack_trace_percentile() to evaluate it.
+	 */
+	uint64_t latency[FX_STACK_TRACE_BUCKETS];
+} fx_stack_trace;
+
+/**
+ * Copies the counters and histogram of the calling thread into the given
+ * structure.
+ *
+ * If the library is compiled with the `with_tracing` meson option (i.e. the
+ * FX_WITH_TRACING pre-processor flag), every fx_stack_switch(),
+ * fx_stack_handle_switch() and fx_stack_switch_batch() call is counted and
+ * timed, and fx_stack_context_swap() calls are counted. Furthermore, if
+ * <sys/sdt.h> is available, the "foxenstack" USDT provider is compiled in with
+ * the probes switch_entry(stack_start, stack_ptr, cback),
+ * switch_return(stack_start, cback, ns), batch_entry(stack_start, stack_ptr,
+ * n_items), batch_return(stack_start, n_items, ns) and context_swap(from, to,
+ * value).
+ *
+ * @param trace is the structure the statistics are written to.
+ * @return non-zero if tracing is enabled; zero and an all-zero structure
+ * otherwise.
+ */
+int fx_stack_trace_get(fx_stack_trace *trace);
+
+/**
+ * Resets the counters and histogram of the calling thread.
+ */
+void fx_stack_trace_reset(void);
+
+/**
+ * Adds a single sample to the latency histogram of the given structure.
+ *
+ * @param trace is the structure that should be updated.
+ * @param ns is the latency that should be recorded in nanoseconds.
+ */
+void fx_stack_trace_record(fx_stack_trace *trace, uint64_t ns);
+
+/**
+ * Adds the counters and histogram in src to those in dst. Can be used to
+ * aggregate the statistics of multiple threads.
+ */
+void fx_stack_trace_merge(fx_stack_trace *dst, const fx_stack_trace *src);
+
+/**
+ * Returns the given percentile of the latency histogram.
+ *
+ * @param trace is the structure containing the histogram.
+ * @param percentile is a value between 0 and 100, e.g. 99.9.
+ * @return an upper bound of the requested percentile in nanoseconds (the
+ * largest value in the corresponding bucket), or zero if the histogram is
+ * empty.
+ */
+uint64_t fx_stack_trace_percentile(const fx_stack_trace *trace,
+                                   double percentile);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,216 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack.hpp
+ *
+ * Header-only C++11 layer on top of fx_stack_switch(). Executes arbitrary
+ * callables with arbitrary arguments on another stack and returns their result
+ * with its original type. The callable, the arguments and the result are
+ * stored on the frame of the caller; no heap memory is allocated.
+ */
+
+#ifndef FX_FOXEN_STACK_HPP
+#define FX_FOXEN_STACK_HPP
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define FX_STACK_HPP_EXCEPTIONS
+#include <exception>
+#endif
+
+#include <foxen/stack.h>
+
+namespace foxen {
+namespace detail {
+
+/**
+ * Storage for the result of a callable of type R. The result is constructed
+ * in-place on the new stack and moved out once the switch returns.
+ */
+template <typename R>
+class stack_result {
+private:
+	alignas(R) unsigned char m_storage[sizeof(R)];
+	bool m_valid = false;
+
+	R *ptr() { return reinterpret_cast<R *>(m_storage); }
+
+public:
+	stack_result() = default;
+	stack_result(const stack_result &) = delete;
+	stack_result &operator=(const stack_result &) = delete;
+
+	~stack_result() {
+		if (m_valid) {
+			ptr()->~R();
+		}
+	}
+
+	template <typename Call>
+	void emplace(Call &call) {
+		new (m_storage) R(call());
+		m_valid = true;
+	}
+
+	R get() { return std::move(*ptr()); }
+};
+
+/**
+ * References are stored as pointers.
+ */
+template <typename R>
+class stack_result<R &> {
+private:
+	R *m_ptr = nullptr;
+
+public:
+	template <typename Call>
+	void emplace(Call &call) {
+		m_ptr = &call();
+	}
+
+	R &get() { return *m_ptr; }
+};
+
+template <typename R>
+class stack_result<R &&> {
+private:
+	R *m_ptr = nullptr;
+
+public:
+	template <typename Call>
+	void emplace(Call &call) {
+		R &&ref = call();
+		m_ptr = &ref;
+	}
+
+	R &&get() { return std::move(*m_ptr); }
+};
+
+template <>
+class stack_result<void> {
+public:
+	template <typename Call>
+	void emplace(Call &call) {
+		call();
+	}
+
+	void get() {}
+};
+
+/**
+ * State shared between the caller and the callback executed on the new
+ * stack. Lives on the frame of the caller.
+ */
+template <typename Call, typename R>
+struct stack_frame {
+	Call call;
+	stack_result<R> result;
+#ifdef FX_STACK_HPP_EXCEPTIONS
+	std::exception_ptr exception;
+#endif
+
+	explicit stack_frame(Call &&call) : call(std::move(call)) {}
+
+	/**
+	 * Callback passed to fx_stack_switch(). Exceptions are caught before they
+	 * reach the stack boundary, independently of whether the library was
+	 * compiled with C++ exception support.
+	 */
+	static void *run(void *data) {
+		stack_frame &self = *static_cast<stack_frame *>(data);
+#ifdef FX_STACK_HPP_EXCEPTIONS
+		try {
+			self.result.emplace(self.call);
+		} catch (...) {
+			self.exception = std::current_exception();
+		}
+#else
+		self.result.emplace(self.call);
+#endif
+		return nullptr;
+	}
+
+	R get() {
+#ifdef FX_STACK_HPP_EXCEPTIONS
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+#endif
+		return result.get();
+	}
+};
+
+}  // namespace detail
+
+/**
+ * Calls f(args...) on the stack described by stack_start and stack_end and
+ * returns the result. Arguments are perfectly forwarded; results may be
+ * references or move-only types. Exceptions thrown by f are re-thrown on the
+ * original stack.
+ *
+ * @param stack_start is a pointer at the lowest address of the stack memory.
+ * @param stack_end is a pointer at the highest address of the stack memory.
+ * @param stack_ptr is the initial stack pointer; usually the same as
+ * stack_end.
+ * @param f is the callable that should be executed.
+ * @param args are the arguments that should be passed to f.
+ * @return the value returned by f.
+ */
+template <typename F, typename... Args>
+auto stack_switch(void *stack_start, void *stack_end, void *stack_ptr, F &&f,
+                  Args &&... args)
+    -> decltype(std::forward<F>(f)(std::forward<Args>(args)...)) {
+	typedef decltype(std::forward<F>(f)(std::forward<Args>(args)...)) R;
+	auto call = [&]() -> R {
+		return std::forward<F>(f)(std::forward<Args>(args)...);
+	};
+	detail::stack_frame<decltype(call), R> frame(std::move(call));
+	fx_stack_switch(stack_start, stack_end, stack_ptr, frame.run, &frame);
+	return frame.get();
+}
+
+/**
+ * Same as above, but executes f on a stack described by a fx_stack_handle.
+ *
+ * @param handle is the stack handle.
+ * @param stack_ptr is the initial stack pointer; usually handle.stack_end.
+ * @param f is the callable that should be executed.
+ * @param args are the arguments that should be passed to f.
+ * @return the value returned by f.
+ */
+template <typename F, typename... Args>
+auto stack_switch(const fx_stack_handle &handle, void *stack_ptr, F &&f,
+                  Args &&... args)
+    -> decltype(std::forward<F>(f)(std::forward<Args>(args)...)) {
+	typedef decltype(std::forward<F>(f)(std::forward<Args>(args)...)) R;
+	auto call = [&]() -> R {
+		return std::forward<F>(f)(std::forward<Args>(args)...);
+	};
+	detail::stack_frame<decltype(call), R> frame(std::move(call));
+	fx_stack_handle_switch(&handle, stack_ptr, frame.run, &frame);
+	return frame.get();
+}
+
+}  // namespace foxen
+
+#endif /* FX_FOXEN_STACK_HPP */
@@ -0,0 +1,66 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef FX_NO_CONFIG
+#include "config.h"
+#endif
+
+#include <foxen/stack_gen.h>
+
+/*****************************************************************************
+ * Helper functions                                                          *
+ *****************************************************************************/
+
+static void *_fx_stack_gen_entry(void *data) {
+	fx_stack_gen *gen = (fx_stack_gen *)data;
+	gen->cback(gen, gen->data);
+	return NULL; /* Signals the end of the sequence to the consumer */
+}
+
+/*****************************************************************************
+ * Public API                                                                *
+ *****************************************************************************/
+
+void fx_stack_gen_init(fx_stack_gen *gen, void *stack_start, void *stack_end,
+                       fx_stack_gen_cback cback, void *data) {
+	memset(&gen->consumer, 0, sizeof(fx_stack_context));
+	gen->cback = cback;
+	gen->data = data;
+	fx_stack_context_init(&gen->producer, stack_start, stack_end,
+	                      _fx_stack_gen_entry, gen);
+}
+
+void fx_stack_gen_destroy(fx_stack_gen *gen) {
+	fx_stack_context_destroy(&gen->producer);
+}
+
+void *fx_stack_gen_next(fx_stack_gen *gen) {
+	if (fx_stack_context_done(&gen->producer)) {
+		return NULL;
+	}
+	return fx_stack_context_swap(&gen->consumer, &gen->producer, NULL);
+}
+
+void fx_stack_gen_yield(fx_stack_gen *gen, void *value) {
+	assert(value);
+	fx_stack_context_swap(&gen->producer, &gen->consumer, value);
+}
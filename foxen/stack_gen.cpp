@@ -0,0 +1 @@
+stack_gen.c
\ No newline at end of file
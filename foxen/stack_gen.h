@@ -0,0 +1,128 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack_gen.h
+ *
+ * Generators on top of fx_stack_context. The producer runs on its own stack
+ * and yields pointers at values that live on that stack; the consumer reads
+ * the values in-place. Each element costs exactly one context switch pair.
+ */
+
+#ifndef FX_FOXEN_STACK_GEN_H
+#define FX_FOXEN_STACK_GEN_H
+
+#include <foxen/stack.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct fx_stack_gen;
+
+/**
+ * Producer function of a generator. Calls fx_stack_gen_yield() for each
+ * element; the generator is exhausted once this function returns.
+ *
+ * @param gen is the generator the producer belongs to.
+ * @param data is the user-defined pointer passed to fx_stack_gen_init().
+ */
+typedef void (*fx_stack_gen_cback)(struct fx_stack_gen *gen, void *data);
+
+/**
+ * A generator. All members of this structure should be treated as private.
+ * The structure must not be moved in memory after fx_stack_gen_init() has
+ * been called.
+ */
+typedef struct fx_stack_gen {
+	/**
+	 * Context of the producer and of the consumer that most recently called
+	 * fx_stack_gen_next().
+	 */
+	fx_stack_context producer;
+	fx_stack_context consumer;
+
+	/**
+	 * Producer function and the user-defined data passed to it.
+	 */
+	fx_stack_gen_cback cback;
+	void *data;
+} fx_stack_gen;
+
+/**
+ * Initialises a generator. The producer function is not executed before the
+ * first call to fx_stack_gen_next().
+ *
+ * @param gen is the generator that should be initialised.
+ * @param stack_start is a pointer at the lowest address of the stack memory
+ * used by the producer.
+ * @param stack_end is a pointer at the highest address of the stack memory
+ * used by the producer.
+ * @param cback is the producer function.
+ * @param data is a user-defined pointer passed to the producer function.
+ */
+void fx_stack_gen_init(fx_stack_gen *gen, void *stack_start, void *stack_end,
+                       fx_stack_gen_cback cback, void *data);
+
+/**
+ * Releases the resources held by the generator. The stack memory itself is
+ * owned by the caller. If the producer has not returned yet, it is abandoned;
+ * in C++, destructors of objects on the producer stack are not executed.
+ *
+ * @param gen is the generator that should be destroyed.
+ */
+void fx_stack_gen_destroy(fx_stack_gen *gen);
+
+/**
+ * Resumes the producer until it yields the next element or returns.
+ *
+ * If the producer throws a C++ exception (and C++ exception support is
+ * enabled), the exception is re-thrown by this function and the generator is
+ * exhausted.
+ *
+ * @param gen is the generator.
+ * @return the pointer passed to fx_stack_gen_yield() by the producer, or NULL
+ * if the generator is exhausted. The pointer remains valid until the next
+ * call to fx_stack_gen_next() or fx_stack_gen_destroy().
+ */
+void *fx_stack_gen_next(fx_stack_gen *gen);
+
+/**
+ * Passes an element to the consumer and suspends the producer until the
+ * consumer requests the next element. Must only be called by the producer
+ * function of the given generator.
+ *
+ * @param gen is the generator the producer belongs to.
+ * @param value is a non-NULL pointer at the element. The element is not
+ * copied; it must remain valid until this function returns.
+ */
+void fx_stack_gen_yield(fx_stack_gen *gen, void *value);
+
+/**
+ * Returns a non-zero value if the producer of the given generator has
+ * returned.
+ */
+static inline int fx_stack_gen_done(const fx_stack_gen *gen) {
+	return fx_stack_context_done(&gen->producer);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_GEN_H */
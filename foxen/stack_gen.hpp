@@ -0,0 +1,223 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack_gen.hpp
+ *
+ * Header-only C++11 range adapter for fx_stack_gen. The producer is an
+ * arbitrary callable receiving a yield function object; the consumer iterates
+ * over references to the yielded elements using a range-based for loop.
+ */
+
+#ifndef FX_FOXEN_STACK_GEN_HPP
+#define FX_FOXEN_STACK_GEN_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define FX_STACK_GEN_HPP_EXCEPTIONS
+#include <exception>
+#endif
+
+#include <foxen/stack_gen.h>
+
+namespace foxen {
+
+/**
+ * Generator yielding references of type T&. T may be const-qualified. The
+ * generator can neither be copied nor moved.
+ */
+template <typename T>
+class generator {
+public:
+	/**
+	 * Function object passed to the producer. Calling it passes a reference
+	 * to the element to the consumer without copying it.
+	 */
+	class yielder {
+	private:
+		generator *m_gen;
+
+	public:
+		explicit yielder(generator *gen) : m_gen(gen) {}
+
+		void operator()(T &value) const { m_gen->yield(&value); }
+		void operator()(T &&value) const { m_gen->yield(&value); }
+	};
+
+	class iterator {
+	private:
+		generator *m_gen;
+
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef typename std::remove_cv<T>::type value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef T *pointer;
+		typedef T &reference;
+
+		explicit iterator(generator *gen) : m_gen(gen) {}
+
+		T &operator*() const { return *m_gen->m_value; }
+		T *operator->() const { return m_gen->m_value; }
+
+		iterator &operator++() {
+			m_gen->advance();
+			return *this;
+		}
+
+		void operator++(int) { m_gen->advance(); }
+
+		/**
+		 * Iterators only compare unequal while the generator has a value;
+		 * the end iterator compares equal to any exhausted iterator.
+		 */
+		bool operator==(const iterator &o) const {
+			return (m_gen ? m_gen->m_value : nullptr) ==
+			       (o.m_gen ? o.m_gen->m_value : nullptr);
+		}
+		bool operator!=(const iterator &o) const { return !(*this == o); }
+	};
+
+private:
+	fx_stack_gen m_gen;
+	T *m_value = nullptr;
+	bool m_started = false;
+	bool m_cancelled = false;
+#ifdef FX_STACK_GEN_HPP_EXCEPTIONS
+	std::exception_ptr m_exception;
+#endif
+
+	/**
+	 * Thrown by the yielder to unwind the producer stack if the generator is
+	 * destroyed before the producer has returned.
+	 */
+	struct cancelled {};
+
+	template <typename F>
+	struct producer_data {
+		generator *gen;
+		typename std::remove_reference<F>::type *f;
+	};
+
+	/**
+	 * Producer entry point. Moves the callable onto the producer stack and
+	 * hands control back to the constructor, so the callable does not need
+	 * to outlive the constructor call.
+	 */
+	template <typename F>
+	static void run(fx_stack_gen *gen_, void *data_) {
+		producer_data<F> *data = static_cast<producer_data<F> *>(data_);
+		generator *gen = data->gen;
+		typename std::decay<F>::type f(std::forward<F>(*data->f));
+		fx_stack_gen_yield(gen_, gen);
+		if (gen->m_cancelled) {
+			return;
+		}
+#ifdef FX_STACK_GEN_HPP_EXCEPTIONS
+		try {
+			f(yielder(gen));
+		} catch (cancelled &) {
+			/* The generator is being destroyed */
+		} catch (...) {
+			gen->m_exception = std::current_exception();
+		}
+#else
+		f(yielder(gen));
+#endif
+	}
+
+	void yield(T *value) {
+		fx_stack_gen_yield(&m_gen,
+		                   const_cast<void *>(static_cast<const void *>(value)));
+#ifdef FX_STACK_GEN_HPP_EXCEPTIONS
+		if (m_cancelled) {
+			throw cancelled();
+		}
+#endif
+	}
+
+	void advance() {
+		m_value = static_cast<T *>(fx_stack_gen_next(&m_gen));
+#ifdef FX_STACK_GEN_HPP_EXCEPTIONS
+		if (m_exception) {
+			std::exception_ptr exception = std::move(m_exception);
+			m_exception = nullptr;
+			std::rethrow_exception(exception);
+		}
+#endif
+	}
+
+public:
+	/**
+	 * Creates a generator executing f(yield) on the given stack. The producer
+	 * is started before the constructor returns and suspended before f is
+	 * called.
+	 *
+	 * @param stack_start is a pointer at the lowest address of the stack
+	 * memory used by the producer.
+	 * @param stack_end is a pointer at the highest address of the stack memory
+	 * used by the producer.
+	 * @param f is the producer, a callable accepting a yielder. It is moved
+	 * or copied onto the producer stack.
+	 */
+	template <typename F>
+	generator(void *stack_start, void *stack_end, F &&f) {
+		producer_data<F> data{this, &f};
+		fx_stack_gen_init(&m_gen, stack_start, stack_end, run<F>, &data);
+		fx_stack_gen_next(&m_gen);
+	}
+
+	generator(const generator &) = delete;
+	generator &operator=(const generator &) = delete;
+
+	/**
+	 * Destroys the generator. If exceptions are enabled and the producer has
+	 * not returned yet, the producer stack is unwound by throwing an internal
+	 * exception from the pending yield call.
+	 */
+	~generator() {
+		if (!fx_stack_gen_done(&m_gen)) {
+			m_cancelled = true;
+#ifdef FX_STACK_GEN_HPP_EXCEPTIONS
+			fx_stack_gen_next(&m_gen);
+#endif
+		}
+		fx_stack_gen_destroy(&m_gen);
+	}
+
+	/**
+	 * Returns an iterator at the first element. Must only be called once.
+	 */
+	iterator begin() {
+		if (!m_started) {
+			m_started = true;
+			advance();
+		}
+		return iterator(this);
+	}
+
+	iterator end() { return iterator(nullptr); }
+};
+
+}  // namespace foxen
+
+#endif /* FX_FOXEN_STACK_GEN_HPP */
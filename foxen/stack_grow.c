@@ -0,0 +1,215 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Required for pthread_getattr_np() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#ifndef FX_NO_CONFIG
+#include "config.h"
+#endif
+
+#include <foxen/stack_grow.h>
+#include <foxen/stack_pool.h>
+
+#include "stack_internal.h"
+
+/*****************************************************************************
+ * Native stack bounds                                                       *
+ *****************************************************************************/
+
+/**
+ * Bounds of the native stack of the calling thread. Both are zero if the
+ * bounds have not been queried yet; the range is empty if they cannot be
+ * determined.
+ */
+static __thread uintptr_t _fx_stack_grow_native_start FX_STACK_TLS_IE = 0U;
+static __thread uintptr_t _fx_stack_grow_native_end FX_STACK_TLS_IE = 0U;
+
+static __attribute__((noinline)) void _fx_stack_grow_query_native_bounds(
+    void) {
+	uintptr_t start = UINTPTR_MAX, end = UINTPTR_MAX;
+#if defined(__GLIBC__)
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		void *addr = NULL;
+		size_t size = 0U;
+		if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+			start = (uintptr_t)addr;
+			end = start + size;
+		}
+		pthread_attr_destroy(&attr);
+	}
+#endif
+	_fx_stack_grow_native_start = start;
+	_fx_stack_grow_native_end = end;
+}
+
+/*****************************************************************************
+ * Global segment pools                                                      *
+ *****************************************************************************/
+
+/**
+ * Global pools of stack segments, one per size class. Each pool is
+ * initialised on first use; the state is zero if the pool has not been
+ * initialised, one while it is being initialised, two once it is ready and
+ * three if the initialisation failed.
+ */
+static fx_stack_pool _fx_stack_grow_pools[FX_STACK_GROW_N_CLASSES];
+static int _fx_stack_grow_pool_state[FX_STACK_GROW_N_CLASSES];
+
+static fx_stack_pool *_fx_stack_grow_pool(size_t cls) {
+	int state = __atomic_load_n(&_fx_stack_grow_pool_state[cls],
+	                            __ATOMIC_ACQUIRE);
+	if (state == 0) {
+		if (__atomic_compare_exchange_n(&_fx_stack_grow_pool_state[cls],
+		                                &state, 1, false, __ATOMIC_ACQUIRE,
+		                                __ATOMIC_ACQUIRE)) {
+			/* Release the memory of deep recursions once they are done, but
+			   keep the smallest segment size resident */
+			fx_stack_pool *pool = &_fx_stack_grow_pools[cls];
+			state = fx_stack_pool_init(pool, FX_STACK_GROW_MIN_SIZE << cls,
+			                           FX_STACK_GROW_POOL_CAPACITY, 0U)
+			            ? 2
+			            : 3;
+			fx_stack_pool_set_reclaim(
+			    pool, FX_STACK_GROW_MIN_SIZE,
+			    FX_STACK_RECLAIM_ON_FREE | FX_STACK_RECLAIM_LAZY);
+			__atomic_store_n(&_fx_stack_grow_pool_state[cls], state,
+			                 __ATOMIC_RELEASE);
+		}
+	}
+
+	/* Wait for another thread to finish initialising the pool */
+	while (state == 1) {
+		state = __atomic_load_n(&_fx_stack_grow_pool_state[cls],
+		                        __ATOMIC_ACQUIRE);
+	}
+	return (state == 2) ? &_fx_stack_grow_pools[cls] : NULL;
+}
+
+/**
+ * Executes the callback on the given stack segment and returns the segment to
+ * the pool, even if the callback throws a C++ exception.
+ */
+static void *_fx_stack_grow_switch(fx_stack_pool *pool, fx_stack *stack,
+                                   fx_stack_cback cback, void *data) {
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	try {
+		void *result = fx_stack_switch(stack->stack_start, stack->stack_end,
+		                               stack->stack_end, cback, data);
+		fx_stack_pool_free(pool, stack);
+		return result;
+	} catch (...) {
+		fx_stack_pool_free(pool, stack);
+		throw;
+	}
+#else
+	void *result = fx_stack_switch(stack->stack_start, stack->stack_end,
+	                               stack->stack_end, cback, data);
+	fx_stack_pool_free(pool, stack);
+	return result;
+#endif
+}
+
+static __attribute__((noinline)) void *_fx_stack_grow(size_t new_size,
+                                                      fx_stack_cback cback,
+                                                      void *data) {
+	/* Determine the size class */
+	size_t cls = 0U;
+	while ((cls < FX_STACK_GROW_N_CLASSES) &&
+	       ((FX_STACK_GROW_MIN_SIZE << cls) < new_size)) {
+		cls++;
+	}
+
+	/* Take a segment from the global pool for this size class */
+	if (cls < FX_STACK_GROW_N_CLASSES) {
+		fx_stack_pool *pool = _fx_stack_grow_pool(cls);
+		fx_stack *stack = pool ? fx_stack_pool_alloc(pool) : NULL;
+		if (!stack) {
+			abort(); /* Executing the callback would overflow the stack */
+		}
+		return _fx_stack_grow_switch(pool, stack, cback, data);
+	}
+
+	/* Use a temporary pool for segments exceeding the largest size class */
+	fx_stack_pool pool;
+	fx_stack *stack = NULL;
+	if (fx_stack_pool_init(&pool, new_size, 1U, 0U)) {
+		stack = fx_stack_pool_alloc(&pool);
+	}
+	if (!stack) {
+		abort(); /* Executing the callback would overflow the stack */
+	}
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	try {
+		void *result = _fx_stack_grow_switch(&pool, stack, cback, data);
+		fx_stack_pool_destroy(&pool);
+		return result;
+	} catch (...) {
+		fx_stack_pool_destroy(&pool);
+		throw;
+	}
+#else
+	void *result = _fx_stack_grow_switch(&pool, stack, cback, data);
+	fx_stack_pool_destroy(&pool);
+	return result;
+#endif
+}
+
+/*****************************************************************************
+ * Public API                                                                *
+ *****************************************************************************/
+
+size_t fx_stack_headroom(void) {
+	const uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+
+	/* Stack set up by fx_stack_switch() or a context. The stack pointer may
+	   lie outside of this stack if an unknown stack was entered from it, e.g.
+	   using fx_stack_switch_inline(). */
+	const uintptr_t start = (uintptr_t)_fx_stack_current_start;
+	const uintptr_t end = (uintptr_t)_fx_stack_current_end;
+	if ((sp > start) && (sp <= end)) {
+		return (size_t)(sp - start);
+	}
+
+	/* Native thread stack. If the stack pointer is outside of the native
+	   stack as well, we are executing on an unknown stack. */
+	if (!_fx_stack_grow_native_end) {
+		_fx_stack_grow_query_native_bounds();
+	}
+	if ((sp > _fx_stack_grow_native_start) &&
+	    (sp < _fx_stack_grow_native_end)) {
+		return (size_t)(sp - _fx_stack_grow_native_start);
+	}
+	return 0U;
+}
+
+void *fx_stack_maybe_grow(size_t red_zone, size_t new_size,
+                          fx_stack_cback cback, void *data) {
+	if (fx_stack_headroom() >= red_zone) {
+		return cback(data);
+	}
+	return _fx_stack_grow(new_size, cback, data);
+}
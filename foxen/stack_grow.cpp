@@ -0,0 +1 @@
+stack_grow.c
\ No newline at end of file
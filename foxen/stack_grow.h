@@ -0,0 +1,91 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FX_FOXEN_STACK_GROW_H
+#define FX_FOXEN_STACK_GROW_H
+
+#include <stddef.h>
+
+#include <foxen/stack.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Smallest stack segment handed out by fx_stack_maybe_grow(). Segment sizes
+ * are rounded up to a power of two; each size class is served by its own
+ * global stack pool.
+ */
+#ifndef FX_STACK_GROW_MIN_SIZE
+#define FX_STACK_GROW_MIN_SIZE (64U * 1024U)
+#endif
+
+/**
+ * Number of segment size classes. Larger segments are mapped on demand and
+ * unmapped once the callback returns.
+ */
+#ifndef FX_STACK_GROW_N_CLASSES
+#define FX_STACK_GROW_N_CLASSES 10U
+#endif
+
+/**
+ * Maximum number of segments of each size class that can be in use at the
+ * same time.
+ */
+#ifndef FX_STACK_GROW_POOL_CAPACITY
+#define FX_STACK_GROW_POOL_CAPACITY 4096U
+#endif
+
+/**
+ * Returns the number of bytes left on the stack the calling code is executing
+ * on. For stacks entered via fx_stack_switch() or fx_stack_context_swap() this
+ * is derived from fx_stack_current_start(); the bounds of the native stack of
+ * each thread are queried once and cached. Returns zero if the bounds of the
+ * native stack cannot be determined on this platform, or if the code executes
+ * on a stack unknown to the library (e.g. one entered using
+ * fx_stack_switch_inline()).
+ */
+size_t fx_stack_headroom(void);
+
+/**
+ * Executes "cback" directly if at least "red_zone" bytes are left on the
+ * current stack (see fx_stack_headroom()). Otherwise, a stack segment of at
+ * least "new_size" bytes is taken from a global pool, the callback is executed
+ * on this segment using fx_stack_switch(), and the segment is returned to the
+ * pool. Place calls to this function at the recursion points of deeply
+ * recursive code; the common case only costs a headroom check.
+ *
+ * Aborts the program if no stack segment can be mapped.
+ *
+ * @param red_zone is the minimum number of bytes that must be left on the
+ * current stack for "cback" to be executed directly.
+ * @param new_size is the size of the new stack segment in bytes.
+ * @param cback is the callback function that should be executed.
+ * @param data is a user-defined pointer that should be passed to the callback
+ * function.
+ * @return the return value of the callback function.
+ */
+void *fx_stack_maybe_grow(size_t red_zone, size_t new_size,
+                          fx_stack_cback cback, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_GROW_H */
@@ -0,0 +1,98 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack_inline.h
+ *
+ * Header-only variant of fx_stack_switch(). Including this header compiles the
+ * platform-specific stack switching code into the including translation unit,
+ * so the switch is a direct call instead of a call through the PLT of the
+ * shared library.
+ */
+
+#ifndef FX_FOXEN_STACK_INLINE_H
+#define FX_FOXEN_STACK_INLINE_H
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <foxen/stack.h>
+
+/* Only include the _fx_stack_switch function; the context switching code is
+   part of the library */
+#ifndef FX_STACK_PLATFORM_NO_CONTEXT
+#define FX_STACK_PLATFORM_NO_CONTEXT
+#endif
+#include <foxen/platform/stack_platformselect.h>
+
+#ifdef FX_WITH_VALGRIND
+#include <valgrind.h>
+#endif
+
+/**
+ * Defined if C++ exceptions propagate through _fx_stack_switch() without
+ * catching and re-throwing them on the original stack.
+ */
+#if defined(__amd64__) || defined(__i386__)
+#define FX_STACK_INLINE_NATIVE_EXCEPTIONS
+#endif
+
+/**
+ * Same as fx_stack_switch(), but can be inlined at the call site. In C++ code
+ * on platforms other than x86 and x86_64, this falls back to fx_stack_switch(),
+ * which catches exceptions thrown by the callback and re-throws them on the
+ * original stack.
+ *
+ * In contrast to fx_stack_switch(), this function does not update
+ * fx_stack_current_start() (so fx_stack_maybe_grow() always switches to a new
+ * segment when called from the callback) and does not paint the stack if the
+ * library was compiled with FX_WITH_STACK_WATERMARK. The stack is registered
+ * with valgrind if FX_WITH_VALGRIND is defined when including this header.
+ */
+static inline void *fx_stack_switch_inline(void *stack_start, void *stack_end,
+                                           void *stack_ptr,
+                                           fx_stack_cback cback, void *data) {
+#if defined(__cplusplus) && !defined(FX_STACK_INLINE_NATIVE_EXCEPTIONS)
+	return fx_stack_switch(stack_start, stack_end, stack_ptr, cback, data);
+#else
+	/* Make sure the given stack pointer is sane */
+	assert((stack_start < stack_ptr) && (stack_ptr <= stack_end));
+
+	void *(*fn)(void *, fx_stack_cback, void *) = _fx_stack_switch;
+#ifdef __cplusplus
+	/* The compiler cannot see that the assembly code calls the callback and
+	   would otherwise assume that _fx_stack_switch() never throws, discarding
+	   the exception handlers around the call site. Hide the callee. */
+	__asm__("" : "+r"(fn));
+#endif
+
+#ifdef FX_WITH_VALGRIND
+	const unsigned int stack_id =
+	    VALGRIND_STACK_REGISTER(stack_start, stack_end);
+	void *result = fn(stack_ptr, cback, data);
+	VALGRIND_STACK_DEREGISTER(stack_id);
+	return result;
+#else
+	(void)stack_start;
+	(void)stack_end;
+	return fn(stack_ptr, cback, data);
+#endif
+#endif
+}
+
+#endif /* FX_FOXEN_STACK_INLINE_H */
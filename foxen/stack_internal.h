@@ -0,0 +1,61 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack_internal.h
+ *
+ * Declarations shared between the translation units of the library. This
+ * header is not installed.
+ */
+
+#ifndef FX_FOXEN_STACK_INTERNAL_H
+#define FX_FOXEN_STACK_INTERNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Thread-local variables accessed on the switching fast path use the
+ * initial-exec TLS model. This turns each access into a thread-pointer
+ * relative load instead of a call to __tls_get_addr() when the library is
+ * loaded dynamically.
+ */
+#define FX_STACK_TLS_IE __attribute__((tls_model("initial-exec")))
+
+/**
+ * Symbols shared between the translation units of the library but not
+ * exported from it.
+ */
+#define FX_STACK_HIDDEN __attribute__((visibility("hidden")))
+
+/**
+ * Low- and high-address of the stack the calling thread is currently executing
+ * on or NULL if it is executing on its native stack. Defined in stack.c; the
+ * public accessor of the former is fx_stack_current_start().
+ */
+extern FX_STACK_HIDDEN __thread void *volatile _fx_stack_current_start
+    FX_STACK_TLS_IE;
+extern FX_STACK_HIDDEN __thread void *volatile _fx_stack_current_end
+    FX_STACK_TLS_IE;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_INTERNAL_H */
@@ -0,0 +1,694 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Required for accept4() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef FX_NO_CONFIG
+#include "config.h"
+#endif
+
+#include <foxen/stack_io.h>
+
+/*****************************************************************************
+ * Data structures                                                           *
+ *****************************************************************************/
+
+#define FX_STACK_IO_NONE ((size_t)-1)
+#define FX_STACK_IO_EVENT_KEY UINT64_MAX
+#define FX_STACK_IO_MAX_EVENTS 64
+
+/* Resolution of the timeouts; epoll_wait() accepts milliseconds */
+#define FX_STACK_IO_TICK_NS 1000000U
+
+typedef struct _fx_stack_io_waiter {
+	/**
+	 * Suspended task or NULL if the slot is free.
+	 */
+	fx_stack_sched_task *task;
+
+	/**
+	 * Location at which the result (zero or an error code) is stored before
+	 * the task is resumed.
+	 */
+	int *result;
+
+	/**
+	 * File descriptor the task is waiting for or -1 and the events the task
+	 * is waiting for.
+	 */
+	int fd;
+	uint32_t events;
+
+	/**
+	 * Timer in the timing wheel of the reactor or NULL if the task waits
+	 * without a timeout. The timer is stored on the stack of the task.
+	 */
+	fx_stack_timer *timer;
+
+	/**
+	 * Next slot in the free list.
+	 */
+	size_t next_free;
+} _fx_stack_io_waiter;
+
+typedef struct _fx_stack_io_fd {
+	/**
+	 * Waiter slots of the tasks waiting for the file descriptor to become
+	 * readable and writable or FX_STACK_IO_NONE. A task waiting for both
+	 * occupies both slots.
+	 */
+	size_t reader;
+	size_t writer;
+
+	/**
+	 * Incremented whenever the file descriptor is armed. Stored in the epoll
+	 * event data, so events fetched before the file descriptor was armed
+	 * again are discarded.
+	 */
+	uint32_t generation;
+} _fx_stack_io_fd;
+
+/**
+ * Data passed from a task to the park callback.
+ */
+typedef struct {
+	fx_stack_io *io;
+	int fd;
+	uint32_t events;
+	int64_t deadline;
+	int result;
+
+	/**
+	 * Timer expiring at the deadline and the waiter slot it belongs to.
+	 */
+	fx_stack_timer timer;
+	size_t idx;
+} _fx_stack_io_wait_data;
+
+/*****************************************************************************
+ * Helper functions                                                          *
+ *****************************************************************************/
+
+/*
+ * glibc declares __errno_location() as a const function, so the compiler may
+ * reuse the address of errno across a context switch, after which the task
+ * may be running on another thread. errno is thus only accessed in the
+ * following functions, which never switch contexts.
+ */
+
+static __attribute__((noinline)) ssize_t _fx_stack_io_sys_read(int fd,
+                                                                void *buf,
+                                                                size_t count) {
+	const ssize_t res = read(fd, buf, count);
+	return (res < 0) ? -(ssize_t)errno : res;
+}
+
+static __attribute__((noinline)) ssize_t _fx_stack_io_sys_write(
+    int fd, const void *buf, size_t count) {
+	const ssize_t res = write(fd, buf, count);
+	return (res < 0) ? -(ssize_t)errno : res;
+}
+
+static __attribute__((noinline)) int _fx_stack_io_sys_accept(
+    int fd, struct sockaddr *addr, socklen_t *addrlen) {
+	const int res = accept4(fd, addr, addrlen, SOCK_NONBLOCK);
+	return (res < 0) ? -errno : res;
+}
+
+static __attribute__((noinline)) int _fx_stack_io_sys_connect(
+    int fd, const struct sockaddr *addr, socklen_t addrlen) {
+	const int res = connect(fd, addr, addrlen);
+	return (res < 0) ? -errno : res;
+}
+
+static __attribute__((noinline)) ssize_t _fx_stack_io_return(ssize_t res) {
+	if (res < 0) {
+		errno = (int)-res;
+		return -1;
+	}
+	return res;
+}
+
+static int64_t _fx_stack_io_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;
+}
+
+static int64_t _fx_stack_io_deadline(int timeout_ms) {
+	return (timeout_ms < 0) ? -1
+	                        : _fx_stack_io_now() + (int64_t)timeout_ms * 1000000LL;
+}
+
+/**
+ * Returns the number of milliseconds until the given deadline, rounded up, or
+ * -1 if the deadline is -1.
+ */
+static int _fx_stack_io_remaining_ms(int64_t deadline) {
+	if (deadline < 0) {
+		return -1;
+	}
+	const int64_t ms = (deadline - _fx_stack_io_now() + 999999LL) / 1000000LL;
+	return (ms <= 0) ? 0 : ((ms > INT32_MAX) ? INT32_MAX : (int)ms);
+}
+
+static void _fx_stack_io_wake(fx_stack_io *io) {
+	const uint64_t one = 1U;
+	ssize_t res;
+	do {
+		res = write(io->event_fd, &one, sizeof(one));
+	} while ((res < 0) && (errno == EINTR));
+}
+
+/*****************************************************************************
+ * Waiter slots                                                              *
+ *****************************************************************************/
+
+static size_t _fx_stack_io_slot_alloc(fx_stack_io *io) {
+	if (io->free_head == FX_STACK_IO_NONE) {
+		/* Double the number of slots; slots are only referenced by index */
+		const size_t n = io->n_waiters ? (2U * io->n_waiters) : 64U;
+		_fx_stack_io_waiter *waiters = (_fx_stack_io_waiter *)realloc(
+		    io->waiters, n * sizeof(_fx_stack_io_waiter));
+		if (!waiters) {
+			return FX_STACK_IO_NONE;
+		}
+		io->waiters = waiters;
+		for (size_t i = io->n_waiters; i < n; i++) {
+			memset(&waiters[i], 0, sizeof(_fx_stack_io_waiter));
+			waiters[i].next_free = (i + 1U < n) ? (i + 1U) : FX_STACK_IO_NONE;
+		}
+		io->free_head = io->n_waiters;
+		io->n_waiters = n;
+	}
+	const size_t idx = io->free_head;
+	io->free_head = io->waiters[idx].next_free;
+	return idx;
+}
+
+static void _fx_stack_io_slot_free(fx_stack_io *io, size_t idx) {
+	_fx_stack_io_waiter *w = &io->waiters[idx];
+	w->task = NULL;
+	w->next_free = io->free_head;
+	io->free_head = idx;
+}
+
+/*****************************************************************************
+ * File descriptors                                                          *
+ *****************************************************************************/
+
+/**
+ * A task waiting for EPOLLOUT occupies the writer slot of the file descriptor,
+ * a task waiting for any other event occupies the reader slot.
+ */
+static bool _fx_stack_io_is_reader(uint32_t events) {
+	return (events & ~(uint32_t)EPOLLOUT) || !(events & EPOLLOUT);
+}
+
+static bool _fx_stack_io_is_writer(uint32_t events) {
+	return events & EPOLLOUT;
+}
+
+/**
+ * Returns the entry of the given file descriptor, growing the table if
+ * necessary. Returns NULL if the table could not be grown.
+ */
+static _fx_stack_io_fd *_fx_stack_io_fd_get(fx_stack_io *io, int fd) {
+	if ((size_t)fd >= io->n_fds) {
+		size_t n = io->n_fds ? io->n_fds : 64U;
+		while (n <= (size_t)fd) {
+			n *= 2U;
+		}
+		_fx_stack_io_fd *fds =
+		    (_fx_stack_io_fd *)realloc(io->fds, n * sizeof(_fx_stack_io_fd));
+		if (!fds) {
+			return NULL;
+		}
+		for (size_t i = io->n_fds; i < n; i++) {
+			fds[i].reader = FX_STACK_IO_NONE;
+			fds[i].writer = FX_STACK_IO_NONE;
+			fds[i].generation = 0U;
+		}
+		io->fds = fds;
+		io->n_fds = n;
+	}
+	return &io->fds[fd];
+}
+
+static bool _fx_stack_io_fd_busy(const _fx_stack_io_fd *f) {
+	return (f->reader != FX_STACK_IO_NONE) || (f->writer != FX_STACK_IO_NONE);
+}
+
+/**
+ * Arms the file descriptor for a single event out of the union of the events
+ * the reader and the writer are waiting for. Re-uses an existing registration
+ * if possible. Returns zero or an error code.
+ */
+static int _fx_stack_io_fd_arm(fx_stack_io *io, int fd) {
+	_fx_stack_io_fd *f = &io->fds[fd];
+	uint32_t events = 0U;
+	if (f->reader != FX_STACK_IO_NONE) {
+		events |= io->waiters[f->reader].events;
+	}
+	if (f->writer != FX_STACK_IO_NONE) {
+		events |= io->waiters[f->writer].events;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events | EPOLLONESHOT;
+	f->generation++;
+	ev.data.u64 = ((uint64_t)f->generation << 32U) | (uint64_t)fd;
+	if ((epoll_ctl(io->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) &&
+	    ((errno != ENOENT) ||
+	     (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0))) {
+		return errno;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ * Waiting                                                                   *
+ *****************************************************************************/
+
+/**
+ * Stores the result in the given waiter, removes it from its file descriptor,
+ * releases the slot and resumes the task. Must be called with the reactor
+ * mutex held.
+ */
+static void _fx_stack_io_complete(fx_stack_io *io, size_t idx, int result) {
+	_fx_stack_io_waiter *w = &io->waiters[idx];
+	fx_stack_sched_task *task = w->task;
+	if (w->timer) {
+		fx_stack_timer_cancel(&io->timers, w->timer);
+	}
+	if (w->fd >= 0) {
+		_fx_stack_io_fd *f = &io->fds[w->fd];
+		if (f->reader == idx) {
+			f->reader = FX_STACK_IO_NONE;
+		}
+		if (f->writer == idx) {
+			f->writer = FX_STACK_IO_NONE;
+		}
+	}
+	*w->result = result;
+	_fx_stack_io_slot_free(io, idx);
+	fx_stack_sched_unpark(task);
+}
+
+/**
+ * Re-arms the file descriptor for the tasks still waiting on it. If this
+ * fails, the tasks are resumed with the error code.
+ */
+static void _fx_stack_io_fd_rearm(fx_stack_io *io, int fd) {
+	_fx_stack_io_fd *f = &io->fds[fd];
+	if (!_fx_stack_io_fd_busy(f)) {
+		return;
+	}
+	const int err = _fx_stack_io_fd_arm(io, fd);
+	if (err) {
+		if (f->reader != FX_STACK_IO_NONE) {
+			_fx_stack_io_complete(io, f->reader, err);
+		}
+		if (f->writer != FX_STACK_IO_NONE) {
+			_fx_stack_io_complete(io, f->writer, err);
+		}
+	}
+}
+
+/**
+ * Resumes the tasks waiting on the file descriptor that are interested in the
+ * reported events and re-arms the file descriptor for the remaining task.
+ */
+static void _fx_stack_io_fd_ready(fx_stack_io *io, int fd, uint32_t events) {
+	_fx_stack_io_fd *f = &io->fds[fd];
+	if ((f->reader != FX_STACK_IO_NONE) &&
+	    (events & (io->waiters[f->reader].events | EPOLLERR | EPOLLHUP))) {
+		_fx_stack_io_complete(io, f->reader, 0);
+	}
+	if ((f->writer != FX_STACK_IO_NONE) &&
+	    (events & (io->waiters[f->writer].events | EPOLLERR | EPOLLHUP))) {
+		_fx_stack_io_complete(io, f->writer, 0);
+	}
+	_fx_stack_io_fd_rearm(io, fd);
+}
+
+static void _fx_stack_io_wait_data_init(_fx_stack_io_wait_data *data,
+                                        fx_stack_io *io, int fd,
+                                        uint32_t events, int64_t deadline) {
+	memset(data, 0, sizeof(_fx_stack_io_wait_data));
+	data->io = io;
+	data->fd = fd;
+	data->events = events;
+	data->deadline = deadline;
+}
+
+/**
+ * Timer callback resuming a task whose deadline has passed.
+ */
+static void _fx_stack_io_expire(fx_stack_timer *timer, void *data_) {
+	/* The data lives on the stack of the task and is gone once the task has
+	   been resumed */
+	_fx_stack_io_wait_data *data = (_fx_stack_io_wait_data *)data_;
+	fx_stack_io *io = data->io;
+	const int fd = data->fd;
+	(void)timer;
+	_fx_stack_io_complete(io, data->idx, ETIMEDOUT);
+
+	/* Re-arm the file descriptor for the other task waiting on it, or disarm
+	   it. Events that have already been fetched are discarded since the
+	   generation of the file descriptor changes when it is armed again. */
+	if (fd >= 0) {
+		if (_fx_stack_io_fd_busy(&io->fds[fd])) {
+			_fx_stack_io_fd_rearm(io, fd);
+		} else {
+			epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		}
+	}
+}
+
+/**
+ * Park callback registering a suspended task with the reactor.
+ */
+static void _fx_stack_io_arm(fx_stack_sched_task *task, void *data_) {
+	_fx_stack_io_wait_data *data = (_fx_stack_io_wait_data *)data_;
+	fx_stack_io *io = data->io;
+
+	pthread_mutex_lock(&io->mutex);
+	const size_t idx = _fx_stack_io_slot_alloc(io);
+	if (idx == FX_STACK_IO_NONE) {
+		pthread_mutex_unlock(&io->mutex);
+		data->result = ENOMEM;
+		fx_stack_sched_unpark(task);
+		return;
+	}
+
+	_fx_stack_io_waiter *w = &io->waiters[idx];
+	w->task = task;
+	w->result = &data->result;
+	w->fd = data->fd;
+	w->events = data->events;
+	w->timer = NULL;
+
+	/* Take the reader and/or writer slot of the file descriptor and arm it
+	   for the events of both tasks waiting on it */
+	if (data->fd >= 0) {
+		const bool reader = _fx_stack_io_is_reader(data->events);
+		const bool writer = _fx_stack_io_is_writer(data->events);
+		_fx_stack_io_fd *f = _fx_stack_io_fd_get(io, data->fd);
+		int err;
+		if (!f) {
+			err = ENOMEM;
+		} else if ((reader && (f->reader != FX_STACK_IO_NONE)) ||
+		           (writer && (f->writer != FX_STACK_IO_NONE))) {
+			err = EBUSY;
+		} else {
+			f->reader = reader ? idx : f->reader;
+			f->writer = writer ? idx : f->writer;
+			err = _fx_stack_io_fd_arm(io, data->fd);
+			if (err) {
+				f->reader = reader ? FX_STACK_IO_NONE : f->reader;
+				f->writer = writer ? FX_STACK_IO_NONE : f->writer;
+			}
+		}
+		if (err) {
+			data->result = err;
+			_fx_stack_io_slot_free(io, idx);
+			pthread_mutex_unlock(&io->mutex);
+			fx_stack_sched_unpark(task);
+			return;
+		}
+	}
+
+	/* Interrupt the reactor thread if the earliest deadline changed */
+	if (data->deadline >= 0) {
+		const uint64_t next = fx_stack_timer_wheel_next(&io->timers);
+		data->idx = idx;
+		w->timer = &data->timer;
+		fx_stack_timer_add(&io->timers, &data->timer, (uint64_t)data->deadline,
+		                   _fx_stack_io_expire, data);
+		if (fx_stack_timer_wheel_next(&io->timers) < next) {
+			_fx_stack_io_wake(io);
+		}
+	}
+	pthread_mutex_unlock(&io->mutex);
+}
+
+/**
+ * Waits until the file descriptor is ready or the deadline has passed.
+ * Returns zero or an error code.
+ */
+static int _fx_stack_io_wait_until(fx_stack_io *io, int fd, uint32_t events,
+                                   int64_t deadline) {
+	/* Block the calling thread if this is not a task */
+	if (!fx_stack_sched_current()) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = (short)(((events & EPOLLIN) ? POLLIN : 0) |
+		                     ((events & EPOLLOUT) ? POLLOUT : 0));
+		pfd.revents = 0;
+		while (true) {
+			const int res = poll(&pfd, 1U, _fx_stack_io_remaining_ms(deadline));
+			if (res > 0) {
+				return 0;
+			} else if (res == 0) {
+				return ETIMEDOUT;
+			} else if (errno != EINTR) {
+				return errno;
+			}
+		}
+	}
+
+	_fx_stack_io_wait_data data;
+	_fx_stack_io_wait_data_init(&data, io, fd, events, deadline);
+	fx_stack_sched_park(_fx_stack_io_arm, &data);
+	return data.result;
+}
+
+/*****************************************************************************
+ * Reactor thread                                                            *
+ *****************************************************************************/
+
+static void *_fx_stack_io_main(void *data) {
+	fx_stack_io *io = (fx_stack_io *)data;
+	struct epoll_event events[FX_STACK_IO_MAX_EVENTS];
+
+	pthread_mutex_lock(&io->mutex);
+	while (!io->stop) {
+		/* Wait until the earliest deadline */
+		const uint64_t next = fx_stack_timer_wheel_next(&io->timers);
+		const int timeout =
+		    (next == UINT64_MAX) ? -1 : _fx_stack_io_remaining_ms((int64_t)next);
+		pthread_mutex_unlock(&io->mutex);
+		const int n_events = epoll_wait(io->epoll_fd, events,
+		                                FX_STACK_IO_MAX_EVENTS, timeout);
+		pthread_mutex_lock(&io->mutex);
+
+		/* Resume the tasks whose file descriptor is ready */
+		for (int i = 0; i < n_events; i++) {
+			const uint64_t key = events[i].data.u64;
+			if (key == FX_STACK_IO_EVENT_KEY) {
+				/* Reset the eventfd; fails with EAGAIN if already reset */
+				uint64_t value;
+				ssize_t res = read(io->event_fd, &value, sizeof(value));
+				(void)res;
+				continue;
+			}
+			const int fd = (int)(key & 0xFFFFFFFFU);
+			const uint32_t generation = (uint32_t)(key >> 32U);
+			if (((size_t)fd < io->n_fds) &&
+			    (io->fds[fd].generation == generation)) {
+				_fx_stack_io_fd_ready(io, fd, events[i].events);
+			}
+		}
+
+		/* Resume the tasks whose deadline has passed */
+		if (io->timers.n_timers > 0U) {
+			fx_stack_timer_wheel_advance(&io->timers,
+			                             (uint64_t)_fx_stack_io_now());
+		}
+	}
+	pthread_mutex_unlock(&io->mutex);
+	return NULL;
+}
+
+/*****************************************************************************
+ * Public API                                                                *
+ *****************************************************************************/
+
+bool fx_stack_io_init(fx_stack_io *io) {
+	memset(io, 0, sizeof(fx_stack_io));
+	io->free_head = FX_STACK_IO_NONE;
+	fx_stack_timer_wheel_init(&io->timers, FX_STACK_IO_TICK_NS,
+	                          (uint64_t)_fx_stack_io_now());
+	io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (io->epoll_fd < 0) {
+		return false;
+	}
+	io->event_fd = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (io->event_fd < 0) {
+		close(io->epoll_fd);
+		return false;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = FX_STACK_IO_EVENT_KEY;
+	if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->event_fd, &ev) < 0) {
+		goto err;
+	}
+
+	pthread_mutex_init(&io->mutex, NULL);
+	if (pthread_create(&io->thread, NULL, _fx_stack_io_main, io) != 0) {
+		pthread_mutex_destroy(&io->mutex);
+		goto err;
+	}
+	return true;
+
+err:
+	close(io->event_fd);
+	close(io->epoll_fd);
+	return false;
+}
+
+void fx_stack_io_destroy(fx_stack_io *io) {
+	pthread_mutex_lock(&io->mutex);
+	io->stop = 1;
+	_fx_stack_io_wake(io);
+	pthread_mutex_unlock(&io->mutex);
+	pthread_join(io->thread, NULL);
+
+	pthread_mutex_destroy(&io->mutex);
+	close(io->event_fd);
+	close(io->epoll_fd);
+	free(io->waiters);
+	io->waiters = NULL;
+	free(io->fds);
+	io->fds = NULL;
+}
+
+int fx_stack_io_wait(fx_stack_io *io, int fd, uint32_t events, int timeout_ms) {
+	const int res = _fx_stack_io_wait_until(io, fd, events,
+	                                        _fx_stack_io_deadline(timeout_ms));
+	return (int)_fx_stack_io_return(-(ssize_t)res);
+}
+
+void fx_stack_io_sleep(fx_stack_io *io, int timeout_ms) {
+	const int64_t deadline = _fx_stack_io_deadline(timeout_ms);
+	if (!fx_stack_sched_current()) {
+		int res;
+		do {
+			res = poll(NULL, 0U, _fx_stack_io_remaining_ms(deadline));
+		} while (res < 0);
+		return;
+	}
+	_fx_stack_io_wait_data data;
+	_fx_stack_io_wait_data_init(&data, io, -1, 0U, deadline);
+	fx_stack_sched_park(_fx_stack_io_arm, &data);
+}
+
+int fx_stack_io_set_nonblocking(int fd) {
+	const int flags = fcntl(fd, F_GETFL);
+	if (flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+ssize_t fx_stack_io_read(fx_stack_io *io, int fd, void *buf, size_t count,
+                         int timeout_ms) {
+	const int64_t deadline = _fx_stack_io_deadline(timeout_ms);
+	while (true) {
+		const ssize_t res = _fx_stack_io_sys_read(fd, buf, count);
+		if ((res != -EAGAIN) && (res != -EWOULDBLOCK) && (res != -EINTR)) {
+			return _fx_stack_io_return(res);
+		}
+		const int err = _fx_stack_io_wait_until(io, fd, EPOLLIN, deadline);
+		if (err) {
+			return _fx_stack_io_return(-(ssize_t)err);
+		}
+	}
+}
+
+ssize_t fx_stack_io_write(fx_stack_io *io, int fd, const void *buf,
+                          size_t count, int timeout_ms) {
+	const int64_t deadline = _fx_stack_io_deadline(timeout_ms);
+	while (true) {
+		const ssize_t res = _fx_stack_io_sys_write(fd, buf, count);
+		if ((res != -EAGAIN) && (res != -EWOULDBLOCK) && (res != -EINTR)) {
+			return _fx_stack_io_return(res);
+		}
+		const int err = _fx_stack_io_wait_until(io, fd, EPOLLOUT, deadline);
+		if (err) {
+			return _fx_stack_io_return(-(ssize_t)err);
+		}
+	}
+}
+
+int fx_stack_io_accept(fx_stack_io *io, int fd, struct sockaddr *addr,
+                       socklen_t *addrlen, int timeout_ms) {
+	const int64_t deadline = _fx_stack_io_deadline(timeout_ms);
+	while (true) {
+		const int res = _fx_stack_io_sys_accept(fd, addr, addrlen);
+		if ((res != -EAGAIN) && (res != -EWOULDBLOCK) && (res != -EINTR)) {
+			return (int)_fx_stack_io_return(res);
+		}
+		const int err = _fx_stack_io_wait_until(io, fd, EPOLLIN, deadline);
+		if (err) {
+			return (int)_fx_stack_io_return(-(ssize_t)err);
+		}
+	}
+}
+
+int fx_stack_io_connect(fx_stack_io *io, int fd, const struct sockaddr *addr,
+                        socklen_t addrlen, int timeout_ms) {
+	const int res = _fx_stack_io_sys_connect(fd, addr, addrlen);
+	if (res != -EINPROGRESS) {
+		return (int)_fx_stack_io_return(res);
+	}
+
+	/* Wait for the connection to be established and fetch the result */
+	const int err = _fx_stack_io_wait_until(io, fd, EPOLLOUT,
+	                                        _fx_stack_io_deadline(timeout_ms));
+	if (err) {
+		return (int)_fx_stack_io_return(-(ssize_t)err);
+	}
+	int so_error = 0;
+	socklen_t len = sizeof(so_error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0) {
+		return -1;
+	}
+	return (int)_fx_stack_io_return(-(ssize_t)so_error);
+}
@@ -0,0 +1,182 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack_io.h
+ *
+ * epoll-based I/O reactor for tasks executed by a fx_stack_sched. Instead of
+ * blocking the worker thread, the I/O functions in this file suspend the
+ * calling task until the file descriptor is ready, allowing the worker to
+ * execute other tasks in the meantime. This module is only available on Linux.
+ */
+
+#ifndef FX_FOXEN_STACK_IO_H
+#define FX_FOXEN_STACK_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <foxen/stack_sched.h>
+#include <foxen/stack_timer.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _fx_stack_io_waiter;
+struct _fx_stack_io_fd;
+
+/**
+ * An I/O reactor. A dedicated thread waits for file descriptors and timeouts
+ * using epoll_wait() and resumes the corresponding tasks.
+ *
+ * All members of this structure should be treated as private.
+ */
+typedef struct fx_stack_io {
+	/**
+	 * epoll instance and eventfd used to interrupt epoll_wait().
+	 */
+	int epoll_fd;
+	int event_fd;
+
+	/**
+	 * The reactor thread.
+	 */
+	pthread_t thread;
+
+	/**
+	 * Mutex protecting all of the following members.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Array of waiter slots and list of free slots.
+	 */
+	struct _fx_stack_io_waiter *waiters;
+	size_t n_waiters;
+	size_t free_head;
+
+	/**
+	 * Table indexed by file descriptor referencing the waiter slots of the
+	 * tasks waiting to read from and to write to the file descriptor.
+	 */
+	struct _fx_stack_io_fd *fds;
+	size_t n_fds;
+
+	/**
+	 * Timing wheel holding the timers of the waiters with a timeout.
+	 */
+	fx_stack_timer_wheel timers;
+
+	/**
+	 * Set to a non-zero value once the reactor thread should terminate.
+	 */
+	int stop;
+} fx_stack_io;
+
+/**
+ * Initialises a reactor and starts the reactor thread. A single reactor can
+ * serve tasks from any number of schedulers.
+ *
+ * @param io is the reactor that should be initialised.
+ * @return true if the reactor was initialised successfully, false otherwise.
+ */
+bool fx_stack_io_init(fx_stack_io *io);
+
+/**
+ * Stops the reactor thread and releases all resources. Must only be called
+ * once no task is waiting on the reactor.
+ *
+ * @param io is the reactor that should be destroyed.
+ */
+void fx_stack_io_destroy(fx_stack_io *io);
+
+/**
+ * Waits until the given file descriptor is ready. If called from within a
+ * fx_stack_sched task, the task is suspended until the file descriptor is
+ * ready; otherwise the calling thread blocks in poll().
+ *
+ * At any time, one task may wait for a file descriptor to become readable
+ * and another one for it to become writable; waiting for both EPOLLIN and
+ * EPOLLOUT counts as both. Further tasks fail with errno set to EBUSY.
+ *
+ * @param io is the reactor that should be used.
+ * @param fd is the file descriptor to wait for.
+ * @param events is a combination of EPOLLIN and EPOLLOUT.
+ * @param timeout_ms is the maximum number of milliseconds to wait or a
+ * negative value to wait indefinitely.
+ * @return zero if the file descriptor is ready, -1 otherwise. errno is set to
+ * ETIMEDOUT if the timeout expired.
+ */
+int fx_stack_io_wait(fx_stack_io *io, int fd, uint32_t events, int timeout_ms);
+
+/**
+ * Suspends the calling task for the given number of milliseconds. Blocks the
+ * calling thread if not called from within a task.
+ *
+ * @param io is the reactor that should be used.
+ * @param timeout_ms is the number of milliseconds to sleep.
+ */
+void fx_stack_io_sleep(fx_stack_io *io, int timeout_ms);
+
+/**
+ * Sets the O_NONBLOCK flag of the given file descriptor. The functions below
+ * expect non-blocking file descriptors.
+ *
+ * @param fd is the file descriptor that should be modified.
+ * @return zero on success, -1 otherwise.
+ */
+int fx_stack_io_set_nonblocking(int fd);
+
+/**
+ * Variants of read(), write(), accept() and connect() that suspend the
+ * calling task instead of blocking the worker thread. The file descriptor must
+ * be non-blocking. Return values and errno are the same as for the
+ * corresponding system call; errno is set to ETIMEDOUT if the timeout expired
+ * before the operation could be completed.
+ *
+ * @param io is the reactor that should be used.
+ * @param fd is a non-blocking file descriptor.
+ * @param timeout_ms is the maximum number of milliseconds to wait or a
+ * negative value to wait indefinitely.
+ */
+ssize_t fx_stack_io_read(fx_stack_io *io, int fd, void *buf, size_t count,
+                         int timeout_ms);
+
+ssize_t fx_stack_io_write(fx_stack_io *io, int fd, const void *buf,
+                          size_t count, int timeout_ms);
+
+/**
+ * The returned file descriptor is non-blocking.
+ */
+int fx_stack_io_accept(fx_stack_io *io, int fd, struct sockaddr *addr,
+                       socklen_t *addrlen, int timeout_ms);
+
+int fx_stack_io_connect(fx_stack_io *io, int fd, const struct sockaddr *addr,
+                        socklen_t addrlen, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_IO_H */
@@ -0,0 +1,903 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Required for MAP_ANONYMOUS, MAP_POPULATE, MAP_HUGETLB, MADV_FREE and
+   getcpu() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef FX_NO_CONFIG
+#include "config.h"
+#endif
+
+#include <foxen/stack_pool.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Memory policy of mbind(); from <numaif.h>, which is part of libnuma */
+#define FX_STACK_POOL_MPOL_PREFERRED 1
+
+/* Number of bits in the node mask passed to mbind() */
+#define FX_STACK_POOL_ULONG_BITS (sizeof(unsigned long) * 8U)
+#define FX_STACK_POOL_NODE_MASK_LEN                                  \
+	((FX_STACK_NUMA_MAX_NODES + FX_STACK_POOL_ULONG_BITS - 1U) / \
+	 FX_STACK_POOL_ULONG_BITS)
+
+/* Layout of the tagged free_batches and unmapped pointers; see stack_pool.h */
+#define FX_STACK_POOL_TAG_SHIFT (sizeof(uintptr_t) * 4U)
+#define FX_STACK_POOL_TAG_ONE (((uintptr_t)1U) << FX_STACK_POOL_TAG_SHIFT)
+#define FX_STACK_POOL_IDX_MASK (FX_STACK_POOL_TAG_ONE - 1U)
+
+/*****************************************************************************
+ * Helper functions                                                          *
+ *****************************************************************************/
+
+static size_t _fx_stack_pool_page_size(void) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	return (page_size > 0) ? (size_t)page_size : 4096U;
+}
+
+static size_t _fx_stack_pool_round_up(size_t size, size_t align) {
+	return ((size + align - 1U) / align) * align;
+}
+
+static void *_fx_stack_pool_map(size_t size, bool populate) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+#ifdef MAP_POPULATE
+	if (populate) {
+		flags |= MAP_POPULATE;
+	}
+#else
+	(void)populate;
+#endif
+
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+/**
+ * Faults in the given region by writing to each page.
+ */
+static void _fx_stack_pool_prefault(void *mem, size_t size, size_t page_size) {
+	for (size_t i = 0U; i < size; i += page_size) {
+		((volatile uint8_t *)mem)[i] = 0U;
+	}
+}
+
+/**
+ * Places the memory of a newly mapped stack on the node the pool belongs to.
+ * Failure is not fatal; the memory is then placed according to the default
+ * policy.
+ */
+static void _fx_stack_pool_bind(const fx_stack_pool *pool, void *mem,
+                                size_t size) {
+#ifdef SYS_mbind
+	if ((pool->node >= 0) &&
+	    ((size_t)pool->node < FX_STACK_NUMA_MAX_NODES)) {
+		const size_t node = (size_t)pool->node;
+		unsigned long mask[FX_STACK_POOL_NODE_MASK_LEN];
+		memset(mask, 0, sizeof(mask));
+		mask[node / FX_STACK_POOL_ULONG_BITS] |=
+		    1UL << (node % FX_STACK_POOL_ULONG_BITS);
+		syscall(SYS_mbind, mem, (unsigned long)size,
+		        FX_STACK_POOL_MPOL_PREFERRED, mask,
+		        (unsigned long)FX_STACK_NUMA_MAX_NODES + 1UL, 0U);
+	}
+#else
+	(void)pool;
+	(void)mem;
+	(void)size;
+#endif
+}
+
+/**
+ * Maps a region of the given size whose start is aligned to "align" bytes by
+ * over-allocating and unmapping the excess.
+ */
+static void *_fx_stack_pool_map_aligned(size_t size, size_t align) {
+	if (align <= _fx_stack_pool_page_size()) {
+		return _fx_stack_pool_map(size, false);
+	}
+	if (size > SIZE_MAX - align) {
+		return NULL;
+	}
+
+	uint8_t *mem = (uint8_t *)_fx_stack_pool_map(size + align, false);
+	if (!mem) {
+		return NULL;
+	}
+	uint8_t *start =
+	    (uint8_t *)_fx_stack_pool_round_up((uintptr_t)mem, align);
+	if (start > mem) {
+		munmap(mem, (size_t)(start - mem));
+	}
+	munmap(start + size, (size_t)(mem + align - start));
+	return start;
+}
+
+/**
+ * Reads the first line of the given file into buf. Returns false if the file
+ * cannot be read.
+ */
+static bool _fx_stack_pool_read_line(const char *path, char *buf,
+                                     size_t size) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+	const bool res = fgets(buf, (int)size, f) != NULL;
+	fclose(f);
+	return res;
+}
+
+/**
+ * Returns the size of transparent huge pages, or zero if they are disabled or
+ * their size cannot be determined.
+ */
+static size_t _fx_stack_pool_thp_size(void) {
+	/* The active mode is enclosed in brackets, e.g. "always [madvise] never" */
+	char buf[128];
+	if (!_fx_stack_pool_read_line(
+	        "/sys/kernel/mm/transparent_hugepage/enabled", buf, sizeof(buf)) ||
+	    strstr(buf, "[never]") || !strchr(buf, '[')) {
+		return 0U;
+	}
+	if (!_fx_stack_pool_read_line(
+	        "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", buf,
+	        sizeof(buf))) {
+		return 0U;
+	}
+	return (size_t)strtoull(buf, NULL, 10);
+}
+
+/**
+ * Returns the default size of the pages in the hugetlbfs pool, or zero if it
+ * cannot be determined.
+ */
+static size_t _fx_stack_pool_hugetlb_size(void) {
+	FILE *f = fopen("/proc/meminfo", "r");
+	if (!f) {
+		return 0U;
+	}
+	char buf[128];
+	unsigned long long size_kib = 0U;
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "Hugepagesize: %llu kB", &size_kib) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return (size_t)size_kib * 1024U;
+}
+
+/**
+ * Maps the arena of a pool backed by huge pages. Returns NULL if neither
+ * transparent huge pages nor the hugetlbfs pool are available. Otherwise
+ * writes the size of the huge pages backing the mapping to huge_page_size,
+ * or zero if it cannot be determined.
+ */
+static void *_fx_stack_pool_map_huge(size_t size, size_t align,
+                                     size_t *huge_page_size) {
+#ifdef MADV_HUGEPAGE
+	/* Request transparent huge pages. This also lifts the implicit
+	   MADV_NOHUGEPAGE recent kernels apply to MAP_STACK mappings. The kernel
+	   only uses huge pages if they are enabled and the mapping is made of
+	   naturally aligned huge pages. */
+	const size_t thp_size = _fx_stack_pool_thp_size();
+	if (thp_size && (align % thp_size == 0U) && (size % thp_size == 0U)) {
+		void *thp = _fx_stack_pool_map_aligned(size, align);
+		if (thp) {
+			if (madvise(thp, size, MADV_HUGEPAGE) == 0) {
+				*huge_page_size = thp_size;
+				return thp;
+			}
+			munmap(thp, size);
+		}
+	}
+#endif
+#ifdef MAP_HUGETLB
+	/* Fall back to the hugetlbfs pool. These mappings are implicitly aligned
+	   to the huge page size, which may not be sufficient. */
+	void *tlb = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (tlb != MAP_FAILED) {
+		if ((uintptr_t)tlb % align == 0U) {
+			*huge_page_size = _fx_stack_pool_hugetlb_size();
+			return tlb;
+		}
+		munmap(tlb, size);
+	}
+#endif
+	(void)size;
+	(void)align;
+	(void)huge_page_size;
+	return NULL;
+}
+
+/**
+ * Maps the arena of a pool initialised by fx_stack_pool_init_arena().
+ */
+static bool _fx_stack_pool_map_arena(fx_stack_pool *pool, size_t align) {
+	/* Try to map huge pages first, if requested */
+	uint8_t *mem = NULL;
+	if (pool->flags & FX_STACK_POOL_HUGE_PAGES) {
+		mem = (uint8_t *)_fx_stack_pool_map_huge(pool->arena_size, align,
+		                                         &pool->huge_page_size);
+	}
+	if (!mem) {
+		mem = (uint8_t *)_fx_stack_pool_map_aligned(pool->arena_size, align);
+	}
+	if (!mem) {
+		return false;
+	}
+
+	/* Pre-fault the arena by writing to each page. Step by the base page
+	   size, since the kernel may back the arena with regular pages even if
+	   huge pages were requested. */
+	if (pool->flags & FX_STACK_POOL_POPULATE) {
+		_fx_stack_pool_prefault(mem, pool->arena_size,
+		                        _fx_stack_pool_page_size());
+	}
+
+	pool->arena = mem;
+	return true;
+}
+
+/**
+ * Pushes a descriptor whose stack could not be mapped onto the Treiber stack
+ * of unmapped descriptors, so it is retried by a later allocation.
+ */
+static void _fx_stack_pool_push_unmapped(fx_stack_pool *pool,
+                                         fx_stack *stack) {
+	const uintptr_t idx = (uintptr_t)(stack - pool->stacks) + 1U;
+	uintptr_t head = __atomic_load_n(&pool->unmapped, __ATOMIC_RELAXED);
+	uintptr_t new_head;
+	do {
+		__atomic_store_n(&stack->next_batch, head & FX_STACK_POOL_IDX_MASK,
+		                 __ATOMIC_RELAXED);
+		new_head = idx | ((head & ~FX_STACK_POOL_IDX_MASK) +
+		                  FX_STACK_POOL_TAG_ONE);
+	} while (!__atomic_compare_exchange_n(&pool->unmapped, &head, new_head,
+	                                      true, __ATOMIC_RELEASE,
+	                                      __ATOMIC_RELAXED));
+}
+
+/**
+ * Pops a descriptor from the Treiber stack of unmapped descriptors. Returns
+ * NULL if there are no such descriptors.
+ */
+static fx_stack *_fx_stack_pool_pop_unmapped(fx_stack_pool *pool) {
+	uintptr_t head = __atomic_load_n(&pool->unmapped, __ATOMIC_ACQUIRE);
+	uintptr_t new_head;
+	fx_stack *stack;
+	do {
+		const uintptr_t idx = head & FX_STACK_POOL_IDX_MASK;
+		if (idx == 0U) {
+			return NULL;
+		}
+		stack = &pool->stacks[idx - 1U];
+		new_head = __atomic_load_n(&stack->next_batch, __ATOMIC_RELAXED) |
+		           ((head & ~FX_STACK_POOL_IDX_MASK) + FX_STACK_POOL_TAG_ONE);
+	} while (!__atomic_compare_exchange_n(&pool->unmapped, &head, new_head,
+	                                      true, __ATOMIC_ACQUIRE,
+	                                      __ATOMIC_ACQUIRE));
+	return stack;
+}
+
+/**
+ * Maps the memory for the stack belonging to a descriptor whose mapping
+ * failed before, or to the next unused descriptor. Returns NULL if the pool is
+ * exhausted or the memory could not be mapped.
+ */
+static fx_stack *_fx_stack_pool_map_stack(fx_stack_pool *pool) {
+	/* Retry a descriptor whose mapping failed, or claim the next unused
+	   descriptor */
+	fx_stack *stack = _fx_stack_pool_pop_unmapped(pool);
+	size_t idx;
+	if (stack) {
+		idx = (size_t)(stack - pool->stacks);
+	} else {
+		idx = __atomic_load_n(&pool->n_stacks, __ATOMIC_RELAXED);
+		do {
+			if (idx >= pool->capacity) {
+				return NULL;
+			}
+		} while (!__atomic_compare_exchange_n(&pool->n_stacks, &idx,
+		                                      idx + 1U, true, __ATOMIC_RELAXED,
+		                                      __ATOMIC_RELAXED));
+		stack = &pool->stacks[idx];
+	}
+	stack->stack_start = NULL;
+	stack->stack_end = NULL;
+	stack->next = NULL;
+	__atomic_store_n(&stack->next_batch, 0U, __ATOMIC_RELAXED);
+	stack->batch_size = 1U;
+
+	/* Map the guard page and the stack in one go, or take the slot from the
+	   arena. If this fails, the descriptor is put aside for a later attempt,
+	   so transient failures do not reduce the capacity of the pool. */
+	const size_t size = pool->guard_size + pool->stack_size;
+	uint8_t *mem;
+	if (pool->arena) {
+		mem = (uint8_t *)pool->arena + idx * pool->slot_size;
+	} else {
+		/* Stacks bound to a node are pre-faulted after they have been bound,
+		   MAP_POPULATE would fault them in on the current node */
+		const bool populate = pool->flags & FX_STACK_POOL_POPULATE;
+		mem = (uint8_t *)_fx_stack_pool_map(size, populate && (pool->node < 0));
+		if (!mem) {
+			_fx_stack_pool_push_unmapped(pool, stack);
+			return NULL;
+		}
+		if (pool->node >= 0) {
+			_fx_stack_pool_bind(pool, mem, size);
+			if (populate) {
+				_fx_stack_pool_prefault(mem + pool->guard_size, pool->stack_size,
+				                        _fx_stack_pool_page_size());
+			}
+		}
+	}
+
+	/* Revoke all access rights from the guard page below the stack */
+	if (pool->guard_size &&
+	    (mprotect(mem, pool->guard_size, PROT_NONE) != 0)) {
+		if (!pool->arena) {
+			munmap(mem, size);
+		}
+		_fx_stack_pool_push_unmapped(pool, stack);
+		return NULL;
+	}
+
+	stack->stack_start = mem + pool->guard_size;
+	stack->stack_end = mem + size;
+	if (pool->arena && (pool->flags & FX_STACK_POOL_COLOUR)) {
+		const size_t n_colours =
+		    _fx_stack_pool_page_size() / FX_STACK_POOL_COLOUR_STRIDE;
+		stack->stack_end = mem + size - (idx % n_colours) *
+		                                    FX_STACK_POOL_COLOUR_STRIDE;
+	}
+
+#ifdef FX_WITH_STACK_WATERMARK
+	fx_stack_paint(stack->stack_start, stack->stack_end);
+#endif
+	return stack;
+}
+
+/**
+ * Called whenever a stack is returned to the pool or a cache. Records the
+ * high-water mark of the stack and trims the stack if configured to do so.
+ */
+static void _fx_stack_pool_release(fx_stack_pool *pool, fx_stack *stack) {
+#ifdef FX_WITH_STACK_WATERMARK
+	/* Record the high-water mark and re-paint the used part of the stack */
+	const size_t used =
+	    fx_stack_high_water_mark(stack->stack_start, stack->stack_end);
+	fx_stack_watermark_record(&pool->watermark, used);
+	fx_stack_paint((uint8_t *)stack->stack_end - used, stack->stack_end);
+#endif
+
+	if (pool->reclaim_flags & FX_STACK_RECLAIM_ON_FREE) {
+		fx_stack_reclaim(stack->stack_start, stack->stack_end,
+		                 pool->reclaim_keep, pool->reclaim_flags);
+	}
+}
+
+/**
+ * Pushes a batch of "size" stacks linked via their "next" member onto the
+ * Treiber stack of released batches.
+ */
+static void _fx_stack_pool_push_batch(fx_stack_pool *pool, fx_stack *first,
+                                      size_t size) {
+	const uintptr_t idx = (uintptr_t)(first - pool->stacks) + 1U;
+	first->batch_size = size;
+
+	/* Increment the counter first, so it never underflows */
+	__atomic_fetch_add(&pool->n_free, size, __ATOMIC_RELAXED);
+
+	uintptr_t head = __atomic_load_n(&pool->free_batches, __ATOMIC_RELAXED);
+	uintptr_t new_head;
+	do {
+		__atomic_store_n(&first->next_batch, head & FX_STACK_POOL_IDX_MASK,
+		                 __ATOMIC_RELAXED);
+		new_head = idx | ((head & ~FX_STACK_POOL_IDX_MASK) +
+		                  FX_STACK_POOL_TAG_ONE);
+	} while (!__atomic_compare_exchange_n(&pool->free_batches, &head, new_head,
+	                                      true, __ATOMIC_RELEASE,
+	                                      __ATOMIC_RELAXED));
+}
+
+/**
+ * Links the given array of stacks into a batch and pushes it onto the Treiber
+ * stack of released batches.
+ */
+static void _fx_stack_pool_push_array(fx_stack_pool *pool, fx_stack **stacks,
+                                      size_t n) {
+	for (size_t i = 0U; i + 1U < n; i++) {
+		stacks[i]->next = stacks[i + 1U];
+	}
+	stacks[n - 1U]->next = NULL;
+	_fx_stack_pool_push_batch(pool, stacks[0U], n);
+}
+
+/**
+ * Pops the most recently released batch of stacks. Returns NULL if there are
+ * no released stacks.
+ */
+static fx_stack *_fx_stack_pool_pop_batch(fx_stack_pool *pool) {
+	uintptr_t head = __atomic_load_n(&pool->free_batches, __ATOMIC_ACQUIRE);
+	uintptr_t new_head;
+	fx_stack *first;
+	do {
+		const uintptr_t idx = head & FX_STACK_POOL_IDX_MASK;
+		if (idx == 0U) {
+			return NULL;
+		}
+
+		/* The descriptor may be concurrently popped and pushed again by
+		   another thread; in this case the tag has changed and the CAS
+		   fails. */
+		first = &pool->stacks[idx - 1U];
+		new_head = __atomic_load_n(&first->next_batch, __ATOMIC_RELAXED) |
+		           ((head & ~FX_STACK_POOL_IDX_MASK) + FX_STACK_POOL_TAG_ONE);
+	} while (!__atomic_compare_exchange_n(&pool->free_batches, &head, new_head,
+	                                      true, __ATOMIC_ACQUIRE,
+	                                      __ATOMIC_ACQUIRE));
+
+	__atomic_fetch_sub(&pool->n_free, first->batch_size, __ATOMIC_RELAXED);
+	return first;
+}
+
+/*****************************************************************************
+ * Public API                                                                *
+ *****************************************************************************/
+
+bool fx_stack_pool_init(fx_stack_pool *pool, size_t stack_size,
+                        size_t capacity, unsigned int flags) {
+	const size_t page_size = _fx_stack_pool_page_size();
+
+	pool->stack_size = _fx_stack_pool_round_up(stack_size, page_size);
+	pool->guard_size = (flags & FX_STACK_POOL_NO_GUARD) ? 0U : page_size;
+	pool->arena = NULL;
+	pool->arena_size = 0U;
+	pool->slot_size = 0U;
+	pool->huge_page_size = 0U;
+	pool->capacity = capacity;
+	pool->n_stacks = 0U;
+	pool->flags = flags;
+	pool->free_batches = 0U;
+	pool->n_free = 0U;
+	pool->unmapped = 0U;
+	pool->stacks = NULL;
+	memset(&pool->watermark, 0, sizeof(pool->watermark));
+	pool->reclaim_keep = 0U;
+	pool->reclaim_flags = 0U;
+	pool->node = -1;
+
+	/* Descriptor indices must fit into the lower half of free_batches */
+	if (capacity >= FX_STACK_POOL_IDX_MASK) {
+		return false;
+	}
+
+	/* Map the descriptor table. Pages are only backed by physical memory once
+	   they are touched, so a large capacity is cheap. */
+	if (capacity > 0U) {
+		pool->stacks = (fx_stack *)_fx_stack_pool_map(
+		    _fx_stack_pool_round_up(capacity * sizeof(fx_stack), page_size),
+		    false);
+		if (!pool->stacks) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool fx_stack_pool_init_arena(fx_stack_pool *pool, size_t stack_size,
+                              size_t slot_align, size_t capacity,
+                              unsigned int flags) {
+	if (!fx_stack_pool_init(pool, stack_size, capacity, flags)) {
+		return false;
+	}
+
+	/* The slot alignment must be a power of two, at least the page size */
+	const size_t page_size = _fx_stack_pool_page_size();
+	if (slot_align & (slot_align - 1U)) {
+		fx_stack_pool_destroy(pool);
+		return false;
+	}
+	slot_align = (slot_align < page_size) ? page_size : slot_align;
+
+	/* Guard pages would split the huge pages */
+	if (flags & FX_STACK_POOL_HUGE_PAGES) {
+		pool->guard_size = 0U;
+	}
+
+	/* Stacks are enlarged to fill their entire slot. Reserve an extra page
+	   for the colour offset, so each stack has at least the requested size */
+	const size_t colour_size =
+	    (flags & FX_STACK_POOL_COLOUR) ? page_size : 0U;
+	pool->slot_size = _fx_stack_pool_round_up(
+	    pool->guard_size + pool->stack_size + colour_size, slot_align);
+	pool->stack_size = pool->slot_size - pool->guard_size;
+	if (capacity == 0U) {
+		return true;
+	}
+	if (capacity >
+	    (SIZE_MAX - FX_STACK_POOL_HUGE_PAGE_SIZE) / pool->slot_size) {
+		fx_stack_pool_destroy(pool);
+		return false;
+	}
+
+	/* Huge page mappings must be aligned to and be a multiple of the huge
+	   page size */
+	pool->arena_size = capacity * pool->slot_size;
+	if (flags & FX_STACK_POOL_HUGE_PAGES) {
+		pool->arena_size = _fx_stack_pool_round_up(
+		    pool->arena_size, FX_STACK_POOL_HUGE_PAGE_SIZE);
+		if (slot_align < FX_STACK_POOL_HUGE_PAGE_SIZE) {
+			slot_align = FX_STACK_POOL_HUGE_PAGE_SIZE;
+		}
+	}
+	if (!_fx_stack_pool_map_arena(pool, slot_align)) {
+		fx_stack_pool_destroy(pool);
+		return false;
+	}
+	return true;
+}
+
+void fx_stack_pool_destroy(fx_stack_pool *pool) {
+	const size_t page_size = _fx_stack_pool_page_size();
+
+	/* Unmap the arena or all individually mapped stacks, including the guard
+	   pages */
+	if (pool->arena) {
+		munmap(pool->arena, pool->arena_size);
+	}
+	for (size_t i = 0U; (i < pool->n_stacks) && !pool->arena; i++) {
+		uint8_t *mem = (uint8_t *)pool->stacks[i].stack_start;
+		if (mem) {
+			munmap(mem - pool->guard_size,
+			       pool->guard_size + pool->stack_size);
+		}
+	}
+
+	/* Unmap the descriptor table */
+	if (pool->stacks) {
+		munmap(pool->stacks, _fx_stack_pool_round_up(
+		                         pool->capacity * sizeof(fx_stack), page_size));
+	}
+
+	pool->stacks = NULL;
+	pool->arena = NULL;
+	pool->arena_size = 0U;
+	pool->capacity = 0U;
+	pool->n_stacks = 0U;
+	pool->free_batches = 0U;
+	pool->n_free = 0U;
+	pool->unmapped = 0U;
+}
+
+size_t fx_stack_pool_reserve(fx_stack_pool *pool, size_t n) {
+	size_t n_free;
+	while ((n_free = __atomic_load_n(&pool->n_free, __ATOMIC_RELAXED)) < n) {
+		fx_stack *stack = _fx_stack_pool_map_stack(pool);
+		if (!stack) {
+			break;
+		}
+		_fx_stack_pool_push_batch(pool, stack, 1U);
+	}
+	return n_free;
+}
+
+fx_stack *fx_stack_pool_alloc(fx_stack_pool *pool) {
+	/* Reuse a released stack, return the remainder of the batch */
+	fx_stack *stack = _fx_stack_pool_pop_batch(pool);
+	if (stack) {
+		if (stack->batch_size > 1U) {
+			_fx_stack_pool_push_batch(pool, stack->next,
+			                          stack->batch_size - 1U);
+		}
+		stack->next = NULL;
+		return stack;
+	}
+
+	/* Otherwise map a new stack */
+	return _fx_stack_pool_map_stack(pool);
+}
+
+void fx_stack_pool_free(fx_stack_pool *pool, fx_stack *stack) {
+	/* Make sure the stack belongs to this pool */
+	assert((stack >= pool->stacks) && (stack < pool->stacks + pool->capacity));
+
+	_fx_stack_pool_release(pool, stack);
+	stack->next = NULL;
+	_fx_stack_pool_push_batch(pool, stack, 1U);
+}
+
+size_t fx_stack_reclaim(void *stack_start, void *stack_end, size_t keep,
+                        unsigned int flags) {
+	/* Only release pages that lie entirely within the stack region */
+	const uintptr_t page_size = _fx_stack_pool_page_size();
+	const uintptr_t start =
+	    _fx_stack_pool_round_up((uintptr_t)stack_start, page_size);
+	if ((start >= (uintptr_t)stack_end) ||
+	    (keep >= (uintptr_t)stack_end - start)) {
+		return 0U;
+	}
+	const uintptr_t end = ((uintptr_t)stack_end - keep) & ~(page_size - 1U);
+	if (end <= start) {
+		return 0U;
+	}
+
+	/* Prefer MADV_FREE if requested, fall back to MADV_DONTNEED if it is not
+	   supported by the kernel */
+	bool ok = false;
+#ifdef MADV_FREE
+	if (flags & FX_STACK_RECLAIM_LAZY) {
+		ok = madvise((void *)start, end - start, MADV_FREE) == 0;
+	}
+#else
+	(void)flags;
+#endif
+	if (!ok && (madvise((void *)start, end - start, MADV_DONTNEED) != 0)) {
+		return 0U;
+	}
+
+#ifdef FX_WITH_STACK_WATERMARK
+	fx_stack_paint((void *)start, (void *)end);
+#endif
+	return end - start;
+}
+
+void fx_stack_pool_set_reclaim(fx_stack_pool *pool, size_t keep,
+                               unsigned int flags) {
+	pool->reclaim_keep = keep;
+	pool->reclaim_flags = flags;
+}
+
+size_t fx_stack_pool_trim(fx_stack_pool *pool, size_t keep,
+                          unsigned int flags) {
+	/* Take the released batches from the pool and link them via their
+	   next_batch member. Stop after visiting each stack at most once, even if
+	   other threads keep releasing stacks. */
+	const size_t n_max = __atomic_load_n(&pool->n_stacks, __ATOMIC_RELAXED);
+	size_t n = 0U, n_bytes = 0U;
+	uintptr_t batches = 0U;
+	fx_stack *batch;
+	while ((n < n_max) && (batch = _fx_stack_pool_pop_batch(pool))) {
+		for (fx_stack *stack = batch; stack; stack = stack->next, n++) {
+			n_bytes += fx_stack_reclaim(stack->stack_start, stack->stack_end,
+			                            keep, flags);
+		}
+		__atomic_store_n(&batch->next_batch, batches, __ATOMIC_RELAXED);
+		batches = (uintptr_t)(batch - pool->stacks) + 1U;
+	}
+
+	/* Return the batches to the pool */
+	while (batches) {
+		batch = &pool->stacks[batches - 1U];
+		batches = batch->next_batch;
+		_fx_stack_pool_push_batch(pool, batch, batch->batch_size);
+	}
+	return n_bytes;
+}
+
+void fx_stack_pool_cache_init(fx_stack_pool_cache *cache, fx_stack_pool *pool) {
+	cache->pool = pool;
+	cache->n_stacks = 0U;
+}
+
+void fx_stack_pool_cache_destroy(fx_stack_pool_cache *cache) {
+	/* Return the cached stacks in batches */
+	while (cache->n_stacks > 0U) {
+		const size_t n = (cache->n_stacks > FX_STACK_POOL_CACHE_BATCH)
+		                     ? FX_STACK_POOL_CACHE_BATCH
+		                     : cache->n_stacks;
+		cache->n_stacks -= n;
+		_fx_stack_pool_push_array(cache->pool, cache->stacks + cache->n_stacks,
+		                          n);
+	}
+}
+
+fx_stack *fx_stack_pool_cache_alloc(fx_stack_pool_cache *cache) {
+	if (cache->n_stacks == 0U) {
+		/* Refill the cache with a batch of stacks from the shared pool. If
+		   there are none, directly map a new stack. */
+		fx_stack *stack = _fx_stack_pool_pop_batch(cache->pool);
+		if (!stack) {
+			return _fx_stack_pool_map_stack(cache->pool);
+		}
+		assert(stack->batch_size <= 2U * FX_STACK_POOL_CACHE_BATCH);
+		while (stack) {
+			cache->stacks[cache->n_stacks++] = stack;
+			stack = stack->next;
+		}
+	}
+	return cache->stacks[--cache->n_stacks];
+}
+
+void fx_stack_pool_cache_free(fx_stack_pool_cache *cache, fx_stack *stack) {
+	/* Make sure the stack belongs to the pool of this cache */
+	assert((stack >= cache->pool->stacks) &&
+	       (stack < cache->pool->stacks + cache->pool->capacity));
+
+	_fx_stack_pool_release(cache->pool, stack);
+	if (cache->n_stacks == 2U * FX_STACK_POOL_CACHE_BATCH) {
+		/* The cache is full. Return the least recently released batch to the
+		   shared pool and keep the more recently used stacks. */
+		_fx_stack_pool_push_array(cache->pool, cache->stacks,
+		                          FX_STACK_POOL_CACHE_BATCH);
+		memmove(cache->stacks, cache->stacks + FX_STACK_POOL_CACHE_BATCH,
+		        FX_STACK_POOL_CACHE_BATCH * sizeof(fx_stack *));
+		cache->n_stacks = FX_STACK_POOL_CACHE_BATCH;
+	}
+	cache->stacks[cache->n_stacks++] = stack;
+}
+
+size_t fx_stack_pool_cache_trim(fx_stack_pool_cache *cache, size_t keep,
+                                unsigned int flags) {
+	size_t n_bytes = 0U;
+	for (size_t i = 0U; i < cache->n_stacks; i++) {
+		n_bytes += fx_stack_reclaim(cache->stacks[i]->stack_start,
+		                            cache->stacks[i]->stack_end, keep, flags);
+	}
+	return n_bytes;
+}
+
+/*****************************************************************************
+ * NUMA placement                                                            *
+ *****************************************************************************/
+
+size_t fx_stack_numa_node_count(void) {
+	/* The list of online nodes does not change at runtime; cache the result.
+	   Racing threads compute the same value. */
+	static size_t n_nodes = 0U;
+	size_t res = __atomic_load_n(&n_nodes, __ATOMIC_RELAXED);
+	if (res > 0U) {
+		return res;
+	}
+
+	/* Parse the list of online nodes, e.g. "0-1,3", and find the largest
+	   node index */
+	res = 1U;
+	FILE *f = fopen("/sys/devices/system/node/online", "r");
+	if (f) {
+		char buf[256];
+		if (fgets(buf, sizeof(buf), f)) {
+			size_t value = 0U;
+			for (const char *c = buf;; c++) {
+				if ((*c >= '0') && (*c <= '9')) {
+					value = value * 10U + (size_t)(*c - '0');
+					continue;
+				}
+				res = (value + 1U > res) ? (value + 1U) : res;
+				value = 0U;
+				if (*c == '\0') {
+					break;
+				}
+			}
+		}
+		fclose(f);
+	}
+	res = (res > FX_STACK_NUMA_MAX_NODES) ? FX_STACK_NUMA_MAX_NODES : res;
+	__atomic_store_n(&n_nodes, res, __ATOMIC_RELAXED);
+	return res;
+}
+
+size_t fx_stack_numa_current_node(void) {
+	unsigned int cpu = 0U, node = 0U;
+#if defined(__GLIBC__) && \
+    ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 29)))
+	/* Uses the vDSO where available */
+	if (getcpu(&cpu, &node) != 0) {
+		return 0U;
+	}
+#elif defined(SYS_getcpu)
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+		return 0U;
+	}
+#endif
+	return (node < fx_stack_numa_node_count()) ? node : 0U;
+}
+
+bool fx_stack_numa_pool_init(fx_stack_numa_pool *pool, size_t stack_size,
+                             size_t capacity, unsigned int flags) {
+	pool->n_nodes = fx_stack_numa_node_count();
+	pool->pools =
+	    (fx_stack_pool *)calloc(pool->n_nodes, sizeof(fx_stack_pool));
+	if (!pool->pools) {
+		return false;
+	}
+
+	/* Only bind the memory if there is more than one node */
+	for (size_t i = 0U; i < pool->n_nodes; i++) {
+		if (!fx_stack_pool_init(&pool->pools[i], stack_size, capacity,
+		                        flags)) {
+			pool->n_nodes = i + 1U;
+			fx_stack_numa_pool_destroy(pool);
+			return false;
+		}
+		pool->pools[i].node = (pool->n_nodes > 1U) ? (int)i : -1;
+	}
+	return true;
+}
+
+void fx_stack_numa_pool_destroy(fx_stack_numa_pool *pool) {
+	for (size_t i = 0U; i < pool->n_nodes; i++) {
+		fx_stack_pool_destroy(&pool->pools[i]);
+	}
+	free(pool->pools);
+	pool->pools = NULL;
+	pool->n_nodes = 0U;
+}
+
+fx_stack_pool *fx_stack_numa_pool_local(fx_stack_numa_pool *pool) {
+	return &pool->pools[fx_stack_numa_current_node() % pool->n_nodes];
+}
+
+fx_stack *fx_stack_numa_pool_alloc_on(fx_stack_numa_pool *pool, size_t node) {
+	/* Fall back to the other nodes in a round-robin fashion */
+	for (size_t i = 0U; i < pool->n_nodes; i++) {
+		fx_stack *stack =
+		    fx_stack_pool_alloc(&pool->pools[(node + i) % pool->n_nodes]);
+		if (stack) {
+			return stack;
+		}
+	}
+	return NULL;
+}
+
+fx_stack *fx_stack_numa_pool_alloc(fx_stack_numa_pool *pool) {
+	return fx_stack_numa_pool_alloc_on(pool, fx_stack_numa_current_node());
+}
+
+void fx_stack_numa_pool_free(fx_stack_numa_pool *pool, fx_stack *stack) {
+	fx_stack_pool_free(&pool->pools[fx_stack_numa_pool_node(pool, stack)],
+	                   stack);
+}
+
+size_t fx_stack_numa_pool_node(const fx_stack_numa_pool *pool,
+                               const fx_stack *stack) {
+	/* Find the pool whose descriptor table contains the stack */
+	for (size_t i = 0U; i < pool->n_nodes; i++) {
+		const fx_stack_pool *p = &pool->pools[i];
+		if ((stack >= p->stacks) && (stack < p->stacks + p->capacity)) {
+			return i;
+		}
+	}
+	assert(false);
+	return 0U;
+}
@@ -0,0 +1,560 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FX_FOXEN_STACK_POOL_H
+#define FX_FOXEN_STACK_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <foxen/stack.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * If this flag is passed to fx_stack_pool_init(), the memory of newly mapped
+ * stacks is pre-faulted (using MAP_POPULATE where available). This avoids
+ * page-fault latency when switching to a stack for the first time.
+ */
+#define FX_STACK_POOL_POPULATE (1U << 0U)
+
+/**
+ * If this flag is passed to fx_stack_pool_init_arena(), the arena is backed by
+ * huge pages. Transparent huge pages are requested using MADV_HUGEPAGE; if
+ * they are disabled or their size does not divide
+ * FX_STACK_POOL_HUGE_PAGE_SIZE, the arena is mapped from the hugetlbfs pool
+ * using MAP_HUGETLB. If neither is available, regular pages are used. Implies
+ * FX_STACK_POOL_NO_GUARD, since guard pages would split the huge pages.
+ */
+#define FX_STACK_POOL_HUGE_PAGES (1U << 1U)
+
+/**
+ * If this flag is passed to fx_stack_pool_init() or fx_stack_pool_init_arena(),
+ * stacks are not separated by guard pages. Stack overflows silently corrupt
+ * the neighbouring stack.
+ */
+#define FX_STACK_POOL_NO_GUARD (1U << 2U)
+
+/**
+ * If this flag is passed to fx_stack_pool_init_arena(), the stack_end of
+ * consecutive slots is lowered by increasing multiples of
+ * FX_STACK_POOL_COLOUR_STRIDE bytes, up to a page. Otherwise the tops of all
+ * stacks, where most of the accesses happen, map to the same cache sets, which
+ * results in conflict misses when switching between many stacks.
+ */
+#define FX_STACK_POOL_COLOUR (1U << 3U)
+
+/**
+ * Offset between the stack_end of neighbouring slots in an arena created with
+ * FX_STACK_POOL_COLOUR. Should be the cache line size.
+ */
+#ifndef FX_STACK_POOL_COLOUR_STRIDE
+#define FX_STACK_POOL_COLOUR_STRIDE 64U
+#endif
+
+/**
+ * Huge page size assumed by fx_stack_pool_init_arena(). The arena is aligned
+ * to and its size rounded up to a multiple of this value if huge pages are
+ * requested.
+ */
+#ifndef FX_STACK_POOL_HUGE_PAGE_SIZE
+#define FX_STACK_POOL_HUGE_PAGE_SIZE (2U * 1024U * 1024U)
+#endif
+
+/**
+ * If this flag is passed to fx_stack_reclaim() or the trim functions, pages
+ * are released using MADV_FREE (where available). The kernel only reclaims the
+ * pages under memory pressure, which is cheaper than MADV_DONTNEED if the
+ * pages are likely to be used again.
+ */
+#define FX_STACK_RECLAIM_LAZY (1U << 0U)
+
+/**
+ * If this flag is passed to fx_stack_pool_set_reclaim(), stacks are trimmed
+ * whenever they are returned to the pool or to a cache.
+ */
+#define FX_STACK_RECLAIM_ON_FREE (1U << 1U)
+
+/**
+ * Number of stacks exchanged between a fx_stack_pool_cache and the shared pool
+ * in a single batch. A cache holds at most twice this number of stacks.
+ */
+#ifndef FX_STACK_POOL_CACHE_BATCH
+#define FX_STACK_POOL_CACHE_BATCH 16U
+#endif
+
+/**
+ * Maximum number of NUMA nodes distinguished by fx_stack_numa_pool. Memory on
+ * nodes with a larger index is not placed explicitly.
+ */
+#ifndef FX_STACK_NUMA_MAX_NODES
+#define FX_STACK_NUMA_MAX_NODES 64U
+#endif
+
+/**
+ * Descriptor of a stack handed out by fx_stack_pool_alloc(). The stack_start
+ * and stack_end members can be directly passed to fx_stack_switch() or
+ * fx_stack_context_init().
+ */
+typedef struct fx_stack {
+	/**
+	 * Low-address of the usable stack memory. Unless the pool was created
+	 * without guard pages, the page directly below this address is a guard
+	 * page; accessing it results in a segmentation fault.
+	 */
+	void *stack_start;
+
+	/**
+	 * High-address of the usable stack memory.
+	 */
+	void *stack_end;
+
+	/**
+	 * Next descriptor in the same batch of released stacks. Private.
+	 */
+	struct fx_stack *next;
+
+	/**
+	 * Index plus one of the first descriptor of the next batch in the pool.
+	 * Only valid for the first descriptor in a batch. Private.
+	 */
+	uintptr_t next_batch;
+
+	/**
+	 * Number of descriptors in the batch. Only valid for the first descriptor
+	 * in a batch. Private.
+	 */
+	size_t batch_size;
+} fx_stack;
+
+/**
+ * A pool of stacks of equal size. Stacks are mapped using mmap() on demand and
+ * are never returned to the operating system before the pool is destroyed;
+ * released stacks are kept in a free list and handed out again in O(1).
+ * Alternatively, all stacks are carved out of a single region (the arena)
+ * that is reserved by fx_stack_pool_init_arena().
+ *
+ * All members of this structure should be treated as private. All functions
+ * operating on the pool are thread-safe and lock-free. Released stacks are
+ * stored in batches in a tagged Treiber stack. Use a fx_stack_pool_cache per
+ * thread to avoid contention on the shared pool.
+ */
+typedef struct fx_stack_pool {
+	/**
+	 * Usable size of each stack and size of the guard page in bytes. Both are
+	 * multiples of the system page size.
+	 */
+	size_t stack_size;
+	size_t guard_size;
+
+	/**
+	 * Region all stacks are carved from if the pool was initialised using
+	 * fx_stack_pool_init_arena(), NULL otherwise. Stack i occupies the slot
+	 * of slot_size bytes at offset i * slot_size, with the guard page (if
+	 * any) at the bottom of the slot.
+	 */
+	void *arena;
+	size_t arena_size;
+	size_t slot_size;
+
+	/**
+	 * Size of the huge pages backing the arena or zero if the arena is backed
+	 * by regular pages. The size is determined from the transparent huge page
+	 * settings in /sys/kernel/mm/transparent_hugepage or the default
+	 * hugetlbfs page size; it is zero if it cannot be confirmed. May be read
+	 * at any time.
+	 */
+	size_t huge_page_size;
+
+	/**
+	 * Maximum number of stacks in the pool and the number of stacks that have
+	 * been mapped so far. The latter is accessed atomically.
+	 */
+	size_t capacity;
+	size_t n_stacks;
+
+	/**
+	 * Flags passed to fx_stack_pool_init().
+	 */
+	unsigned int flags;
+
+	/**
+	 * Table holding "capacity" stack descriptors. Descriptors are never
+	 * moved, so pointers at them are valid until the pool is destroyed.
+	 */
+	fx_stack *stacks;
+
+	/**
+	 * Head of the Treiber stack of released batches. The lower half of the
+	 * bits holds the index plus one of the first descriptor in the topmost
+	 * batch, the upper half holds a tag that is incremented with every update
+	 * to prevent the ABA problem. Accessed atomically.
+	 */
+	uintptr_t free_batches;
+
+	/**
+	 * Number of stacks in the released batches. Accessed atomically.
+	 */
+	size_t n_free;
+
+	/**
+	 * Head of the Treiber stack of descriptors whose stack could not be
+	 * mapped, linked via their next_batch member and tagged like
+	 * free_batches. These descriptors are retried before unused ones are
+	 * claimed. Accessed atomically.
+	 */
+	uintptr_t unmapped;
+
+	/**
+	 * Aggregate of the high-water marks of all stacks returned to the pool.
+	 * Only updated if the library is compiled with FX_WITH_STACK_WATERMARK;
+	 * in this case stacks are painted when they are mapped and the used part
+	 * is measured and re-painted whenever a stack is released. May be read at
+	 * any time.
+	 */
+	fx_stack_watermark watermark;
+
+	/**
+	 * Number of bytes below stack_end that are kept resident when a stack is
+	 * trimmed on release and the FX_STACK_RECLAIM_* flags passed to
+	 * fx_stack_pool_set_reclaim().
+	 */
+	size_t reclaim_keep;
+	unsigned int reclaim_flags;
+
+	/**
+	 * NUMA node the memory of the stacks is bound to, or -1 if the memory is
+	 * placed according to the default policy of the mapping thread.
+	 */
+	int node;
+} fx_stack_pool;
+
+/**
+ * A set of stack pools, one per NUMA node. The memory of the stacks in each
+ * pool is placed on the corresponding node (using mbind() with
+ * MPOL_PREFERRED), and each node has its own free list. Stacks are allocated
+ * from the node of the CPU the calling thread is running on. On machines with
+ * a single node, this is equivalent to a single fx_stack_pool.
+ *
+ * All members of this structure should be treated as private.
+ */
+typedef struct fx_stack_numa_pool {
+	/**
+	 * Number of nodes and one pool per node.
+	 */
+	size_t n_nodes;
+	fx_stack_pool *pools;
+} fx_stack_numa_pool;
+
+/**
+ * Thread-local cache of stacks belonging to a fx_stack_pool. Stacks are taken
+ * from and returned to the cache without any atomic operations. Stacks are
+ * exchanged with the shared pool in batches of FX_STACK_POOL_CACHE_BATCH
+ * stacks, requiring a single atomic operation per batch.
+ *
+ * A cache must only be used by a single thread at a time. All members of this
+ * structure should be treated as private.
+ */
+typedef struct fx_stack_pool_cache {
+	/**
+	 * Pool the cache belongs to.
+	 */
+	fx_stack_pool *pool;
+
+	/**
+	 * Cached stacks; the most recently released stack is stored last.
+	 */
+	fx_stack *stacks[2U * FX_STACK_POOL_CACHE_BATCH];
+	size_t n_stacks;
+} fx_stack_pool_cache;
+
+/**
+ * Initialises a stack pool. No stacks are mapped until they are requested
+ * using fx_stack_pool_alloc() or fx_stack_pool_reserve().
+ *
+ * @param pool is the pool that should be initialised.
+ * @param stack_size is the usable size of each stack in bytes. Rounded up to
+ * a multiple of the page size.
+ * @param capacity is the maximum number of stacks that can be handed out by
+ * the pool. Limited to 2^16 - 1 on 32-bit and 2^32 - 1 on 64-bit platforms.
+ * @param flags is a combination of FX_STACK_POOL_* flags.
+ * @return true if the pool was initialised successfully, false otherwise.
+ */
+bool fx_stack_pool_init(fx_stack_pool *pool, size_t stack_size,
+                        size_t capacity, unsigned int flags);
+
+/**
+ * Initialises a stack pool that carves its stacks out of a single contiguous
+ * region. The virtual memory for all stacks is reserved up-front; physical
+ * memory is only allocated once a stack is touched. Backing the arena by huge
+ * pages reduces TLB misses when switching between many stacks, at the cost of
+ * resident memory growing in units of whole huge pages.
+ *
+ * Note that each guard page splits the arena into separate memory mappings in
+ * the kernel; use FX_STACK_POOL_NO_GUARD for pools with tens of thousands of
+ * stacks to stay below the per-process mapping limit. fx_stack_reclaim() on
+ * stacks in a huge page arena splits the affected huge pages.
+ *
+ * @param pool is the pool that should be initialised.
+ * @param stack_size is the minimum usable size of each stack in bytes.
+ * @param slot_align is the alignment of each slot in bytes, i.e. of the
+ * stack_end of each stack unless FX_STACK_POOL_COLOUR is given. Must be zero
+ * (page size) or a power of two. The size of a slot, including the guard page,
+ * is rounded up to a multiple of this value.
+ * @param capacity is the number of stacks in the arena. Subject to the same
+ * limits as in fx_stack_pool_init().
+ * @param flags is a combination of FX_STACK_POOL_* flags. If
+ * FX_STACK_POOL_POPULATE is given, the entire arena is pre-faulted.
+ * @return true if the pool was initialised successfully, false otherwise.
+ */
+bool fx_stack_pool_init_arena(fx_stack_pool *pool, size_t stack_size,
+                              size_t slot_align, size_t capacity,
+                              unsigned int flags);
+
+/**
+ * Unmaps all stacks belonging to the pool. Stacks that are still in use must
+ * no longer be accessed. Must not be called concurrently with any other
+ * function operating on the pool.
+ *
+ * @param pool is the pool that should be destroyed.
+ */
+void fx_stack_pool_destroy(fx_stack_pool *pool);
+
+/**
+ * Makes sure that at least n stacks are mapped and ready to be handed out
+ * without calling into the kernel.
+ *
+ * @param pool is the pool in which the stacks should be reserved.
+ * @param n is the number of stacks that should be available in the free list.
+ * @return the number of stacks that are available in the free list, which may
+ * be smaller than n if the capacity of the pool is exhausted.
+ */
+size_t fx_stack_pool_reserve(fx_stack_pool *pool, size_t n);
+
+/**
+ * Takes a stack from the pool. Released stacks are reused, most recently
+ * released batches first; otherwise a new stack is mapped.
+ *
+ * @param pool is the pool from which the stack should be taken.
+ * @return a pointer at the stack descriptor or NULL if the capacity of the pool
+ * is exhausted or the stack could not be mapped.
+ */
+fx_stack *fx_stack_pool_alloc(fx_stack_pool *pool);
+
+/**
+ * Returns a stack to the pool.
+ *
+ * @param pool is the pool from which the stack was taken.
+ * @param stack is the stack descriptor returned by fx_stack_pool_alloc().
+ */
+void fx_stack_pool_free(fx_stack_pool *pool, fx_stack *stack);
+
+/**
+ * Releases the physical memory backing the pages of a stack that lie more than
+ * "keep" bytes below stack_end, so that the resident memory of a stack tracks
+ * its current rather than its historical peak usage. The virtual memory
+ * remains mapped; released pages read as zero (or retain their old content if
+ * FX_STACK_RECLAIM_LAZY is used) and are faulted in again when touched. Only
+ * pages that lie entirely within the stack region are released, so this works
+ * for both pooled and caller-provided stacks. The stack must not be in use.
+ *
+ * If the library is compiled with FX_WITH_STACK_WATERMARK, the released pages
+ * are re-painted, which makes them resident again.
+ *
+ * @param stack_start is the low-address of the stack, i.e. the value passed
+ * to fx_stack_switch().
+ * @param stack_end is the high-address of the stack.
+ * @param keep is the number of bytes below stack_end that should remain
+ * resident.
+ * @param flags is a combination of FX_STACK_RECLAIM_* flags.
+ * @return the number of bytes that were released.
+ */
+size_t fx_stack_reclaim(void *stack_start, void *stack_end, size_t keep,
+                        unsigned int flags);
+
+/**
+ * Configures whether and how stacks are trimmed when they are released to the
+ * pool or one of its caches. Trimming on release costs a system call per
+ * released stack; use fx_stack_pool_trim() periodically instead if stacks are
+ * released at a high rate. Must not be called concurrently with any other
+ * function operating on the pool.
+ *
+ * @param pool is the pool that should be configured.
+ * @param keep is the number of bytes below the end of each stack that should
+ * remain resident.
+ * @param flags is a combination of FX_STACK_RECLAIM_* flags. Trimming on
+ * release is only enabled if FX_STACK_RECLAIM_ON_FREE is set.
+ */
+void fx_stack_pool_set_reclaim(fx_stack_pool *pool, size_t keep,
+                               unsigned int flags);
+
+/**
+ * Trims all stacks currently held in the shared free list of the pool using
+ * fx_stack_reclaim(). Stacks in fx_stack_pool_cache instances are not
+ * affected. Released stacks are temporarily removed from the free list, so
+ * concurrent calls to fx_stack_pool_alloc() may map new stacks while the pool
+ * is being trimmed.
+ *
+ * @param pool is the pool that should be trimmed.
+ * @param keep is the number of bytes below the end of each stack that should
+ * remain resident.
+ * @param flags is a combination of FX_STACK_RECLAIM_* flags.
+ * @return the number of bytes that were released.
+ */
+size_t fx_stack_pool_trim(fx_stack_pool *pool, size_t keep,
+                          unsigned int flags);
+
+/**
+ * Initialises an empty thread-local cache for the given pool.
+ *
+ * @param cache is the cache that should be initialised.
+ * @param pool is the pool the cache belongs to.
+ */
+void fx_stack_pool_cache_init(fx_stack_pool_cache *cache, fx_stack_pool *pool);
+
+/**
+ * Returns all stacks in the cache to the shared pool.
+ *
+ * @param cache is the cache that should be destroyed.
+ */
+void fx_stack_pool_cache_destroy(fx_stack_pool_cache *cache);
+
+/**
+ * Takes a stack from the cache. If the cache is empty, a batch of stacks is
+ * fetched from the shared pool; if the pool is empty as well, a new stack is
+ * mapped.
+ *
+ * @param cache is the cache from which the stack should be taken.
+ * @return a pointer at the stack descriptor or NULL if the capacity of the pool
+ * is exhausted or the stack could not be mapped.
+ */
+fx_stack *fx_stack_pool_cache_alloc(fx_stack_pool_cache *cache);
+
+/**
+ * Returns a stack to the cache. If the cache is full, the least recently
+ * released batch of stacks is returned to the shared pool.
+ *
+ * @param cache is the cache the stack should be returned to.
+ * @param stack is a stack descriptor belonging to the pool of the cache.
+ */
+void fx_stack_pool_cache_free(fx_stack_pool_cache *cache, fx_stack *stack);
+
+/**
+ * Trims all stacks held in the cache using fx_stack_reclaim().
+ *
+ * @param cache is the cache that should be trimmed.
+ * @param keep is the number of bytes below the end of each stack that should
+ * remain resident.
+ * @param flags is a combination of FX_STACK_RECLAIM_* flags.
+ * @return the number of bytes that were released.
+ */
+size_t fx_stack_pool_cache_trim(fx_stack_pool_cache *cache, size_t keep,
+                                unsigned int flags);
+
+/**
+ * Returns the number of NUMA nodes in the system, i.e. the largest online node
+ * index plus one. Returns one if the system is not a NUMA system or the number
+ * of nodes cannot be determined. Limited to FX_STACK_NUMA_MAX_NODES.
+ */
+size_t fx_stack_numa_node_count(void);
+
+/**
+ * Returns the NUMA node of the CPU the calling thread is currently running
+ * on, or zero if it cannot be determined. Unless the thread is bound to the
+ * CPUs of a single node, the result may be outdated by the time it is used.
+ */
+size_t fx_stack_numa_current_node(void);
+
+/**
+ * Initialises one stack pool per NUMA node.
+ *
+ * @param pool is the NUMA pool that should be initialised.
+ * @param stack_size is the usable size of each stack in bytes.
+ * @param capacity is the maximum number of stacks per node.
+ * @param flags is a combination of FX_STACK_POOL_* flags passed to
+ * fx_stack_pool_init(). If FX_STACK_POOL_POPULATE is given, stacks are
+ * pre-faulted after they have been bound to their node.
+ * @return true if the pool was initialised successfully, false otherwise.
+ */
+bool fx_stack_numa_pool_init(fx_stack_numa_pool *pool, size_t stack_size,
+                             size_t capacity, unsigned int flags);
+
+/**
+ * Destroys all per-node pools. See fx_stack_pool_destroy().
+ *
+ * @param pool is the NUMA pool that should be destroyed.
+ */
+void fx_stack_numa_pool_destroy(fx_stack_numa_pool *pool);
+
+/**
+ * Returns the pool belonging to the node of the calling thread. Use this to
+ * initialise a per-thread fx_stack_pool_cache for worker threads that are
+ * bound to a node.
+ *
+ * @param pool is the NUMA pool.
+ * @return the pool of the current node.
+ */
+fx_stack_pool *fx_stack_numa_pool_local(fx_stack_numa_pool *pool);
+
+/**
+ * Takes a stack placed on the given node. If the pool of that node is
+ * exhausted, the stack is taken from the next node that has stacks left.
+ *
+ * @param pool is the NUMA pool from which the stack should be taken.
+ * @param node is the preferred node. Reduced modulo the number of nodes.
+ * @return a pointer at the stack descriptor or NULL if all pools are
+ * exhausted.
+ */
+fx_stack *fx_stack_numa_pool_alloc_on(fx_stack_numa_pool *pool, size_t node);
+
+/**
+ * Takes a stack placed on the node of the calling thread. Equivalent to
+ * calling fx_stack_numa_pool_alloc_on() with fx_stack_numa_current_node().
+ *
+ * @param pool is the NUMA pool from which the stack should be taken.
+ * @return a pointer at the stack descriptor or NULL if all pools are
+ * exhausted.
+ */
+fx_stack *fx_stack_numa_pool_alloc(fx_stack_numa_pool *pool);
+
+/**
+ * Returns a stack to the free list of the node it is placed on.
+ *
+ * @param pool is the NUMA pool from which the stack was taken.
+ * @param stack is the stack descriptor returned by one of the allocation
+ * functions.
+ */
+void fx_stack_numa_pool_free(fx_stack_numa_pool *pool, fx_stack *stack);
+
+/**
+ * Returns the node the given stack is placed on.
+ *
+ * @param pool is the NUMA pool from which the stack was taken.
+ * @param stack is the stack descriptor.
+ */
+size_t fx_stack_numa_pool_node(const fx_stack_numa_pool *pool,
+                               const fx_stack *stack);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_POOL_H */
@@ -0,0 +1,769 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Required for sysconf() and pthread_condattr_setclock() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#ifndef FX_NO_CONFIG
+#include "config.h"
+#endif
+
+#include <foxen/stack_sched.h>
+
+#ifdef FX_WITH_CPP_EXCEPTIONS
+#include <exception>
+#include <utility>
+#endif
+
+/*****************************************************************************
+ * Data structures                                                           *
+ *****************************************************************************/
+
+/**
+ * Reason for which a task transferred control back to its worker.
+ */
+typedef enum {
+	FX_STACK_SCHED_TASK_YIELD,
+	FX_STACK_SCHED_TASK_JOIN,
+	FX_STACK_SCHED_TASK_PARK
+} _fx_stack_sched_task_state;
+
+/**
+ * Special values of the "waiter" member of a task. Any other non-NULL value is
+ * the task waiting for the task to finish.
+ */
+#define FX_STACK_SCHED_WAITER_DONE ((fx_stack_sched_task *)1)
+#define FX_STACK_SCHED_WAITER_EXTERNAL ((fx_stack_sched_task *)2)
+
+struct fx_stack_sched_task {
+	/**
+	 * Execution context and stack of the task. The stack is taken from the
+	 * pool once the task is executed for the first time and returned once the
+	 * task has finished.
+	 */
+	fx_stack_context ctx;
+	fx_stack *stack;
+
+	/**
+	 * Scheduler the task belongs to and worker that is currently executing
+	 * the task.
+	 */
+	fx_stack_sched *sched;
+	struct fx_stack_sched_worker *worker;
+
+	/**
+	 * Callback function, user-defined data, and the value returned by the
+	 * callback function.
+	 */
+	fx_stack_cback cback;
+	void *data;
+	void *result;
+
+	/**
+	 * Opaque pointer at a C++ exception thrown by the callback function.
+	 */
+	void *exception;
+
+	/**
+	 * Task or thread waiting for this task to finish. Set to
+	 * FX_STACK_SCHED_WAITER_DONE once the task has finished.
+	 */
+	fx_stack_sched_task *waiter;
+
+	/**
+	 * Reason for the last transfer of control to the worker and, if the task
+	 * is waiting for another task, the task it is waiting for. If the task
+	 * is parked, the callback that should be executed by the worker.
+	 */
+	_fx_stack_sched_task_state state;
+	fx_stack_sched_task *join_target;
+	fx_stack_sched_park_cback park_cback;
+	void *park_data;
+
+	/**
+	 * Next task in the shared queue.
+	 */
+	fx_stack_sched_task *next;
+};
+
+typedef struct fx_stack_sched_worker {
+	/**
+	 * Scheduler the worker belongs to and the worker thread.
+	 */
+	fx_stack_sched *sched;
+	pthread_t thread;
+
+	/**
+	 * Context of the worker thread and thread-local stack cache.
+	 */
+	fx_stack_context main;
+	fx_stack_pool_cache cache;
+
+	/**
+	 * State of the random number generator used to select steal victims.
+	 */
+	uint32_t rng;
+
+	/**
+	 * Timers of the tasks sleeping on this worker. Only accessed by the
+	 * worker thread itself.
+	 */
+	fx_stack_timer_wheel timers;
+
+	/**
+	 * Chase-Lev deque. Only the owning worker modifies "bottom" and pushes or
+	 * pops tasks at the bottom end; other workers steal tasks from the top
+	 * end. The indices are placed on separate cache lines.
+	 */
+	char _pad0[64];
+	size_t top;
+	char _pad1[64];
+	size_t bottom;
+	char _pad2[64];
+	fx_stack_sched_task *deque[FX_STACK_SCHED_DEQUE_CAPACITY];
+} fx_stack_sched_worker;
+
+/**
+ * Task executed by the calling thread or NULL. This variable must never be
+ * accessed after a context switch within the same function, since the task
+ * may have migrated to another thread in the meantime.
+ */
+static __thread fx_stack_sched_task *volatile _fx_stack_sched_current = NULL;
+
+/*****************************************************************************
+ * Chase-Lev deque                                                           *
+ *****************************************************************************/
+
+/*
+ * Implementation following N. M. Lê, A. Pop, A. Cohen, F. Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models", PPoPP 2013,
+ * with a fixed capacity. Indices are unsigned and compared via their signed
+ * difference.
+ */
+
+#define FX_STACK_SCHED_DEQUE_MASK (FX_STACK_SCHED_DEQUE_CAPACITY - 1U)
+
+static bool _fx_stack_sched_deque_push(fx_stack_sched_worker *worker,
+                                       fx_stack_sched_task *task) {
+	const size_t b = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+	const size_t t = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+	if (b - t >= FX_STACK_SCHED_DEQUE_CAPACITY) {
+		return false; /* Full */
+	}
+	__atomic_store_n(&worker->deque[b & FX_STACK_SCHED_DEQUE_MASK], task,
+	                 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&worker->bottom, b + 1U, __ATOMIC_RELAXED);
+	return true;
+}
+
+static fx_stack_sched_task *_fx_stack_sched_deque_pop(
+    fx_stack_sched_worker *worker) {
+	const size_t b = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1U;
+	__atomic_store_n(&worker->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	size_t t = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+
+	fx_stack_sched_task *task = NULL;
+	if ((ptrdiff_t)(b - t) >= 0) {
+		task = __atomic_load_n(&worker->deque[b & FX_STACK_SCHED_DEQUE_MASK],
+		                       __ATOMIC_RELAXED);
+		if (b == t) {
+			/* Last element; race against concurrent steals */
+			if (!__atomic_compare_exchange_n(&worker->top, &t, t + 1U, false,
+			                                 __ATOMIC_SEQ_CST,
+			                                 __ATOMIC_RELAXED)) {
+				task = NULL;
+			}
+			__atomic_store_n(&worker->bottom, b + 1U, __ATOMIC_RELAXED);
+		}
+	} else {
+		/* Empty */
+		__atomic_store_n(&worker->bottom, b + 1U, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+static fx_stack_sched_task *_fx_stack_sched_deque_steal(
+    fx_stack_sched_worker *worker) {
+	size_t t = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	const size_t b = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+	if ((ptrdiff_t)(b - t) <= 0) {
+		return NULL; /* Empty */
+	}
+	fx_stack_sched_task *task = __atomic_load_n(
+	    &worker->deque[t & FX_STACK_SCHED_DEQUE_MASK], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&worker->top, &t, t + 1U, false,
+	                                 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL; /* Lost the race against another thief or the owner */
+	}
+	return task;
+}
+
+/*****************************************************************************
+ * Shared queue and idle workers                                             *
+ *****************************************************************************/
+
+/**
+ * Wakes up an idle worker after a task has become runnable.
+ */
+static void _fx_stack_sched_notify(fx_stack_sched *sched) {
+	__atomic_add_fetch(&sched->epoch, 1U, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sched->n_idle, __ATOMIC_SEQ_CST) > 0U) {
+		pthread_mutex_lock(&sched->idle_mutex);
+		pthread_cond_signal(&sched->idle_cond);
+		pthread_mutex_unlock(&sched->idle_mutex);
+	}
+}
+
+static void _fx_stack_sched_enqueue(fx_stack_sched *sched,
+                                    fx_stack_sched_task *task) {
+	task->next = NULL;
+	pthread_mutex_lock(&sched->queue_mutex);
+	if (sched->queue_tail) {
+		sched->queue_tail->next = task;
+	} else {
+		sched->queue_head = task;
+	}
+	sched->queue_tail = task;
+	__atomic_store_n(&sched->queue_size, sched->queue_size + 1U,
+	                 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sched->queue_mutex);
+}
+
+static fx_stack_sched_task *_fx_stack_sched_dequeue(fx_stack_sched *sched) {
+	if (__atomic_load_n(&sched->queue_size, __ATOMIC_RELAXED) == 0U) {
+		return NULL;
+	}
+	pthread_mutex_lock(&sched->queue_mutex);
+	fx_stack_sched_task *task = sched->queue_head;
+	if (task) {
+		sched->queue_head = task->next;
+		if (!sched->queue_head) {
+			sched->queue_tail = NULL;
+		}
+		__atomic_store_n(&sched->queue_size, sched->queue_size - 1U,
+		                 __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&sched->queue_mutex);
+	return task;
+}
+
+/**
+ * Makes the given task runnable. The task is pushed onto the deque of the
+ * given worker if possible, otherwise it is placed in the shared queue.
+ */
+static void _fx_stack_sched_push(fx_stack_sched *sched,
+                                 fx_stack_sched_worker *worker,
+                                 fx_stack_sched_task *task) {
+	if (!worker || !_fx_stack_sched_deque_push(worker, task)) {
+		_fx_stack_sched_enqueue(sched, task);
+	}
+	_fx_stack_sched_notify(sched);
+}
+
+/**
+ * Makes all tasks that were put aside for lack of a stack runnable again.
+ * Called whenever stacks have been returned to the pool or a cache.
+ */
+static void _fx_stack_sched_retry(fx_stack_sched *sched,
+                                  fx_stack_sched_worker *worker) {
+	/* Pairs with the fence in _fx_stack_sched_defer() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sched->n_pending, __ATOMIC_RELAXED) == 0U) {
+		return;
+	}
+	pthread_mutex_lock(&sched->queue_mutex);
+	fx_stack_sched_task *task = sched->pending;
+	sched->pending = NULL;
+	__atomic_store_n(&sched->n_pending, 0U, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sched->queue_mutex);
+
+	while (task) {
+		fx_stack_sched_task *next = task->next;
+		_fx_stack_sched_push(sched, worker, task);
+		task = next;
+	}
+}
+
+/**
+ * Puts a task that could not obtain a stack aside until another task returns
+ * its stack, instead of spinning on the pool.
+ */
+static void _fx_stack_sched_defer(fx_stack_sched *sched,
+                                  fx_stack_sched_worker *worker,
+                                  fx_stack_sched_task *task) {
+	pthread_mutex_lock(&sched->queue_mutex);
+	task->next = sched->pending;
+	sched->pending = task;
+	__atomic_store_n(&sched->n_pending, sched->n_pending + 1U,
+	                 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sched->queue_mutex);
+
+	/* A stack may have been returned to the pool before the task was put
+	   aside, in which case the worker returning it did not see the task */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sched->pool.n_free, __ATOMIC_RELAXED) > 0U) {
+		_fx_stack_sched_retry(sched, worker);
+	}
+}
+
+/*****************************************************************************
+ * Timers                                                                    *
+ *****************************************************************************/
+
+/**
+ * Data passed from a sleeping task to the park callback.
+ */
+typedef struct {
+	fx_stack_timer timer;
+	uint64_t deadline;
+} _fx_stack_sched_sleep_data;
+
+/**
+ * Timer callback resuming a sleeping task. Executed by the worker that owns
+ * the timer wheel, which is the worker the task was suspended on.
+ */
+static void _fx_stack_sched_wake(fx_stack_timer *timer, void *data) {
+	fx_stack_sched_task *task = (fx_stack_sched_task *)data;
+	(void)timer;
+	_fx_stack_sched_push(task->sched, task->worker, task);
+}
+
+/**
+ * Park callback adding the timer of a sleeping task to the wheel of the
+ * worker that suspended it.
+ */
+static void _fx_stack_sched_sleep_arm(fx_stack_sched_task *task, void *data_) {
+	_fx_stack_sched_sleep_data *data = (_fx_stack_sched_sleep_data *)data_;
+	fx_stack_timer_add(&task->worker->timers, &data->timer, data->deadline,
+	                   _fx_stack_sched_wake, task);
+}
+
+/**
+ * Waits on the idle condition variable until it is signalled or the given
+ * deadline (as returned by fx_stack_timer_now()) has passed. Returns false if
+ * the deadline has passed. Must be called with the idle mutex held.
+ */
+static bool _fx_stack_sched_idle_wait(fx_stack_sched *sched,
+                                      uint64_t deadline) {
+	if (deadline == UINT64_MAX) {
+		pthread_cond_wait(&sched->idle_cond, &sched->idle_mutex);
+		return true;
+	}
+
+	/* Convert the deadline to the clock used by the condition variable */
+	uint64_t abs_ns = deadline;
+#if !(defined(_POSIX_CLOCK_SELECTION) && (_POSIX_CLOCK_SELECTION > 0))
+	const uint64_t now = fx_stack_timer_now();
+	struct timespec ts_now;
+	clock_gettime(CLOCK_REALTIME, &ts_now);
+	abs_ns = ((deadline > now) ? (deadline - now) : 0U) +
+	         ((uint64_t)ts_now.tv_sec) * 1000000000U + (uint64_t)ts_now.tv_nsec;
+#endif
+	struct timespec ts;
+	ts.tv_sec = (time_t)(abs_ns / 1000000000U);
+	ts.tv_nsec = (long)(abs_ns % 1000000000U);
+	return pthread_cond_timedwait(&sched->idle_cond, &sched->idle_mutex,
+	                              &ts) != ETIMEDOUT;
+}
+
+/*****************************************************************************
+ * Workers                                                                   *
+ *****************************************************************************/
+
+static void *_fx_stack_sched_task_entry(void *data) {
+	fx_stack_sched_task *task = (fx_stack_sched_task *)data;
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	/* Store any exception in the task; it is re-thrown by the joiner */
+	try {
+		task->result = task->cback(task->data);
+	} catch (...) {
+		task->exception = new std::exception_ptr(std::current_exception());
+	}
+#else
+	task->result = task->cback(task->data);
+#endif
+	return NULL;
+}
+
+static void _fx_stack_sched_finish(fx_stack_sched_worker *worker,
+                                   fx_stack_sched_task *task) {
+	fx_stack_sched *sched = worker->sched;
+
+	/* Return the stack to the pool and resume the tasks waiting for one */
+	fx_stack_context_destroy(&task->ctx);
+	fx_stack_pool_cache_free(&worker->cache, task->stack);
+	task->stack = NULL;
+	_fx_stack_sched_retry(sched, worker);
+
+	/* Mark the task as done and wake up the waiter */
+	fx_stack_sched_task *waiter = __atomic_exchange_n(
+	    &task->waiter, FX_STACK_SCHED_WAITER_DONE, __ATOMIC_ACQ_REL);
+	if (waiter == FX_STACK_SCHED_WAITER_EXTERNAL) {
+		pthread_mutex_lock(&sched->join_mutex);
+		pthread_cond_broadcast(&sched->join_cond);
+		pthread_mutex_unlock(&sched->join_mutex);
+	} else if (waiter) {
+		_fx_stack_sched_push(sched, worker, waiter);
+	}
+}
+
+static void _fx_stack_sched_run(fx_stack_sched_worker *worker,
+                                fx_stack_sched_task *task) {
+	fx_stack_sched *sched = worker->sched;
+
+	/* Fetch a stack when the task is executed for the first time */
+	if (!task->stack) {
+		task->stack = fx_stack_pool_cache_alloc(&worker->cache);
+		if (!task->stack) {
+			/* Retry once another task has released its stack */
+			_fx_stack_sched_defer(sched, worker, task);
+			return;
+		}
+		fx_stack_context_init(&task->ctx, task->stack->stack_start,
+		                      task->stack->stack_end,
+		                      _fx_stack_sched_task_entry, task);
+	}
+
+	/* Execute the task until it finishes or transfers control back */
+	task->worker = worker;
+	_fx_stack_sched_current = task;
+	fx_stack_context_swap(&worker->main, &task->ctx, NULL);
+	_fx_stack_sched_current = NULL;
+
+	if (fx_stack_context_done(&task->ctx)) {
+		_fx_stack_sched_finish(worker, task);
+	} else if (task->state == FX_STACK_SCHED_TASK_YIELD) {
+		_fx_stack_sched_enqueue(sched, task);
+		_fx_stack_sched_notify(sched);
+	} else if (task->state == FX_STACK_SCHED_TASK_JOIN) {
+		/* Register the task as waiter now that it is suspended. If the target
+		   finished in the meantime, the task can continue right away. */
+		fx_stack_sched_task *expected = NULL;
+		if (!__atomic_compare_exchange_n(&task->join_target->waiter, &expected,
+		                                 task, false, __ATOMIC_ACQ_REL,
+		                                 __ATOMIC_ACQUIRE)) {
+			assert(expected == FX_STACK_SCHED_WAITER_DONE);
+			_fx_stack_sched_push(sched, worker, task);
+		}
+	} else if (task->state == FX_STACK_SCHED_TASK_PARK) {
+		/* The task may be resumed by another thread as soon as the callback
+		   has handed it over; do not access the task afterwards */
+		task->park_cback(task, task->park_data);
+	}
+}
+
+static fx_stack_sched_task *_fx_stack_sched_find(
+    fx_stack_sched_worker *worker) {
+	fx_stack_sched *sched = worker->sched;
+
+	/* Own deque first, then the shared queue */
+	fx_stack_sched_task *task = _fx_stack_sched_deque_pop(worker);
+	if (!task) {
+		task = _fx_stack_sched_dequeue(sched);
+	}
+
+	/* Try to steal from the other workers, starting at a random victim */
+	const size_t n_workers = sched->n_workers;
+	if (!task && (n_workers > 1U)) {
+		worker->rng ^= worker->rng << 13U;
+		worker->rng ^= worker->rng >> 17U;
+		worker->rng ^= worker->rng << 5U;
+		const size_t offs = worker->rng % n_workers;
+		for (size_t i = 0U; !task && (i < n_workers); i++) {
+			fx_stack_sched_worker *victim =
+			    &sched->workers[(offs + i) % n_workers];
+			if (victim != worker) {
+				task = _fx_stack_sched_deque_steal(victim);
+			}
+		}
+	}
+	return task;
+}
+
+static void *_fx_stack_sched_worker_main(void *data) {
+	fx_stack_sched_worker *worker = (fx_stack_sched_worker *)data;
+	fx_stack_sched *sched = worker->sched;
+
+	while (true) {
+		/* Resume the tasks whose timers have expired in one batch */
+		if (worker->timers.n_timers > 0U) {
+			fx_stack_timer_wheel_advance(&worker->timers, fx_stack_timer_now());
+		}
+
+		/* Remember the epoch before searching for work; any task becoming
+		   runnable afterwards increments the epoch */
+		const size_t epoch = __atomic_load_n(&sched->epoch, __ATOMIC_SEQ_CST);
+		fx_stack_sched_task *task = _fx_stack_sched_find(worker);
+		if (task) {
+			_fx_stack_sched_run(worker, task);
+			continue;
+		}
+
+		/* Return the cached stacks to the pool, so other workers can use them
+		   while this worker is sleeping */
+		if (worker->cache.n_stacks > 0U) {
+			fx_stack_pool_cache_destroy(&worker->cache);
+			_fx_stack_sched_retry(sched, worker);
+		}
+
+		/* Sleep until a task becomes runnable or the next timer expires */
+		const uint64_t deadline = fx_stack_timer_wheel_next(&worker->timers);
+		pthread_mutex_lock(&sched->idle_mutex);
+		__atomic_add_fetch(&sched->n_idle, 1U, __ATOMIC_SEQ_CST);
+		while (!sched->stop &&
+		       (__atomic_load_n(&sched->epoch, __ATOMIC_SEQ_CST) == epoch)) {
+			if (!_fx_stack_sched_idle_wait(sched, deadline)) {
+				break;
+			}
+		}
+		__atomic_sub_fetch(&sched->n_idle, 1U, __ATOMIC_SEQ_CST);
+		const int stop = sched->stop;
+		pthread_mutex_unlock(&sched->idle_mutex);
+		if (stop) {
+			break;
+		}
+	}
+
+	fx_stack_pool_cache_destroy(&worker->cache);
+	return NULL;
+}
+
+/**
+ * Stops the workers and waits for the first "n_started" worker threads to
+ * terminate.
+ */
+static void _fx_stack_sched_stop(fx_stack_sched *sched, size_t n_started) {
+	pthread_mutex_lock(&sched->idle_mutex);
+	sched->stop = 1;
+	pthread_cond_broadcast(&sched->idle_cond);
+	pthread_mutex_unlock(&sched->idle_mutex);
+	for (size_t i = 0U; i < n_started; i++) {
+		pthread_join(sched->workers[i].thread, NULL);
+	}
+}
+
+/**
+ * Releases all resources once the worker threads have terminated.
+ */
+static void _fx_stack_sched_release(fx_stack_sched *sched) {
+	pthread_cond_destroy(&sched->join_cond);
+	pthread_mutex_destroy(&sched->join_mutex);
+	pthread_cond_destroy(&sched->idle_cond);
+	pthread_mutex_destroy(&sched->idle_mutex);
+	pthread_mutex_destroy(&sched->queue_mutex);
+	free(sched->workers);
+	fx_stack_pool_destroy(&sched->pool);
+	sched->workers = NULL;
+	sched->n_workers = 0U;
+}
+
+/*****************************************************************************
+ * Public API                                                                *
+ *****************************************************************************/
+
+bool fx_stack_sched_init(fx_stack_sched *sched, size_t n_workers,
+                         size_t stack_size, size_t max_tasks) {
+	memset(sched, 0, sizeof(fx_stack_sched));
+	if (n_workers == 0U) {
+		const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n_workers = (n_cpus > 0) ? (size_t)n_cpus : 1U;
+	}
+
+	if (!fx_stack_pool_init(&sched->pool, stack_size, max_tasks, 0U)) {
+		return false;
+	}
+	sched->workers = (fx_stack_sched_worker *)calloc(
+	    n_workers, sizeof(fx_stack_sched_worker));
+	if (!sched->workers) {
+		fx_stack_pool_destroy(&sched->pool);
+		return false;
+	}
+	pthread_mutex_init(&sched->queue_mutex, NULL);
+	pthread_mutex_init(&sched->idle_mutex, NULL);
+	pthread_condattr_t idle_cond_attr;
+	pthread_condattr_init(&idle_cond_attr);
+#if defined(_POSIX_CLOCK_SELECTION) && (_POSIX_CLOCK_SELECTION > 0)
+	/* Timeouts of idle workers are relative to the monotonic clock */
+	pthread_condattr_setclock(&idle_cond_attr, CLOCK_MONOTONIC);
+#endif
+	pthread_cond_init(&sched->idle_cond, &idle_cond_attr);
+	pthread_condattr_destroy(&idle_cond_attr);
+	pthread_mutex_init(&sched->join_mutex, NULL);
+	pthread_cond_init(&sched->join_cond, NULL);
+
+	/* Initialise all workers before starting any of them. Running workers
+	   read n_workers and the worker array without further synchronisation;
+	   pthread_create() makes both visible to the new thread. */
+	for (size_t i = 0U; i < n_workers; i++) {
+		fx_stack_sched_worker *worker = &sched->workers[i];
+		worker->sched = sched;
+		worker->rng = 2463534242U + (uint32_t)i;
+		fx_stack_timer_wheel_init(&worker->timers, FX_STACK_SCHED_TIMER_TICK_NS,
+		                          fx_stack_timer_now());
+		fx_stack_pool_cache_init(&worker->cache, &sched->pool);
+	}
+	sched->n_workers = n_workers;
+
+	/* Start the workers */
+	for (size_t i = 0U; i < n_workers; i++) {
+		if (pthread_create(&sched->workers[i].thread, NULL,
+		                   _fx_stack_sched_worker_main,
+		                   &sched->workers[i]) != 0) {
+			_fx_stack_sched_stop(sched, i);
+			_fx_stack_sched_release(sched);
+			return false;
+		}
+	}
+	return true;
+}
+
+void fx_stack_sched_destroy(fx_stack_sched *sched) {
+	assert(!_fx_stack_sched_current);
+	_fx_stack_sched_stop(sched, sched->n_workers);
+	_fx_stack_sched_release(sched);
+}
+
+fx_stack_sched_task *fx_stack_sched_spawn(fx_stack_sched *sched,
+                                          fx_stack_cback cback, void *data) {
+	fx_stack_sched_task *task =
+	    (fx_stack_sched_task *)calloc(1U, sizeof(fx_stack_sched_task));
+	if (!task) {
+		return NULL;
+	}
+	task->sched = sched;
+	task->cback = cback;
+	task->data = data;
+
+	/* Push the task onto the deque of the current worker, if any */
+	fx_stack_sched_task *current = _fx_stack_sched_current;
+	_fx_stack_sched_push(sched,
+	                     (current && (current->sched == sched)) ? current->worker
+	                                                            : NULL,
+	                     task);
+	return task;
+}
+
+void fx_stack_sched_yield(void) {
+	fx_stack_sched_task *current = _fx_stack_sched_current;
+	if (current) {
+		current->state = FX_STACK_SCHED_TASK_YIELD;
+		fx_stack_context_swap(&current->ctx, &current->worker->main, NULL);
+	}
+}
+
+void fx_stack_sched_park(fx_stack_sched_park_cback cback, void *data) {
+	fx_stack_sched_task *current = _fx_stack_sched_current;
+	assert(current);
+	current->state = FX_STACK_SCHED_TASK_PARK;
+	current->park_cback = cback;
+	current->park_data = data;
+	fx_stack_context_swap(&current->ctx, &current->worker->main, NULL);
+}
+
+void fx_stack_sched_sleep(uint64_t ns) {
+	const uint64_t now = fx_stack_timer_now();
+	fx_stack_sched_sleep_until((ns > UINT64_MAX - now) ? UINT64_MAX
+	                                                   : (now + ns));
+}
+
+void fx_stack_sched_sleep_until(uint64_t deadline) {
+	if (_fx_stack_sched_current) {
+		_fx_stack_sched_sleep_data data;
+		data.deadline = deadline;
+		fx_stack_sched_park(_fx_stack_sched_sleep_arm, &data);
+		return;
+	}
+
+	/* Block the calling thread if this is not a task */
+	uint64_t now;
+	while ((now = fx_stack_timer_now()) < deadline) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)((deadline - now) / 1000000000U);
+		ts.tv_nsec = (long)((deadline - now) % 1000000000U);
+		nanosleep(&ts, NULL);
+	}
+}
+
+void fx_stack_sched_unpark(fx_stack_sched_task *task) {
+	/* Prefer the deque of the calling worker, if any */
+	fx_stack_sched_task *current = _fx_stack_sched_current;
+	_fx_stack_sched_push(task->sched,
+	                     (current && (current->sched == task->sched))
+	                         ? current->worker
+	                         : NULL,
+	                     task);
+}
+
+void *fx_stack_sched_join(fx_stack_sched_task *task) {
+	fx_stack_sched *sched = task->sched;
+	fx_stack_sched_task *current = _fx_stack_sched_current;
+	if (__atomic_load_n(&task->waiter, __ATOMIC_ACQUIRE) !=
+	    FX_STACK_SCHED_WAITER_DONE) {
+		if (current) {
+			/* Suspend the current task; the worker registers it as waiter */
+			current->state = FX_STACK_SCHED_TASK_JOIN;
+			current->join_target = task;
+			fx_stack_context_swap(&current->ctx, &current->worker->main, NULL);
+		} else {
+			/* Block the calling thread */
+			pthread_mutex_lock(&sched->join_mutex);
+			fx_stack_sched_task *expected = NULL;
+			__atomic_compare_exchange_n(&task->waiter, &expected,
+			                            FX_STACK_SCHED_WAITER_EXTERNAL, false,
+			                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+			while (__atomic_load_n(&task->waiter, __ATOMIC_ACQUIRE) !=
+			       FX_STACK_SCHED_WAITER_DONE) {
+				pthread_cond_wait(&sched->join_cond, &sched->join_mutex);
+			}
+			pthread_mutex_unlock(&sched->join_mutex);
+		}
+	}
+
+	/* The task has finished; release the handle */
+	void *result = task->result;
+#ifdef FX_WITH_CPP_EXCEPTIONS
+	std::exception_ptr *exception = (std::exception_ptr *)task->exception;
+	free(task);
+	if (exception) {
+		std::exception_ptr eptr = std::move(*exception);
+		delete exception;
+		std::rethrow_exception(eptr);
+	}
+#else
+	free(task);
+#endif
+	return result;
+}
+
+fx_stack_sched_task *fx_stack_sched_current(void) {
+	return _fx_stack_sched_current;
+}
@@ -0,0 +1 @@
+stack_sched.c
\ No newline at end of file
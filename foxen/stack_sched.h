@@ -0,0 +1,248 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack_sched.h
+ *
+ * Work-stealing scheduler that multiplexes lightweight tasks onto a fixed
+ * number of worker threads. Each task is executed as a fx_stack_context on a
+ * stack taken from a fx_stack_pool.
+ */
+
+#ifndef FX_FOXEN_STACK_SCHED_H
+#define FX_FOXEN_STACK_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <foxen/stack.h>
+#include <foxen/stack_pool.h>
+#include <foxen/stack_timer.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Capacity of the work-stealing deque of each worker. Tasks spawned while the
+ * deque of the current worker is full are placed in the shared queue. Must be
+ * a power of two.
+ */
+#ifndef FX_STACK_SCHED_DEQUE_CAPACITY
+#define FX_STACK_SCHED_DEQUE_CAPACITY 1024U
+#endif
+
+/**
+ * Resolution of the per-worker timing wheels used by fx_stack_sched_sleep()
+ * in nanoseconds. Sleep deadlines are rounded up to a multiple of this value.
+ */
+#ifndef FX_STACK_SCHED_TIMER_TICK_NS
+#define FX_STACK_SCHED_TIMER_TICK_NS 1000U
+#endif
+
+struct fx_stack_sched_worker;
+
+/**
+ * Opaque task handle returned by fx_stack_sched_spawn(). Every task must be
+ * joined exactly once using fx_stack_sched_join(), which releases the handle.
+ */
+typedef struct fx_stack_sched_task fx_stack_sched_task;
+
+/**
+ * A scheduler executing tasks on a fixed pool of worker threads. Each worker
+ * owns a Chase-Lev deque; tasks spawned by a task are pushed onto the deque of
+ * the worker executing it, and idle workers steal tasks from other workers.
+ * Tasks spawned by threads outside the scheduler and tasks that yield are
+ * placed in a shared FIFO queue.
+ *
+ * All members of this structure should be treated as private.
+ */
+typedef struct fx_stack_sched {
+	/**
+	 * Pool from which the stacks of the tasks are taken.
+	 */
+	fx_stack_pool pool;
+
+	/**
+	 * Array of workers.
+	 */
+	struct fx_stack_sched_worker *workers;
+	size_t n_workers;
+
+	/**
+	 * Shared FIFO queue of runnable tasks, protected by queue_mutex.
+	 * queue_size may be read without holding the mutex.
+	 */
+	pthread_mutex_t queue_mutex;
+	fx_stack_sched_task *queue_head;
+	fx_stack_sched_task *queue_tail;
+	size_t queue_size;
+
+	/**
+	 * Tasks that could not obtain a stack since the pool was exhausted, also
+	 * protected by queue_mutex. They are made runnable again once a stack is
+	 * returned. n_pending may be read without holding the mutex.
+	 */
+	fx_stack_sched_task *pending;
+	size_t n_pending;
+
+	/**
+	 * Idle workers sleep on idle_cond until the epoch counter is incremented,
+	 * which happens whenever a task becomes runnable.
+	 */
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;
+	size_t n_idle;
+	size_t epoch;
+
+	/**
+	 * Threads outside of the scheduler waiting for a task to finish sleep on
+	 * join_cond.
+	 */
+	pthread_mutex_t join_mutex;
+	pthread_cond_t join_cond;
+
+	/**
+	 * Set to a non-zero value once the workers should terminate.
+	 */
+	int stop;
+} fx_stack_sched;
+
+/**
+ * Initialises a scheduler and starts the worker threads.
+ *
+ * @param sched is the scheduler that should be initialised.
+ * @param n_workers is the number of worker threads. If zero, one worker per
+ * online CPU is started.
+ * @param stack_size is the stack size of each task in bytes.
+ * @param max_tasks is the maximum number of tasks that can have a stack at the
+ * same time. Tasks that cannot obtain a stack are delayed until another task
+ * finishes.
+ * @return true if the scheduler was initialised successfully, false otherwise.
+ */
+bool fx_stack_sched_init(fx_stack_sched *sched, size_t n_workers,
+                         size_t stack_size, size_t max_tasks);
+
+/**
+ * Stops the worker threads and releases all resources. Must only be called
+ * once all spawned tasks have been joined, and not from within a task.
+ *
+ * @param sched is the scheduler that should be destroyed.
+ */
+void fx_stack_sched_destroy(fx_stack_sched *sched);
+
+/**
+ * Creates a task executing cback(data) on one of the workers. May be called
+ * from any thread, including from within tasks.
+ *
+ * @param sched is the scheduler that should execute the task.
+ * @param cback is the callback function executed by the task.
+ * @param data is a user-defined pointer passed to the callback function.
+ * @return a handle that must be passed to fx_stack_sched_join(), or NULL if
+ * the task could not be allocated.
+ */
+fx_stack_sched_task *fx_stack_sched_spawn(fx_stack_sched *sched,
+                                          fx_stack_cback cback, void *data);
+
+/**
+ * Suspends the calling task and places it at the end of the shared queue,
+ * allowing other tasks to run. Does nothing if not called from within a task.
+ */
+void fx_stack_sched_yield(void);
+
+/**
+ * Callback function executed by fx_stack_sched_park() once the calling task
+ * has been suspended.
+ *
+ * @param task is the suspended task. The task must eventually be passed to
+ * fx_stack_sched_unpark(), and must not be accessed once it has been.
+ * @param data is the user-defined pointer passed to fx_stack_sched_park().
+ */
+typedef void (*fx_stack_sched_park_cback)(fx_stack_sched_task *task,
+                                          void *data);
+
+/**
+ * Suspends the calling task until it is resumed using fx_stack_sched_unpark().
+ * The given callback is executed by the worker thread after the task has been
+ * suspended; this allows to hand the task over to another thread (such as an
+ * I/O reactor) without racing against the task being resumed while it is
+ * still executing. Must only be called from within a task.
+ *
+ * @param cback is the callback function that should be executed once the task
+ * is suspended.
+ * @param data is a user-defined pointer passed to the callback function.
+ */
+void fx_stack_sched_park(fx_stack_sched_park_cback cback, void *data);
+
+/**
+ * Suspends the calling task for at least the given number of nanoseconds.
+ * The task is resumed by the worker it was suspended on; each worker keeps
+ * the timers of its sleeping tasks in its own timing wheel, so suspending and
+ * resuming a task costs O(1) and requires no locking. Blocks the calling
+ * thread if not called from within a task.
+ *
+ * @param ns is the minimum number of nanoseconds the task is suspended.
+ */
+void fx_stack_sched_sleep(uint64_t ns);
+
+/**
+ * Suspends the calling task until the given deadline has passed. Blocks the
+ * calling thread if not called from within a task.
+ *
+ * @param deadline is the absolute time in nanoseconds on the clock returned by
+ * fx_stack_timer_now(). Deadlines in the past resume the task as soon as
+ * possible.
+ */
+void fx_stack_sched_sleep_until(uint64_t deadline);
+
+/**
+ * Makes a task suspended by fx_stack_sched_park() runnable again. May be
+ * called from any thread, including from within the park callback.
+ *
+ * @param task is the task that should be resumed.
+ */
+void fx_stack_sched_unpark(fx_stack_sched_task *task);
+
+/**
+ * Waits for the given task to finish and releases the task handle. If called
+ * from within a task, the calling task is suspended and its worker executes
+ * other tasks in the meantime; otherwise the calling thread blocks.
+ *
+ * If the task threw a C++ exception (and C++ exception support is enabled),
+ * the exception is re-thrown by this function.
+ *
+ * @param task is the task handle returned by fx_stack_sched_spawn(). Each task
+ * can only be joined once.
+ * @return the value returned by the callback function of the task.
+ */
+void *fx_stack_sched_join(fx_stack_sched_task *task);
+
+/**
+ * Returns the task executing on the calling thread or NULL if the calling
+ * thread is not executing a task.
+ */
+fx_stack_sched_task *fx_stack_sched_current(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_SCHED_H */
@@ -0,0 +1,150 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FX_NO_CONFIG
+#include "config.h"
+#endif
+
+#include <foxen/stack_shared.h>
+
+/*****************************************************************************
+ * Helper functions                                                          *
+ *****************************************************************************/
+
+/**
+ * Copies the live portion of the stack of the given context from the run
+ * stack into its heap buffer.
+ */
+static void _fx_stack_shared_evict(fx_stack_shared_context *sctx) {
+	fx_stack_shared *shared = sctx->shared;
+	const size_t size = (size_t)((uint8_t *)shared->stack_end -
+	                             (uint8_t *)sctx->ctx.sp);
+	assert(size <= (size_t)((uint8_t *)shared->stack_end -
+	                        (uint8_t *)shared->stack_start));
+
+	/* Keep the buffer right-sized; only re-allocate if the buffer is too
+	   small or much larger than necessary */
+	if ((size > sctx->buf_capacity) || (size < sctx->buf_capacity / 2U)) {
+		void *buf = realloc(sctx->buf, size);
+		if (!buf) {
+			abort(); /* The stack cannot be evicted without losing data */
+		}
+		sctx->buf = buf;
+		sctx->buf_capacity = size;
+	}
+	memcpy(sctx->buf, sctx->ctx.sp, size);
+	sctx->buf_size = size;
+}
+
+/**
+ * Copies the stack of the given context from its heap buffer back onto the
+ * run stack.
+ */
+static void _fx_stack_shared_restore(fx_stack_shared_context *sctx) {
+	fx_stack_shared *shared = sctx->shared;
+	assert(sctx->ctx.sp ==
+	       (void *)((uint8_t *)shared->stack_end - sctx->buf_size));
+	memcpy(sctx->ctx.sp, sctx->buf, sctx->buf_size);
+	sctx->buf_size = 0U;
+}
+
+/*****************************************************************************
+ * Public API                                                                *
+ *****************************************************************************/
+
+void fx_stack_shared_init(fx_stack_shared *shared, void *stack_start,
+                          void *stack_end) {
+	assert(stack_start < stack_end);
+	shared->stack_start = stack_start;
+	shared->stack_end = stack_end;
+	shared->occupant = NULL;
+}
+
+void fx_stack_shared_context_init(fx_stack_shared_context *sctx,
+                                  fx_stack_shared *shared, fx_stack_cback cback,
+                                  void *data) {
+	memset(&sctx->ctx, 0, sizeof(sctx->ctx));
+	memset(&sctx->caller, 0, sizeof(sctx->caller));
+	sctx->shared = shared;
+	sctx->cback = cback;
+	sctx->data = data;
+	sctx->started = 0;
+	sctx->buf = NULL;
+	sctx->buf_size = 0U;
+	sctx->buf_capacity = 0U;
+}
+
+void fx_stack_shared_context_destroy(fx_stack_shared_context *sctx) {
+	if (sctx->shared->occupant == sctx) {
+		sctx->shared->occupant = NULL;
+	}
+	if (sctx->started) {
+		fx_stack_context_destroy(&sctx->ctx);
+	}
+	free(sctx->buf);
+	sctx->buf = NULL;
+	sctx->buf_size = 0U;
+	sctx->buf_capacity = 0U;
+}
+
+void *fx_stack_shared_resume(fx_stack_shared_context *sctx, void *value) {
+	fx_stack_shared *shared = sctx->shared;
+
+	/* Make sure we are not executing on the run stack */
+	assert(((void *)&shared < shared->stack_start) ||
+	       ((void *)&shared >= shared->stack_end));
+
+	if (shared->occupant != sctx) {
+		/* Evict the current occupant, unless it has finished */
+		fx_stack_shared_context *occupant = shared->occupant;
+		if (occupant && !fx_stack_context_done(&occupant->ctx)) {
+			_fx_stack_shared_evict(occupant);
+		}
+
+		/* Either write the initial frame to the run stack or restore the
+		   evicted stack */
+		if (!sctx->started) {
+			fx_stack_context_init(&sctx->ctx, shared->stack_start,
+			                      shared->stack_end, sctx->cback, sctx->data);
+			sctx->started = 1;
+		} else {
+			_fx_stack_shared_restore(sctx);
+		}
+		shared->occupant = sctx;
+	}
+
+	void *result = fx_stack_context_swap(&sctx->caller, &sctx->ctx, value);
+
+	/* Release the heap buffer and the run stack once the context finished */
+	if (fx_stack_context_done(&sctx->ctx)) {
+		free(sctx->buf);
+		sctx->buf = NULL;
+		sctx->buf_capacity = 0U;
+		shared->occupant = NULL;
+	}
+	return result;
+}
+
+void *fx_stack_shared_yield(fx_stack_shared_context *sctx, void *value) {
+	return fx_stack_context_swap(&sctx->ctx, &sctx->caller, value);
+}
@@ -0,0 +1 @@
+stack_shared.c
\ No newline at end of file
@@ -0,0 +1,179 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FX_FOXEN_STACK_SHARED_H
+#define FX_FOXEN_STACK_SHARED_H
+
+#include <stddef.h>
+
+#include <foxen/stack.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct fx_stack_shared_context;
+
+/**
+ * A large run stack shared by many contexts. Only one context can reside on
+ * the run stack at a time. When another context is resumed, the live portion
+ * of the resident context's stack (i.e. the memory between its stack pointer
+ * and stack_end) is copied into a heap buffer of exactly the required size and
+ * copied back once the context is resumed again.
+ *
+ * This trades a memcpy() of the live stack portion on each eviction for a
+ * memory footprint per suspended context that is proportional to its actual
+ * stack depth, instead of the size of a dedicated stack.
+ *
+ * Note that pointers at objects on the stack of a context must not be
+ * dereferenced by other contexts sharing the same run stack; the memory at
+ * these addresses is overwritten while the context is evicted.
+ *
+ * All members of this structure should be treated as private.
+ */
+typedef struct fx_stack_shared {
+	/**
+	 * Low- and high-address of the run stack.
+	 */
+	void *stack_start;
+	void *stack_end;
+
+	/**
+	 * Context that currently resides on the run stack or NULL.
+	 */
+	struct fx_stack_shared_context *occupant;
+} fx_stack_shared;
+
+/**
+ * A context executing on a shared run stack. All members of this structure
+ * should be treated as private.
+ */
+typedef struct fx_stack_shared_context {
+	/**
+	 * The actual execution context and the context of the code that resumed
+	 * the context most recently.
+	 */
+	fx_stack_context ctx;
+	fx_stack_context caller;
+
+	/**
+	 * Run stack used by the context.
+	 */
+	fx_stack_shared *shared;
+
+	/**
+	 * Callback function and user-defined data passed to
+	 * fx_stack_shared_context_init(). The execution context is only
+	 * initialised once the context is resumed for the first time.
+	 */
+	fx_stack_cback cback;
+	void *data;
+	int started;
+
+	/**
+	 * Heap buffer holding the live portion of the stack while the context is
+	 * evicted from the run stack.
+	 */
+	void *buf;
+	size_t buf_size;
+	size_t buf_capacity;
+} fx_stack_shared_context;
+
+/**
+ * Initialises a shared run stack.
+ *
+ * @param shared is the shared run stack that should be initialised.
+ * @param stack_start is the low-address of the memory region that should be
+ * used as a run stack.
+ * @param stack_end is the high-address of the memory region that should be used
+ * as a run stack.
+ */
+void fx_stack_shared_init(fx_stack_shared *shared, void *stack_start,
+                          void *stack_end);
+
+/**
+ * Initialises a context executing on the given shared run stack. No memory is
+ * touched until the context is resumed for the first time.
+ *
+ * @param sctx is the context that should be initialised.
+ * @param shared is the run stack the context should execute on.
+ * @param cback is the callback function executed by the context.
+ * @param data is a user-defined pointer that should be passed to the callback
+ * function.
+ */
+void fx_stack_shared_context_init(fx_stack_shared_context *sctx,
+                                  fx_stack_shared *shared, fx_stack_cback cback,
+                                  void *data);
+
+/**
+ * Frees the buffer holding the evicted stack of the context. See
+ * fx_stack_context_destroy() for more information.
+ *
+ * @param sctx is the context that should be destroyed.
+ */
+void fx_stack_shared_context_destroy(fx_stack_shared_context *sctx);
+
+/**
+ * Resumes the given context until it calls fx_stack_shared_yield() or its
+ * callback returns. If another context resides on the run stack, its live
+ * stack portion is copied into its heap buffer first. Must not be called from
+ * code executing on the run stack.
+ *
+ * @param sctx is the context that should be resumed. Must not have finished.
+ * @param value is passed to the context as the result of
+ * fx_stack_shared_yield().
+ * @return the value passed to fx_stack_shared_yield() or the return value of
+ * the callback function.
+ */
+void *fx_stack_shared_resume(fx_stack_shared_context *sctx, void *value);
+
+/**
+ * Suspends the calling context and transfers control back to the code that
+ * called fx_stack_shared_resume(). The stack of the context remains on the run
+ * stack until another context is resumed.
+ *
+ * @param sctx is the currently executing context.
+ * @param value is passed to the resuming code as the result of
+ * fx_stack_shared_resume().
+ * @return the value passed to fx_stack_shared_resume().
+ */
+void *fx_stack_shared_yield(fx_stack_shared_context *sctx, void *value);
+
+/**
+ * Returns a non-zero value if the callback function of the given context has
+ * returned.
+ */
+static inline int fx_stack_shared_context_done(
+    const fx_stack_shared_context *sctx) {
+	return fx_stack_context_done(&sctx->ctx);
+}
+
+/**
+ * Returns the number of bytes currently allocated on the heap for storing the
+ * evicted stack of the given context.
+ */
+static inline size_t fx_stack_shared_context_saved_size(
+    const fx_stack_shared_context *sctx) {
+	return sctx->buf_capacity;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_SHARED_H */
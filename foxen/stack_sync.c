@@ -0,0 +1,559 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sched.h>
+
+#ifndef FX_NO_CONFIG
+#include "config.h"
+#endif
+
+#include <foxen/stack_sync.h>
+
+/*****************************************************************************
+ * Wait queues                                                               *
+ *****************************************************************************/
+
+/**
+ * Number of iterations a thread spins on a queue lock before calling
+ * sched_yield(). Queue locks are only held for a few instructions.
+ */
+#define FX_STACK_SYNC_SPIN 64U
+
+typedef struct _fx_stack_sync_waiter {
+	/**
+	 * Next waiter in the queue.
+	 */
+	struct _fx_stack_sync_waiter *next;
+
+	/**
+	 * Suspended task.
+	 */
+	fx_stack_sched_task *task;
+} _fx_stack_sync_waiter;
+
+static void _fx_stack_sync_queue_init(fx_stack_sync_queue *queue,
+                                      unsigned int flags) {
+	queue->flags = flags;
+	queue->lock = 0;
+	queue->head = NULL;
+	queue->tail = NULL;
+}
+
+static void _fx_stack_sync_lock(fx_stack_sync_queue *queue) {
+	if (queue->flags & FX_STACK_SYNC_LOCAL) {
+		return;
+	}
+	unsigned int n = 0U;
+	while (__atomic_exchange_n(&queue->lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&queue->lock, __ATOMIC_RELAXED)) {
+			if (++n >= FX_STACK_SYNC_SPIN) {
+				sched_yield();
+				n = 0U;
+			}
+		}
+	}
+}
+
+static void _fx_stack_sync_unlock(fx_stack_sync_queue *queue) {
+	if (!(queue->flags & FX_STACK_SYNC_LOCAL)) {
+		__atomic_store_n(&queue->lock, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Executed by the worker once the waiting task has been suspended. Only then
+ * the task may be resumed by another thread.
+ */
+static void _fx_stack_sync_park_cback(fx_stack_sched_task *task, void *data) {
+	(void)task;
+	_fx_stack_sync_unlock((fx_stack_sync_queue *)data);
+}
+
+/**
+ * Appends the calling task to the queue and suspends it until it is removed
+ * from the queue and resumed. The queue lock must be held by the caller and
+ * is released once the task is suspended.
+ */
+static void _fx_stack_sync_wait(fx_stack_sync_queue *queue) {
+	_fx_stack_sync_waiter waiter;
+	waiter.next = NULL;
+	waiter.task = fx_stack_sched_current();
+	assert(waiter.task);
+
+	if (queue->tail) {
+		queue->tail->next = &waiter;
+	} else {
+		queue->head = &waiter;
+	}
+	queue->tail = &waiter;
+
+	fx_stack_sched_park(_fx_stack_sync_park_cback, queue);
+}
+
+/**
+ * Removes the longest waiting task from the queue. The queue lock must be
+ * held by the caller. The returned task must be resumed after the lock has
+ * been released.
+ */
+static fx_stack_sched_task *_fx_stack_sync_pop(fx_stack_sync_queue *queue) {
+	_fx_stack_sync_waiter *waiter = queue->head;
+	if (!waiter) {
+		return NULL;
+	}
+	queue->head = waiter->next;
+	if (!queue->head) {
+		queue->tail = NULL;
+	}
+	return waiter->task;
+}
+
+/**
+ * Removes all waiters from the queue and resumes them. If given, n_waiting is
+ * decremented by the number of resumed tasks.
+ */
+static void _fx_stack_sync_wake_all(fx_stack_sync_queue *queue,
+                                      size_t *n_waiting) {
+	_fx_stack_sync_lock(queue);
+	_fx_stack_sync_waiter *waiter = queue->head;
+	queue->head = NULL;
+	queue->tail = NULL;
+	size_t n = 0U;
+	for (_fx_stack_sync_waiter *w = waiter; w; w = w->next) {
+		n++;
+	}
+	if (n_waiting) {
+		if (queue->flags & FX_STACK_SYNC_LOCAL) {
+			*n_waiting -= n;
+		} else {
+			__atomic_sub_fetch(n_waiting, n, __ATOMIC_SEQ_CST);
+		}
+	}
+	_fx_stack_sync_unlock(queue);
+
+	/* The waiters live on the stacks of the tasks; read "next" before the
+	   task is resumed */
+	while (waiter) {
+		_fx_stack_sync_waiter *next = waiter->next;
+		fx_stack_sched_unpark(waiter->task);
+		waiter = next;
+	}
+}
+
+/*****************************************************************************
+ * Semaphore                                                                 *
+ *****************************************************************************/
+
+void fx_stack_sem_init(fx_stack_sem *sem, size_t count, unsigned int flags) {
+	sem->count = (long)count;
+	sem->n_wakeups = 0U;
+	_fx_stack_sync_queue_init(&sem->queue, flags);
+}
+
+void fx_stack_sem_destroy(fx_stack_sem *sem) {
+	assert(!sem->queue.head);
+	(void)sem;
+}
+
+void fx_stack_sem_wait(fx_stack_sem *sem) {
+	/* Fast path: take a unit if one is available */
+	if (sem->queue.flags & FX_STACK_SYNC_LOCAL) {
+		if (--sem->count >= 0) {
+			return;
+		}
+	} else if (__atomic_sub_fetch(&sem->count, 1, __ATOMIC_ACQUIRE) >= 0) {
+		return;
+	}
+
+	/* A unit may have been posted between decrementing the count and
+	   acquiring the lock */
+	_fx_stack_sync_lock(&sem->queue);
+	if (sem->n_wakeups > 0U) {
+		sem->n_wakeups--;
+		_fx_stack_sync_unlock(&sem->queue);
+		return;
+	}
+	_fx_stack_sync_wait(&sem->queue);
+}
+
+bool fx_stack_sem_trywait(fx_stack_sem *sem) {
+	if (sem->queue.flags & FX_STACK_SYNC_LOCAL) {
+		if (sem->count > 0) {
+			sem->count--;
+			return true;
+		}
+		return false;
+	}
+	long count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while (count > 0) {
+		if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, true,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void fx_stack_sem_post(fx_stack_sem *sem) {
+	/* Fast path: nobody is waiting */
+	if (sem->queue.flags & FX_STACK_SYNC_LOCAL) {
+		if (++sem->count > 0) {
+			return;
+		}
+	} else if (__atomic_add_fetch(&sem->count, 1, __ATOMIC_RELEASE) > 0) {
+		return;
+	}
+
+	/* Hand the unit over to the longest waiting task. If the task that
+	   decremented the count has not reached the queue yet, leave the unit
+	   for it. */
+	_fx_stack_sync_lock(&sem->queue);
+	fx_stack_sched_task *task = _fx_stack_sync_pop(&sem->queue);
+	if (!task) {
+		sem->n_wakeups++;
+	}
+	_fx_stack_sync_unlock(&sem->queue);
+	if (task) {
+		fx_stack_sched_unpark(task);
+	}
+}
+
+/*****************************************************************************
+ * Mutex                                                                     *
+ *****************************************************************************/
+
+void fx_stack_mutex_init(fx_stack_mutex *mutex, unsigned int flags) {
+	fx_stack_sem_init(&mutex->sem, 1U, flags);
+}
+
+void fx_stack_mutex_destroy(fx_stack_mutex *mutex) {
+	assert(mutex->sem.count == 1);
+	fx_stack_sem_destroy(&mutex->sem);
+}
+
+void fx_stack_mutex_lock(fx_stack_mutex *mutex) {
+	fx_stack_sem_wait(&mutex->sem);
+}
+
+bool fx_stack_mutex_trylock(fx_stack_mutex *mutex) {
+	return fx_stack_sem_trywait(&mutex->sem);
+}
+
+void fx_stack_mutex_unlock(fx_stack_mutex *mutex) {
+	fx_stack_sem_post(&mutex->sem);
+}
+
+/*****************************************************************************
+ * Condition variable                                                        *
+ *****************************************************************************/
+
+void fx_stack_cond_init(fx_stack_cond *cond, unsigned int flags) {
+	_fx_stack_sync_queue_init(&cond->queue, flags);
+}
+
+void fx_stack_cond_destroy(fx_stack_cond *cond) {
+	assert(!cond->queue.head);
+	(void)cond;
+}
+
+void fx_stack_cond_wait(fx_stack_cond *cond, fx_stack_mutex *mutex) {
+	/* Signals are delivered under the queue lock, so none can be lost
+	   between unlocking the mutex and suspending the task */
+	_fx_stack_sync_lock(&cond->queue);
+	fx_stack_mutex_unlock(mutex);
+	_fx_stack_sync_wait(&cond->queue);
+	fx_stack_mutex_lock(mutex);
+}
+
+void fx_stack_cond_signal(fx_stack_cond *cond) {
+	_fx_stack_sync_lock(&cond->queue);
+	fx_stack_sched_task *task = _fx_stack_sync_pop(&cond->queue);
+	_fx_stack_sync_unlock(&cond->queue);
+	if (task) {
+		fx_stack_sched_unpark(task);
+	}
+}
+
+void fx_stack_cond_broadcast(fx_stack_cond *cond) {
+	_fx_stack_sync_wake_all(&cond->queue, NULL);
+}
+
+/*****************************************************************************
+ * Channel                                                                   *
+ *****************************************************************************/
+
+/*
+ * The multi-producer, multi-consumer ring buffer follows D. Vyukov's bounded
+ * MPMC queue: each cell carries a sequence number indicating whether it is
+ * ready to be written or read in the current round.
+ */
+
+static bool _fx_stack_chan_push(fx_stack_chan *chan, void *value) {
+	if (chan->flags & FX_STACK_SYNC_LOCAL) {
+		if (chan->tail - chan->head > chan->mask) {
+			return false;
+		}
+		chan->cells[chan->tail++ & chan->mask].value = value;
+		return true;
+	}
+
+	if (chan->flags & FX_STACK_CHAN_SPSC) {
+		const size_t t = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+		if (t - __atomic_load_n(&chan->head, __ATOMIC_ACQUIRE) > chan->mask) {
+			return false;
+		}
+		chan->cells[t & chan->mask].value = value;
+		__atomic_store_n(&chan->tail, t + 1U, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	size_t t = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+	while (true) {
+		_fx_stack_chan_cell *cell = &chan->cells[t & chan->mask];
+		const size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		const intptr_t diff = (intptr_t)(seq - t);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&chan->tail, &t, t + 1U, true,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				cell->value = value;
+				__atomic_store_n(&cell->seq, t + 1U, __ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false; /* Full */
+		} else {
+			t = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static bool _fx_stack_chan_pop(fx_stack_chan *chan, void **value) {
+	if (chan->flags & FX_STACK_SYNC_LOCAL) {
+		if (chan->tail == chan->head) {
+			return false;
+		}
+		*value = chan->cells[chan->head++ & chan->mask].value;
+		return true;
+	}
+
+	if (chan->flags & FX_STACK_CHAN_SPSC) {
+		const size_t h = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&chan->tail, __ATOMIC_ACQUIRE) == h) {
+			return false;
+		}
+		*value = chan->cells[h & chan->mask].value;
+		__atomic_store_n(&chan->head, h + 1U, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	size_t h = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+	while (true) {
+		_fx_stack_chan_cell *cell = &chan->cells[h & chan->mask];
+		const size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		const intptr_t diff = (intptr_t)(seq - (h + 1U));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&chan->head, &h, h + 1U, true,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				*value = cell->value;
+				__atomic_store_n(&cell->seq, h + chan->mask + 1U,
+				                 __ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false; /* Empty */
+		} else {
+			h = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static bool _fx_stack_chan_closed(fx_stack_chan *chan) {
+	if (chan->flags & FX_STACK_SYNC_LOCAL) {
+		return chan->closed;
+	}
+	return __atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns true if a send (or a receive) might succeed.
+ */
+static bool _fx_stack_chan_ready(fx_stack_chan *chan, bool send) {
+	const size_t h = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+	const size_t t = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+	return send ? (t - h <= chan->mask) : (t != h);
+}
+
+/**
+ * Suspends the calling task until it is woken up by a receiver (or a sender).
+ * Returns false without waiting if the channel has been closed.
+ */
+static bool _fx_stack_chan_wait(fx_stack_chan *chan, bool send) {
+	fx_stack_sync_queue *queue = send ? &chan->senders : &chan->receivers;
+	size_t *n_waiting = send ? &chan->n_senders : &chan->n_receivers;
+
+	_fx_stack_sync_lock(queue);
+	if (_fx_stack_chan_closed(chan)) {
+		_fx_stack_sync_unlock(queue);
+		return false;
+	}
+
+	/* Announce the waiter before checking the ring buffer a final time; the
+	   other side first updates the ring buffer and then checks for waiters */
+	const bool local = chan->flags & FX_STACK_SYNC_LOCAL;
+	if (local) {
+		(*n_waiting)++;
+	} else {
+		__atomic_add_fetch(n_waiting, 1U, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	if (_fx_stack_chan_ready(chan, send)) {
+		if (local) {
+			(*n_waiting)--;
+		} else {
+			__atomic_sub_fetch(n_waiting, 1U, __ATOMIC_SEQ_CST);
+		}
+		_fx_stack_sync_unlock(queue);
+		return true;
+	}
+
+	/* The task waking this task decrements the counter */
+	_fx_stack_sync_wait(queue);
+	return true;
+}
+
+/**
+ * Resumes a single receiver (or sender) after an element was sent (or
+ * received).
+ */
+static void _fx_stack_chan_wake(fx_stack_chan *chan, bool send) {
+	fx_stack_sync_queue *queue = send ? &chan->senders : &chan->receivers;
+	size_t *n_waiting = send ? &chan->n_senders : &chan->n_receivers;
+
+	const bool local = chan->flags & FX_STACK_SYNC_LOCAL;
+	if (local) {
+		if (!*n_waiting) {
+			return;
+		}
+	} else {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(n_waiting, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+
+	_fx_stack_sync_lock(queue);
+	fx_stack_sched_task *task = _fx_stack_sync_pop(queue);
+	if (task) {
+		if (local) {
+			(*n_waiting)--;
+		} else {
+			__atomic_sub_fetch(n_waiting, 1U, __ATOMIC_SEQ_CST);
+		}
+	}
+	_fx_stack_sync_unlock(queue);
+	if (task) {
+		fx_stack_sched_unpark(task);
+	}
+}
+
+bool fx_stack_chan_init(fx_stack_chan *chan, size_t capacity,
+                        unsigned int flags) {
+	memset(chan, 0, sizeof(fx_stack_chan));
+
+	size_t n_cells = 1U;
+	while (n_cells < capacity) {
+		n_cells *= 2U;
+	}
+	chan->cells =
+	    (_fx_stack_chan_cell *)malloc(n_cells * sizeof(_fx_stack_chan_cell));
+	if (!chan->cells) {
+		return false;
+	}
+	for (size_t i = 0U; i < n_cells; i++) {
+		chan->cells[i].seq = i;
+		chan->cells[i].value = NULL;
+	}
+
+	chan->flags = flags;
+	chan->mask = n_cells - 1U;
+	_fx_stack_sync_queue_init(&chan->senders, flags);
+	_fx_stack_sync_queue_init(&chan->receivers, flags);
+	return true;
+}
+
+void fx_stack_chan_destroy(fx_stack_chan *chan) {
+	assert(!chan->senders.head && !chan->receivers.head);
+	free(chan->cells);
+	chan->cells = NULL;
+}
+
+bool fx_stack_chan_send(fx_stack_chan *chan, void *value) {
+	while (!_fx_stack_chan_closed(chan)) {
+		if (_fx_stack_chan_push(chan, value)) {
+			_fx_stack_chan_wake(chan, false);
+			return true;
+		}
+		if (!_fx_stack_chan_wait(chan, true)) {
+			break;
+		}
+	}
+	return false;
+}
+
+bool fx_stack_chan_trysend(fx_stack_chan *chan, void *value) {
+	if (_fx_stack_chan_closed(chan) || !_fx_stack_chan_push(chan, value)) {
+		return false;
+	}
+	_fx_stack_chan_wake(chan, false);
+	return true;
+}
+
+bool fx_stack_chan_recv(fx_stack_chan *chan, void **value) {
+	while (!_fx_stack_chan_pop(chan, value)) {
+		if (!_fx_stack_chan_wait(chan, false)) {
+			/* Closed; drain elements sent before the channel was closed */
+			return fx_stack_chan_tryrecv(chan, value);
+		}
+	}
+	_fx_stack_chan_wake(chan, true);
+	return true;
+}
+
+bool fx_stack_chan_tryrecv(fx_stack_chan *chan, void **value) {
+	if (!_fx_stack_chan_pop(chan, value)) {
+		return false;
+	}
+	_fx_stack_chan_wake(chan, true);
+	return true;
+}
+
+void fx_stack_chan_close(fx_stack_chan *chan) {
+	if (chan->flags & FX_STACK_SYNC_LOCAL) {
+		chan->closed = 1;
+	} else {
+		__atomic_store_n(&chan->closed, 1, __ATOMIC_SEQ_CST);
+	}
+	_fx_stack_sync_wake_all(&chan->senders, &chan->n_senders);
+	_fx_stack_sync_wake_all(&chan->receivers, &chan->n_receivers);
+}
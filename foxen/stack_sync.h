@@ -0,0 +1,353 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack_sync.h
+ *
+ * Synchronisation primitives for tasks executed by a fx_stack_sched. Instead
+ * of blocking the worker thread, a task waiting for a mutex, a condition
+ * variable, a semaphore or a channel is suspended, and the worker executes
+ * other tasks in the meantime. Uncontended operations do not suspend.
+ *
+ * Functions that may have to wait must only be called from within a task;
+ * functions that never wait (unlocking, signalling, posting and the try_*
+ * functions) may be called from any thread.
+ */
+
+#ifndef FX_FOXEN_STACK_SYNC_H
+#define FX_FOXEN_STACK_SYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <foxen/stack_sched.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * If this flag is passed to any of the initialisation functions below, all
+ * tasks accessing the object are assumed to be executed by the same worker
+ * thread, e.g. by a scheduler with a single worker. Operations then do not
+ * use any atomic instructions or locks.
+ */
+#define FX_STACK_SYNC_LOCAL (1U << 0U)
+
+/**
+ * If this flag is passed to fx_stack_chan_init(), at most one task sends and
+ * at most one task receives at the same time. The channel then uses a ring
+ * buffer that only requires acquire/release loads and stores.
+ */
+#define FX_STACK_CHAN_SPSC (1U << 1U)
+
+struct _fx_stack_sync_waiter;
+
+/**
+ * FIFO queue of suspended tasks. All members of this structure should be
+ * treated as private.
+ */
+typedef struct fx_stack_sync_queue {
+	/**
+	 * Flags passed to the initialisation function of the object the queue
+	 * belongs to.
+	 */
+	unsigned int flags;
+
+	/**
+	 * Spin lock protecting the queue. Unused if FX_STACK_SYNC_LOCAL is set.
+	 */
+	int lock;
+
+	/**
+	 * Linked list of waiters. The waiters are stored on the stacks of the
+	 * suspended tasks.
+	 */
+	struct _fx_stack_sync_waiter *head;
+	struct _fx_stack_sync_waiter *tail;
+} fx_stack_sync_queue;
+
+/**
+ * Counting semaphore. All members of this structure should be treated as
+ * private.
+ */
+typedef struct fx_stack_sem {
+	/**
+	 * Number of available units. Negative values indicate the number of tasks
+	 * that are waiting or about to wait.
+	 */
+	long count;
+
+	/**
+	 * Number of units posted to tasks that have decremented the count but not
+	 * yet added themselves to the queue. Protected by the queue lock.
+	 */
+	size_t n_wakeups;
+
+	fx_stack_sync_queue queue;
+} fx_stack_sem;
+
+/**
+ * Mutex. Ownership is directly handed over to the longest waiting task when
+ * the mutex is unlocked. All members of this structure should be treated as
+ * private.
+ */
+typedef struct fx_stack_mutex {
+	fx_stack_sem sem;
+} fx_stack_mutex;
+
+/**
+ * Condition variable. All members of this structure should be treated as
+ * private.
+ */
+typedef struct fx_stack_cond {
+	fx_stack_sync_queue queue;
+} fx_stack_cond;
+
+/**
+ * Slot of a multi-producer, multi-consumer channel.
+ */
+typedef struct _fx_stack_chan_cell {
+	size_t seq;
+	void *value;
+} _fx_stack_chan_cell;
+
+/**
+ * Bounded channel passing pointers from senders to receivers in FIFO order.
+ * The ring buffer itself is lock-free; the queue locks are only acquired if a
+ * task has to wait or has to be woken up. All members of this structure
+ * should be treated as private.
+ */
+typedef struct fx_stack_chan {
+	/**
+	 * Flags passed to fx_stack_chan_init().
+	 */
+	unsigned int flags;
+
+	/**
+	 * Ring buffer with a power-of-two number of cells.
+	 */
+	_fx_stack_chan_cell *cells;
+	size_t mask;
+
+	/**
+	 * Index of the next cell to receive from and to send to. Both indices
+	 * only ever increase and are placed on separate cache lines.
+	 */
+	char _pad0[64];
+	size_t head;
+	char _pad1[64];
+	size_t tail;
+	char _pad2[64];
+
+	/**
+	 * Set to a non-zero value by fx_stack_chan_close().
+	 */
+	int closed;
+
+	/**
+	 * Number of tasks in the process of waiting for free space or for an
+	 * element, and the corresponding queues.
+	 */
+	size_t n_senders;
+	size_t n_receivers;
+	fx_stack_sync_queue senders;
+	fx_stack_sync_queue receivers;
+} fx_stack_chan;
+
+/******************************************************************************
+ * Semaphore                                                                  *
+ ******************************************************************************/
+
+/**
+ * Initialises a semaphore.
+ *
+ * @param sem is the semaphore that should be initialised.
+ * @param count is the initial number of available units.
+ * @param flags is either zero or FX_STACK_SYNC_LOCAL.
+ */
+void fx_stack_sem_init(fx_stack_sem *sem, size_t count, unsigned int flags);
+
+/**
+ * Destroys a semaphore. No task must be waiting for the semaphore.
+ */
+void fx_stack_sem_destroy(fx_stack_sem *sem);
+
+/**
+ * Takes a unit from the semaphore. Suspends the calling task until a unit is
+ * available. Must only be called from within a task.
+ */
+void fx_stack_sem_wait(fx_stack_sem *sem);
+
+/**
+ * Takes a unit from the semaphore if one is available.
+ *
+ * @return true if a unit was taken, false otherwise.
+ */
+bool fx_stack_sem_trywait(fx_stack_sem *sem);
+
+/**
+ * Returns a unit to the semaphore. If tasks are waiting, the unit is passed
+ * to the longest waiting task, which is resumed.
+ */
+void fx_stack_sem_post(fx_stack_sem *sem);
+
+/******************************************************************************
+ * Mutex                                                                      *
+ ******************************************************************************/
+
+/**
+ * Initialises a mutex.
+ *
+ * @param mutex is the mutex that should be initialised.
+ * @param flags is either zero or FX_STACK_SYNC_LOCAL.
+ */
+void fx_stack_mutex_init(fx_stack_mutex *mutex, unsigned int flags);
+
+/**
+ * Destroys a mutex. The mutex must not be locked.
+ */
+void fx_stack_mutex_destroy(fx_stack_mutex *mutex);
+
+/**
+ * Locks the mutex. Suspends the calling task until the mutex is available.
+ * Must only be called from within a task. The mutex is not recursive.
+ */
+void fx_stack_mutex_lock(fx_stack_mutex *mutex);
+
+/**
+ * Locks the mutex if it is available.
+ *
+ * @return true if the mutex was locked, false otherwise.
+ */
+bool fx_stack_mutex_trylock(fx_stack_mutex *mutex);
+
+/**
+ * Unlocks the mutex. Since tasks may migrate between worker threads, the
+ * mutex may be unlocked by a different thread than the one that locked it.
+ */
+void fx_stack_mutex_unlock(fx_stack_mutex *mutex);
+
+/******************************************************************************
+ * Condition variable                                                         *
+ ******************************************************************************/
+
+/**
+ * Initialises a condition variable.
+ *
+ * @param cond is the condition variable that should be initialised.
+ * @param flags is either zero or FX_STACK_SYNC_LOCAL.
+ */
+void fx_stack_cond_init(fx_stack_cond *cond, unsigned int flags);
+
+/**
+ * Destroys a condition variable. No task must be waiting for it.
+ */
+void fx_stack_cond_destroy(fx_stack_cond *cond);
+
+/**
+ * Atomically unlocks the mutex and suspends the calling task until the
+ * condition variable is signalled, then locks the mutex again. Must only be
+ * called from within a task. There are no spurious wake-ups, but the
+ * condition should nevertheless be checked in a loop, since another task may
+ * have changed the state before the mutex was re-acquired.
+ *
+ * @param cond is the condition variable.
+ * @param mutex is the mutex that is locked by the calling task.
+ */
+void fx_stack_cond_wait(fx_stack_cond *cond, fx_stack_mutex *mutex);
+
+/**
+ * Resumes the longest waiting task, if any.
+ */
+void fx_stack_cond_signal(fx_stack_cond *cond);
+
+/**
+ * Resumes all waiting tasks.
+ */
+void fx_stack_cond_broadcast(fx_stack_cond *cond);
+
+/******************************************************************************
+ * Channel                                                                    *
+ ******************************************************************************/
+
+/**
+ * Initialises a channel.
+ *
+ * @param chan is the channel that should be initialised.
+ * @param capacity is the maximum number of elements in the channel. Rounded
+ * up to the next power of two.
+ * @param flags is a combination of FX_STACK_SYNC_LOCAL and FX_STACK_CHAN_SPSC.
+ * @return true if the channel was initialised successfully, false if the ring
+ * buffer could not be allocated.
+ */
+bool fx_stack_chan_init(fx_stack_chan *chan, size_t capacity,
+                        unsigned int flags);
+
+/**
+ * Releases the ring buffer. No task must be waiting for the channel.
+ */
+void fx_stack_chan_destroy(fx_stack_chan *chan);
+
+/**
+ * Sends an element. Suspends the calling task while the channel is full. Must
+ * only be called from within a task.
+ *
+ * @param chan is the channel.
+ * @param value is the element that should be sent.
+ * @return true if the element was sent, false if the channel was closed.
+ */
+bool fx_stack_chan_send(fx_stack_chan *chan, void *value);
+
+/**
+ * Sends an element if the channel is not full.
+ *
+ * @return true if the element was sent, false if the channel is full or was
+ * closed.
+ */
+bool fx_stack_chan_trysend(fx_stack_chan *chan, void *value);
+
+/**
+ * Receives an element. Suspends the calling task while the channel is empty.
+ * Must only be called from within a task.
+ *
+ * @param chan is the channel.
+ * @param value is the location at which the received element is stored.
+ * @return true if an element was received, false if the channel was closed
+ * and all elements have been received.
+ */
+bool fx_stack_chan_recv(fx_stack_chan *chan, void **value);
+
+/**
+ * Receives an element if the channel is not empty.
+ *
+ * @return true if an element was received, false otherwise.
+ */
+bool fx_stack_chan_tryrecv(fx_stack_chan *chan, void **value);
+
+/**
+ * Closes the channel. Subsequent sends fail; receivers receive the remaining
+ * elements. All waiting tasks are resumed.
+ */
+void fx_stack_chan_close(fx_stack_chan *chan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_SYNC_H */
@@ -0,0 +1,280 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <string.h>
+#include <time.h>
+
+#ifndef FX_NO_CONFIG
+#include "config.h"
+#endif
+
+#include <foxen/stack_timer.h>
+
+#define FX_STACK_TIMER_SLOT_MASK ((uint64_t)(FX_STACK_TIMER_SLOTS - 1U))
+
+/* Slot index of timers in the batch of expired timers */
+#define FX_STACK_TIMER_SLOT_BATCH (FX_STACK_TIMER_LEVELS * FX_STACK_TIMER_SLOTS)
+
+/******************************************************************************
+ * Private helper functions                                                   *
+ ******************************************************************************/
+
+/**
+ * Returns the first slot list of the given wheel. The slot index stored in a
+ * timer is relative to this list.
+ */
+static inline fx_stack_timer **_fx_stack_timer_slots(
+    fx_stack_timer_wheel *wheel) {
+	return &wheel->slots[0][0];
+}
+
+/**
+ * Returns the index of the level and slot that should hold a timer expiring
+ * at the given tick. Timers that are due or overdue are stored in the level
+ * zero slot of the current tick; this slot is not used otherwise, since the
+ * current tick has already been processed.
+ */
+static unsigned int _fx_stack_timer_slot_idx(const fx_stack_timer_wheel *wheel,
+                                             uint64_t expires) {
+	if (expires <= wheel->now) {
+		return (unsigned int)(wheel->now & FX_STACK_TIMER_SLOT_MASK);
+	}
+	const unsigned int msb =
+	    63U - (unsigned int)__builtin_clzll(expires ^ wheel->now);
+	const unsigned int level = msb / FX_STACK_TIMER_SLOT_BITS;
+	const unsigned int slot =
+	    (unsigned int)((expires >> (level * FX_STACK_TIMER_SLOT_BITS)) &
+	                   FX_STACK_TIMER_SLOT_MASK);
+	return level * FX_STACK_TIMER_SLOTS + slot;
+}
+
+static void _fx_stack_timer_insert(fx_stack_timer_wheel *wheel,
+                                   fx_stack_timer *timer) {
+	const unsigned int idx = _fx_stack_timer_slot_idx(wheel, timer->expires);
+	fx_stack_timer **head = _fx_stack_timer_slots(wheel) + idx;
+	timer->slot = idx;
+	timer->next = *head;
+	timer->pprev = head;
+	if (*head) {
+		(*head)->pprev = &timer->next;
+	}
+	*head = timer;
+	wheel->occupied[idx / FX_STACK_TIMER_SLOTS] |=
+	    ((uint64_t)1U) << (idx % FX_STACK_TIMER_SLOTS);
+}
+
+/**
+ * Detaches the list of timers stored in the given slot from the wheel.
+ */
+static fx_stack_timer *_fx_stack_timer_detach(fx_stack_timer_wheel *wheel,
+                                              unsigned int idx) {
+	fx_stack_timer **head = _fx_stack_timer_slots(wheel) + idx;
+	fx_stack_timer *timer = *head;
+	*head = NULL;
+	wheel->occupied[idx / FX_STACK_TIMER_SLOTS] &=
+	    ~(((uint64_t)1U) << (idx % FX_STACK_TIMER_SLOTS));
+	return timer;
+}
+
+/**
+ * Moves all timers in the given slot to the batch of expired timers. Since all
+ * timers in a slot are due at the same time, the order of the batch is the
+ * order of the deadlines. Timers in the batch remain pending until their
+ * callback is executed, so they can still be cancelled.
+ */
+static void _fx_stack_timer_collect(fx_stack_timer_wheel *wheel,
+                                    unsigned int idx,
+                                    fx_stack_timer ***batch_tail,
+                                    size_t *n_expired) {
+	fx_stack_timer *timer = _fx_stack_timer_detach(wheel, idx);
+	while (timer) {
+		timer->slot = FX_STACK_TIMER_SLOT_BATCH;
+		timer->pprev = *batch_tail;
+		**batch_tail = timer;
+		*batch_tail = &timer->next;
+		timer = timer->next;
+		(*n_expired)++;
+	}
+	**batch_tail = NULL;
+}
+
+/**
+ * Re-inserts all timers in the given slot relative to the current time. This
+ * moves each timer to a lower level.
+ */
+static void _fx_stack_timer_cascade(fx_stack_timer_wheel *wheel,
+                                    unsigned int idx) {
+	fx_stack_timer *timer = _fx_stack_timer_detach(wheel, idx);
+	while (timer) {
+		fx_stack_timer *next = timer->next;
+		_fx_stack_timer_insert(wheel, timer);
+		timer = next;
+	}
+}
+
+/**
+ * Searches the tick after the current tick at which the next slot must be
+ * processed, i.e. the start of the first occupied slot following the current
+ * slot on any level. Lower levels always precede higher levels.
+ *
+ * @param idx receives the index of the slot.
+ * @return false if no timer is pending except for overdue ones.
+ */
+static bool _fx_stack_timer_next_event(const fx_stack_timer_wheel *wheel,
+                                       uint64_t *tick, unsigned int *idx) {
+	const uint64_t now = wheel->now;
+	for (unsigned int level = 0U; level < FX_STACK_TIMER_LEVELS; level++) {
+		const unsigned int shift = level * FX_STACK_TIMER_SLOT_BITS;
+		const unsigned int cur =
+		    (unsigned int)((now >> shift) & FX_STACK_TIMER_SLOT_MASK);
+		const uint64_t later =
+		    wheel->occupied[level] & ~((((uint64_t)2U) << cur) - 1U);
+		if (later) {
+			const unsigned int slot = (unsigned int)__builtin_ctzll(later);
+			const unsigned int high_shift = shift + FX_STACK_TIMER_SLOT_BITS;
+			const uint64_t high =
+			    (high_shift < 64U) ? (now & ~((((uint64_t)1U) << high_shift) - 1U))
+			                       : 0U;
+			*tick = high | (((uint64_t)slot) << shift);
+			*idx = level * FX_STACK_TIMER_SLOTS + slot;
+			return true;
+		}
+	}
+	return false;
+}
+
+/******************************************************************************
+ * Public API                                                                 *
+ ******************************************************************************/
+
+uint64_t fx_stack_timer_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+void fx_stack_timer_wheel_init(fx_stack_timer_wheel *wheel, uint64_t tick_ns,
+                               uint64_t now_ns) {
+	memset(wheel, 0, sizeof(fx_stack_timer_wheel));
+	wheel->tick_ns = tick_ns ? tick_ns : 1U;
+	wheel->now = now_ns / wheel->tick_ns;
+}
+
+void fx_stack_timer_add(fx_stack_timer_wheel *wheel, fx_stack_timer *timer,
+                        uint64_t deadline_ns, fx_stack_timer_cback cback,
+                        void *data) {
+	/* Round the deadline up, so timers never expire early */
+	timer->expires = deadline_ns / wheel->tick_ns +
+	                 ((deadline_ns % wheel->tick_ns) ? 1U : 0U);
+	timer->cback = cback;
+	timer->data = data;
+	_fx_stack_timer_insert(wheel, timer);
+	wheel->n_timers++;
+}
+
+bool fx_stack_timer_cancel(fx_stack_timer_wheel *wheel, fx_stack_timer *timer) {
+	if (!timer->pprev) {
+		return false;
+	}
+	*timer->pprev = timer->next;
+	if (timer->next) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->pprev = NULL;
+
+	/* Timers in the batch of expired timers are no longer counted */
+	if (timer->slot == FX_STACK_TIMER_SLOT_BATCH) {
+		return true;
+	}
+	if (!_fx_stack_timer_slots(wheel)[timer->slot]) {
+		wheel->occupied[timer->slot / FX_STACK_TIMER_SLOTS] &=
+		    ~(((uint64_t)1U) << (timer->slot % FX_STACK_TIMER_SLOTS));
+	}
+	wheel->n_timers--;
+	return true;
+}
+
+uint64_t fx_stack_timer_wheel_next(const fx_stack_timer_wheel *wheel) {
+	if (wheel->n_timers == 0U) {
+		return UINT64_MAX;
+	}
+
+	/* Overdue timers are stored in the level zero slot of the current tick */
+	uint64_t tick = wheel->now;
+	unsigned int idx;
+	if (!(wheel->occupied[0] & (((uint64_t)1U)
+	                            << (wheel->now & FX_STACK_TIMER_SLOT_MASK)))) {
+		_fx_stack_timer_next_event(wheel, &tick, &idx);
+	}
+	if (tick > UINT64_MAX / wheel->tick_ns) {
+		return UINT64_MAX;
+	}
+	return tick * wheel->tick_ns;
+}
+
+size_t fx_stack_timer_wheel_advance(fx_stack_timer_wheel *wheel,
+                                    uint64_t now_ns) {
+	const uint64_t target = now_ns / wheel->tick_ns;
+	fx_stack_timer *batch = NULL, **batch_tail = &batch;
+	size_t n_expired = 0U;
+
+	/* Collect the overdue timers */
+	_fx_stack_timer_collect(
+	    wheel, (unsigned int)(wheel->now & FX_STACK_TIMER_SLOT_MASK),
+	    &batch_tail, &n_expired);
+
+	/* Jump from one occupied slot to the next until the target is reached.
+	   Slots on higher levels are cascaded, which may add timers to the level
+	   zero slot of the new current tick. */
+	uint64_t tick;
+	unsigned int idx;
+	while (_fx_stack_timer_next_event(wheel, &tick, &idx) && tick <= target) {
+		wheel->now = tick;
+		if (idx >= FX_STACK_TIMER_SLOTS) {
+			_fx_stack_timer_cascade(wheel, idx);
+		}
+		_fx_stack_timer_collect(
+		    wheel, (unsigned int)(tick & FX_STACK_TIMER_SLOT_MASK), &batch_tail,
+		    &n_expired);
+	}
+	if (target > wheel->now) {
+		wheel->now = target;
+	}
+	wheel->n_timers -= n_expired;
+
+	/* Execute the callbacks. Timers re-added by a callback are inserted
+	   relative to the new current time and are not part of this batch. A
+	   callback may cancel timers that are still in the batch. */
+	size_t n_executed = 0U;
+	while (batch) {
+		fx_stack_timer *timer = batch;
+		batch = timer->next;
+		if (batch) {
+			batch->pprev = &batch;
+		}
+		timer->next = NULL;
+		timer->pprev = NULL;
+		timer->cback(timer, timer->data);
+		n_executed++;
+	}
+	return n_executed;
+}
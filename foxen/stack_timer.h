@@ -0,0 +1,195 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stack_timer.h
+ *
+ * Hierarchical timing wheel. Timers are intrusive and inserted and cancelled
+ * in O(1); expired timers are collected in batches when the wheel is
+ * advanced. A wheel is not thread-safe; it is meant to be owned by a single
+ * thread, such as a fx_stack_sched worker or the fx_stack_io reactor.
+ */
+
+#ifndef FX_FOXEN_STACK_TIMER_H
+#define FX_FOXEN_STACK_TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of slots per level (as a power of two) and number of levels. Eleven
+ * levels of 64 slots cover the entire 64-bit tick range, so there is no
+ * overflow list.
+ */
+#define FX_STACK_TIMER_SLOT_BITS 6U
+#define FX_STACK_TIMER_SLOTS (1U << FX_STACK_TIMER_SLOT_BITS)
+#define FX_STACK_TIMER_LEVELS 11U
+
+struct fx_stack_timer;
+
+/**
+ * Callback executed once a timer has expired.
+ *
+ * @param timer is the expired timer. It is no longer part of the wheel and may
+ * be re-added from within the callback.
+ * @param data is the user-defined pointer passed to fx_stack_timer_add().
+ */
+typedef void (*fx_stack_timer_cback)(struct fx_stack_timer *timer, void *data);
+
+/**
+ * A timer. All members of this structure should be treated as private. The
+ * structure must not be moved in memory while the timer is pending.
+ */
+typedef struct fx_stack_timer {
+	/**
+	 * Neighbours in the list of the slot or the batch of expired timers the
+	 * timer is stored in. "pprev" points at the "next" member of the previous
+	 * timer or at the head of the list, and is NULL if the timer is not
+	 * pending.
+	 */
+	struct fx_stack_timer *next;
+	struct fx_stack_timer **pprev;
+
+	/**
+	 * Expiry time in ticks and index of the slot the timer is stored in.
+	 */
+	uint64_t expires;
+	unsigned int slot;
+
+	/**
+	 * Callback executed once the timer has expired and its user-defined data.
+	 */
+	fx_stack_timer_cback cback;
+	void *data;
+} fx_stack_timer;
+
+/**
+ * A hierarchical timing wheel. Level l holds the timers whose expiry time
+ * differs from the current time in bits [6l, 6l + 6) but not in any higher
+ * bit. Whenever the current time reaches a slot on a higher level, the timers
+ * in that slot are cascaded to lower levels. Timers thus never expire early
+ * or late with respect to the tick resolution. An occupancy bitmap per level
+ * allows to skip empty slots, so advancing the wheel costs O(levels) for each
+ * cascade or expiry batch, independently of the elapsed time.
+ *
+ * All members of this structure should be treated as private.
+ */
+typedef struct fx_stack_timer_wheel {
+	/**
+	 * Duration of a tick in nanoseconds and the current time in ticks.
+	 */
+	uint64_t tick_ns;
+	uint64_t now;
+
+	/**
+	 * Number of pending timers.
+	 */
+	size_t n_timers;
+
+	/**
+	 * Bitmap of the non-empty slots per level and the slots themselves.
+	 */
+	uint64_t occupied[FX_STACK_TIMER_LEVELS];
+	fx_stack_timer *slots[FX_STACK_TIMER_LEVELS][FX_STACK_TIMER_SLOTS];
+} fx_stack_timer_wheel;
+
+/**
+ * Returns the current time of the monotonic clock in nanoseconds. This is the
+ * time base used by all functions in this file.
+ */
+uint64_t fx_stack_timer_now(void);
+
+/**
+ * Initialises an empty timing wheel.
+ *
+ * @param wheel is the wheel that should be initialised.
+ * @param tick_ns is the resolution of the wheel in nanoseconds. Deadlines are
+ * rounded up to a multiple of this value.
+ * @param now_ns is the current time, usually fx_stack_timer_now().
+ */
+void fx_stack_timer_wheel_init(fx_stack_timer_wheel *wheel, uint64_t tick_ns,
+                               uint64_t now_ns);
+
+/**
+ * Adds a timer to the wheel. The timer must not be pending. Deadlines in the
+ * past expire on the next call to fx_stack_timer_wheel_advance().
+ *
+ * @param wheel is the wheel the timer should be added to.
+ * @param timer is the timer. Its memory must remain valid until it has expired
+ * or has been cancelled.
+ * @param deadline_ns is the absolute time at which the timer expires.
+ * @param cback is the callback executed once the timer has expired.
+ * @param data is a user-defined pointer passed to the callback.
+ */
+void fx_stack_timer_add(fx_stack_timer_wheel *wheel, fx_stack_timer *timer,
+                        uint64_t deadline_ns, fx_stack_timer_cback cback,
+                        void *data);
+
+/**
+ * Removes a pending timer from the wheel without executing its callback.
+ *
+ * @param wheel is the wheel the timer was added to.
+ * @param timer is the timer that should be cancelled.
+ * @return true if the timer was pending, false if it had already expired or
+ * been cancelled.
+ */
+bool fx_stack_timer_cancel(fx_stack_timer_wheel *wheel, fx_stack_timer *timer);
+
+/**
+ * Returns true if the given timer has been added to a wheel and has neither
+ * expired nor been cancelled since.
+ */
+static inline bool fx_stack_timer_pending(const fx_stack_timer *timer) {
+	return timer->pprev != NULL;
+}
+
+/**
+ * Returns the time at which the wheel should be advanced next, or UINT64_MAX
+ * if no timer is pending. This is a lower bound of the earliest deadline;
+ * advancing the wheel at that time either expires timers or cascades them to
+ * a lower level, after which the bound is exact or tighter.
+ *
+ * @param wheel is the wheel that should be queried.
+ */
+uint64_t fx_stack_timer_wheel_next(const fx_stack_timer_wheel *wheel);
+
+/**
+ * Advances the wheel to the given time and executes the callbacks of all
+ * timers whose deadline is not later than that time. All due timers are
+ * removed from the wheel before the first callback is executed; they are
+ * executed in the order of their deadlines. A callback may cancel due timers
+ * whose callback has not been executed yet.
+ *
+ * @param wheel is the wheel that should be advanced.
+ * @param now_ns is the current time, usually fx_stack_timer_now(). Times in
+ * the past are ignored.
+ * @return the number of executed callbacks.
+ */
+size_t fx_stack_timer_wheel_advance(fx_stack_timer_wheel *wheel,
+                                    uint64_t now_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_FOXEN_STACK_TIMER_H */
@@ -21,11 +21,15 @@ This Python script implements a test runner that compiles libfoxenstack for
 various target platform and executes them via qemu.
 """
 
+import argparse
 import copy
+import json
 import os
+import re
 import subprocess
 import sys
 import tempfile
+from datetime import datetime
 
 ################################################################################
 # COLOURS                                                                      #
@@ -51,7 +55,8 @@ platforms = {
             "cpp": ["g++", "clang++"]
         },
         "flags": [],
-        "wrapper": None
+        "wrapper": None,
+        "insn_wrapper": "qemu-x86_64-static"
     },
     "x86-mlib-gnu": {
         "compilers": {
@@ -62,7 +67,9 @@ platforms = {
         [["-m32"], ["-I/usr/i686-linux-gnu/include/c++/8/i686-linux-gnu"],
          ["-I/usr/i686-linux-gnu/include"]],
         "wrapper":
-        None
+        None,
+        "insn_wrapper":
+        "qemu-i386-static"
     },
     "i386-gnu": {
         "compilers": {
@@ -88,6 +95,14 @@ platforms = {
         "flags": [[None, "-march=armv7", "-march=armv8-a"]],
         "wrapper": "qemu-arm-static"
     },
+    "aarch64-gnu": {
+        "compilers": {
+            "c": ["aarch64-linux-gnu-gcc"],
+            "cpp": ["aarch64-linux-gnu-g++"]
+        },
+        "flags": [[None, "-march=armv8.2-a"]],
+        "wrapper": "qemu-aarch64-static"
+    },
 }
 
 #
@@ -96,8 +111,17 @@ platforms = {
 #
 flags = [["-static"], ["-DFX_NO_CONFIG"], ["-I/usr/include/valgrind"],
          ["-I/usr/local/include"], ["-I."], [None, "-DFX_WITH_VALGRIND"],
+         [None, "-DFX_WITH_STACK_WATERMARK"], [None, "-DFX_WITH_TRACING"],
+         [None, "-DFX_STACK_PROFILE_MINIMAL", "-DFX_STACK_PROFILE_FULL"],
          ["-O0", "-O3"]]
 
+#
+# Libraries passed to the linker after the source files. The stack pool uses
+# threads and atomic builtins (which require libatomic on i386 and ARMv6), the
+# unit tests use the floating point environment functions from libm.
+#
+libs = ["-pthread", "-latomic", "-lm"]
+
 ################################################################################
 # COMPILER SANITY TEST PROGRAMS                                                #
 ################################################################################
@@ -136,18 +160,99 @@ targets = {
     "c": {
         "files": [
             ["foxen/stack.c", "test/test_stack.c"],
+            ["foxen/stack.c", "foxen/stack_pool.c", "test/test_stack_pool.c"],
+            ["foxen/stack.c", "foxen/stack_pool.c", "test/test_stack_pool_mt.c"],
+            ["foxen/stack.c", "foxen/stack_shared.c", "test/test_stack_shared.c"],
+            [
+                "foxen/stack.c", "foxen/stack_pool.c", "foxen/stack_grow.c",
+                "test/test_stack_grow.c"
+            ],
+            [
+                "foxen/stack.c", "foxen/stack_pool.c", "foxen/stack_sched.c",
+                "foxen/stack_timer.c", "test/test_stack_sched.c"
+            ],
+            [
+                "foxen/stack.c", "foxen/stack_pool.c", "foxen/stack_sched.c",
+                "foxen/stack_timer.c", "foxen/stack_sync.c",
+                "test/test_stack_sync.c"
+            ],
+            [
+                "foxen/stack.c", "foxen/stack_pool.c", "foxen/stack_sched.c",
+                "foxen/stack_timer.c", "foxen/stack_io.c",
+                "test/test_stack_io.c"
+            ],
+            ["foxen/stack.c", "foxen/stack_gen.c", "test/test_stack_gen.c"],
+            [
+                "foxen/stack.c", "foxen/stack_pool.c", "foxen/stack_sched.c",
+                "foxen/stack_timer.c", "test/test_stack_timer.c"
+            ],
         ],
         "flags": []
     },
     "cpp": {
         "files": [
             ["foxen/stack.cpp", "test/test_stack.c"],
-            ["foxen/stack.cpp", "test/test_stack_cpp.cpp"],
+            [
+                "foxen/stack.cpp", "foxen/stack_pool.c", "foxen/stack_sched.cpp",
+                "foxen/stack_timer.c", "test/test_stack_cpp.cpp"
+            ],
+            [
+                "foxen/stack.cpp", "foxen/stack_gen.cpp",
+                "test/test_stack_hpp.cpp"
+            ],
+            ["foxen/stack.cpp", "foxen/stack_pool.c", "test/test_stack_pool.c"],
+            ["foxen/stack.cpp", "foxen/stack_pool.c", "test/test_stack_pool_mt.c"],
+            [
+                "foxen/stack.cpp", "foxen/stack_shared.cpp",
+                "test/test_stack_shared.c"
+            ],
+            [
+                "foxen/stack.cpp", "foxen/stack_pool.c", "foxen/stack_grow.cpp",
+                "test/test_stack_grow.c"
+            ],
+            [
+                "foxen/stack.cpp", "foxen/stack_pool.c", "foxen/stack_sched.cpp",
+                "foxen/stack_timer.c", "test/test_stack_sched.c"
+            ],
+            [
+                "foxen/stack.cpp", "foxen/stack_pool.c", "foxen/stack_sched.cpp",
+                "foxen/stack_timer.c", "foxen/stack_sync.c",
+                "test/test_stack_sync.c"
+            ],
+            [
+                "foxen/stack.cpp", "foxen/stack_pool.c", "foxen/stack_sched.cpp",
+                "foxen/stack_timer.c", "foxen/stack_io.c",
+                "test/test_stack_io.c"
+            ],
+            [
+                "foxen/stack.cpp", "foxen/stack_gen.cpp",
+                "test/test_stack_gen.c"
+            ],
+            [
+                "foxen/stack.cpp", "foxen/stack_pool.c", "foxen/stack_sched.cpp",
+                "foxen/stack_timer.c", "test/test_stack_timer.c"
+            ],
         ],
         "flags": [["-DFX_WITH_CPP_EXCEPTIONS"]]
     },
 }
 
+#
+# Instruction count benchmark. The program is executed under qemu with the "insn"
+# TCG plugin for each of the given modes and both iteration counts; the number
+# of instructions per round trip is the difference between the two runs divided
+# by the difference in iterations. Platforms that are executed natively specify
+# an "insn_wrapper" that is used instead of the default wrapper.
+#
+insn_targets = {
+    "c": ["foxen/stack.c", "bench/bench_insn.c"],
+    "cpp": ["foxen/stack.cpp", "bench/bench_insn.c"],
+}
+
+insn_modes = ["switch", "context", "swapcontext"]
+
+insn_iterations = [1000, 11000]
+
 ################################################################################
 # HELPER FUNCTIONS                                                             #
 ################################################################################
@@ -171,22 +276,15 @@ def gen_flag_combinations(flags):
             return  # All elements were reset to zero again! We're done
 
 
-def compile_and_run_executable(compiler,
-                               files,
-                               flags=None,
-                               output=None,
-                               wrapper=None,
-                               info=None):
+def compile_executable(compiler, files, output, flags=None, info=None):
     # Use sane defaults
     if flags is None:
         flags = []
-    if output is None:
-        output = tempfile.mktemp()
     if info is None:
         info = {}
 
     # Compile the executable
-    info["compile_cmd"] = [compiler] + flags + files + ["-o", output]
+    info["compile_cmd"] = [compiler] + flags + files + libs + ["-o", output]
     p = subprocess.Popen(
         info["compile_cmd"], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
     stdout, stderr = p.communicate()
@@ -195,29 +293,52 @@ def compile_and_run_executable(compiler,
             "Error while invoking the compiler, returncode={}, stderr=\"{}\"".
             format(p.returncode, str(stderr, "utf-8")))
 
-    # Execute the executable
+
+def run_executable(output, wrapper=None, args=None, info=None):
+    # Use sane defaults
     if wrapper is None:
         wrapper = []
-    else:
+    elif isinstance(wrapper, str):
         wrapper = [wrapper]
+    if args is None:
+        args = []
+    if info is None:
+        info = {}
 
-    info["execute_cmd"] = wrapper + [output]
+    # Execute the executable
+    info["execute_cmd"] = wrapper + [output] + args
     p = subprocess.Popen(
         info["execute_cmd"], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
     stdout, stderr = p.communicate()
     if p.returncode != 0:
         raise Exception(
             "Error while executing the program, returncode={}, stderr=\"{}\"".
-            format(p.returncode,
-                   str(stderr, "utf-8"), " ".join(info["compile_cmd"])))
-
-    # Delete the temporary output file
-    if os.path.exists(output):
-        os.unlink(output)
+            format(p.returncode, str(stderr, "utf-8")))
 
     return str(stdout, "utf-8"), str(stderr, "utf-8")
 
 
+def compile_and_run_executable(compiler,
+                               files,
+                               flags=None,
+                               output=None,
+                               wrapper=None,
+                               info=None):
+    # Use sane defaults
+    if output is None:
+        output = tempfile.mktemp()
+    if info is None:
+        info = {}
+
+    try:
+        compile_executable(compiler, files, output, flags=flags, info=info)
+        return run_executable(output, wrapper=wrapper, info=info)
+    finally:
+        # Delete the temporary output file
+        if os.path.exists(output):
+            os.unlink(output)
+
+
 def compile_and_run_test_program(compiler,
                                  prog_str,
                                  lang,
@@ -339,51 +460,230 @@ def execute_plan(plan):
     return info
 
 
-# Run all tests in parallel
-import multiprocessing
-p = multiprocessing.Pool(multiprocessing.cpu_count())
-res = p.map(execute_plan, gen_execution_plans())
+def gen_insn_plans():
+    """
+    Generates one instruction count benchmark per platform, compiler and flag
+    combination.
+    """
+    for lang, files in insn_targets.items():
+        flags_target = targets[lang]["flags"]
+        for platform_name, platform in platforms.items():
+            wrapper = platform.get("insn_wrapper", platform["wrapper"])
+            for compiler in platform["compilers"][lang]:
+                for flags_ in gen_flag_combinations(flags + flags_target +
+                                                    platform["flags"]):
+                    yield {
+                        "lang": lang,
+                        "compiler": compiler,
+                        "platform": platform_name,
+                        "flags": flags_,
+                        "wrapper": wrapper,
+                        "files": files
+                    }
+
+
+def get_insn_key(plan):
+    return " ".join([plan["platform"], plan["lang"], plan["compiler"]] +
+                    plan["flags"])
+
+
+def count_insns(output, wrapper, plugin, args, info):
+    """
+    Executes the given program under qemu with the "insn" plugin and returns
+    the number of executed guest instructions.
+    """
+    _, stderr = run_executable(
+        output,
+        wrapper=[wrapper, "-plugin", plugin, "-d", "plugin"],
+        args=args,
+        info=info)
+    matches = re.findall(r"insns:\s*(\d+)", stderr)
+    if not matches:
+        raise Exception(
+            "Could not find the instruction count in the output of the insn "
+            "plugin, stderr=\"{}\"".format(stderr))
+    return int(matches[-1])
 
-# Count the number of failed/successful tests
-n_total = len(res)
-n_failed_sanity = 0
-n_failed = 0
-for r in res:
-    if not r["success_sanity_check"]:
-        n_failed_sanity += 1
-    elif not r["success_test"]:
-        n_failed += 1
 
-# All tests passed, print a success message
-if n_failed == 0 and n_failed_sanity == 0:
-    print(
-        "{}[OK ]{} Success! All tests passed.".format(ANSI_GREEN, ANSI_RESET))
+def execute_insn_plan(plan, plugin):
+    info = {"config": plan, "key": get_insn_key(plan), "insns": {}}
+
+    def run():
+        if plan["wrapper"] is None:
+            raise Exception("No qemu wrapper defined for this platform")
+        output = tempfile.mktemp()
+        try:
+            compile_executable(
+                plan["compiler"],
+                plan["files"],
+                output,
+                flags=plan["flags"],
+                info=info)
+            for mode in insn_modes:
+                n0, n1 = insn_iterations
+                c0 = count_insns(output, plan["wrapper"], plugin,
+                                 [mode, str(n0)], info)
+                c1 = count_insns(output, plan["wrapper"], plugin,
+                                 [mode, str(n1)], info)
+                info["insns"][mode] = (c1 - c0) / (n1 - n0)
+        finally:
+            if os.path.exists(output):
+                os.unlink(output)
+
+    try:
+        run()
+        info["success"], info["msg"] = True, None
+    except Exception as e:
+        info["success"], info["msg"] = False, str(e)
+
+    print("{:15} [{:3}] {:25} {:5} {} {}".format(
+        plan["platform"].upper(), plan["lang"].upper(),
+        plan["compiler"].upper(), get_checkmark(info["success"]),
+        " ".join("{}={:.1f}".format(k, v)
+                 for k, v in sorted(info["insns"].items())), plan["flags"]))
+    return info
+
+
+def compare_insn_counts(res, baseline, threshold):
+    """
+    Compares the instruction counts against a previous report and returns the
+    number of benchmarks that regressed by more than the given number of
+    instructions per round trip.
+    """
+    baseline = {r["key"]: r["insns"] for r in baseline if r["success"]}
+    n_regressions = 0
+    for r in res:
+        for mode, insns in sorted(r["insns"].items()):
+            if not mode in baseline.get(r["key"], {}):
+                continue
+            delta = insns - baseline[r["key"]][mode]
+            if delta > threshold:
+                n_regressions += 1
+                print("{}[ERR]{} {} {}: {:.1f} -> {:.1f} instructions".format(
+                    ANSI_RED, ANSI_RESET, r["key"], mode,
+                    baseline[r["key"]][mode], insns))
+            elif delta < -threshold:
+                print("{}[OK ]{} {} {}: {:.1f} -> {:.1f} instructions".format(
+                    ANSI_GREEN, ANSI_RESET, r["key"], mode,
+                    baseline[r["key"]][mode], insns))
+    return n_regressions
+
+
+def run_insn_counts(args):
+    import functools
+    import multiprocessing
+    p = multiprocessing.Pool(multiprocessing.cpu_count())
+    res = p.map(
+        functools.partial(execute_insn_plan, plugin=args.insn_plugin),
+        gen_insn_plans())
+
+    fn = args.insn_report
+    if fn is None:
+        fn = datetime.strftime(datetime.now(),
+                               "insn_counts_%Y-%m-%d-%H-%M-%S.json")
+    with open(fn, 'w') as f:
+        json.dump(res, f, sort_keys=True, indent=4)
+    print("{}[---]{} Wrote instruction counts to {}".format(
+        ANSI_ORANGE, ANSI_RESET, fn))
+
+    n_failed = len([r for r in res if not r["success"]])
+    if n_failed > 0:
+        print("{}[WRN]{} {} out of {} benchmark(s) could not be executed".
+              format(ANSI_ORANGE, ANSI_RESET, n_failed, len(res)))
+
+    if args.insn_baseline is None:
+        sys.exit(0 if n_failed < len(res) else 1)
+
+    with open(args.insn_baseline, 'r') as f:
+        baseline = json.load(f)
+    n_regressions = compare_insn_counts(res, baseline, args.insn_threshold)
+    if n_regressions > 0:
+        print("{}[ERR]{} {} benchmark(s) regressed compared to {}".format(
+            ANSI_RED, ANSI_RESET, n_regressions, args.insn_baseline))
+        sys.exit(1)
+    print("{}[OK ]{} No regressions compared to {}".format(
+        ANSI_GREEN, ANSI_RESET, args.insn_baseline))
     sys.exit(0)
 
-import json
-from datetime import datetime
-fn = datetime.strftime(datetime.now(), "test_results_%Y-%m-%d-%H-%M-%S.json")
-with open(fn, 'w') as f:
-    json.dump(res, f, sort_keys=True, indent=4)
-print("{}[---]{} Wrote test information to {}".format(ANSI_ORANGE, ANSI_RESET,
-                                                      fn))
-
-if n_failed == 0 and n_failed_sanity < n_total:
-    print("{}[OK ]{} All {} tests passing the sanity check were successful.".
-          format(ANSI_GREEN, ANSI_RESET, n_total - n_failed_sanity))
-
-# No tests really failed, but some tests did not pass the sanity check, i.e. the
-# platform or compiler are not setup correctly
-if n_failed == 0:
+
+def run_tests():
+    # Run all tests in parallel
+    import multiprocessing
+    p = multiprocessing.Pool(multiprocessing.cpu_count())
+    res = p.map(execute_plan, gen_execution_plans())
+
+    # Count the number of failed/successful tests
+    n_total = len(res)
+    n_failed_sanity = 0
+    n_failed = 0
+    for r in res:
+        if not r["success_sanity_check"]:
+            n_failed_sanity += 1
+        elif not r["success_test"]:
+            n_failed += 1
+
+    # All tests passed, print a success message
+    if n_failed == 0 and n_failed_sanity == 0:
+        print(
+            "{}[OK ]{} Success! All tests passed.".format(ANSI_GREEN, ANSI_RESET))
+        sys.exit(0)
+
+    fn = datetime.strftime(datetime.now(), "test_results_%Y-%m-%d-%H-%M-%S.json")
+    with open(fn, 'w') as f:
+        json.dump(res, f, sort_keys=True, indent=4)
+    print("{}[---]{} Wrote test information to {}".format(ANSI_ORANGE, ANSI_RESET,
+                                                          fn))
+
+    if n_failed == 0 and n_failed_sanity < n_total:
+        print("{}[OK ]{} All {} tests passing the sanity check were successful.".
+              format(ANSI_GREEN, ANSI_RESET, n_total - n_failed_sanity))
+
+    # No tests really failed, but some tests did not pass the sanity check, i.e. the
+    # platform or compiler are not setup correctly
+    if n_failed == 0:
+        print(
+            "{}[WRN]{} {} test(s) failed the sanity check (platforms not setup correctly?)".
+            format(ANSI_ORANGE, ANSI_RESET, n_failed_sanity))
+        sys.exit(1)
+
+    # Tests failed.
     print(
-        "{}[WRN]{} {} test(s) failed the sanity check (platforms not setup correctly?)".
-        format(ANSI_ORANGE, ANSI_RESET, n_failed_sanity))
+        "{}[ERR]{} {} out of {} tests failed. {} test(s) failed the sanity check".
+        format(ANSI_RED, ANSI_RESET, n_failed, n_total - n_failed_sanity,
+               n_failed_sanity))
     sys.exit(1)
 
-# Tests failed.
-print(
-    "{}[ERR]{} {} out of {} tests failed. {} test(s) failed the sanity check".
-    format(ANSI_RED, ANSI_RESET, n_failed, n_total - n_failed_sanity,
-           n_failed_sanity))
-sys.exit(1)
 
+################################################################################
+# MAIN PROGRAM                                                                 #
+################################################################################
+
+parser = argparse.ArgumentParser(description=__doc__)
+parser.add_argument(
+    "--insn-count",
+    action="store_true",
+    help="Count the instructions per stack switch instead of running the tests")
+parser.add_argument(
+    "--insn-plugin",
+    default=os.environ.get("QEMU_INSN_PLUGIN", "libinsn.so"),
+    help="Path to the qemu \"insn\" TCG plugin (default: $QEMU_INSN_PLUGIN)")
+parser.add_argument(
+    "--insn-report",
+    default=None,
+    help="File the instruction count report is written to")
+parser.add_argument(
+    "--insn-baseline",
+    default=None,
+    help="Previous instruction count report to compare against")
+parser.add_argument(
+    "--insn-threshold",
+    type=float,
+    default=1.0,
+    help="Number of additional instructions per round trip that are reported "
+    "as a regression")
+args = parser.parse_args()
+
+if args.insn_count:
+    run_insn_counts(args)
+else:
+    run_tests()
@@ -17,10 +17,30 @@
  */
 
 #include <foxen/stack.h>
+#include <foxen/stack_inline.h>
 #include <foxen/unittest.h>
 
+#include <alloca.h>
+#include <fenv.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Unwinding is checked using glibc's backtrace() on platforms where C code
+   has unwind tables by default */
+#if defined(__GLIBC__) && \
+    (defined(__amd64__) || defined(__i386__) || defined(__aarch64__))
+#include <execinfo.h>
+#define TEST_UNWIND
+#endif
+
+/* Contexts only preserve the floating point control state in the full
+   register-save profile */
+#if defined(FX_STACK_PROFILE_FULL) && defined(FE_UPWARD) && \
+    defined(FE_DOWNWARD) && defined(FE_TOWARDZERO)
+#define TEST_FP_CONTROL
+#endif
 
 /******************************************************************************
  * UNITTESTS                                                                  *
@@ -50,6 +70,23 @@ static void test_simple(void) {
 	free(stack_start);
 }
 
+/******************************************************************************
+ * Unit test test_simple_inline()                                             *
+ ******************************************************************************/
+
+static void test_simple_inline(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	int data = 4813;
+	void *res = fx_stack_switch_inline(stack_start, stack_end, stack_end,
+	                                   test_simple_cback, &data);
+	EXPECT_EQ((void *)0xAFFEAFFEU, res);
+	EXPECT_EQ(57756, data);
+
+	free(stack_start);
+}
+
 /******************************************************************************
  * Unit test test_recursive()                                                 *
  ******************************************************************************/
@@ -122,14 +159,563 @@ static void test_check_addr(void) {
 	free(stack_start);
 }
 
+/******************************************************************************
+ * Unit test test_context_ping_pong()                                         *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_context main;
+	fx_stack_context ctx;
+} test_context_ping_pong_data;
+
+static void *test_context_ping_pong_cback(void *data_) {
+	test_context_ping_pong_data *data = (test_context_ping_pong_data *)data_;
+	uintptr_t i, sum = 0;
+	for (i = 0; i < 100; i++) {
+		/* Pass the counter to the main context, receive a value back */
+		sum += (uintptr_t)fx_stack_context_swap(&data->ctx, &data->main,
+		                                        (void *)i);
+	}
+	return (void *)sum;
+}
+
+static void test_context_ping_pong(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	test_context_ping_pong_data data;
+	memset(&data, 0, sizeof(data));
+	fx_stack_context_init(&data.ctx, stack_start, stack_end,
+	                      test_context_ping_pong_cback, &data);
+
+	uintptr_t i;
+	void *res = fx_stack_context_swap(&data.main, &data.ctx, NULL);
+	for (i = 0; i < 100; i++) {
+		EXPECT_EQ((void *)i, res);
+		EXPECT_FALSE(fx_stack_context_done(&data.ctx));
+		res = fx_stack_context_swap(&data.main, &data.ctx, (void *)(2 * i));
+	}
+
+	/* The context finished and returned the sum of all values sent to it */
+	EXPECT_TRUE(fx_stack_context_done(&data.ctx));
+	EXPECT_EQ((void *)9900, res);
+
+	fx_stack_context_destroy(&data.ctx);
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_context_symmetric()                                         *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_context main;
+	fx_stack_context a;
+	fx_stack_context b;
+	char trace[16];
+	int trace_len;
+} test_context_symmetric_data;
+
+static void *test_context_symmetric_cback_a(void *data_) {
+	test_context_symmetric_data *data = (test_context_symmetric_data *)data_;
+	data->trace[data->trace_len++] = 'a';
+	fx_stack_context_swap(&data->a, &data->b, NULL);
+	data->trace[data->trace_len++] = 'a';
+	return (void *)0xA;
+}
+
+static void *test_context_symmetric_cback_b(void *data_) {
+	test_context_symmetric_data *data = (test_context_symmetric_data *)data_;
+	data->trace[data->trace_len++] = 'b';
+
+	/* "a" was last resumed by "b", so finishing "a" returns control to "b" */
+	void *res = fx_stack_context_swap(&data->b, &data->a, NULL);
+	EXPECT_EQ((void *)0xA, res);
+	EXPECT_TRUE(fx_stack_context_done(&data->a));
+	data->trace[data->trace_len++] = 'b';
+
+	/* The caller of "b" is dead now, explicitly switch to the main context */
+	fx_stack_context_swap(&data->b, &data->main, (void *)0xC);
+	data->trace[data->trace_len++] = 'b';
+	return (void *)0xB;
+}
+
+static void test_context_symmetric(void) {
+	void *stack_a = malloc(STACK_LEN);
+	void *stack_b = malloc(STACK_LEN);
+
+	test_context_symmetric_data data;
+	memset(&data, 0, sizeof(data));
+	fx_stack_context_init(&data.a, stack_a,
+	                      (void *)((uintptr_t)stack_a + STACK_LEN),
+	                      test_context_symmetric_cback_a, &data);
+	fx_stack_context_init(&data.b, stack_b,
+	                      (void *)((uintptr_t)stack_b + STACK_LEN),
+	                      test_context_symmetric_cback_b, &data);
+
+	EXPECT_EQ((void *)0xC, fx_stack_context_swap(&data.main, &data.a, NULL));
+	EXPECT_TRUE(fx_stack_context_done(&data.a));
+	EXPECT_FALSE(fx_stack_context_done(&data.b));
+
+	/* Resuming "b" makes the main context its caller */
+	EXPECT_EQ((void *)0xB, fx_stack_context_swap(&data.main, &data.b, NULL));
+	EXPECT_TRUE(fx_stack_context_done(&data.b));
+	EXPECT_EQ(5, data.trace_len);
+	EXPECT_EQ(0, memcmp(data.trace, "ababb", 5));
+
+	fx_stack_context_destroy(&data.a);
+	fx_stack_context_destroy(&data.b);
+	free(stack_a);
+	free(stack_b);
+}
+
+/******************************************************************************
+ * Unit test test_watermark()                                                 *
+ ******************************************************************************/
+
+static void *test_watermark_cback(void *data) {
+	/* Use at least the given number of bytes on the stack */
+	const size_t n = (size_t)(uintptr_t)data;
+	volatile uint8_t *buf = (volatile uint8_t *)alloca(n);
+	for (size_t i = 0U; i < n; i++) {
+		buf[i] = (uint8_t)i;
+	}
+	return (void *)(uintptr_t)buf[n - 1U];
+}
+
+static void test_watermark(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	/* A freshly painted stack has not been used */
+	fx_stack_paint(stack_start, stack_end);
+	EXPECT_EQ(0U, fx_stack_high_water_mark(stack_start, stack_end));
+
+	/* The high-water mark grows with the stack usage of the callback */
+	size_t prev = 0U;
+	for (size_t n = 1024U; n <= 8192U; n *= 2U) {
+		fx_stack_paint(stack_start, stack_end);
+		fx_stack_switch(stack_start, stack_end, stack_end, test_watermark_cback,
+		                (void *)(uintptr_t)n);
+		const size_t used = fx_stack_high_water_mark(stack_start, stack_end);
+		EXPECT_GE(used, n);
+		EXPECT_LT(used, n + 1024U);
+		EXPECT_GT(used, prev);
+		prev = used;
+
+		/* Only available if compiled with FX_WITH_STACK_WATERMARK */
+		const size_t last = fx_stack_last_high_water_mark();
+		EXPECT_TRUE((last == 0U) || (last == used));
+	}
+
+	/* Aggregate statistics */
+	fx_stack_watermark wm = FX_STACK_WATERMARK_INIT;
+	fx_stack_watermark_record(&wm, 100U);
+	fx_stack_watermark_record(&wm, 300U);
+	fx_stack_watermark_record(&wm, 200U);
+	EXPECT_EQ(3U, wm.count);
+	EXPECT_EQ(300U, wm.max);
+	EXPECT_EQ(600U, wm.sum);
+
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_handle()                                                    *
+ ******************************************************************************/
+
+static void *test_handle_cback(void *data) {
+	*((int *)data) += 1;
+	return fx_stack_current_start();
+}
+
+static void test_handle(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	fx_stack_handle handle;
+	fx_stack_handle_init(&handle, stack_start, stack_end);
+	EXPECT_EQ(stack_start, handle.stack_start);
+	EXPECT_EQ(stack_end, handle.stack_end);
+
+	/* The handle can be used for any number of switches */
+	int data = 0;
+	for (unsigned int i = 0U; i < 16U; i++) {
+		EXPECT_EQ(stack_start, fx_stack_handle_switch(&handle, stack_end,
+		                                              test_handle_cback, &data));
+		EXPECT_EQ(NULL, fx_stack_current_start());
+	}
+	EXPECT_EQ(16, data);
+
+	fx_stack_handle_destroy(&handle);
+	EXPECT_EQ(NULL, handle.stack_start);
+	EXPECT_EQ(NULL, handle.stack_end);
+
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_batch()                                                     *
+ ******************************************************************************/
+
+typedef struct {
+	void *stack_start;
+	int value;
+	unsigned int n_on_stack;
+} test_batch_data;
+
+static void *test_batch_cback(void *data_) {
+	test_batch_data *data = (test_batch_data *)data_;
+	if (fx_stack_current_start() == data->stack_start) {
+		data->n_on_stack++;
+	}
+	data->value *= 2;
+	return (void *)(intptr_t)data->value;
+}
+
+static void test_batch(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	/* Each item is executed once, in order, on the given stack */
+	test_batch_data data = {stack_start, 3, 0U};
+	fx_stack_batch_item items[8];
+	memset(items, 0xFF, sizeof(items));
+	for (unsigned int i = 0U; i < 8U; i++) {
+		items[i].cback = test_batch_cback;
+		items[i].data = &data;
+	}
+	EXPECT_EQ(0U, fx_stack_switch_batch(stack_start, stack_end, stack_end,
+	                                    items, 8U));
+	EXPECT_EQ(8U, data.n_on_stack);
+	EXPECT_EQ(3 << 8, data.value);
+	for (unsigned int i = 0U; i < 8U; i++) {
+		EXPECT_EQ((void *)(intptr_t)(3 << (i + 1U)), items[i].result);
+		EXPECT_EQ(NULL, items[i].exception);
+	}
+	EXPECT_EQ(NULL, fx_stack_current_start());
+
+	/* Empty batches are allowed */
+	EXPECT_EQ(0U, fx_stack_switch_batch(stack_start, stack_end, stack_end,
+	                                    NULL, 0U));
+
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_trace()                                                     *
+ ******************************************************************************/
+
+static void *test_trace_cback(void *data) {
+	/* Spin for the given number of iterations */
+	for (volatile size_t i = 0U; i < (size_t)(uintptr_t)data; i++) {
+	}
+	return data;
+}
+
+static void test_trace(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	/* Counters are only available if compiled with FX_WITH_TRACING */
+	fx_stack_trace_reset();
+	for (unsigned int i = 0U; i < 10U; i++) {
+		fx_stack_switch(stack_start, stack_end, stack_end, test_trace_cback,
+		                (void *)(uintptr_t)(i * 1000U));
+	}
+	fx_stack_batch_item items[3];
+	for (unsigned int i = 0U; i < 3U; i++) {
+		items[i].cback = test_trace_cback;
+		items[i].data = NULL;
+	}
+	fx_stack_switch_batch(stack_start, stack_end, stack_end, items, 3U);
+
+	fx_stack_trace *trace = (fx_stack_trace *)malloc(sizeof(fx_stack_trace));
+	if (fx_stack_trace_get(trace)) {
+		EXPECT_EQ(10U, trace->n_switches);
+		EXPECT_EQ(1U, trace->n_batches);
+		EXPECT_EQ(3U, trace->n_batch_items);
+		uint64_t n_samples = 0U;
+		for (size_t i = 0U; i < FX_STACK_TRACE_BUCKETS; i++) {
+			n_samples += trace->latency[i];
+		}
+		EXPECT_EQ(11U, n_samples);
+		EXPECT_GT(fx_stack_trace_percentile(trace, 100.0), 0U);
+
+		fx_stack_trace_reset();
+		fx_stack_trace_get(trace);
+		EXPECT_EQ(0U, trace->n_switches);
+	} else {
+		EXPECT_EQ(0U, trace->n_switches);
+	}
+
+	/* Small values are recorded exactly, large values with bounded error */
+	memset(trace, 0, sizeof(fx_stack_trace));
+	EXPECT_EQ(0U, fx_stack_trace_percentile(trace, 50.0));
+	for (uint64_t v = 1U; v <= 100U; v++) {
+		fx_stack_trace_record(trace, v);
+	}
+	EXPECT_EQ(1U, fx_stack_trace_percentile(trace, 0.0));
+	EXPECT_EQ(7U, fx_stack_trace_percentile(trace, 7.0));
+	EXPECT_EQ(51U, fx_stack_trace_percentile(trace, 50.0));
+	EXPECT_EQ(103U, fx_stack_trace_percentile(trace, 100.0));
+
+	fx_stack_trace_record(trace, UINT64_MAX);
+	EXPECT_EQ(UINT64_MAX, fx_stack_trace_percentile(trace, 100.0));
+	for (uint64_t v = 8U; v < (1ULL << 40U); v = v * 3U + 1U) {
+		fx_stack_trace tmp;
+		memset(&tmp, 0, sizeof(tmp));
+		fx_stack_trace_record(&tmp, v);
+		const uint64_t ub = fx_stack_trace_percentile(&tmp, 50.0);
+		EXPECT_GE(ub, v);
+		EXPECT_LE(ub - v, v >> FX_STACK_TRACE_SUB_BITS);
+	}
+
+	/* Merging adds counters and histograms */
+	fx_stack_trace *sum = (fx_stack_trace *)malloc(sizeof(fx_stack_trace));
+	memset(sum, 0, sizeof(fx_stack_trace));
+	trace->n_switches = 5U;
+	fx_stack_trace_merge(sum, trace);
+	fx_stack_trace_merge(sum, trace);
+	EXPECT_EQ(10U, sum->n_switches);
+	EXPECT_EQ(51U, fx_stack_trace_percentile(sum, 50.0));
+
+	free(sum);
+	free(trace);
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_local()                                                     *
+ ******************************************************************************/
+
+static int test_local_key = -1;
+
+static void *test_local_switch_cback(void *data) {
+	/* Callbacks of fx_stack_switch() share the table of the caller */
+	void *value = fx_stack_local_get(test_local_key);
+	fx_stack_local_set(test_local_key, data);
+	return value;
+}
+
+static void *test_local_context_cback(void *data_) {
+	test_context_ping_pong_data *data = (test_context_ping_pong_data *)data_;
+
+	/* Contexts start out with an empty table */
+	void *initial = fx_stack_local_get(test_local_key);
+	fx_stack_local_set(test_local_key, (void *)0x2);
+	fx_stack_context_swap(&data->ctx, &data->main, initial);
+
+	/* The value survives the round trip through the main context */
+	return fx_stack_local_get(test_local_key);
+}
+
+static void test_local(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	test_local_key = fx_stack_local_key_create();
+	const int other_key = fx_stack_local_key_create();
+	EXPECT_GE(test_local_key, 0);
+	EXPECT_GT(other_key, test_local_key);
+	EXPECT_EQ(NULL, fx_stack_local_get(test_local_key));
+	fx_stack_local_set(test_local_key, (void *)0x1);
+	fx_stack_local_set(other_key, (void *)0x3);
+
+	/* Plain stack switches */
+	EXPECT_EQ((void *)0x1, fx_stack_switch(stack_start, stack_end, stack_end,
+	                                       test_local_switch_cback,
+	                                       (void *)0x4));
+	EXPECT_EQ((void *)0x4, fx_stack_local_get(test_local_key));
+	fx_stack_local_set(test_local_key, (void *)0x1);
+
+	/* Each context has its own table; switching back restores the table of
+	   the calling thread */
+	test_context_ping_pong_data data;
+	memset(&data, 0, sizeof(data));
+	fx_stack_context_init(&data.ctx, stack_start, stack_end,
+	                      test_local_context_cback, &data);
+	EXPECT_EQ(NULL, fx_stack_context_swap(&data.main, &data.ctx, NULL));
+	EXPECT_EQ((void *)0x1, fx_stack_local_get(test_local_key));
+	EXPECT_EQ((void *)0x2, fx_stack_context_swap(&data.main, &data.ctx, NULL));
+	EXPECT_TRUE(fx_stack_context_done(&data.ctx));
+	EXPECT_EQ((void *)0x1, fx_stack_local_get(test_local_key));
+	EXPECT_EQ((void *)0x3, fx_stack_local_get(other_key));
+	fx_stack_context_destroy(&data.ctx);
+
+	/* The number of keys is limited */
+	int n_keys = other_key + 1;
+	while (fx_stack_local_key_create() >= 0) {
+		n_keys++;
+	}
+	EXPECT_EQ(FX_STACK_LOCAL_SLOTS, (unsigned int)n_keys);
+
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_fp_control()                                                *
+ ******************************************************************************/
+
+#ifdef TEST_FP_CONTROL
+
+typedef struct {
+	fx_stack_context main;
+	fx_stack_context ctx;
+	int round_initial;
+	int round_resumed;
+} test_fp_control_data;
+
+static void *test_fp_control_cback(void *data_) {
+	test_fp_control_data *data = (test_fp_control_data *)data_;
+	data->round_initial = fegetround();
+	fesetround(FE_UPWARD);
+	fx_stack_context_swap(&data->ctx, &data->main, NULL);
+	data->round_resumed = fegetround();
+	return NULL;
+}
+
+#endif /* TEST_FP_CONTROL */
+
+static void test_fp_control(void) {
+#ifdef TEST_FP_CONTROL
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+	const int round = fegetround();
+
+	/* Platforms without floating point unit cannot change the rounding
+	   mode */
+	if (fesetround(FE_DOWNWARD) != 0) {
+		free(stack_start);
+		return;
+	}
+
+	/* New contexts inherit the control state of the initialising thread */
+	test_fp_control_data data;
+	memset(&data, 0, sizeof(data));
+	fx_stack_context_init(&data.ctx, stack_start, stack_end,
+	                      test_fp_control_cback, &data);
+	fesetround(FE_TONEAREST);
+	fx_stack_context_swap(&data.main, &data.ctx, NULL);
+	EXPECT_EQ(FE_DOWNWARD, data.round_initial);
+
+	/* Changing the rounding mode in one context does not affect the other */
+	EXPECT_EQ(FE_TONEAREST, fegetround());
+	fesetround(FE_TOWARDZERO);
+	fx_stack_context_swap(&data.main, &data.ctx, NULL);
+	EXPECT_TRUE(fx_stack_context_done(&data.ctx));
+	EXPECT_EQ(FE_UPWARD, data.round_resumed);
+	EXPECT_EQ(FE_TOWARDZERO, fegetround());
+
+	fx_stack_context_destroy(&data.ctx);
+	fesetround(round);
+	free(stack_start);
+#endif
+}
+
+/******************************************************************************
+ * Unit test test_unwind()                                                    *
+ ******************************************************************************/
+
+#ifdef TEST_UNWIND
+
+#define TEST_UNWIND_STACK_LEN (4096U * 64U)
+#define TEST_UNWIND_MAX_FRAMES 64
+
+typedef struct {
+	void *frames[TEST_UNWIND_MAX_FRAMES];
+	int n_frames;
+} test_unwind_data;
+
+static void *test_unwind_cback(void *data_) {
+	test_unwind_data *data = (test_unwind_data *)data_;
+	data->n_frames = backtrace(data->frames, TEST_UNWIND_MAX_FRAMES);
+	return NULL;
+}
+
+static bool test_unwind_contains(const test_unwind_data *data, void *addr) {
+	for (int i = 0; i < data->n_frames; i++) {
+		if (data->frames[i] == addr) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Switches to the given stack, unwinds from within the callback and returns
+ * the return address of this function, which must be part of the backtrace.
+ */
+__attribute__((noinline)) static void *test_unwind_switch(
+    void *stack_start, void *stack_end, bool use_inline,
+    test_unwind_data *data) {
+	if (use_inline) {
+		fx_stack_switch_inline(stack_start, stack_end, stack_end,
+		                       test_unwind_cback, data);
+	} else {
+		fx_stack_switch(stack_start, stack_end, stack_end, test_unwind_cback,
+		                data);
+	}
+	__asm__ __volatile__("" : : : "memory"); /* Prevent tail calls */
+	return __builtin_return_address(0);
+}
+
+#endif /* TEST_UNWIND */
+
+static void test_unwind(void) {
+#ifdef TEST_UNWIND
+	void *stack_start = malloc(TEST_UNWIND_STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + TEST_UNWIND_STACK_LEN);
+
+	/* The first call to backtrace() loads the unwinder; do this on the
+	   original stack */
+	test_unwind_data data;
+	test_unwind_cback(&data);
+	EXPECT_GT(data.n_frames, 0);
+
+	/* The unwinder walks from the callback into the frames on the original
+	   stack */
+	for (int use_inline = 0; use_inline < 2; use_inline++) {
+		memset(&data, 0, sizeof(data));
+		void *addr = test_unwind_switch(stack_start, stack_end, use_inline,
+		                                &data);
+		EXPECT_TRUE(test_unwind_contains(&data, addr));
+	}
+
+	/* Unwinding stops at the outermost frame of a context */
+	fx_stack_context ctx_main, ctx;
+	memset(&ctx_main, 0, sizeof(ctx_main));
+	memset(&data, 0, sizeof(data));
+	fx_stack_context_init(&ctx, stack_start, stack_end, test_unwind_cback,
+	                      &data);
+	fx_stack_context_swap(&ctx_main, &ctx, NULL);
+	EXPECT_TRUE(fx_stack_context_done(&ctx));
+	EXPECT_GT(data.n_frames, 0);
+	EXPECT_LT(data.n_frames, TEST_UNWIND_MAX_FRAMES);
+	fx_stack_context_destroy(&ctx);
+
+	free(stack_start);
+#endif
+}
+
 /******************************************************************************
  * MAIN                                                                       *
  ******************************************************************************/
 
 int main() {
 	RUN(test_simple);
+	RUN(test_simple_inline);
 	RUN(test_recursive);
 	RUN(test_check_addr);
+	RUN(test_context_ping_pong);
+	RUN(test_context_symmetric);
+	RUN(test_watermark);
+	RUN(test_handle);
+	RUN(test_batch);
+	RUN(test_trace);
+	RUN(test_local);
+	RUN(test_fp_control);
+	RUN(test_unwind);
 	DONE;
 }
 
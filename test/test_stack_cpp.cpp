@@ -17,18 +17,21 @@
  */
 
 #include <foxen/stack.h>
+#include <foxen/stack_inline.h>
+#include <foxen/stack_sched.h>
 #include <foxen/unittest.h>
 
 #include <stdexcept>
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 /******************************************************************************
  * UNITTESTS                                                                  *
  ******************************************************************************/
 
-#define STACK_LEN 4096U
+#define STACK_LEN (4096U * 4U)
 
 namespace {
 
@@ -88,6 +91,137 @@ static void test_exception(void) {
 	free(stack_start);
 }
 
+struct TestContextExceptionData {
+	fx_stack_context main;
+	fx_stack_context ctx;
+	int value;
+};
+
+static void *test_context_exception_cback(void *data_) {
+	TestContextExceptionData *data = (TestContextExceptionData *)data_;
+	TestSimpleCbackUnwind obj(&data->value);
+	fx_stack_context_swap(&data->ctx, &data->main, nullptr);
+	throw std::runtime_error("foobar");
+	return (void *)0xAFFEAFFEU;
+}
+
+static void test_context_exception(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	TestContextExceptionData data;
+	memset(&data, 0, sizeof(data));
+	data.value = 4813;
+	fx_stack_context_init(&data.ctx, stack_start, stack_end,
+	                      test_context_exception_cback, &data);
+
+	/* The first swap returns once the context suspends itself */
+	fx_stack_context_swap(&data.main, &data.ctx, nullptr);
+	EXPECT_EQ(4813, data.value);
+
+	/* The second swap re-throws the exception thrown inside the context */
+	bool did_catch = false;
+	try {
+		fx_stack_context_swap(&data.main, &data.ctx, nullptr);
+	} catch (std::runtime_error &e) {
+		EXPECT_TRUE(std::string(e.what()) == "foobar");
+		did_catch = true;
+	}
+	EXPECT_TRUE(did_catch);
+	EXPECT_TRUE(fx_stack_context_done(&data.ctx));
+	EXPECT_EQ(57756, data.value);
+
+	fx_stack_context_destroy(&data.ctx);
+	free(stack_start);
+}
+
+static void test_inline_exception(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	int data = 4813;
+	bool did_catch = false;
+	try {
+		fx_stack_switch_inline(stack_start, stack_end, stack_end,
+		                       test_exception_cback, &data);
+	} catch (std::runtime_error &e) {
+		EXPECT_TRUE(std::string(e.what()) == "foobar");
+		did_catch = true;
+	}
+	EXPECT_TRUE(did_catch);
+	EXPECT_EQ(57756, data);
+
+	free(stack_start);
+}
+
+static void test_batch_exception(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	/* An exception in one item does not prevent the execution of the others */
+	int data[3] = {4813, 4813, 4813};
+	fx_stack_batch_item items[3] = {
+	    {test_simple_cback, &data[0], nullptr, nullptr},
+	    {test_exception_cback, &data[1], nullptr, nullptr},
+	    {test_simple_cback, &data[2], nullptr, nullptr}};
+	EXPECT_EQ(1U, fx_stack_switch_batch(stack_start, stack_end, stack_end,
+	                                    items, 3U));
+	for (unsigned int i = 0U; i < 3U; i++) {
+		EXPECT_EQ(57756, data[i]);
+	}
+	EXPECT_EQ((void *)0xAFFEAFFEU, items[0].result);
+	EXPECT_EQ(nullptr, items[0].exception);
+	EXPECT_EQ(nullptr, items[1].result);
+	EXPECT_NE(nullptr, items[1].exception);
+	EXPECT_EQ((void *)0xAFFEAFFEU, items[2].result);
+	EXPECT_EQ(nullptr, items[2].exception);
+
+	/* The exception is re-thrown on the calling stack */
+	bool did_catch = false;
+	try {
+		fx_stack_batch_item_rethrow(&items[0]);
+		fx_stack_batch_item_rethrow(&items[1]);
+	} catch (std::runtime_error &e) {
+		EXPECT_TRUE(std::string(e.what()) == "foobar");
+		did_catch = true;
+	}
+	EXPECT_TRUE(did_catch);
+	EXPECT_EQ(nullptr, items[1].exception);
+
+	/* Exceptions can be discarded */
+	fx_stack_switch_batch(stack_start, stack_end, stack_end, items + 1U, 1U);
+	EXPECT_NE(nullptr, items[1].exception);
+	fx_stack_batch_item_release(&items[1]);
+	EXPECT_EQ(nullptr, items[1].exception);
+
+	free(stack_start);
+}
+
+static void test_sched_exception(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, 2U, STACK_LEN, 16U));
+
+	/* Exceptions thrown by a task are re-thrown by the joining thread */
+	int data = 4813;
+	fx_stack_sched_task *task =
+	    fx_stack_sched_spawn(&sched, test_exception_cback, &data);
+	bool did_catch = false;
+	try {
+		fx_stack_sched_join(task);
+	} catch (std::runtime_error &e) {
+		EXPECT_TRUE(std::string(e.what()) == "foobar");
+		did_catch = true;
+	}
+	EXPECT_TRUE(did_catch);
+	EXPECT_EQ(57756, data);
+
+	/* The scheduler remains usable afterwards */
+	task = fx_stack_sched_spawn(&sched, test_simple_cback, &data);
+	EXPECT_EQ((void *)0xAFFEAFFEU, fx_stack_sched_join(task));
+
+	fx_stack_sched_destroy(&sched);
+}
+
 /******************************************************************************
  * MAIN                                                                       *
  ******************************************************************************/
@@ -95,6 +229,10 @@ static void test_exception(void) {
 int main() {
 	RUN(test_simple);
 	RUN(test_exception);
+	RUN(test_context_exception);
+	RUN(test_inline_exception);
+	RUN(test_batch_exception);
+	RUN(test_sched_exception);
 	DONE;
 }
 
@@ -0,0 +1,173 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <foxen/stack_gen.h>
+#include <foxen/unittest.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 16U)
+
+/******************************************************************************
+ * Unit test test_range()                                                     *
+ ******************************************************************************/
+
+static void test_range_producer(fx_stack_gen *gen, void *data) {
+	const unsigned int n = *(unsigned int *)data;
+	for (unsigned int i = 0U; i < n; i++) {
+		fx_stack_gen_yield(gen, &i);
+	}
+}
+
+static void test_range(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	fx_stack_gen gen;
+	unsigned int n = 100U;
+	fx_stack_gen_init(&gen, stack_start, stack_end, test_range_producer, &n);
+	EXPECT_FALSE(fx_stack_gen_done(&gen));
+
+	unsigned int *value, expected = 0U;
+	while ((value = (unsigned int *)fx_stack_gen_next(&gen))) {
+		/* The value is read in-place from the producer stack */
+		EXPECT_TRUE(((void *)value > stack_start) &&
+		            ((void *)value < stack_end));
+		EXPECT_EQ(expected, *value);
+		expected++;
+	}
+	EXPECT_EQ(100U, expected);
+	EXPECT_TRUE(fx_stack_gen_done(&gen));
+
+	/* Exhausted generators keep returning NULL */
+	EXPECT_EQ(NULL, fx_stack_gen_next(&gen));
+	fx_stack_gen_destroy(&gen);
+
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_recursive()                                                 *
+ ******************************************************************************/
+
+typedef struct test_recursive_node {
+	struct test_recursive_node *left, *right;
+	unsigned int value;
+} test_recursive_node;
+
+static test_recursive_node *test_recursive_build(unsigned int lo,
+                                                 unsigned int hi) {
+	if (lo >= hi) {
+		return NULL;
+	}
+	const unsigned int mid = lo + (hi - lo) / 2U;
+	test_recursive_node *node =
+	    (test_recursive_node *)malloc(sizeof(test_recursive_node));
+	node->left = test_recursive_build(lo, mid);
+	node->right = test_recursive_build(mid + 1U, hi);
+	node->value = mid;
+	return node;
+}
+
+static void test_recursive_free(test_recursive_node *node) {
+	if (node) {
+		test_recursive_free(node->left);
+		test_recursive_free(node->right);
+		free(node);
+	}
+}
+
+static void test_recursive_visit(fx_stack_gen *gen,
+                                 test_recursive_node *node) {
+	/* Yield from deep within the recursion */
+	if (node) {
+		test_recursive_visit(gen, node->left);
+		fx_stack_gen_yield(gen, node);
+		test_recursive_visit(gen, node->right);
+	}
+}
+
+static void test_recursive_producer(fx_stack_gen *gen, void *data) {
+	test_recursive_visit(gen, (test_recursive_node *)data);
+}
+
+static void test_recursive(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	test_recursive_node *root = test_recursive_build(0U, 1000U);
+	fx_stack_gen gen;
+	fx_stack_gen_init(&gen, stack_start, stack_end, test_recursive_producer,
+	                  root);
+
+	/* In-order traversal yields the values in ascending order */
+	test_recursive_node *node;
+	unsigned int expected = 0U;
+	while ((node = (test_recursive_node *)fx_stack_gen_next(&gen))) {
+		EXPECT_EQ(expected, node->value);
+		expected++;
+	}
+	EXPECT_EQ(1000U, expected);
+	fx_stack_gen_destroy(&gen);
+
+	test_recursive_free(root);
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_abandon()                                                   *
+ ******************************************************************************/
+
+static void test_abandon(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	/* Generators can be destroyed before they are exhausted, and the stack
+	   can be re-used afterwards */
+	unsigned int n = 100U;
+	for (unsigned int i = 0U; i < 10U; i++) {
+		fx_stack_gen gen;
+		fx_stack_gen_init(&gen, stack_start, stack_end, test_range_producer,
+		                  &n);
+		for (unsigned int j = 0U; j <= i; j++) {
+			unsigned int *value = (unsigned int *)fx_stack_gen_next(&gen);
+			EXPECT_NE(NULL, value);
+			EXPECT_EQ(j, *value);
+		}
+		EXPECT_FALSE(fx_stack_gen_done(&gen));
+		fx_stack_gen_destroy(&gen);
+	}
+
+	free(stack_start);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_range);
+	RUN(test_recursive);
+	RUN(test_abandon);
+	DONE;
+}
@@ -0,0 +1,231 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <foxen/stack.h>
+#include <foxen/stack_grow.h>
+#include <foxen/stack_inline.h>
+#include <foxen/unittest.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 16U)
+#define RED_ZONE (4096U * 4U)
+#define SEGMENT_SIZE (256U * 1024U)
+
+/******************************************************************************
+ * Unit test test_headroom()                                                  *
+ ******************************************************************************/
+
+static void *test_headroom_cback(void *data) {
+	*((size_t *)data) = fx_stack_headroom();
+	return fx_stack_current_start();
+}
+
+static void test_headroom(void) {
+	/* The native stack of the main thread is known on glibc */
+	EXPECT_EQ(NULL, fx_stack_current_start());
+	const size_t headroom = fx_stack_headroom();
+
+	/* The headroom on a separate stack is bounded by its size */
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+	size_t inner = 0U;
+	EXPECT_EQ(stack_start,
+	          fx_stack_switch(stack_start, stack_end, stack_end,
+	                          test_headroom_cback, &inner));
+	EXPECT_GT(inner, 0U);
+	EXPECT_LT(inner, STACK_LEN);
+
+	/* The previous stack is restored once the callback returns */
+	EXPECT_EQ(NULL, fx_stack_current_start());
+	if (headroom > 0U) {
+		EXPECT_LT(fx_stack_headroom() - headroom, 1024U);
+	}
+
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_context_headroom()                                          *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_context main;
+	fx_stack_context ctx;
+} test_context_headroom_data;
+
+static void *test_context_headroom_cback(void *data_) {
+	test_context_headroom_data *data = (test_context_headroom_data *)data_;
+	for (unsigned int i = 0U; i < 3U; i++) {
+		void *start = fx_stack_current_start();
+		fx_stack_context_swap(&data->ctx, &data->main, start);
+	}
+	return NULL;
+}
+
+static void test_context_headroom(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	test_context_headroom_data data;
+	memset(&data, 0, sizeof(data));
+	fx_stack_context_init(&data.ctx, stack_start, stack_end,
+	                      test_context_headroom_cback, &data);
+	for (unsigned int i = 0U; i < 3U; i++) {
+		EXPECT_EQ(stack_start,
+		          fx_stack_context_swap(&data.main, &data.ctx, NULL));
+		EXPECT_EQ(NULL, fx_stack_current_start());
+	}
+	fx_stack_context_swap(&data.main, &data.ctx, NULL);
+	EXPECT_TRUE(fx_stack_context_done(&data.ctx));
+	EXPECT_EQ(NULL, fx_stack_current_start());
+
+	fx_stack_context_destroy(&data.ctx);
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_inline_headroom()                                           *
+ ******************************************************************************/
+
+typedef struct {
+	void *inline_start;
+	void *inline_end;
+	size_t headroom;
+	void *grow_start;
+} test_inline_headroom_data;
+
+static void *test_inline_headroom_grow(void *data) {
+	(void)data;
+	return fx_stack_current_start();
+}
+
+static void *test_inline_headroom_inner(void *data_) {
+	/* The inline stack is unknown to the library */
+	test_inline_headroom_data *data = (test_inline_headroom_data *)data_;
+	data->headroom = fx_stack_headroom();
+	data->grow_start = fx_stack_maybe_grow(RED_ZONE, SEGMENT_SIZE,
+	                                       test_inline_headroom_grow, NULL);
+	return NULL;
+}
+
+static void *test_inline_headroom_outer(void *data_) {
+	test_inline_headroom_data *data = (test_inline_headroom_data *)data_;
+	return fx_stack_switch_inline(data->inline_start, data->inline_end,
+	                              data->inline_end, test_inline_headroom_inner,
+	                              data);
+}
+
+static void test_inline_headroom(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+	void *inline_start = malloc(STACK_LEN);
+	void *inline_end = (void *)((uintptr_t)inline_start + STACK_LEN);
+
+	/* Enter the inline stack from a stack set up by fx_stack_switch() */
+	test_inline_headroom_data data = {inline_start, inline_end, 1U, NULL};
+	fx_stack_switch(stack_start, stack_end, stack_end,
+	                test_inline_headroom_outer, &data);
+	EXPECT_EQ(0U, data.headroom);
+	EXPECT_NE(NULL, data.grow_start);
+	EXPECT_NE(stack_start, data.grow_start);
+
+	free(inline_start);
+	free(stack_start);
+}
+
+/******************************************************************************
+ * Unit test test_deep_recursion()                                            *
+ ******************************************************************************/
+
+typedef struct {
+	unsigned int depth;
+	unsigned int n_switches;
+	void *stack_start;
+} test_deep_recursion_data;
+
+static void *test_deep_recursion_cback(void *data_) {
+	test_deep_recursion_data *data = (test_deep_recursion_data *)data_;
+
+	/* Count the number of times the stack was switched */
+	if (fx_stack_current_start() != data->stack_start) {
+		data->stack_start = fx_stack_current_start();
+		data->n_switches++;
+	}
+
+	/* Use some stack memory on each level */
+	volatile uint8_t buf[512];
+	buf[0] = (uint8_t)data->depth;
+	buf[sizeof(buf) - 1U] = (uint8_t)data->depth;
+	if (data->depth > 0U) {
+		data->depth--;
+		fx_stack_maybe_grow(RED_ZONE, SEGMENT_SIZE, test_deep_recursion_cback,
+		                    data);
+		data->depth++;
+	}
+	return (void *)(uintptr_t)(buf[0] + buf[sizeof(buf) - 1U]);
+}
+
+static void *test_deep_recursion_thread(void *data) {
+	/* Executing this recursion on a 64 KiB thread stack without switching to
+	   new segments would crash */
+	return fx_stack_maybe_grow(RED_ZONE, SEGMENT_SIZE,
+	                           test_deep_recursion_cback, data);
+}
+
+static void test_deep_recursion(void) {
+	/* Shallow recursions are executed inline */
+	test_deep_recursion_data data = {10U, 0U, NULL};
+	fx_stack_maybe_grow(RED_ZONE, SEGMENT_SIZE, test_deep_recursion_cback,
+	                    &data);
+	EXPECT_EQ(0U, data.n_switches);
+
+	/* Deep recursions on a small thread stack switch to new segments */
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_LEN);
+	pthread_t thread;
+	data.depth = 10000U;
+	data.n_switches = 0U;
+	data.stack_start = NULL;
+	EXPECT_EQ(0, pthread_create(&thread, &attr, test_deep_recursion_thread,
+	                            &data));
+	EXPECT_EQ(0, pthread_join(thread, NULL));
+	pthread_attr_destroy(&attr);
+	EXPECT_EQ(10000U, data.depth);
+	EXPECT_GT(data.n_switches, 10000U * 512U / SEGMENT_SIZE);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_headroom);
+	RUN(test_context_headroom);
+	RUN(test_inline_headroom);
+	RUN(test_deep_recursion);
+	DONE;
+}
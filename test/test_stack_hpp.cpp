@@ -0,0 +1,333 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <foxen/stack.hpp>
+#include <foxen/stack_gen.hpp>
+#include <foxen/unittest.h>
+
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/******************************************************************************
+ * Allocation counter                                                         *
+ ******************************************************************************/
+
+static size_t n_allocations = 0U;
+
+void *operator new(size_t size) {
+	n_allocations++;
+	void *res = malloc(size ? size : 1U);
+	if (!res) {
+		throw std::bad_alloc();
+	}
+	return res;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 16U)
+
+namespace {
+
+class Stack {
+private:
+	void *m_start;
+
+public:
+	Stack() : m_start(malloc(STACK_LEN)) {}
+	~Stack() { free(m_start); }
+
+	void *start() const { return m_start; }
+	void *end() const { return (void *)((uintptr_t)m_start + STACK_LEN); }
+};
+
+/**
+ * Type that can neither be copied nor default-constructed.
+ */
+class MoveOnly {
+private:
+	int m_value;
+
+public:
+	explicit MoveOnly(int value) : m_value(value) {}
+	MoveOnly(const MoveOnly &) = delete;
+	MoveOnly(MoveOnly &&o) : m_value(o.m_value) { o.m_value = -1; }
+
+	int value() const { return m_value; }
+};
+
+int add(int a, int b) { return a + b; }
+
+}  // namespace
+
+/******************************************************************************
+ * Unit test test_lambda()                                                    *
+ ******************************************************************************/
+
+static void test_lambda(void) {
+	Stack stack;
+
+	/* Captures, arguments and typed results */
+	int x = 4813;
+	EXPECT_EQ(57756, foxen::stack_switch(stack.start(), stack.end(),
+	                                     stack.end(),
+	                                     [&](int factor) { return x * factor; },
+	                                     12));
+
+	/* Plain functions and lvalue arguments that are modified */
+	EXPECT_EQ(5, foxen::stack_switch(stack.start(), stack.end(), stack.end(),
+	                                 add, 2, 3));
+	foxen::stack_switch(stack.start(), stack.end(), stack.end(),
+	                    [](int &y) { y *= 12; }, x);
+	EXPECT_EQ(57756, x);
+
+	/* The callable is executed on the new stack */
+	const uintptr_t sp = foxen::stack_switch(
+	    stack.start(), stack.end(), stack.end(), []() {
+		    int local;
+		    return (uintptr_t)&local;
+	    });
+	EXPECT_GT(sp, (uintptr_t)stack.start());
+	EXPECT_LT(sp, (uintptr_t)stack.end());
+}
+
+/******************************************************************************
+ * Unit test test_move_only()                                                 *
+ ******************************************************************************/
+
+static void test_move_only(void) {
+	Stack stack;
+
+	/* Move-only results */
+	MoveOnly res = foxen::stack_switch(stack.start(), stack.end(), stack.end(),
+	                                   []() { return MoveOnly(42); });
+	EXPECT_EQ(42, res.value());
+
+	/* Move-only arguments are forwarded */
+	std::unique_ptr<int> ptr(new int(4813));
+	std::unique_ptr<int> ptr2 = foxen::stack_switch(
+	    stack.start(), stack.end(), stack.end(),
+	    [](std::unique_ptr<int> p) {
+		    *p *= 12;
+		    return p;
+	    },
+	    std::move(ptr));
+	EXPECT_TRUE(ptr == nullptr);
+	EXPECT_EQ(57756, *ptr2);
+
+	/* Reference results refer to the original object */
+	int x = 0;
+	int &ref = foxen::stack_switch(stack.start(), stack.end(), stack.end(),
+	                               [&]() -> int & { return x; });
+	ref = 17;
+	EXPECT_EQ(17, x);
+}
+
+/******************************************************************************
+ * Unit test test_no_allocation()                                             *
+ ******************************************************************************/
+
+static void test_no_allocation(void) {
+	Stack stack;
+	fx_stack_handle handle;
+	fx_stack_handle_init(&handle, stack.start(), stack.end());
+
+	/* Neither closures nor results are allocated on the heap */
+	char buf[256] = {0};
+	const size_t n_allocations_before = n_allocations;
+	const size_t sum = foxen::stack_switch(
+	    stack.start(), stack.end(), stack.end(),
+	    [&buf](size_t a, size_t b) { return a + b + sizeof(buf); }, 1U, 2U);
+	const MoveOnly res = foxen::stack_switch(
+	    handle, handle.stack_end, [](int v) { return MoveOnly(v); }, 5);
+	EXPECT_EQ(n_allocations_before, n_allocations);
+	EXPECT_EQ(259U, sum);
+	EXPECT_EQ(5, res.value());
+
+	fx_stack_handle_destroy(&handle);
+}
+
+/******************************************************************************
+ * Unit test test_exception()                                                 *
+ ******************************************************************************/
+
+static void test_exception(void) {
+	Stack stack;
+
+	bool did_catch = false;
+	try {
+		foxen::stack_switch(stack.start(), stack.end(), stack.end(),
+		                    []() -> MoveOnly {
+			                    throw std::runtime_error("foobar");
+		                    });
+	} catch (std::runtime_error &e) {
+		EXPECT_TRUE(std::string(e.what()) == "foobar");
+		did_catch = true;
+	}
+	EXPECT_TRUE(did_catch);
+}
+
+/******************************************************************************
+ * Unit test test_generator()                                                 *
+ ******************************************************************************/
+
+namespace {
+
+/**
+ * Move-only producer that counts how often it has been destroyed.
+ */
+class CountingProducer {
+private:
+	std::unique_ptr<int> m_n;
+	int *m_n_destroyed;
+
+public:
+	CountingProducer(int n, int *n_destroyed)
+	    : m_n(new int(n)), m_n_destroyed(n_destroyed) {}
+	CountingProducer(CountingProducer &&) = default;
+	~CountingProducer() {
+		if (m_n) {
+			(*m_n_destroyed)++;
+		}
+	}
+
+	void operator()(foxen::generator<const int>::yielder yield) {
+		for (int i = 0; i < *m_n; i++) {
+			yield(i * i);
+		}
+	}
+};
+
+}  // namespace
+
+static void test_generator(void) {
+	Stack stack;
+
+	/* Elements are passed by reference */
+	int sum = 0, n = 0;
+	{
+		const size_t n_allocations_before = n_allocations;
+		foxen::generator<int> gen(stack.start(), stack.end(),
+		                          [](foxen::generator<int>::yielder yield) {
+			                          for (int i = 0; i < 100; i++) {
+				                          yield(i);
+			                          }
+		                          });
+		for (int &x : gen) {
+			EXPECT_GT((uintptr_t)&x, (uintptr_t)stack.start());
+			EXPECT_LT((uintptr_t)&x, (uintptr_t)stack.end());
+			sum += x;
+			n++;
+		}
+		EXPECT_EQ(n_allocations_before, n_allocations);
+	}
+	EXPECT_EQ(100, n);
+	EXPECT_EQ(4950, sum);
+
+	/* The producer is moved onto the producer stack and destroyed once it
+	   returns */
+	int n_destroyed = 0;
+	{
+		foxen::generator<const int> gen(stack.start(), stack.end(),
+		                                CountingProducer(4, &n_destroyed));
+		std::string s;
+		for (const int &x : gen) {
+			s += std::to_string(x) + ",";
+		}
+		EXPECT_TRUE(s == "0,1,4,9,");
+		EXPECT_EQ(1, n_destroyed);
+	}
+	EXPECT_EQ(1, n_destroyed);
+
+	/* Destroying a generator early unwinds the producer stack */
+	n_destroyed = 0;
+	{
+		foxen::generator<const int> gen(stack.start(), stack.end(),
+		                                CountingProducer(100, &n_destroyed));
+		for (const int &x : gen) {
+			if (x == 9) {
+				break;
+			}
+		}
+		EXPECT_EQ(0, n_destroyed);
+	}
+	EXPECT_EQ(1, n_destroyed);
+
+	/* Also before the producer was executed */
+	n_destroyed = 0;
+	{
+		foxen::generator<const int> gen(stack.start(), stack.end(),
+		                                CountingProducer(100, &n_destroyed));
+	}
+	EXPECT_EQ(1, n_destroyed);
+}
+
+/******************************************************************************
+ * Unit test test_generator_exception()                                       *
+ ******************************************************************************/
+
+static void test_generator_exception(void) {
+	Stack stack;
+
+	foxen::generator<int> gen(stack.start(), stack.end(),
+	                          [](foxen::generator<int>::yielder yield) {
+		                          int x = 1;
+		                          yield(x);
+		                          throw std::runtime_error("foobar");
+	                          });
+
+	/* The exception is re-thrown when advancing the iterator */
+	int n = 0;
+	bool did_catch = false;
+	try {
+		for (int &x : gen) {
+			EXPECT_EQ(1, x);
+			n++;
+		}
+	} catch (std::runtime_error &e) {
+		EXPECT_TRUE(std::string(e.what()) == "foobar");
+		did_catch = true;
+	}
+	EXPECT_TRUE(did_catch);
+	EXPECT_EQ(1, n);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_lambda);
+	RUN(test_move_only);
+	RUN(test_no_allocation);
+	RUN(test_exception);
+	RUN(test_generator);
+	RUN(test_generator_exception);
+	DONE;
+}
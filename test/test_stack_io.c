@@ -0,0 +1,351 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Required for pipe2() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack_io.h>
+#include <foxen/stack_sched.h>
+#include <foxen/unittest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 16U)
+#define N_MESSAGES 1000U
+#define N_CONNECTIONS 16U
+
+static fx_stack_io io;
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1e3 * (double)ts.tv_sec + 1e-6 * (double)ts.tv_nsec;
+}
+
+/******************************************************************************
+ * Unit test test_pipe()                                                      *
+ ******************************************************************************/
+
+static void *test_pipe_reader(void *data) {
+	/* Blocks until the writer task has written the messages */
+	const int fd = *(int *)data;
+	uintptr_t sum = 0U;
+	for (unsigned int i = 0U; i < N_MESSAGES; i++) {
+		uint32_t msg;
+		if (fx_stack_io_read(&io, fd, &msg, sizeof(msg), -1) !=
+		    (ssize_t)sizeof(msg)) {
+			return NULL;
+		}
+		sum += msg;
+	}
+	return (void *)sum;
+}
+
+static void *test_pipe_writer(void *data) {
+	const int fd = *(int *)data;
+	for (uint32_t i = 0U; i < N_MESSAGES; i++) {
+		if (fx_stack_io_write(&io, fd, &i, sizeof(i), -1) !=
+		    (ssize_t)sizeof(i)) {
+			return NULL;
+		}
+		if ((i % 100U) == 0U) {
+			fx_stack_sched_yield();
+		}
+	}
+	return (void *)1U;
+}
+
+static void test_pipe(void) {
+	/* Use a single worker; a blocking read would deadlock */
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, 1U, STACK_LEN, 16U));
+
+	int fds[2];
+	EXPECT_EQ(0, pipe2(fds, O_NONBLOCK));
+	fx_stack_sched_task *reader =
+	    fx_stack_sched_spawn(&sched, test_pipe_reader, &fds[0]);
+	fx_stack_sched_task *writer =
+	    fx_stack_sched_spawn(&sched, test_pipe_writer, &fds[1]);
+	EXPECT_EQ((void *)1U, fx_stack_sched_join(writer));
+	EXPECT_EQ((void *)(uintptr_t)(N_MESSAGES * (N_MESSAGES - 1U) / 2U),
+	          fx_stack_sched_join(reader));
+	close(fds[0]);
+	close(fds[1]);
+
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_timeout()                                                   *
+ ******************************************************************************/
+
+static void *test_timeout_read(void *data) {
+	/* Nothing is ever written to the pipe */
+	const int fd = *(int *)data;
+	char c;
+	if (fx_stack_io_read(&io, fd, &c, 1U, 20) != -1) {
+		return NULL;
+	}
+	return (void *)(intptr_t)errno;
+}
+
+static void *test_timeout_sleep(void *data) {
+	fx_stack_io_sleep(&io, (int)(intptr_t)data);
+	return data;
+}
+
+static void test_timeout(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, 2U, STACK_LEN, 128U));
+
+	int fds[2];
+	EXPECT_EQ(0, pipe2(fds, O_NONBLOCK));
+
+	/* Reads time out */
+	double t0 = now_ms();
+	fx_stack_sched_task *task =
+	    fx_stack_sched_spawn(&sched, test_timeout_read, &fds[0]);
+	EXPECT_EQ((void *)(intptr_t)ETIMEDOUT, fx_stack_sched_join(task));
+	EXPECT_GE(now_ms() - t0, 19.0);
+
+	/* The file descriptor can be waited on again after a timeout */
+	EXPECT_EQ(1, write(fds[1], "x", 1U));
+	char c = 0;
+	EXPECT_EQ(0, fx_stack_io_wait(&io, fds[0], EPOLLIN, 1000));
+	EXPECT_EQ(1, fx_stack_io_read(&io, fds[0], &c, 1U, 1000));
+	EXPECT_EQ('x', c);
+
+	/* Many tasks sleeping concurrently */
+	fx_stack_sched_task *tasks[100];
+	t0 = now_ms();
+	for (intptr_t i = 0; i < 100; i++) {
+		tasks[i] = fx_stack_sched_spawn(&sched, test_timeout_sleep,
+		                                (void *)((i * 7) % 50));
+	}
+	for (intptr_t i = 0; i < 100; i++) {
+		EXPECT_EQ((void *)((i * 7) % 50), fx_stack_sched_join(tasks[i]));
+	}
+	EXPECT_GE(now_ms() - t0, 48.0);
+
+	/* Outside of a task, the calling thread blocks */
+	t0 = now_ms();
+	EXPECT_EQ(-1, fx_stack_io_read(&io, fds[0], &c, 1U, 10));
+	EXPECT_EQ(ETIMEDOUT, errno);
+	EXPECT_GE(now_ms() - t0, 9.0);
+
+	close(fds[0]);
+	close(fds[1]);
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_read_write()                                                *
+ ******************************************************************************/
+
+static void *test_read_write_reader(void *data) {
+	const int fd = *(int *)data;
+	char c = 0;
+	if (fx_stack_io_read(&io, fd, &c, 1U, 2000) != 1) {
+		return (void *)(intptr_t)-errno;
+	}
+	return (void *)(intptr_t)c;
+}
+
+static void *test_read_write_writer(void *data) {
+	const int fd = *(int *)data;
+	if (fx_stack_io_write(&io, fd, "y", 1U, 2000) != 1) {
+		return (void *)(intptr_t)-errno;
+	}
+	return (void *)(intptr_t)'y';
+}
+
+static void test_read_write(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, 2U, STACK_LEN, 16U));
+
+	/* Fill the send buffer, so both reading and writing block */
+	int fds[2];
+	EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+	char buf[4096];
+	memset(buf, 0, sizeof(buf));
+	while (write(fds[0], buf, sizeof(buf)) > 0) {
+	}
+
+	/* One task reads from and another one writes to the same socket */
+	fx_stack_sched_task *reader =
+	    fx_stack_sched_spawn(&sched, test_read_write_reader, &fds[0]);
+	fx_stack_io_sleep(&io, 20);
+	fx_stack_sched_task *writer =
+	    fx_stack_sched_spawn(&sched, test_read_write_writer, &fds[0]);
+	fx_stack_io_sleep(&io, 20);
+
+	/* A second reader is rejected */
+	fx_stack_sched_task *busy =
+	    fx_stack_sched_spawn(&sched, test_read_write_reader, &fds[0]);
+	EXPECT_EQ((void *)(intptr_t)-EBUSY, fx_stack_sched_join(busy));
+
+	/* Make room in the send buffer, then send a byte to the reader */
+	while (read(fds[1], buf, sizeof(buf)) > 0) {
+	}
+	EXPECT_EQ((void *)(intptr_t)'y', fx_stack_sched_join(writer));
+	EXPECT_EQ(1, write(fds[1], "x", 1U));
+	EXPECT_EQ((void *)(intptr_t)'x', fx_stack_sched_join(reader));
+
+	close(fds[0]);
+	close(fds[1]);
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_loopback()                                                  *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_sched *sched;
+	int fd;
+	uint16_t port;
+} test_loopback_data;
+
+static void *test_loopback_echo(void *data) {
+	/* Echo everything until the client closes the connection */
+	const int fd = (int)(intptr_t)data;
+	char buf[256];
+	ssize_t n;
+	while ((n = fx_stack_io_read(&io, fd, buf, sizeof(buf), 1000)) > 0) {
+		for (ssize_t i = 0; i < n;) {
+			const ssize_t m = fx_stack_io_write(&io, fd, buf + i,
+			                                    (size_t)(n - i), 1000);
+			if (m <= 0) {
+				break;
+			}
+			i += m;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *test_loopback_server(void *data_) {
+	test_loopback_data *data = (test_loopback_data *)data_;
+	fx_stack_sched_task *tasks[N_CONNECTIONS];
+	uintptr_t n_accepted = 0U;
+	for (unsigned int i = 0U; i < N_CONNECTIONS; i++) {
+		const int fd = fx_stack_io_accept(&io, data->fd, NULL, NULL, 1000);
+		if (fd < 0) {
+			break;
+		}
+		tasks[n_accepted++] = fx_stack_sched_spawn(
+		    data->sched, test_loopback_echo, (void *)(intptr_t)fd);
+	}
+	for (uintptr_t i = 0U; i < n_accepted; i++) {
+		fx_stack_sched_join(tasks[i]);
+	}
+	return (void *)n_accepted;
+}
+
+static void *test_loopback_client(void *data_) {
+	test_loopback_data *data = (test_loopback_data *)data_;
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = data->port;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	uintptr_t n_ok = 0U;
+	if (fx_stack_io_connect(&io, fd, (struct sockaddr *)&addr, sizeof(addr),
+	                        1000) == 0) {
+		for (uint32_t i = 0U; i < 100U; i++) {
+			uint32_t msg = 0U;
+			if ((fx_stack_io_write(&io, fd, &i, sizeof(i), 1000) ==
+			     (ssize_t)sizeof(i)) &&
+			    (fx_stack_io_read(&io, fd, &msg, sizeof(msg), 1000) ==
+			     (ssize_t)sizeof(msg)) &&
+			    (msg == i)) {
+				n_ok++;
+			}
+		}
+	}
+	close(fd);
+	return (void *)n_ok;
+}
+
+static void test_loopback(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, 4U, STACK_LEN, 64U));
+
+	/* Listen on an arbitrary port on the loopback interface */
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	EXPECT_NE(-1, fd);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrlen = sizeof(addr);
+	EXPECT_EQ(0, bind(fd, (struct sockaddr *)&addr, sizeof(addr)));
+	EXPECT_EQ(0, listen(fd, N_CONNECTIONS));
+	EXPECT_EQ(0, getsockname(fd, (struct sockaddr *)&addr, &addrlen));
+
+	test_loopback_data data = {&sched, fd, addr.sin_port};
+	fx_stack_sched_task *server =
+	    fx_stack_sched_spawn(&sched, test_loopback_server, &data);
+	fx_stack_sched_task *clients[N_CONNECTIONS];
+	for (unsigned int i = 0U; i < N_CONNECTIONS; i++) {
+		clients[i] = fx_stack_sched_spawn(&sched, test_loopback_client, &data);
+	}
+	for (unsigned int i = 0U; i < N_CONNECTIONS; i++) {
+		EXPECT_EQ((void *)100U, fx_stack_sched_join(clients[i]));
+	}
+	EXPECT_EQ((void *)(uintptr_t)N_CONNECTIONS, fx_stack_sched_join(server));
+
+	close(fd);
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	if (!fx_stack_io_init(&io)) {
+		return 1;
+	}
+	RUN(test_pipe);
+	RUN(test_timeout);
+	RUN(test_read_write);
+	RUN(test_loopback);
+	fx_stack_io_destroy(&io);
+	DONE;
+}
@@ -0,0 +1,514 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Required for mincore() and syscall() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <foxen/stack.h>
+#include <foxen/stack_pool.h>
+#include <foxen/unittest.h>
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 4U)
+
+/******************************************************************************
+ * Unit test test_alloc_free()                                                *
+ ******************************************************************************/
+
+static void *test_alloc_free_cback(void *data) {
+	*((int *)data) *= 12;
+	return (void *)0xAFFEAFFEU;
+}
+
+static void test_alloc_free(void) {
+	fx_stack_pool pool;
+	EXPECT_TRUE(fx_stack_pool_init(&pool, STACK_LEN - 1U, 4U, 0U));
+
+	fx_stack *stack = fx_stack_pool_alloc(&pool);
+	EXPECT_NE(NULL, stack);
+	EXPECT_EQ(0U, ((uintptr_t)stack->stack_start) % 16U);
+	EXPECT_EQ(0U, ((uintptr_t)stack->stack_end) % 16U);
+	EXPECT_GE((uintptr_t)stack->stack_end - (uintptr_t)stack->stack_start,
+	          (uintptr_t)STACK_LEN - 1U);
+
+	int data = 4813;
+	void *res = fx_stack_switch(stack->stack_start, stack->stack_end,
+	                            stack->stack_end, test_alloc_free_cback, &data);
+	EXPECT_EQ((void *)0xAFFEAFFEU, res);
+	EXPECT_EQ(57756, data);
+
+	/* Released stacks are handed out again */
+	fx_stack_pool_free(&pool, stack);
+	EXPECT_EQ(stack, fx_stack_pool_alloc(&pool));
+	fx_stack_pool_free(&pool, stack);
+
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Unit test test_capacity()                                                  *
+ ******************************************************************************/
+
+static void test_capacity(void) {
+	fx_stack_pool pool;
+	EXPECT_TRUE(fx_stack_pool_init(&pool, STACK_LEN, 3U,
+	                               FX_STACK_POOL_POPULATE));
+	EXPECT_EQ(2U, fx_stack_pool_reserve(&pool, 2U));
+
+	fx_stack *stacks[3];
+	for (unsigned int i = 0U; i < 3U; i++) {
+		stacks[i] = fx_stack_pool_alloc(&pool);
+		EXPECT_NE(NULL, stacks[i]);
+	}
+
+	/* The pool is exhausted */
+	EXPECT_EQ(NULL, fx_stack_pool_alloc(&pool));
+	EXPECT_EQ(0U, fx_stack_pool_reserve(&pool, 1U));
+
+	/* Stacks are reused in LIFO order */
+	fx_stack_pool_free(&pool, stacks[0]);
+	fx_stack_pool_free(&pool, stacks[2]);
+	EXPECT_EQ(stacks[2], fx_stack_pool_alloc(&pool));
+	EXPECT_EQ(stacks[0], fx_stack_pool_alloc(&pool));
+	EXPECT_EQ(NULL, fx_stack_pool_alloc(&pool));
+
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Unit test test_map_failure()                                               *
+ ******************************************************************************/
+
+static void test_map_failure(void) {
+	/* Prevent new mappings by lowering the address space limit */
+	struct rlimit limit;
+	EXPECT_EQ(0, getrlimit(RLIMIT_AS, &limit));
+	struct rlimit low = limit;
+	low.rlim_cur = 0U;
+
+	fx_stack_pool pool;
+	EXPECT_TRUE(fx_stack_pool_init(&pool, STACK_LEN, 1U, 0U));
+	EXPECT_EQ(0, setrlimit(RLIMIT_AS, &low));
+	fx_stack *failed = fx_stack_pool_alloc(&pool);
+	EXPECT_EQ(0, setrlimit(RLIMIT_AS, &limit));
+	EXPECT_EQ(NULL, failed);
+
+	/* The descriptor claimed by the failed allocation is not lost */
+	fx_stack *stack = fx_stack_pool_alloc(&pool);
+	EXPECT_NE(NULL, stack);
+	EXPECT_EQ(NULL, fx_stack_pool_alloc(&pool));
+	fx_stack_pool_free(&pool, stack);
+	EXPECT_EQ(stack, fx_stack_pool_alloc(&pool));
+	fx_stack_pool_free(&pool, stack);
+
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Unit test test_guard_page()                                                *
+ ******************************************************************************/
+
+static void test_guard_page(void) {
+	fx_stack_pool pool;
+	EXPECT_TRUE(fx_stack_pool_init(&pool, STACK_LEN, 1U, 0U));
+	fx_stack *stack = fx_stack_pool_alloc(&pool);
+	EXPECT_NE(NULL, stack);
+
+	/* Writing to the lowest stack byte is fine, writing below it must result
+	   in a segmentation fault. Do this in a child process. */
+	pid_t pid = fork();
+	if (pid == 0) {
+		volatile uint8_t *ptr = (volatile uint8_t *)stack->stack_start;
+		ptr[0] = 1;
+		ptr[-1] = 1;
+		_exit(0);
+	}
+
+	int status = 0;
+	EXPECT_EQ(pid, waitpid(pid, &status, 0));
+	EXPECT_TRUE(WIFSIGNALED(status));
+	EXPECT_TRUE(WIFSIGNALED(status) && (WTERMSIG(status) == SIGSEGV ||
+	                                    WTERMSIG(status) == SIGBUS));
+
+	fx_stack_pool_free(&pool, stack);
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Unit test test_watermark()                                                 *
+ ******************************************************************************/
+
+static void *test_watermark_cback(void *data) {
+	(void)data;
+	volatile uint8_t buf[4096];
+	for (size_t i = 0U; i < sizeof(buf); i++) {
+		buf[i] = (uint8_t)i;
+	}
+	return (void *)(uintptr_t)buf[sizeof(buf) - 1U];
+}
+
+static void test_watermark(void) {
+	fx_stack_pool pool;
+	EXPECT_TRUE(fx_stack_pool_init(&pool, STACK_LEN, 1U, 0U));
+	fx_stack *stack = fx_stack_pool_alloc(&pool);
+	EXPECT_NE(NULL, stack);
+
+	fx_stack_paint(stack->stack_start, stack->stack_end);
+	fx_stack_switch(stack->stack_start, stack->stack_end, stack->stack_end,
+	                test_watermark_cback, NULL);
+	const size_t used =
+	    fx_stack_high_water_mark(stack->stack_start, stack->stack_end);
+	EXPECT_GE(used, 4096U);
+
+	/* The pool only records high-water marks if compiled with
+	   FX_WITH_STACK_WATERMARK; released stacks are re-painted */
+	fx_stack_pool_free(&pool, stack);
+	if (pool.watermark.count > 0U) {
+		EXPECT_EQ(1U, pool.watermark.count);
+		EXPECT_EQ(used, pool.watermark.max);
+		EXPECT_EQ(used, pool.watermark.sum);
+
+		stack = fx_stack_pool_alloc(&pool);
+		EXPECT_EQ(0U,
+		          fx_stack_high_water_mark(stack->stack_start, stack->stack_end));
+		fx_stack_pool_free(&pool, stack);
+	}
+
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Unit test test_reclaim()                                                   *
+ ******************************************************************************/
+
+#define RECLAIM_STACK_LEN (4096U * 16U)
+#define RECLAIM_KEEP (4096U * 2U)
+
+static void *test_reclaim_cback(void *data) {
+	/* Touch most of the stack */
+	(void)data;
+	volatile uint8_t buf[RECLAIM_STACK_LEN - 4096U];
+	for (size_t i = 0U; i < sizeof(buf); i += 64U) {
+		buf[i] = 1U;
+	}
+	return NULL;
+}
+
+static size_t test_reclaim_resident(fx_stack *stack) {
+	const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t n_pages =
+	    ((uint8_t *)stack->stack_end - (uint8_t *)stack->stack_start) /
+	    page_size;
+	unsigned char vec[RECLAIM_STACK_LEN / 4096U];
+	if ((n_pages > sizeof(vec)) ||
+	    (mincore(stack->stack_start, n_pages * page_size, vec) != 0)) {
+		return 0U;
+	}
+	size_t n_resident = 0U;
+	for (size_t i = 0U; i < n_pages; i++) {
+		n_resident += (vec[i] & 1U) ? page_size : 0U;
+	}
+	return n_resident;
+}
+
+static void test_reclaim(void) {
+	fx_stack_pool pool;
+	EXPECT_TRUE(fx_stack_pool_init(&pool, RECLAIM_STACK_LEN, 2U, 0U));
+	fx_stack *stack = fx_stack_pool_alloc(&pool);
+	EXPECT_NE(NULL, stack);
+	const size_t size =
+	    (uint8_t *)stack->stack_end - (uint8_t *)stack->stack_start;
+
+	/* Explicitly reclaim a caller-provided stack region */
+	fx_stack_switch(stack->stack_start, stack->stack_end, stack->stack_end,
+	                test_reclaim_cback, NULL);
+	EXPECT_GE(test_reclaim_resident(stack), size - 4096U);
+	EXPECT_EQ(size - RECLAIM_KEEP,
+	          fx_stack_reclaim(stack->stack_start, stack->stack_end,
+	                           RECLAIM_KEEP, 0U));
+	EXPECT_EQ(0U, fx_stack_reclaim(stack->stack_start, stack->stack_end,
+	                               size, 0U));
+
+	/* Released pages read as zero, unless they were re-painted. Note that
+	   reading a released page maps it again. */
+	size_t resident = test_reclaim_resident(stack);
+	const uintptr_t word = *(volatile uintptr_t *)stack->stack_start;
+	EXPECT_TRUE((word == 0U) || (word == FX_STACK_PAINT_PATTERN));
+	if (word == 0U) {
+		EXPECT_LE(resident, RECLAIM_KEEP);
+	}
+
+	/* Trim the stacks in the free list */
+	fx_stack_switch(stack->stack_start, stack->stack_end, stack->stack_end,
+	                test_reclaim_cback, NULL);
+	fx_stack_pool_free(&pool, stack);
+	EXPECT_EQ(size - RECLAIM_KEEP,
+	          fx_stack_pool_trim(&pool, RECLAIM_KEEP, FX_STACK_RECLAIM_LAZY));
+	EXPECT_EQ(stack, fx_stack_pool_alloc(&pool));
+
+	/* Trim stacks when they are released */
+	fx_stack_pool_set_reclaim(&pool, RECLAIM_KEEP, FX_STACK_RECLAIM_ON_FREE);
+	fx_stack_switch(stack->stack_start, stack->stack_end, stack->stack_end,
+	                test_reclaim_cback, NULL);
+	fx_stack_pool_free(&pool, stack);
+	resident = test_reclaim_resident(stack);
+	if (*(volatile uintptr_t *)stack->stack_start == 0U) {
+		EXPECT_LE(resident, RECLAIM_KEEP);
+	}
+
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Unit test test_arena()                                                     *
+ ******************************************************************************/
+
+#define ARENA_SLOT_ALIGN (4096U * 8U)
+
+static void test_arena(void) {
+	fx_stack_pool pool;
+	EXPECT_FALSE(fx_stack_pool_init_arena(&pool, STACK_LEN, 3U * 4096U, 4U,
+	                                      0U));
+	EXPECT_TRUE(fx_stack_pool_init_arena(&pool, STACK_LEN, ARENA_SLOT_ALIGN,
+	                                     4U, FX_STACK_POOL_POPULATE));
+	EXPECT_EQ(0U, pool.huge_page_size);
+
+	/* Stacks are handed out from consecutive, aligned slots; the guard page
+	   is part of the slot */
+	fx_stack *stacks[4];
+	for (unsigned int i = 0U; i < 4U; i++) {
+		stacks[i] = fx_stack_pool_alloc(&pool);
+		EXPECT_NE(NULL, stacks[i]);
+		EXPECT_EQ(0U, (uintptr_t)stacks[i]->stack_end % ARENA_SLOT_ALIGN);
+		EXPECT_EQ((uintptr_t)ARENA_SLOT_ALIGN - 4096U,
+		          (uintptr_t)stacks[i]->stack_end -
+		              (uintptr_t)stacks[i]->stack_start);
+		if (i > 0U) {
+			EXPECT_EQ((uintptr_t)stacks[i - 1U]->stack_end + 4096U,
+			          (uintptr_t)stacks[i]->stack_start);
+		}
+
+		int data = 4813;
+		fx_stack_switch(stacks[i]->stack_start, stacks[i]->stack_end,
+		                stacks[i]->stack_end, test_alloc_free_cback, &data);
+		EXPECT_EQ(57756, data);
+	}
+	EXPECT_EQ(NULL, fx_stack_pool_alloc(&pool));
+
+	/* Writing below the lowest stack byte hits the guard page */
+	pid_t pid = fork();
+	if (pid == 0) {
+		volatile uint8_t *ptr = (volatile uint8_t *)stacks[2]->stack_start;
+		ptr[0] = 1;
+		ptr[-1] = 1;
+		_exit(0);
+	}
+	int status = 0;
+	EXPECT_EQ(pid, waitpid(pid, &status, 0));
+	EXPECT_TRUE(WIFSIGNALED(status) && (WTERMSIG(status) == SIGSEGV ||
+	                                    WTERMSIG(status) == SIGBUS));
+
+	/* Released stacks are handed out again */
+	fx_stack_pool_free(&pool, stacks[1]);
+	EXPECT_EQ(stacks[1], fx_stack_pool_alloc(&pool));
+	for (unsigned int i = 0U; i < 4U; i++) {
+		fx_stack_pool_free(&pool, stacks[i]);
+	}
+	fx_stack_pool_destroy(&pool);
+
+	/* Without guard pages stacks are directly adjacent */
+	EXPECT_TRUE(fx_stack_pool_init_arena(&pool, STACK_LEN, 0U, 2U,
+	                                     FX_STACK_POOL_NO_GUARD));
+	stacks[0] = fx_stack_pool_alloc(&pool);
+	stacks[1] = fx_stack_pool_alloc(&pool);
+	EXPECT_EQ(STACK_LEN, (uintptr_t)stacks[0]->stack_end -
+	                         (uintptr_t)stacks[0]->stack_start);
+	EXPECT_EQ(stacks[0]->stack_end, stacks[1]->stack_start);
+	fx_stack_pool_destroy(&pool);
+
+	/* Cache colouring staggers the tops of the stacks */
+	EXPECT_TRUE(fx_stack_pool_init_arena(&pool, STACK_LEN, 0U, 2U,
+	                                     FX_STACK_POOL_COLOUR));
+	stacks[0] = fx_stack_pool_alloc(&pool);
+	stacks[1] = fx_stack_pool_alloc(&pool);
+	EXPECT_EQ(FX_STACK_POOL_COLOUR_STRIDE,
+	          (uintptr_t)stacks[0]->stack_end + pool.slot_size -
+	              (uintptr_t)stacks[1]->stack_end);
+	for (unsigned int i = 0U; i < 2U; i++) {
+		EXPECT_GE((uintptr_t)stacks[i]->stack_end -
+		              (uintptr_t)stacks[i]->stack_start,
+		          STACK_LEN);
+	}
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Unit test test_arena_huge()                                                *
+ ******************************************************************************/
+
+static void test_arena_huge(void) {
+	/* Falls back to regular pages if no huge pages are available */
+	fx_stack_pool pool;
+	EXPECT_TRUE(fx_stack_pool_init_arena(&pool, STACK_LEN, 0U, 256U,
+	                                     FX_STACK_POOL_HUGE_PAGES));
+	if (pool.huge_page_size) {
+		EXPECT_EQ(0U, (uintptr_t)pool.arena % pool.huge_page_size);
+	}
+	EXPECT_EQ(0U, pool.guard_size);
+	EXPECT_EQ(0U, (uintptr_t)pool.arena % FX_STACK_POOL_HUGE_PAGE_SIZE);
+	EXPECT_EQ(0U, pool.arena_size % FX_STACK_POOL_HUGE_PAGE_SIZE);
+
+	for (unsigned int i = 0U; i < 256U; i++) {
+		fx_stack *stack = fx_stack_pool_alloc(&pool);
+		EXPECT_NE(NULL, stack);
+		EXPECT_EQ((uint8_t *)pool.arena + (i + 1U) * STACK_LEN,
+		          (uint8_t *)stack->stack_end);
+
+		int data = 4813;
+		fx_stack_switch(stack->stack_start, stack->stack_end,
+		                stack->stack_end, test_alloc_free_cback, &data);
+		EXPECT_EQ(57756, data);
+	}
+	EXPECT_EQ(NULL, fx_stack_pool_alloc(&pool));
+	fx_stack_pool_destroy(&pool);
+
+	/* Pre-faulting touches every page, even if the kernel does not back the
+	   arena with huge pages */
+	EXPECT_TRUE(fx_stack_pool_init_arena(
+	    &pool, STACK_LEN, 0U, 16U,
+	    FX_STACK_POOL_HUGE_PAGES | FX_STACK_POOL_POPULATE));
+	const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t n_pages = pool.arena_size / page_size;
+	unsigned char *vec = (unsigned char *)malloc(n_pages);
+	EXPECT_EQ(0, mincore(pool.arena, pool.arena_size, vec));
+	size_t n_resident = 0U;
+	for (size_t i = 0U; i < n_pages; i++) {
+		n_resident += vec[i] & 1U;
+	}
+	EXPECT_EQ(n_pages, n_resident);
+	free(vec);
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * Unit test test_numa()                                                      *
+ ******************************************************************************/
+
+/**
+ * Returns the node of the page containing the given address or -1 if it
+ * cannot be determined.
+ */
+static long test_numa_page_node(void *addr) {
+#ifdef SYS_get_mempolicy
+	int node = -1;
+	const unsigned long flags = 3UL; /* MPOL_F_NODE | MPOL_F_ADDR */
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0UL, addr, flags) != 0) {
+		return -1;
+	}
+	return node;
+#else
+	(void)addr;
+	return -1;
+#endif
+}
+
+static void test_numa(void) {
+	const size_t n_nodes = fx_stack_numa_node_count();
+	EXPECT_GE(n_nodes, 1U);
+	EXPECT_LT(fx_stack_numa_current_node(), n_nodes);
+
+	fx_stack_numa_pool pool;
+	EXPECT_TRUE(fx_stack_numa_pool_init(&pool, STACK_LEN, 2U, 0U));
+
+	/* Stacks are placed on the requested node and released stacks are
+	   returned to the free list of that node */
+	for (size_t node = 0U; node < n_nodes; node++) {
+		fx_stack *stack = fx_stack_numa_pool_alloc_on(&pool, node);
+		EXPECT_NE(NULL, stack);
+		EXPECT_EQ(node, fx_stack_numa_pool_node(&pool, stack));
+
+		int data = 4813;
+		fx_stack_switch(stack->stack_start, stack->stack_end,
+		                stack->stack_end, test_alloc_free_cback, &data);
+		EXPECT_EQ(57756, data);
+		const long page_node =
+		    test_numa_page_node((uint8_t *)stack->stack_end - 1U);
+		EXPECT_TRUE((page_node < 0) || ((size_t)page_node == node));
+
+		fx_stack_numa_pool_free(&pool, stack);
+		EXPECT_EQ(stack, fx_stack_numa_pool_alloc_on(&pool, node));
+		fx_stack_numa_pool_free(&pool, stack);
+	}
+
+	/* Stacks are taken from the current node, unless the thread migrated
+	   in the meantime (it cannot if bound to a node using numactl) */
+	const size_t node = fx_stack_numa_current_node();
+	fx_stack *stack = fx_stack_numa_pool_alloc(&pool);
+	EXPECT_NE(NULL, stack);
+	if (node == fx_stack_numa_current_node()) {
+		EXPECT_EQ(node, fx_stack_numa_pool_node(&pool, stack));
+		EXPECT_EQ(&pool.pools[node], fx_stack_numa_pool_local(&pool));
+	}
+	fx_stack_numa_pool_free(&pool, stack);
+
+	/* Exhausted nodes fall back to the other nodes */
+	fx_stack *stacks[2U * FX_STACK_NUMA_MAX_NODES];
+	for (size_t i = 0U; i < 2U * n_nodes; i++) {
+		stacks[i] = fx_stack_numa_pool_alloc_on(&pool, 0U);
+		EXPECT_NE(NULL, stacks[i]);
+	}
+	EXPECT_EQ(NULL, fx_stack_numa_pool_alloc(&pool));
+	for (size_t i = 0U; i < 2U * n_nodes; i++) {
+		fx_stack_numa_pool_free(&pool, stacks[i]);
+	}
+
+	fx_stack_numa_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_alloc_free);
+	RUN(test_capacity);
+	RUN(test_map_failure);
+	RUN(test_guard_page);
+	RUN(test_watermark);
+	RUN(test_reclaim);
+	RUN(test_arena);
+	RUN(test_arena_huge);
+	RUN(test_numa);
+	DONE;
+}
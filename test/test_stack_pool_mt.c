@@ -0,0 +1,184 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <foxen/stack.h>
+#include <foxen/stack_pool.h>
+#include <foxen/unittest.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 4U)
+#define N_THREADS 8U
+#define N_HELD 8U
+#define N_ITERATIONS 200000U
+
+/******************************************************************************
+ * Unit test test_stress()                                                    *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_pool *pool;
+	uintptr_t *owners;
+	uintptr_t id;
+	bool use_cache;
+	unsigned int n_errors;
+} test_stress_data;
+
+static void *test_stress_cback(void *data) {
+	/* Touch some memory on the new stack */
+	volatile uintptr_t buf[64];
+	for (unsigned int i = 0U; i < 64U; i++) {
+		buf[i] = (uintptr_t)data + i;
+	}
+	return (void *)(buf[63] - 63U);
+}
+
+static uint32_t test_stress_rand(uint32_t *state) {
+	/* xorshift32 */
+	uint32_t x = *state;
+	x ^= x << 13U;
+	x ^= x >> 17U;
+	x ^= x << 5U;
+	return (*state = x);
+}
+
+static void *test_stress_thread(void *data_) {
+	test_stress_data *data = (test_stress_data *)data_;
+	fx_stack_pool_cache cache;
+	fx_stack *held[N_HELD];
+	unsigned int n_held = 0U;
+	uint32_t rand_state = 0x9E3779B9U * (uint32_t)(data->id + 1U);
+
+	fx_stack_pool_cache_init(&cache, data->pool);
+	for (unsigned int i = 0U; i < N_ITERATIONS; i++) {
+		const bool do_alloc =
+		    (n_held == 0U) ||
+		    ((n_held < N_HELD) && (test_stress_rand(&rand_state) & 1U));
+		if (do_alloc) {
+			fx_stack *stack = data->use_cache
+			                      ? fx_stack_pool_cache_alloc(&cache)
+			                      : fx_stack_pool_alloc(data->pool);
+			if (!stack) {
+				data->n_errors++;
+				continue;
+			}
+
+			/* Mark the stack as owned by this thread; a stack must never be
+			   handed out twice */
+			uintptr_t expected = 0U;
+			if (!__atomic_compare_exchange_n(
+			        &data->owners[stack - data->pool->stacks], &expected,
+			        data->id, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				data->n_errors++;
+			}
+
+			/* Occasionally execute code on the stack */
+			if ((i % 16U) == 0U) {
+				void *res = fx_stack_switch(stack->stack_start, stack->stack_end,
+				                            stack->stack_end, test_stress_cback,
+				                            (void *)data->id);
+				if (res != (void *)data->id) {
+					data->n_errors++;
+				}
+			}
+			held[n_held++] = stack;
+		} else if ((i % 4096U) == 0U) {
+			/* Occasionally trim the released stacks concurrently to the other
+			   threads */
+			fx_stack_pool_trim(data->pool, 0U, FX_STACK_RECLAIM_LAZY);
+		} else {
+			const unsigned int j = test_stress_rand(&rand_state) % n_held;
+			fx_stack *stack = held[j];
+			held[j] = held[--n_held];
+
+			uintptr_t expected = data->id;
+			if (!__atomic_compare_exchange_n(
+			        &data->owners[stack - data->pool->stacks], &expected, 0U,
+			        false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				data->n_errors++;
+			}
+			if (data->use_cache) {
+				fx_stack_pool_cache_free(&cache, stack);
+			} else {
+				fx_stack_pool_free(data->pool, stack);
+			}
+		}
+	}
+
+	/* Return all stacks */
+	while (n_held > 0U) {
+		fx_stack *stack = held[--n_held];
+		data->owners[stack - data->pool->stacks] = 0U;
+		fx_stack_pool_free(data->pool, stack);
+	}
+	fx_stack_pool_cache_destroy(&cache);
+	return NULL;
+}
+
+static void test_stress(void) {
+	/* Each thread holds at most N_HELD stacks and 2 * FX_STACK_POOL_CACHE_BATCH
+	   cached stacks */
+	const size_t capacity =
+	    N_THREADS * (N_HELD + 2U * FX_STACK_POOL_CACHE_BATCH);
+	fx_stack_pool pool;
+	EXPECT_TRUE(fx_stack_pool_init(&pool, STACK_LEN, capacity, 0U));
+	uintptr_t *owners = (uintptr_t *)calloc(capacity, sizeof(uintptr_t));
+
+	pthread_t threads[N_THREADS];
+	test_stress_data data[N_THREADS];
+	for (unsigned int i = 0U; i < N_THREADS; i++) {
+		data[i].pool = &pool;
+		data[i].owners = owners;
+		data[i].id = i + 1U;
+		data[i].use_cache = (i % 2U) == 0U;
+		data[i].n_errors = 0U;
+		EXPECT_EQ(0, pthread_create(&threads[i], NULL, test_stress_thread,
+		                            &data[i]));
+	}
+	for (unsigned int i = 0U; i < N_THREADS; i++) {
+		EXPECT_EQ(0, pthread_join(threads[i], NULL));
+		EXPECT_EQ(0U, data[i].n_errors);
+	}
+
+	/* All stacks must have been returned to the pool */
+	EXPECT_EQ(pool.n_stacks, pool.n_free);
+	EXPECT_EQ(pool.n_stacks, fx_stack_pool_reserve(&pool, 0U));
+	size_t n = 0U;
+	while (fx_stack_pool_alloc(&pool)) {
+		n++;
+	}
+	EXPECT_EQ(capacity, n);
+
+	free(owners);
+	fx_stack_pool_destroy(&pool);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_stress);
+	DONE;
+}
@@ -0,0 +1,277 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <foxen/stack.h>
+#include <foxen/stack_sched.h>
+#include <foxen/unittest.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 16U)
+#define N_WORKERS 4U
+#define N_TASKS 1000U
+
+/******************************************************************************
+ * Unit test test_spawn_join()                                                *
+ ******************************************************************************/
+
+static void *test_spawn_join_cback(void *data) {
+	/* Tasks are executed on a pooled stack */
+	if (!fx_stack_sched_current() || !fx_stack_current_start()) {
+		return NULL;
+	}
+	return (void *)((uintptr_t)data * 2U);
+}
+
+static void test_spawn_join(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, N_WORKERS, STACK_LEN, N_TASKS));
+	EXPECT_EQ(NULL, fx_stack_sched_current());
+
+	fx_stack_sched_task **tasks =
+	    (fx_stack_sched_task **)malloc(N_TASKS * sizeof(fx_stack_sched_task *));
+	for (uintptr_t i = 0U; i < N_TASKS; i++) {
+		tasks[i] = fx_stack_sched_spawn(&sched, test_spawn_join_cback,
+		                                (void *)(i + 1U));
+		EXPECT_NE(NULL, tasks[i]);
+	}
+	for (uintptr_t i = 0U; i < N_TASKS; i++) {
+		EXPECT_EQ((void *)(2U * (i + 1U)), fx_stack_sched_join(tasks[i]));
+	}
+	free(tasks);
+
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_yield()                                                     *
+ ******************************************************************************/
+
+typedef struct {
+	unsigned int counter;
+	unsigned int n_interleaved;
+} test_yield_data;
+
+static void *test_yield_cback(void *data_) {
+	test_yield_data *data = (test_yield_data *)data_;
+	for (unsigned int i = 0U; i < 100U; i++) {
+		/* Count how often another task ran while this task was suspended */
+		const unsigned int before =
+		    __atomic_add_fetch(&data->counter, 1U, __ATOMIC_SEQ_CST);
+		fx_stack_sched_yield();
+		if (__atomic_load_n(&data->counter, __ATOMIC_SEQ_CST) != before) {
+			__atomic_add_fetch(&data->n_interleaved, 1U, __ATOMIC_SEQ_CST);
+		}
+	}
+	return NULL;
+}
+
+static void test_yield(void) {
+	/* Use a single worker, so tasks only interleave by yielding */
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, 1U, STACK_LEN, 16U));
+
+	test_yield_data data = {0U, 0U};
+	fx_stack_sched_task *tasks[8];
+	for (unsigned int i = 0U; i < 8U; i++) {
+		tasks[i] = fx_stack_sched_spawn(&sched, test_yield_cback, &data);
+	}
+	for (unsigned int i = 0U; i < 8U; i++) {
+		fx_stack_sched_join(tasks[i]);
+	}
+	EXPECT_EQ(800U, data.counter);
+	EXPECT_GT(data.n_interleaved, 700U);
+
+	/* Yielding outside of a task does nothing */
+	fx_stack_sched_yield();
+
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_local()                                                     *
+ ******************************************************************************/
+
+static int test_local_key = -1;
+
+static void *test_local_cback(void *data) {
+	/* Fiber-local values follow the task when it migrates between workers */
+	fx_stack_local_set(test_local_key, data);
+	for (unsigned int i = 0U; i < 100U; i++) {
+		fx_stack_sched_yield();
+		if (fx_stack_local_get(test_local_key) != data) {
+			return NULL;
+		}
+	}
+	return data;
+}
+
+static void test_local(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, 4U, STACK_LEN, 64U));
+
+	test_local_key = fx_stack_local_key_create();
+	EXPECT_GE(test_local_key, 0);
+	fx_stack_local_set(test_local_key, (void *)0x1);
+
+	fx_stack_sched_task *tasks[64];
+	for (uintptr_t i = 0U; i < 64U; i++) {
+		tasks[i] = fx_stack_sched_spawn(&sched, test_local_cback,
+		                                (void *)(i + 2U));
+	}
+	for (uintptr_t i = 0U; i < 64U; i++) {
+		EXPECT_EQ((void *)(i + 2U), fx_stack_sched_join(tasks[i]));
+	}
+	EXPECT_EQ((void *)0x1, fx_stack_local_get(test_local_key));
+
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_nested()                                                    *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_sched *sched;
+	uintptr_t n;
+} test_nested_data;
+
+static void *test_nested_fib(void *data_) {
+	test_nested_data *data = (test_nested_data *)data_;
+	if (data->n < 2U) {
+		return (void *)data->n;
+	}
+
+	/* Compute fib(n - 1) in a new task and fib(n - 2) in this task */
+	test_nested_data d1 = {data->sched, data->n - 1U};
+	test_nested_data d2 = {data->sched, data->n - 2U};
+	fx_stack_sched_task *task =
+	    fx_stack_sched_spawn(data->sched, test_nested_fib, &d1);
+	const uintptr_t f2 = (uintptr_t)test_nested_fib(&d2);
+	const uintptr_t f1 = (uintptr_t)fx_stack_sched_join(task);
+	return (void *)(f1 + f2);
+}
+
+static void test_nested(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, N_WORKERS, STACK_LEN, 8192U));
+
+	/* fib(18) = 2584 spawns 4180 tasks in total */
+	test_nested_data data = {&sched, 18U};
+	fx_stack_sched_task *task =
+	    fx_stack_sched_spawn(&sched, test_nested_fib, &data);
+	EXPECT_EQ((void *)2584U, fx_stack_sched_join(task));
+
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_external_threads()                                          *
+ ******************************************************************************/
+
+static void *test_external_threads_cback(void *data) {
+	fx_stack_sched_yield();
+	return data;
+}
+
+static void *test_external_threads_thread(void *data) {
+	/* Spawn and join tasks from a thread outside of the scheduler */
+	fx_stack_sched *sched = (fx_stack_sched *)data;
+	uintptr_t n_errors = 0U;
+	for (uintptr_t i = 0U; i < N_TASKS; i++) {
+		fx_stack_sched_task *task = fx_stack_sched_spawn(
+		    sched, test_external_threads_cback, (void *)i);
+		if (fx_stack_sched_join(task) != (void *)i) {
+			n_errors++;
+		}
+	}
+	return (void *)n_errors;
+}
+
+static void test_external_threads(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, N_WORKERS, STACK_LEN, 64U));
+
+	pthread_t threads[4];
+	for (unsigned int i = 0U; i < 4U; i++) {
+		EXPECT_EQ(0, pthread_create(&threads[i], NULL,
+		                            test_external_threads_thread, &sched));
+	}
+	for (unsigned int i = 0U; i < 4U; i++) {
+		void *n_errors = NULL;
+		EXPECT_EQ(0, pthread_join(threads[i], &n_errors));
+		EXPECT_EQ(NULL, n_errors);
+	}
+
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_exhausted()                                                 *
+ ******************************************************************************/
+
+static double cpu_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return 1e3 * (double)ts.tv_sec + 1e-6 * (double)ts.tv_nsec;
+}
+
+static void *test_exhausted_cback(void *data) {
+	fx_stack_sched_sleep(20000000U);
+	return data;
+}
+
+static void test_exhausted(void) {
+	/* Only two tasks can hold a stack at the same time */
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, N_WORKERS, STACK_LEN, 2U));
+
+	/* Workers do not spin while all stacks are held by sleeping tasks */
+	const double t0 = cpu_ms();
+	fx_stack_sched_task *tasks[8];
+	for (uintptr_t i = 0U; i < 8U; i++) {
+		tasks[i] = fx_stack_sched_spawn(&sched, test_exhausted_cback, (void *)i);
+	}
+	for (uintptr_t i = 0U; i < 8U; i++) {
+		EXPECT_EQ((void *)i, fx_stack_sched_join(tasks[i]));
+	}
+	EXPECT_LT(cpu_ms() - t0, 40.0);
+
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_spawn_join);
+	RUN(test_yield);
+	RUN(test_local);
+	RUN(test_nested);
+	RUN(test_external_threads);
+	RUN(test_exhausted);
+	DONE;
+}
@@ -0,0 +1,136 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <foxen/stack_shared.h>
+#include <foxen/unittest.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 16U)
+#define N_CONTEXTS 16U
+#define N_STEPS 10U
+
+/******************************************************************************
+ * Unit test test_interleaved()                                               *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_shared_context sctx;
+	unsigned int depth;
+} test_interleaved_data;
+
+static uintptr_t test_interleaved_recurse(test_interleaved_data *data,
+                                          unsigned int depth) {
+	/* Fill a local buffer with a context-specific pattern. The buffer must
+	   survive while the context is evicted from the run stack. */
+	volatile uintptr_t buf[32];
+	for (unsigned int i = 0U; i < 32U; i++) {
+		buf[i] = (uintptr_t)data + depth * 32U + i;
+	}
+
+	uintptr_t sum = 0U;
+	if (depth > 0U) {
+		sum = test_interleaved_recurse(data, depth - 1U);
+	} else {
+		for (unsigned int i = 0U; i < N_STEPS; i++) {
+			sum += (uintptr_t)fx_stack_shared_yield(&data->sctx,
+			                                        (void *)(uintptr_t)i);
+		}
+	}
+
+	for (unsigned int i = 0U; i < 32U; i++) {
+		if (buf[i] != (uintptr_t)data + depth * 32U + i) {
+			return 0U;
+		}
+	}
+	return sum;
+}
+
+static void *test_interleaved_cback(void *data_) {
+	test_interleaved_data *data = (test_interleaved_data *)data_;
+	return (void *)test_interleaved_recurse(data, data->depth);
+}
+
+static void test_interleaved(void) {
+	void *stack_start = malloc(STACK_LEN);
+	void *stack_end = (void *)((uintptr_t)stack_start + STACK_LEN);
+
+	fx_stack_shared shared;
+	fx_stack_shared_init(&shared, stack_start, stack_end);
+
+	test_interleaved_data data[N_CONTEXTS];
+	for (unsigned int i = 0U; i < N_CONTEXTS; i++) {
+		data[i].depth = i;
+		fx_stack_shared_context_init(&data[i].sctx, &shared,
+		                             test_interleaved_cback, &data[i]);
+	}
+
+	/* Resume all contexts in a round-robin fashion, forcing an eviction on
+	   every switch */
+	for (unsigned int step = 0U; step < N_STEPS; step++) {
+		for (unsigned int i = 0U; i < N_CONTEXTS; i++) {
+			void *res = fx_stack_shared_resume(&data[i].sctx,
+			                                   (void *)(uintptr_t)(i + step));
+			EXPECT_EQ((void *)(uintptr_t)step, res);
+		}
+
+		/* Evicted contexts only store their live stack portion; deeper
+		   contexts need more memory */
+		for (unsigned int i = 0U; i + 1U < N_CONTEXTS; i++) {
+			EXPECT_GT(fx_stack_shared_context_saved_size(&data[i].sctx), 0U);
+			EXPECT_LT(fx_stack_shared_context_saved_size(&data[i].sctx),
+			          STACK_LEN / 2U);
+		}
+		EXPECT_LT(fx_stack_shared_context_saved_size(&data[0].sctx),
+		          fx_stack_shared_context_saved_size(
+		              &data[N_CONTEXTS - 2U].sctx));
+	}
+
+	/* Let all contexts finish */
+	for (unsigned int i = 0U; i < N_CONTEXTS; i++) {
+		/* The initial resume passed "i" and was discarded */
+		uintptr_t expected = 0U;
+		for (unsigned int step = 1U; step < N_STEPS; step++) {
+			expected += i + step;
+		}
+		expected += 0xF00U;
+		void *res = fx_stack_shared_resume(&data[i].sctx, (void *)0xF00U);
+		EXPECT_TRUE(fx_stack_shared_context_done(&data[i].sctx));
+		EXPECT_EQ((void *)expected, res);
+		EXPECT_EQ(0U, fx_stack_shared_context_saved_size(&data[i].sctx));
+	}
+
+	for (unsigned int i = 0U; i < N_CONTEXTS; i++) {
+		fx_stack_shared_context_destroy(&data[i].sctx);
+	}
+	free(stack_start);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_interleaved);
+	DONE;
+}
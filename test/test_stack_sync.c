@@ -0,0 +1,358 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <foxen/stack_sched.h>
+#include <foxen/stack_sync.h>
+#include <foxen/unittest.h>
+
+#include <stdint.h>
+
+/******************************************************************************
+ * UNITTESTS                                                                  *
+ ******************************************************************************/
+
+#define STACK_LEN (4096U * 16U)
+#define N_WORKERS 4U
+#define N_TASKS 32U
+#define N_ITERATIONS 200U
+
+/**
+ * Spawns n tasks executing cback(data) and joins them.
+ */
+static void run_tasks(fx_stack_sched *sched, unsigned int n,
+                      fx_stack_cback cback, void *data) {
+	fx_stack_sched_task *tasks[N_TASKS];
+	for (unsigned int i = 0U; i < n; i++) {
+		tasks[i] = fx_stack_sched_spawn(sched, cback, data);
+	}
+	for (unsigned int i = 0U; i < n; i++) {
+		fx_stack_sched_join(tasks[i]);
+	}
+}
+
+/******************************************************************************
+ * Unit test test_mutex()                                                     *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_mutex mutex;
+	unsigned int counter;
+} test_mutex_data;
+
+static void *test_mutex_cback(void *data_) {
+	test_mutex_data *data = (test_mutex_data *)data_;
+	for (unsigned int i = 0U; i < N_ITERATIONS; i++) {
+		/* Suspend the task while holding the mutex, so other tasks have to
+		   wait for it */
+		fx_stack_mutex_lock(&data->mutex);
+		const unsigned int counter = data->counter;
+		fx_stack_sched_yield();
+		data->counter = counter + 1U;
+		fx_stack_mutex_unlock(&data->mutex);
+	}
+	return NULL;
+}
+
+static void test_mutex(void) {
+	const unsigned int flags[2] = {0U, FX_STACK_SYNC_LOCAL};
+	for (unsigned int i = 0U; i < 2U; i++) {
+		fx_stack_sched sched;
+		const bool local = flags[i] & FX_STACK_SYNC_LOCAL;
+		EXPECT_TRUE(fx_stack_sched_init(&sched, local ? 1U : N_WORKERS,
+		                                STACK_LEN, N_TASKS));
+
+		test_mutex_data data;
+		fx_stack_mutex_init(&data.mutex, flags[i]);
+		data.counter = 0U;
+		run_tasks(&sched, N_TASKS, test_mutex_cback, &data);
+		EXPECT_EQ(N_TASKS * N_ITERATIONS, data.counter);
+
+		/* trylock works outside of tasks */
+		EXPECT_TRUE(fx_stack_mutex_trylock(&data.mutex));
+		EXPECT_FALSE(fx_stack_mutex_trylock(&data.mutex));
+		fx_stack_mutex_unlock(&data.mutex);
+		fx_stack_mutex_destroy(&data.mutex);
+
+		fx_stack_sched_destroy(&sched);
+	}
+}
+
+/******************************************************************************
+ * Unit test test_cond()                                                      *
+ ******************************************************************************/
+
+#define TEST_COND_CAPACITY 4U
+
+typedef struct {
+	fx_stack_mutex mutex;
+	fx_stack_cond not_empty;
+	fx_stack_cond not_full;
+	uintptr_t buf[TEST_COND_CAPACITY];
+	unsigned int n;
+	unsigned int n_producers;
+	uintptr_t sum;
+} test_cond_data;
+
+static void *test_cond_producer(void *data_) {
+	test_cond_data *data = (test_cond_data *)data_;
+	for (uintptr_t i = 1U; i <= N_ITERATIONS; i++) {
+		fx_stack_mutex_lock(&data->mutex);
+		while (data->n == TEST_COND_CAPACITY) {
+			fx_stack_cond_wait(&data->not_full, &data->mutex);
+		}
+		data->buf[data->n++] = i;
+		fx_stack_cond_signal(&data->not_empty);
+		fx_stack_mutex_unlock(&data->mutex);
+	}
+
+	fx_stack_mutex_lock(&data->mutex);
+	data->n_producers--;
+	fx_stack_cond_broadcast(&data->not_empty);
+	fx_stack_mutex_unlock(&data->mutex);
+	return NULL;
+}
+
+static void *test_cond_consumer(void *data_) {
+	test_cond_data *data = (test_cond_data *)data_;
+	while (true) {
+		fx_stack_mutex_lock(&data->mutex);
+		while ((data->n == 0U) && (data->n_producers > 0U)) {
+			fx_stack_cond_wait(&data->not_empty, &data->mutex);
+		}
+		if (data->n == 0U) {
+			fx_stack_mutex_unlock(&data->mutex);
+			break;
+		}
+		data->sum += data->buf[--data->n];
+		fx_stack_cond_signal(&data->not_full);
+		fx_stack_mutex_unlock(&data->mutex);
+	}
+	return NULL;
+}
+
+static void test_cond(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, N_WORKERS, STACK_LEN, N_TASKS));
+
+	test_cond_data data;
+	fx_stack_mutex_init(&data.mutex, 0U);
+	fx_stack_cond_init(&data.not_empty, 0U);
+	fx_stack_cond_init(&data.not_full, 0U);
+	data.n = 0U;
+	data.n_producers = N_TASKS / 2U;
+	data.sum = 0U;
+
+	fx_stack_sched_task *tasks[N_TASKS];
+	for (unsigned int i = 0U; i < N_TASKS; i++) {
+		tasks[i] = fx_stack_sched_spawn(
+		    &sched, (i % 2U) ? test_cond_producer : test_cond_consumer, &data);
+	}
+	for (unsigned int i = 0U; i < N_TASKS; i++) {
+		fx_stack_sched_join(tasks[i]);
+	}
+	EXPECT_EQ((N_TASKS / 2U) * (N_ITERATIONS * (N_ITERATIONS + 1U) / 2U),
+	          data.sum);
+
+	fx_stack_cond_destroy(&data.not_full);
+	fx_stack_cond_destroy(&data.not_empty);
+	fx_stack_mutex_destroy(&data.mutex);
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * Unit test test_sem()                                                       *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_sem sem;
+	unsigned int n_active;
+	unsigned int max_active;
+} test_sem_data;
+
+static void *test_sem_cback(void *data_) {
+	test_sem_data *data = (test_sem_data *)data_;
+	for (unsigned int i = 0U; i < 10U; i++) {
+		fx_stack_sem_wait(&data->sem);
+		const unsigned int n_active =
+		    __atomic_add_fetch(&data->n_active, 1U, __ATOMIC_SEQ_CST);
+		unsigned int max_active =
+		    __atomic_load_n(&data->max_active, __ATOMIC_SEQ_CST);
+		while ((n_active > max_active) &&
+		       !__atomic_compare_exchange_n(&data->max_active, &max_active,
+		                                    n_active, false, __ATOMIC_SEQ_CST,
+		                                    __ATOMIC_SEQ_CST)) {
+		}
+		fx_stack_sched_yield();
+		__atomic_sub_fetch(&data->n_active, 1U, __ATOMIC_SEQ_CST);
+		fx_stack_sem_post(&data->sem);
+	}
+	return NULL;
+}
+
+static void test_sem(void) {
+	const unsigned int flags[2] = {0U, FX_STACK_SYNC_LOCAL};
+	for (unsigned int i = 0U; i < 2U; i++) {
+		fx_stack_sched sched;
+		const bool local = flags[i] & FX_STACK_SYNC_LOCAL;
+		EXPECT_TRUE(fx_stack_sched_init(&sched, local ? 1U : N_WORKERS,
+		                                STACK_LEN, N_TASKS));
+
+		/* At most three tasks hold a unit at the same time */
+		test_sem_data data;
+		fx_stack_sem_init(&data.sem, 3U, flags[i]);
+		data.n_active = 0U;
+		data.max_active = 0U;
+		run_tasks(&sched, N_TASKS, test_sem_cback, &data);
+		EXPECT_GT(data.max_active, 0U);
+		EXPECT_LE(data.max_active, 3U);
+		if (local) {
+			/* With a single worker, all units are taken while tasks yield */
+			EXPECT_EQ(3U, data.max_active);
+		}
+
+		for (unsigned int j = 0U; j < 3U; j++) {
+			EXPECT_TRUE(fx_stack_sem_trywait(&data.sem));
+		}
+		EXPECT_FALSE(fx_stack_sem_trywait(&data.sem));
+		for (unsigned int j = 0U; j < 3U; j++) {
+			fx_stack_sem_post(&data.sem);
+		}
+		fx_stack_sem_destroy(&data.sem);
+
+		fx_stack_sched_destroy(&sched);
+	}
+}
+
+/******************************************************************************
+ * Unit test test_chan()                                                      *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_chan chan;
+	uintptr_t sum;
+	unsigned int n;
+} test_chan_data;
+
+static void *test_chan_sender(void *data_) {
+	test_chan_data *data = (test_chan_data *)data_;
+	for (uintptr_t i = 1U; i <= N_ITERATIONS; i++) {
+		if (!fx_stack_chan_send(&data->chan, (void *)i)) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+static void *test_chan_receiver(void *data_) {
+	test_chan_data *data = (test_chan_data *)data_;
+	void *value;
+	while (fx_stack_chan_recv(&data->chan, &value)) {
+		__atomic_add_fetch(&data->sum, (uintptr_t)value, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&data->n, 1U, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+static void test_chan(void) {
+	const unsigned int flags[4] = {0U, FX_STACK_CHAN_SPSC, FX_STACK_SYNC_LOCAL,
+	                               FX_STACK_SYNC_LOCAL | FX_STACK_CHAN_SPSC};
+	for (unsigned int i = 0U; i < 4U; i++) {
+		fx_stack_sched sched;
+		const bool local = flags[i] & FX_STACK_SYNC_LOCAL;
+		const unsigned int n_pairs = (flags[i] & FX_STACK_CHAN_SPSC) ? 1U : 8U;
+		EXPECT_TRUE(fx_stack_sched_init(&sched, local ? 1U : N_WORKERS,
+		                                STACK_LEN, N_TASKS));
+
+		/* A small capacity forces both sides to wait */
+		test_chan_data data;
+		EXPECT_TRUE(fx_stack_chan_init(&data.chan, 4U, flags[i]));
+		data.sum = 0U;
+		data.n = 0U;
+
+		fx_stack_sched_task *receivers[N_TASKS], *senders[N_TASKS];
+		for (unsigned int j = 0U; j < n_pairs; j++) {
+			receivers[j] =
+			    fx_stack_sched_spawn(&sched, test_chan_receiver, &data);
+			senders[j] = fx_stack_sched_spawn(&sched, test_chan_sender, &data);
+		}
+		for (unsigned int j = 0U; j < n_pairs; j++) {
+			fx_stack_sched_join(senders[j]);
+		}
+
+		/* Closing the channel terminates the receivers */
+		fx_stack_chan_close(&data.chan);
+		for (unsigned int j = 0U; j < n_pairs; j++) {
+			fx_stack_sched_join(receivers[j]);
+		}
+		EXPECT_EQ(n_pairs * N_ITERATIONS, data.n);
+		EXPECT_EQ(n_pairs * (N_ITERATIONS * (N_ITERATIONS + 1U) / 2U),
+		          data.sum);
+
+		fx_stack_chan_destroy(&data.chan);
+		fx_stack_sched_destroy(&sched);
+	}
+}
+
+/******************************************************************************
+ * Unit test test_chan_try()                                                  *
+ ******************************************************************************/
+
+static void test_chan_try(void) {
+	const unsigned int flags[3] = {0U, FX_STACK_CHAN_SPSC,
+	                               FX_STACK_SYNC_LOCAL};
+	for (unsigned int i = 0U; i < 3U; i++) {
+		/* The capacity is rounded up to the next power of two */
+		fx_stack_chan chan;
+		EXPECT_TRUE(fx_stack_chan_init(&chan, 5U, flags[i]));
+		for (uintptr_t j = 0U; j < 8U; j++) {
+			EXPECT_TRUE(fx_stack_chan_trysend(&chan, (void *)j));
+		}
+		EXPECT_FALSE(fx_stack_chan_trysend(&chan, NULL));
+
+		/* Elements are received in FIFO order */
+		void *value;
+		for (uintptr_t j = 0U; j < 4U; j++) {
+			EXPECT_TRUE(fx_stack_chan_tryrecv(&chan, &value));
+			EXPECT_EQ((void *)j, value);
+		}
+		EXPECT_TRUE(fx_stack_chan_trysend(&chan, (void *)8U));
+
+		/* Remaining elements can be received after closing the channel */
+		fx_stack_chan_close(&chan);
+		EXPECT_FALSE(fx_stack_chan_trysend(&chan, NULL));
+		for (uintptr_t j = 4U; j < 9U; j++) {
+			EXPECT_TRUE(fx_stack_chan_tryrecv(&chan, &value));
+			EXPECT_EQ((void *)j, value);
+		}
+		EXPECT_FALSE(fx_stack_chan_tryrecv(&chan, &value));
+		fx_stack_chan_destroy(&chan);
+	}
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_mutex);
+	RUN(test_cond);
+	RUN(test_sem);
+	RUN(test_chan);
+	RUN(test_chan_try);
+	DONE;
+}
@@ -0,0 +1,377 @@
+/*
+ *  libfoxenstack -- Library for switching user-space stacks
+ *  Copyright (C) 2018  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <foxen/stack_sched.h>
+#include <foxen/stack_timer.h>
+#include <foxen/unittest.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/******************************************************************************
+ * Helper functions                                                           *
+ ******************************************************************************/
+
+typedef struct {
+	fx_stack_timer timer;
+	uint64_t deadline;
+	uint64_t expired_at;
+	unsigned int n_expired;
+} test_timer;
+
+/* Time passed to the most recent call to fx_stack_timer_wheel_advance() and
+   deadline of the most recently expired timer */
+static uint64_t test_now = 0U;
+static uint64_t test_last_deadline = 0U;
+static bool test_in_order = true;
+
+static void test_timer_cback(fx_stack_timer *timer, void *data) {
+	test_timer *t = (test_timer *)data;
+	EXPECT_EQ(&t->timer, timer);
+	EXPECT_FALSE(fx_stack_timer_pending(timer));
+	t->expired_at = test_now;
+	t->n_expired++;
+	if (t->deadline < test_last_deadline) {
+		test_in_order = false;
+	}
+	test_last_deadline = t->deadline;
+}
+
+static void test_timer_add(fx_stack_timer_wheel *wheel, test_timer *t,
+                           uint64_t deadline) {
+	t->deadline = deadline;
+	t->expired_at = 0U;
+	t->n_expired = 0U;
+	fx_stack_timer_add(wheel, &t->timer, deadline, test_timer_cback, t);
+	EXPECT_TRUE(fx_stack_timer_pending(&t->timer));
+}
+
+static size_t test_advance(fx_stack_timer_wheel *wheel, uint64_t now) {
+	test_now = now;
+	test_last_deadline = 0U;
+	return fx_stack_timer_wheel_advance(wheel, now);
+}
+
+static uint64_t test_rand(uint64_t *state) {
+	*state ^= *state << 13U;
+	*state ^= *state >> 7U;
+	*state ^= *state << 17U;
+	return *state;
+}
+
+/******************************************************************************
+ * Unit test test_exact()                                                     *
+ ******************************************************************************/
+
+static void test_exact(void) {
+	/* Timers at the boundaries of all levels expire exactly at their
+	   deadline, independently of how many cascades they pass through */
+	static const uint64_t deadlines[] = {
+	    1U,          2U,          63U,         64U,        65U,
+	    127U,        4095U,       4096U,       4097U,      262143U,
+	    262144U,     1U << 30U,   (1ULL << 36U) + 17U,     1ULL << 48U,
+	    1ULL << 60U, (1ULL << 63U) + 5U,       UINT64_MAX - 1U};
+	const size_t n = sizeof(deadlines) / sizeof(deadlines[0]);
+
+	for (size_t i = 0U; i < n; i++) {
+		fx_stack_timer_wheel wheel;
+		fx_stack_timer_wheel_init(&wheel, 1U, 0U);
+		test_timer t;
+		test_timer_add(&wheel, &t, deadlines[i]);
+		EXPECT_EQ(1U, wheel.n_timers);
+		EXPECT_LE(fx_stack_timer_wheel_next(&wheel), deadlines[i]);
+
+		/* Approach the deadline in steps */
+		for (uint64_t step = deadlines[i] / 2U; step > 0U; step /= 2U) {
+			EXPECT_EQ(0U, test_advance(&wheel, deadlines[i] - step));
+			EXPECT_EQ(0U, t.n_expired);
+			EXPECT_LE(fx_stack_timer_wheel_next(&wheel), deadlines[i]);
+		}
+		EXPECT_EQ(1U, test_advance(&wheel, deadlines[i]));
+		EXPECT_EQ(1U, t.n_expired);
+		EXPECT_EQ(0U, wheel.n_timers);
+		EXPECT_EQ(UINT64_MAX, fx_stack_timer_wheel_next(&wheel));
+	}
+
+	/* Deadlines are rounded up to the tick resolution */
+	fx_stack_timer_wheel wheel;
+	fx_stack_timer_wheel_init(&wheel, 1000U, 1500U);
+	test_timer t;
+	test_timer_add(&wheel, &t, 2001U);
+	EXPECT_EQ(0U, test_advance(&wheel, 2999U));
+	EXPECT_EQ(1U, test_advance(&wheel, 3000U));
+}
+
+/******************************************************************************
+ * Unit test test_random()                                                    *
+ ******************************************************************************/
+
+#define N_TIMERS 10000U
+
+static void test_random(void) {
+	test_timer *timers = (test_timer *)malloc(N_TIMERS * sizeof(test_timer));
+	uint64_t rng = 4813U;
+
+	/* Start at an odd time, so slot boundaries do not align with zero */
+	uint64_t now = 123456789U;
+	fx_stack_timer_wheel wheel;
+	fx_stack_timer_wheel_init(&wheel, 1U, now);
+	for (size_t i = 0U; i < N_TIMERS; i++) {
+		/* Mix short and long timeouts */
+		const uint64_t range = (i % 3U == 0U) ? 100U : (1U << 24U);
+		test_timer_add(&wheel, &timers[i], now + test_rand(&rng) % range);
+	}
+	EXPECT_EQ(N_TIMERS, wheel.n_timers);
+
+	/* Advance in irregular steps; every timer expires once, in the order of
+	   the deadlines, and within the step that contains its deadline */
+	size_t n_expired = 0U;
+	test_in_order = true;
+	while (wheel.n_timers > 0U) {
+		now += test_rand(&rng) % 50000U;
+		n_expired += test_advance(&wheel, now);
+	}
+	EXPECT_TRUE(test_in_order);
+	EXPECT_EQ(N_TIMERS, n_expired);
+	for (size_t i = 0U; i < N_TIMERS; i++) {
+		EXPECT_EQ(1U, timers[i].n_expired);
+		EXPECT_GE(timers[i].expired_at, timers[i].deadline);
+		EXPECT_LT(timers[i].expired_at - timers[i].deadline, 50000U);
+	}
+	free(timers);
+}
+
+/******************************************************************************
+ * Unit test test_next()                                                      *
+ ******************************************************************************/
+
+static void test_next(void) {
+	uint64_t rng = 17U;
+	test_timer *timers = (test_timer *)malloc(N_TIMERS * sizeof(test_timer));
+	fx_stack_timer_wheel wheel;
+	fx_stack_timer_wheel_init(&wheel, 1U, 0U);
+	for (size_t i = 0U; i < N_TIMERS; i++) {
+		test_timer_add(&wheel, &timers[i], 1U + test_rand(&rng) % (1U << 20U));
+	}
+
+	/* Advancing the wheel to the time returned by fx_stack_timer_wheel_next()
+	   never skips a deadline */
+	size_t n_expired = 0U, n_steps = 0U;
+	test_now = 0U;
+	test_in_order = true;
+	while (wheel.n_timers > 0U) {
+		const uint64_t next = fx_stack_timer_wheel_next(&wheel);
+		EXPECT_GT(next, test_now);
+		n_expired += test_advance(&wheel, next);
+		n_steps++;
+	}
+	EXPECT_TRUE(test_in_order);
+	EXPECT_EQ(N_TIMERS, n_expired);
+	for (size_t i = 0U; i < N_TIMERS; i++) {
+		EXPECT_EQ(timers[i].deadline, timers[i].expired_at);
+	}
+
+	/* Cascades cost a few extra steps, but far fewer than one per tick */
+	EXPECT_LT(n_steps, 2U * N_TIMERS);
+	free(timers);
+}
+
+/******************************************************************************
+ * Unit test test_cancel()                                                    *
+ ******************************************************************************/
+
+static void test_cancel(void) {
+	test_timer *timers = (test_timer *)malloc(N_TIMERS * sizeof(test_timer));
+	uint64_t rng = 42U;
+	fx_stack_timer_wheel wheel;
+	fx_stack_timer_wheel_init(&wheel, 1U, 1000U);
+	for (size_t i = 0U; i < N_TIMERS; i++) {
+		test_timer_add(&wheel, &timers[i], 1000U + test_rand(&rng) % 100000U);
+	}
+
+	/* Cancel every other timer */
+	for (size_t i = 0U; i < N_TIMERS; i += 2U) {
+		EXPECT_TRUE(fx_stack_timer_cancel(&wheel, &timers[i].timer));
+		EXPECT_FALSE(fx_stack_timer_pending(&timers[i].timer));
+		EXPECT_FALSE(fx_stack_timer_cancel(&wheel, &timers[i].timer));
+	}
+	EXPECT_EQ(N_TIMERS / 2U, wheel.n_timers);
+
+	/* Cancel some of the remaining timers after they have been cascaded */
+	test_advance(&wheel, 1000U + 4096U);
+	for (size_t i = 1U; i < N_TIMERS; i += 4U) {
+		if (fx_stack_timer_pending(&timers[i].timer)) {
+			EXPECT_TRUE(fx_stack_timer_cancel(&wheel, &timers[i].timer));
+			timers[i].n_expired = 2U; /* Marker for cancelled timers */
+		}
+	}
+
+	test_advance(&wheel, 1000U + 100000U);
+	EXPECT_EQ(0U, wheel.n_timers);
+	EXPECT_EQ(UINT64_MAX, fx_stack_timer_wheel_next(&wheel));
+	for (size_t i = 0U; i < N_TIMERS; i++) {
+		if (i % 2U == 0U) {
+			EXPECT_EQ(0U, timers[i].n_expired);
+		} else if (timers[i].n_expired != 2U) {
+			EXPECT_EQ(1U, timers[i].n_expired);
+		}
+		EXPECT_FALSE(fx_stack_timer_cancel(&wheel, &timers[i].timer));
+	}
+	free(timers);
+}
+
+/******************************************************************************
+ * Unit test test_cancel_batch()                                              *
+ ******************************************************************************/
+
+static fx_stack_timer_wheel *test_cancel_batch_wheel = NULL;
+static test_timer *test_cancel_batch_victims[2] = {NULL, NULL};
+static bool test_cancel_batch_ok = false;
+
+static void test_cancel_batch_cback(fx_stack_timer *timer, void *data) {
+	/* Cancel timers that are due but have not been executed yet */
+	test_timer *t = (test_timer *)data;
+	(void)timer;
+	t->n_expired++;
+	test_cancel_batch_ok = true;
+	for (unsigned int i = 0U; i < 2U; i++) {
+		fx_stack_timer *victim = &test_cancel_batch_victims[i]->timer;
+		test_cancel_batch_ok = test_cancel_batch_ok &&
+		                       fx_stack_timer_pending(victim) &&
+		                       fx_stack_timer_cancel(test_cancel_batch_wheel,
+		                                             victim) &&
+		                       !fx_stack_timer_pending(victim);
+	}
+}
+
+static void test_cancel_batch(void) {
+	fx_stack_timer_wheel wheel;
+	fx_stack_timer_wheel_init(&wheel, 1U, 0U);
+
+	/* All four timers expire in the same batch; the first one cancels the
+	   second and the last one */
+	test_timer t1, t2, t3, t4;
+	test_timer_add(&wheel, &t2, 20U);
+	test_timer_add(&wheel, &t3, 30U);
+	test_timer_add(&wheel, &t4, 40U);
+	t1.n_expired = 0U;
+	fx_stack_timer_add(&wheel, &t1.timer, 10U, test_cancel_batch_cback, &t1);
+	test_cancel_batch_wheel = &wheel;
+	test_cancel_batch_victims[0] = &t2;
+	test_cancel_batch_victims[1] = &t4;
+
+	EXPECT_EQ(2U, test_advance(&wheel, 40U));
+	EXPECT_TRUE(test_cancel_batch_ok);
+	EXPECT_EQ(1U, t1.n_expired);
+	EXPECT_EQ(0U, t2.n_expired);
+	EXPECT_EQ(1U, t3.n_expired);
+	EXPECT_EQ(0U, t4.n_expired);
+	EXPECT_EQ(0U, wheel.n_timers);
+	EXPECT_EQ(UINT64_MAX, fx_stack_timer_wheel_next(&wheel));
+}
+
+/******************************************************************************
+ * Unit test test_overdue()                                                   *
+ ******************************************************************************/
+
+static fx_stack_timer_wheel *test_readd_wheel = NULL;
+
+static void test_readd_cback(fx_stack_timer *timer, void *data) {
+	/* Re-arm the timer with a deadline that has already passed */
+	test_timer *t = (test_timer *)data;
+	t->n_expired++;
+	fx_stack_timer_add(test_readd_wheel, timer, 0U, test_readd_cback, t);
+}
+
+static void test_overdue(void) {
+	fx_stack_timer_wheel wheel;
+	fx_stack_timer_wheel_init(&wheel, 1U, 5000U);
+
+	/* Deadlines in the past expire on the next call, even if the time has
+	   not changed */
+	test_timer t1, t2;
+	test_timer_add(&wheel, &t1, 10U);
+	test_timer_add(&wheel, &t2, 5000U);
+	EXPECT_EQ(5000U, fx_stack_timer_wheel_next(&wheel));
+	EXPECT_EQ(2U, test_advance(&wheel, 5000U));
+	EXPECT_EQ(1U, t1.n_expired);
+	EXPECT_EQ(1U, t2.n_expired);
+
+	/* Timers re-added by their callback are not part of the current batch */
+	test_readd_wheel = &wheel;
+	t1.n_expired = 0U;
+	fx_stack_timer_add(&wheel, &t1.timer, 0U, test_readd_cback, &t1);
+	EXPECT_EQ(1U, test_advance(&wheel, 5000U));
+	EXPECT_EQ(1U, test_advance(&wheel, 6000U));
+	EXPECT_EQ(2U, t1.n_expired);
+	EXPECT_TRUE(fx_stack_timer_cancel(&wheel, &t1.timer));
+	EXPECT_EQ(0U, test_advance(&wheel, 7000U));
+}
+
+/******************************************************************************
+ * Unit test test_sched_sleep()                                               *
+ ******************************************************************************/
+
+#define N_TASKS 256U
+
+static void *test_sleep_task(void *data) {
+	const uint64_t ns = (uint64_t)(uintptr_t)data;
+	const uint64_t t0 = fx_stack_timer_now();
+	fx_stack_sched_sleep(ns);
+	const uint64_t t1 = fx_stack_timer_now();
+	fx_stack_sched_sleep(ns);
+	const uint64_t t2 = fx_stack_timer_now();
+	return (void *)(uintptr_t)((t1 - t0 >= ns) && (t2 - t1 >= ns));
+}
+
+static void test_sched_sleep(void) {
+	fx_stack_sched sched;
+	EXPECT_TRUE(fx_stack_sched_init(&sched, 2U, 64U * 1024U, N_TASKS));
+
+	/* Many tasks sleeping concurrently for different durations */
+	fx_stack_sched_task *tasks[N_TASKS];
+	const uint64_t t0 = fx_stack_timer_now();
+	for (size_t i = 0U; i < N_TASKS; i++) {
+		tasks[i] = fx_stack_sched_spawn(&sched, test_sleep_task,
+		                                (void *)(uintptr_t)(i * 40000U));
+	}
+	for (size_t i = 0U; i < N_TASKS; i++) {
+		EXPECT_EQ((void *)1, fx_stack_sched_join(tasks[i]));
+	}
+	EXPECT_GE(fx_stack_timer_now() - t0, 2U * (N_TASKS - 1U) * 40000U);
+
+	/* Sleeping outside of a task blocks the calling thread */
+	EXPECT_EQ((void *)1, test_sleep_task((void *)(uintptr_t)1000000U));
+
+	fx_stack_sched_destroy(&sched);
+}
+
+/******************************************************************************
+ * MAIN                                                                       *
+ ******************************************************************************/
+
+int main() {
+	RUN(test_exact);
+	RUN(test_random);
+	RUN(test_next);
+	RUN(test_cancel);
+	RUN(test_cancel_batch);
+	RUN(test_overdue);
+	RUN(test_sched_sleep);
+	DONE;
+}